@@ -0,0 +1,268 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "daemon.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "firmware_bundle.h"
+#include "firmware_cache.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct DaemonDevice
+{
+	const FleetJob *job;
+	std::shared_ptr<const FirmwareImage> image;
+	std::shared_ptr<const FirmwareBundle> bundle;	// Fills in image once the controller is known
+	std::shared_ptr<FirmwareImage> selected;		// The device's own image when bundled
+	std::unique_ptr<HciTransport> transport;
+	uint32_t location;
+	Clock::time_point arrived;
+};
+
+struct Daemon
+{
+	const std::vector<FleetJob> *jobs;
+	std::vector<std::shared_ptr<const FirmwareImage>> images;		// Per job, jobs with the same firmware share one
+	std::vector<std::shared_ptr<const FirmwareBundle>> bundles;		// Per job, set instead of the image for bundles
+	const FleetOptions *options;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<DaemonDevice> pending;
+	std::map<uint32_t, Clock::time_point> upgraded;		// Location -> time of the last successful upgrade
+	bool closed = false;
+	uint32_t succeeded = 0;
+	uint32_t failed = 0;
+};
+
+static std::atomic<bool> stopRequested(false);
+
+static void requestStop(int)
+{
+	stopRequested = true;
+}
+
+static void deviceArrived(Daemon &daemon, std::unique_ptr<HciTransport> transport, uint16_t vendorId, uint16_t productId, uint32_t location)
+{
+	const std::vector<FleetJob> &jobs = *daemon.jobs;
+	size_t index = 0;
+
+	while (index < jobs.size() && (jobs[index].vendorId != vendorId || jobs[index].productId != productId))
+		index++;
+
+	if (index == jobs.size())
+		return;
+
+	std::lock_guard<std::mutex> lock(daemon.lock);
+	std::map<uint32_t, Clock::time_point>::const_iterator upgraded = daemon.upgraded.find(location);
+
+	if (location != 0 && upgraded != daemon.upgraded.end() && Clock::now() - upgraded->second < std::chrono::milliseconds(DAEMON_REPLUG_HOLDOFF))
+	{
+#ifdef DEBUG
+		printf("[%04x:%04x] 0x%08x  Re-enumerated after upgrade, ignoring\n", vendorId, productId, location);
+#endif
+		return;
+	}
+
+	DaemonDevice device;
+	device.job = &jobs[index];
+	device.image = daemon.images[index];
+	device.bundle = daemon.bundles[index];
+
+	if (device.bundle)
+	{
+		device.selected = std::make_shared<FirmwareImage>();
+		device.image = device.selected;
+	}
+
+	device.transport = std::move(transport);
+	device.location = location;
+	device.arrived = Clock::now();
+
+	daemon.pending.push_back(std::move(device));
+	daemon.wake.notify_one();
+}
+
+static void flashDevices(Daemon &daemon)
+{
+	for (;;)
+	{
+		DaemonDevice device;
+
+		{
+			std::unique_lock<std::mutex> lock(daemon.lock);
+			daemon.wake.wait(lock, [&daemon] { return !daemon.pending.empty() || daemon.closed; });
+
+			if (daemon.pending.empty())
+				return;
+
+			device = std::move(daemon.pending.front());
+			daemon.pending.pop_front();
+		}
+
+		const FleetJob &job = *device.job;
+		UpgradeOptions upgradeOptions = daemon.options->upgrade;
+		upgradeOptions.useHandshake = supportsHandshake(job.vendorId, job.productId);
+		upgradeOptions.fixedDelays = upgradeOptions.fixedDelays || needsFixedDelays(job.vendorId, job.productId);
+
+		if (device.bundle)
+		{
+			const FirmwareBundle *bundle = device.bundle.get();
+			FirmwareImage *image = device.selected.get();
+			uint16_t vendorId = job.vendorId;
+			uint16_t productId = job.productId;
+
+			upgradeOptions.selectFirmware = [bundle, image, vendorId, productId](const FirmwareVersion &version)
+			{
+				return bundle->select(version, vendorId, productId, *image) != NULL;
+			};
+		}
+
+		UpgradeSession session(*device.transport, *device.image, upgradeOptions);
+		bool result = session.run();
+
+		// Let the device re-enumerate with the new firmware before it is recorded
+		device.transport.reset();
+
+		double ready = std::chrono::duration<double, std::milli>(Clock::now() - device.arrived).count();
+
+		const char *status = !result ? "FAILED" : session.state() == kUpdateNotNeeded ? "current" : "ok";
+
+		printf("[%04x:%04x] 0x%08x  %-7s %8.1f ms upgrading, %8.1f ms from arrival  %s\n", job.vendorId, job.productId, device.location, status, session.stats().elapsed, ready, job.fileName.c_str());
+
+		std::lock_guard<std::mutex> lock(daemon.lock);
+
+		if (result)
+		{
+			daemon.upgraded[device.location] = Clock::now();
+			daemon.succeeded++;
+		}
+		else
+		{
+			daemon.failed++;
+		}
+	}
+}
+
+// Plug in options.simulator->devices controllers per job, one after the other
+static void simulateArrivals(Daemon &daemon)
+{
+	const std::vector<FleetJob> &jobs = *daemon.jobs;
+	const SimulatorConfig &simulator = *daemon.options->simulator;
+	uint32_t location = 0;
+
+	for (uint32_t n = 0; n < simulator.devices && !stopRequested; n++)
+	{
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			SimulatorConfig config = simulator;
+			config.vendorId = jobs[i].vendorId;
+			config.productId = jobs[i].productId;
+			config.handshake = supportsHandshake(config.vendorId, config.productId);
+			config.seed += n;
+
+			deviceArrived(daemon, std::unique_ptr<HciTransport>(new SimulatedTransport(config)), config.vendorId, config.productId, ++location);
+		}
+	}
+}
+
+bool runDaemon(const std::vector<FleetJob> &jobs, const FleetOptions &options)
+{
+	Daemon daemon;
+	daemon.jobs = &jobs;
+	daemon.images.resize(jobs.size());
+	daemon.bundles.resize(jobs.size());
+	daemon.options = &options;
+
+	std::vector<HotplugMatch> matches;
+	Clock::time_point start = Clock::now();
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (isFirmwareBundle(jobs[i].fileName.c_str()))
+			daemon.bundles[i] = FirmwareCache::shared().acquireBundle(jobs[i].fileName.c_str());
+		else
+			daemon.images[i] = FirmwareCache::shared().acquire(jobs[i].fileName.c_str(), jobs[i].vendorId, jobs[i].productId, options.parseFlags);
+
+		if (!daemon.images[i] && !daemon.bundles[i])
+			return false;
+
+		HotplugMatch match = { jobs[i].vendorId, jobs[i].productId };
+		size_t n = 0;
+
+		while (n < matches.size() && (matches[n].vendorId != match.vendorId || matches[n].productId != match.productId))
+			n++;
+
+		if (n == matches.size())
+			matches.push_back(match);
+	}
+
+	printf("Loaded %zu firmware images for %zu jobs in %.1f ms, waiting for devices on %u workers\n", FirmwareCache::shared().size(), jobs.size(), std::chrono::duration<double, std::milli>(Clock::now() - start).count(), options.workers);
+
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+
+	std::vector<std::thread> workers;
+
+	for (uint32_t i = 0; i < options.workers; i++)
+		workers.push_back(std::thread(flashDevices, std::ref(daemon)));
+
+	bool result = true;
+
+	if (options.simulator)
+	{
+		simulateArrivals(daemon);
+	}
+	else
+	{
+		result = watchUsbTransports(matches, stopRequested, [&daemon](std::unique_ptr<HciTransport> transport, uint16_t vendorId, uint16_t productId)
+		{
+			uint32_t location = transport->location();
+			deviceArrived(daemon, std::move(transport), vendorId, productId, location);
+		});
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(daemon.lock);
+
+		// Upgrades already under way are finished, devices still waiting are left alone
+		if (stopRequested)
+			daemon.pending.clear();
+
+		daemon.closed = true;
+		daemon.wake.notify_all();
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	printf("\n%u devices upgraded, %u failed\n", daemon.succeeded, daemon.failed);
+
+	return result && daemon.failed == 0;
+}
@@ -0,0 +1,43 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef daemon_h
+#define daemon_h
+
+#include <vector>
+#include "fleet.h"
+
+// Arrivals at the location of a device upgraded this recently are its own
+// re-enumeration with the new firmware, not a replug (ms)
+#define DAEMON_REPLUG_HOLDOFF 10000
+
+/*
+ *  Flash matching devices as they are plugged in
+ *
+ *  Firmware for every job is loaded and parsed once up front and stays
+ *  resident, so a device that arrives (including on resume from suspend)
+ *  only waits for its USB transfers. Devices are upgraded on a pool of
+ *  options.workers threads. Runs until SIGINT or SIGTERM, or with a
+ *  simulator until every simulated controller has been flashed.
+ *
+ *  returns true if hotplug monitoring could be set up and nothing failed
+ */
+bool runDaemon(const std::vector<FleetJob> &jobs, const FleetOptions &options);
+
+#endif
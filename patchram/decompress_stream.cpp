@@ -0,0 +1,468 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#include "decompress_stream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef PATCHRAM_USE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef PATCHRAM_USE_LZ4
+#include <lz4frame.h>
+#endif
+
+// zlib window bits: 15 with the zlib header, +16 with the gzip header, negative for raw deflate
+#define ZLIB_WINDOW_BITS 15
+
+// Frame magic numbers, little endian
+#define ZSTD_FRAME_MAGIC 0xfd2fb528
+#define LZ4_FRAME_MAGIC 0x184d2204
+
+// Densest settings short of zstd's ultra levels, which need a larger window to decode
+#define ZSTD_COMPRESSION_LEVEL 19
+#define LZ4_COMPRESSION_LEVEL 12
+
+enum DecodeResult
+{
+	kDecodeMore,			// Needs more input or output space
+	kDecodeEnd,				// End of the compressed stream
+	kDecodeError,
+};
+
+// One decoder behind DecompressStream
+class Decompressor
+{
+public:
+	virtual ~Decompressor() {}
+
+	// Set up for a new stream, returns false if the library could not
+	virtual bool begin() = 0;
+
+	/*
+	 *  Decompress as much of the input as fits into the output
+	 *
+	 *  consumed - Receives the input bytes used
+	 *  produced - Receives the output bytes written
+	 */
+	virtual DecodeResult decode(const uint8_t *input, size_t inputLength, size_t &consumed, uint8_t *output, size_t outputLength, size_t &produced) = 0;
+
+	// Why the last decode failed
+	virtual const char *error() const = 0;
+};
+
+class ZlibDecompressor : public Decompressor
+{
+public:
+	explicit ZlibDecompressor(int windowBits) : mWindowBits(windowBits), mStarted(false), mError(NULL)
+	{
+		memset(&mStream, 0, sizeof(mStream));
+	}
+
+	~ZlibDecompressor()
+	{
+		if (mStarted)
+			inflateEnd(&mStream);
+	}
+
+	bool begin()
+	{
+		mStarted = inflateInit2(&mStream, mWindowBits) == Z_OK;
+		return mStarted;
+	}
+
+	DecodeResult decode(const uint8_t *input, size_t inputLength, size_t &consumed, uint8_t *output, size_t outputLength, size_t &produced)
+	{
+		mStream.next_in = (Bytef *)input;
+		mStream.avail_in = (uInt)inputLength;
+		mStream.next_out = output;
+		mStream.avail_out = (uInt)outputLength;
+
+		int result = inflate(&mStream, Z_NO_FLUSH);
+
+		consumed = inputLength - mStream.avail_in;
+		produced = outputLength - mStream.avail_out;
+
+		if (result == Z_STREAM_END)
+			return kDecodeEnd;
+
+		if (result == Z_OK || result == Z_BUF_ERROR)
+			return kDecodeMore;
+
+		mError = mStream.msg ? mStream.msg : zError(result);
+		return kDecodeError;
+	}
+
+	const char *error() const { return mError; }
+
+private:
+	z_stream mStream;
+	int mWindowBits;
+	bool mStarted;
+	const char *mError;
+};
+
+#ifdef PATCHRAM_USE_ZSTD
+class ZstdDecompressor : public Decompressor
+{
+public:
+	ZstdDecompressor() : mContext(NULL), mError(NULL) {}
+
+	~ZstdDecompressor()
+	{
+		ZSTD_freeDCtx(mContext);
+	}
+
+	bool begin()
+	{
+		mContext = ZSTD_createDCtx();
+		return mContext != NULL;
+	}
+
+	DecodeResult decode(const uint8_t *input, size_t inputLength, size_t &consumed, uint8_t *output, size_t outputLength, size_t &produced)
+	{
+		ZSTD_inBuffer in = { input, inputLength, 0 };
+		ZSTD_outBuffer out = { output, outputLength, 0 };
+
+		// 0 once the frame is decoded and all of it has been written out
+		size_t result = ZSTD_decompressStream(mContext, &out, &in);
+
+		consumed = in.pos;
+		produced = out.pos;
+
+		if (ZSTD_isError(result))
+		{
+			mError = ZSTD_getErrorName(result);
+			return kDecodeError;
+		}
+
+		return result == 0 ? kDecodeEnd : kDecodeMore;
+	}
+
+	const char *error() const { return mError; }
+
+private:
+	ZSTD_DCtx *mContext;
+	const char *mError;
+};
+#endif
+
+#ifdef PATCHRAM_USE_LZ4
+class Lz4Decompressor : public Decompressor
+{
+public:
+	Lz4Decompressor() : mContext(NULL), mError(NULL) {}
+
+	~Lz4Decompressor()
+	{
+		if (mContext != NULL)
+			LZ4F_freeDecompressionContext(mContext);
+	}
+
+	bool begin()
+	{
+		return !LZ4F_isError(LZ4F_createDecompressionContext(&mContext, LZ4F_VERSION));
+	}
+
+	DecodeResult decode(const uint8_t *input, size_t inputLength, size_t &consumed, uint8_t *output, size_t outputLength, size_t &produced)
+	{
+		consumed = inputLength;
+		produced = outputLength;
+
+		// 0 once the frame is decoded and all of it has been written out
+		size_t result = LZ4F_decompress(mContext, output, &produced, input, &consumed, NULL);
+
+		if (LZ4F_isError(result))
+		{
+			mError = LZ4F_getErrorName(result);
+			return kDecodeError;
+		}
+
+		return result == 0 ? kDecodeEnd : kDecodeMore;
+	}
+
+	const char *error() const { return mError; }
+
+private:
+	LZ4F_dctx *mContext;
+	const char *mError;
+};
+#endif
+
+static uint32_t readLittleEndian32(const uint8_t *data)
+{
+	return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+CompressionFormat detectCompression(const uint8_t *data, size_t length)
+{
+	if (length == 0 || data[0] == ':')
+		return kCompressionNone;
+
+	if (length >= 4 && readLittleEndian32(data) == ZSTD_FRAME_MAGIC)
+		return kCompressionZstd;
+
+	if (length >= 4 && readLittleEndian32(data) == LZ4_FRAME_MAGIC)
+		return kCompressionLz4;
+
+	if (length >= 3 && data[0] == 0x1f && data[1] == 0x8b && data[2] == Z_DEFLATED)
+		return kCompressionGzip;
+
+	// CMF: deflate with at most a 32 KB window, FLG: header checksum and no preset dictionary
+	if (length >= 2 && (data[0] & 0x0f) == Z_DEFLATED && (data[0] >> 4) <= 7 && ((data[0] << 8 | data[1]) % 31) == 0 && !(data[1] & 0x20))
+		return kCompressionZlib;
+
+	// Block type 3 is reserved, so this cannot be deflate
+	if (((data[0] >> 1) & 0x03) == 0x03)
+		return kCompressionNone;
+
+	return kCompressionDeflate;
+}
+
+const char *compressionName(CompressionFormat format)
+{
+	switch (format)
+	{
+		case kCompressionNone:
+			return "none";
+		case kCompressionZlib:
+			return "zlib";
+		case kCompressionGzip:
+			return "gzip";
+		case kCompressionDeflate:
+			return "deflate";
+		case kCompressionZstd:
+			return "zstd";
+		case kCompressionLz4:
+			return "lz4";
+	}
+
+	return "unknown";
+}
+
+bool parseCompression(const char *name, CompressionFormat &format)
+{
+	static const CompressionFormat formats[] = { kCompressionNone, kCompressionZlib, kCompressionGzip, kCompressionDeflate, kCompressionZstd, kCompressionLz4 };
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		if (strcmp(name, compressionName(formats[i])) == 0)
+		{
+			format = formats[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool compressionAvailable(CompressionFormat format)
+{
+	switch (format)
+	{
+		case kCompressionZstd:
+#ifdef PATCHRAM_USE_ZSTD
+			return true;
+#else
+			return false;
+#endif
+		case kCompressionLz4:
+#ifdef PATCHRAM_USE_LZ4
+			return true;
+#else
+			return false;
+#endif
+		default:
+			return true;
+	}
+}
+
+CompressionFormat preferredCompression()
+{
+	// zstd decodes several times faster than zlib and packs tighter, LZ4 decodes faster still but packs looser
+#if defined(PATCHRAM_USE_ZSTD)
+	return kCompressionZstd;
+#elif defined(PATCHRAM_USE_LZ4)
+	return kCompressionLz4;
+#else
+	return kCompressionZlib;
+#endif
+}
+
+bool compressBuffer(CompressionFormat format, const uint8_t *data, size_t length, std::vector<uint8_t> &output)
+{
+	switch (format)
+	{
+		case kCompressionZlib:
+		{
+			uLongf size = compressBound((uLong)length);
+			output.resize(size);
+
+			if (compress2(output.data(), &size, data, (uLong)length, Z_BEST_COMPRESSION) != Z_OK)
+				break;
+
+			output.resize(size);
+			return true;
+		}
+#ifdef PATCHRAM_USE_ZSTD
+		case kCompressionZstd:
+		{
+			output.resize(ZSTD_compressBound(length));
+
+			size_t size = ZSTD_compress(output.data(), output.size(), data, length, ZSTD_COMPRESSION_LEVEL);
+
+			if (ZSTD_isError(size))
+				break;
+
+			output.resize(size);
+			return true;
+		}
+#endif
+#ifdef PATCHRAM_USE_LZ4
+		case kCompressionLz4:
+		{
+			LZ4F_preferences_t preferences;
+			memset(&preferences, 0, sizeof(preferences));
+			preferences.compressionLevel = LZ4_COMPRESSION_LEVEL;
+			preferences.frameInfo.contentSize = length;
+
+			output.resize(LZ4F_compressFrameBound(length, &preferences));
+
+			size_t size = LZ4F_compressFrame(output.data(), output.size(), data, length, &preferences);
+
+			if (LZ4F_isError(size))
+				break;
+
+			output.resize(size);
+			return true;
+		}
+#endif
+		default:
+			fprintf(stderr, "Compress: unsupported format (%s)\n", compressionName(format));
+			return false;
+	}
+
+	fprintf(stderr, "Compress: %s failed\n", compressionName(format));
+	return false;
+}
+
+DecompressStream::DecompressStream() :
+	mFormat(kCompressionNone), mFinished(false), mTotalIn(0), mTotalOut(0)
+{
+}
+
+DecompressStream::~DecompressStream()
+{
+}
+
+bool DecompressStream::begin(CompressionFormat format)
+{
+	switch (format)
+	{
+		case kCompressionZlib:
+			mDecompressor.reset(new ZlibDecompressor(ZLIB_WINDOW_BITS));
+			break;
+		case kCompressionGzip:
+			mDecompressor.reset(new ZlibDecompressor(ZLIB_WINDOW_BITS + 16));
+			break;
+		case kCompressionDeflate:
+			mDecompressor.reset(new ZlibDecompressor(-ZLIB_WINDOW_BITS));
+			break;
+#ifdef PATCHRAM_USE_ZSTD
+		case kCompressionZstd:
+			mDecompressor.reset(new ZstdDecompressor());
+			break;
+#endif
+#ifdef PATCHRAM_USE_LZ4
+		case kCompressionLz4:
+			mDecompressor.reset(new Lz4Decompressor());
+			break;
+#endif
+		default:
+			mDecompressor.reset();
+
+			if (compressionAvailable(format))
+				fprintf(stderr, "Decompress: unsupported format (%s)\n", compressionName(format));
+			else
+				fprintf(stderr, "Decompress: %s support is not built in\n", compressionName(format));
+			return false;
+	}
+
+	mFormat = format;
+	mFinished = false;
+	mTotalIn = 0;
+	mTotalOut = 0;
+	mOutput.resize(DECOMPRESS_CHUNK_SIZE);
+
+	if (!mDecompressor->begin())
+	{
+		fprintf(stderr, "Decompress: %s decoder could not be set up\n", compressionName(format));
+		mDecompressor.reset();
+		return false;
+	}
+
+	return true;
+}
+
+bool DecompressStream::push(const uint8_t *data, size_t length, const Sink &sink)
+{
+	if (!mDecompressor)
+		return false;
+
+	if (mFinished)
+		return true;
+
+	size_t produced;
+
+	// Until the input is used up and the last output did not fill the buffer
+	do
+	{
+		size_t consumed = 0;
+		produced = 0;
+
+		DecodeResult result = mDecompressor->decode(data, length, consumed, mOutput.data(), mOutput.size(), produced);
+
+		data += consumed;
+		length -= consumed;
+		mTotalIn += consumed;
+		mTotalOut += produced;
+
+		if (result == kDecodeEnd)
+		{
+			mFinished = true;
+		}
+		else if (result == kDecodeError)
+		{
+			fprintf(stderr, "Decompress: corrupt %s data after %llu bytes (%s)\n", compressionName(mFormat), (unsigned long long)mTotalIn, mDecompressor->error());
+			return false;
+		}
+
+		if (produced > 0 && !sink(mOutput.data(), produced))
+			return false;
+
+		// Nothing more can be done without further input
+		if (consumed == 0 && produced == 0)
+			break;
+	}
+	while (!mFinished && (length > 0 || produced == mOutput.size()));
+
+	return true;
+}
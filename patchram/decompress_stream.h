@@ -0,0 +1,122 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef decompress_stream_h
+#define decompress_stream_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class Decompressor;
+
+// Output handed to the sink at a time, small enough to stay in cache while it is parsed
+#define DECOMPRESS_CHUNK_SIZE (64 * 1024)
+
+/*
+ *  zstd and LZ4 are optional, define PATCHRAM_USE_ZSTD and link libzstd or
+ *  define PATCHRAM_USE_LZ4 and link liblz4 to decode them. Their frames are
+ *  recognized either way.
+ */
+enum CompressionFormat
+{
+	kCompressionNone,		// Stored as is
+	kCompressionZlib,		// RFC 1950, the .zhx files Broadcom ships
+	kCompressionGzip,		// RFC 1952
+	kCompressionDeflate,	// RFC 1951 without a container
+	kCompressionZstd,		// RFC 8878 frame
+	kCompressionLz4,		// LZ4 frame
+};
+
+/*
+ *  Container of a firmware file from its first bytes
+ *
+ *  Intel HEX (a leading ':') is kCompressionNone, zlib, gzip, zstd and LZ4
+ *  are told by their headers. Raw deflate has no magic number, so anything
+ *  else whose first block type is valid is taken for it and inflating decides.
+ *
+ *  data   - Start of the file
+ *  length - Bytes available, at least 4 unless the file is shorter
+ */
+CompressionFormat detectCompression(const uint8_t *data, size_t length);
+
+const char *compressionName(CompressionFormat format);
+
+// Format by name, returns false for an unknown name
+bool parseCompression(const char *name, CompressionFormat &format);
+
+// The format can be decompressed and compressed by this build
+bool compressionAvailable(CompressionFormat format);
+
+// Fastest to decode of the formats this build can write
+CompressionFormat preferredCompression();
+
+/*
+ *  Compress a buffer in one go
+ *
+ *  Uses the densest setting of the format, decoding speed does not depend
+ *  on it. Gzip and raw deflate are not written.
+ *
+ *  returns true or false on error
+ */
+bool compressBuffer(CompressionFormat format, const uint8_t *data, size_t length, std::vector<uint8_t> &output);
+
+/*
+ *  Chunked decompression of a stream of any size
+ *
+ *  Compressed input is pushed in chunks of any size and the output is handed
+ *  to the sink in pieces of up to DECOMPRESS_CHUNK_SIZE bytes as soon as it
+ *  is produced, so memory use does not depend on the size of the stream and
+ *  the sink can work on the output while the rest is still compressed.
+ */
+class DecompressStream
+{
+public:
+	// Returns false to stop decompressing
+	typedef std::function<bool(const uint8_t *data, size_t length)> Sink;
+
+	DecompressStream();
+	~DecompressStream();
+
+	bool begin(CompressionFormat format);
+
+	// Decompress the next chunk of input. Returns false on corrupt input or when the
+	// sink failed. Input after the end of the compressed stream is ignored.
+	bool push(const uint8_t *data, size_t length, const Sink &sink);
+
+	// The end of the compressed stream was reached
+	bool finished() const { return mFinished; }
+
+	uint64_t totalIn() const { return mTotalIn; }
+	uint64_t totalOut() const { return mTotalOut; }
+
+private:
+	DecompressStream(const DecompressStream &);
+	DecompressStream &operator=(const DecompressStream &);
+
+	std::unique_ptr<Decompressor> mDecompressor;
+	CompressionFormat mFormat;
+	std::vector<uint8_t> mOutput;
+	bool mFinished;
+	uint64_t mTotalIn;
+	uint64_t mTotalOut;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "event_reader.h"
+
+#include <chrono>
+
+// Polls of the ring before the consumer blocks
+static const int kSpinCount = 256;
+
+EventReader::EventReader(HciTransport &transport, const std::atomic<uint32_t> *sent) :
+	mTransport(transport), mSent(sent), mStop(false), mRunning(false), mWaiting(false)
+{
+}
+
+EventReader::~EventReader()
+{
+	stop();
+}
+
+void EventReader::start(const std::function<void()> &notify)
+{
+	mNotify = notify;
+	mStop = false;
+	mRunning = true;
+	mThread = std::thread(&EventReader::run, this);
+}
+
+void EventReader::stop()
+{
+	if (!mThread.joinable())
+		return;
+
+	mStop = true;
+
+	// The read may not have been posted yet when the first abort lands
+	while (mRunning)
+	{
+		mTransport.abort();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	mThread.join();
+}
+
+void EventReader::run()
+{
+	while (!mStop)
+	{
+		HciEvent *event = mRing.back();
+
+		if (event == NULL)
+		{
+			// Consumer is behind, never drop an event
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		// Commands sent before the read is posted reached the controller before it could answer
+		event->sent = mSent ? mSent->load() : 0;
+		event->length = HCI_MAX_EVENT_SIZE;
+		event->status = mTransport.readEvent(event->data, &event->length, EVENT_READ_TIMEOUT);
+
+		if (mStop)
+			break;
+
+		if (event->status == kTransportTimeout)
+			continue;
+
+		mRing.push();
+
+		if (mNotify)
+			mNotify();
+
+		if (mWaiting)
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mSignal.notify_one();
+		}
+
+		if (event->status != kTransportSuccess)
+			break;
+	}
+
+	std::lock_guard<std::mutex> lock(mLock);
+	mRunning = false;
+	mSignal.notify_one();
+}
+
+const HciEvent *EventReader::next(uint32_t timeout)
+{
+	HciEvent *event;
+
+	for (int i = 0; i < kSpinCount; i++)
+	{
+		if ((event = mRing.front()) != NULL)
+			return event;
+	}
+
+	std::unique_lock<std::mutex> lock(mLock);
+	mWaiting = true;
+
+	if (timeout == 0)
+		mSignal.wait(lock, [this] { return !mRing.empty() || !mRunning; });
+	else
+		mSignal.wait_for(lock, std::chrono::milliseconds(timeout), [this] { return !mRing.empty() || !mRunning; });
+
+	mWaiting = false;
+
+	return mRing.front();
+}
+
+void EventReader::release()
+{
+	mRing.pop();
+}
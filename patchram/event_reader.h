@@ -0,0 +1,94 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef event_reader_h
+#define event_reader_h
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "hci_transport.h"
+#include "spsc_ring.h"
+
+// Event code (1) + parameter length (1) + up to 255 parameter bytes
+#define HCI_MAX_EVENT_SIZE 257
+#define EVENT_RING_SIZE 32
+
+// Longest a read stays posted before it is posted again (ms), a wedged endpoint never blocks for good
+#define EVENT_READ_TIMEOUT HCI_TIMEOUT
+
+struct HciEvent
+{
+	TransportStatus status;
+	uint32_t length;
+	uint32_t sent;						// Commands the session had sent when the read was posted
+	uint8_t data[HCI_MAX_EVENT_SIZE];
+};
+
+/*
+ *  Background reader for the HCI event endpoint
+ *
+ *  A read is kept posted on the interrupt in endpoint at all times and every
+ *  event is received straight into a slot of a lock-free ring, so events that
+ *  arrive back-to-back are queued rather than missed while the caller is busy
+ *  writing. A failed read is queued with its status and ends the reader.
+ */
+class EventReader : public CacheLineAllocated
+{
+public:
+	// sent (if any) counts the commands of the session, events are stamped with it
+	explicit EventReader(HciTransport &transport, const std::atomic<uint32_t> *sent = NULL);
+	~EventReader();
+
+	// Start reading, notify (if any) is called on the reader thread after every queued event
+	void start(const std::function<void()> &notify = std::function<void()>());
+
+	// Abort the outstanding read and wait for the thread to exit
+	void stop();
+
+	// Oldest event, waiting up to timeout ms for one to arrive (0 waits indefinitely).
+	// Returns NULL on timeout or once the reader has stopped. Hand it back with release().
+	const HciEvent *next(uint32_t timeout = 0);
+	void release();
+
+	// Oldest event without waiting, NULL if none is queued
+	const HciEvent *poll() { return mRing.front(); }
+
+	bool running() const { return mRunning; }
+
+private:
+	void run();
+
+	HciTransport &mTransport;
+	const std::atomic<uint32_t> *mSent;
+	SpscRing<HciEvent, EVENT_RING_SIZE> mRing;
+	std::thread mThread;
+	std::function<void()> mNotify;
+	std::atomic<bool> mStop;
+	std::atomic<bool> mRunning;
+
+	// Only used once the consumer has found the ring empty
+	std::atomic<bool> mWaiting;
+	std::mutex mLock;
+	std::condition_variable mSignal;
+};
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_benchmark.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "firmware_binary.h"
+#include "firmware_image.h"
+#include "firmware_loader.h"
+#include "firmware_recompress.h"
+#include "hcd_firmware.h"
+#include "hci_codec.h"
+#include "hex_decode.h"
+#include "intel_firmware.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// Decoded bytes per round of the hex decode benchmark
+#define HEX_DECODE_BYTES (1 << 20)
+
+static const char *const hexDecoders[] = { "avx2", "sse2", "scalar" };
+
+static double elapsedSince(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/*
+ *  Parse Intel HEX the way parseFirmware did before FirmwareImage
+ *
+ *  One nibble at a time into a cleared record buffer, and every LAUNCH_RAM
+ *  command in a buffer of its own (CFDataCreateMutable) appended to a list
+ *  that grows as it goes (CFArrayAppendValue).
+ */
+static bool parsePerCommand(const uint8_t *data, size_t length, std::vector<std::vector<uint8_t>> &commands)
+{
+	const uint8_t *end = data + length;
+	uint32_t address = 0;
+
+	commands.clear();
+
+	while (data < end)
+	{
+		if (*data++ != HEX_LINE_PREFIX)
+			continue;
+
+		uint8_t binary[HEX_MAX_RECORD_SIZE];
+		uint32_t size = 0;
+		uint32_t sum = 0;
+
+		memset(binary, 0, sizeof(binary));
+
+		while (data + 1 < end && size < sizeof(binary) && hexDecodeScalar(data, 1, &binary[size], NULL))
+		{
+			sum += binary[size++];
+			data += 2;
+		}
+
+		uint8_t recordLength = binary[0];
+
+		if (size != HEX_HEADER_SIZE + recordLength + 1u || (sum & 0xFF) != 0)
+			return false;
+
+		switch (binary[3])
+		{
+			case REC_TYPE_DATA:
+			{
+				std::vector<uint8_t> command;
+				uint8_t header[HCI_COMMAND_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE];
+
+				address = (address & 0xFFFF0000) | binary[1] << 8 | binary[2];
+				hciPut16(header, HCI_OPCODE_LAUNCH_RAM);
+				header[2] = LAUNCH_RAM_ADDRESS_SIZE + recordLength;
+				hciPut32(header + HCI_COMMAND_HEADER_SIZE, address);
+
+				command.reserve(sizeof(header) + recordLength);
+				command.insert(command.end(), header, header + sizeof(header));
+				command.insert(command.end(), binary + HEX_HEADER_SIZE, binary + HEX_HEADER_SIZE + recordLength);
+				commands.push_back(std::move(command));
+				break;
+			}
+			case REC_TYPE_EOF:
+				return true;
+			case REC_TYPE_ESA:
+				address = (binary[4] << 8 | binary[5]) << 4;
+				break;
+			case REC_TYPE_ELA:
+				address = binary[4] << 24 | binary[5] << 16;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return false;
+}
+
+// Both parsers have to produce the same commands, or the comparison means nothing
+static bool sameCommands(const std::vector<std::vector<uint8_t>> &commands, const FirmwareImage &image)
+{
+	if (commands.size() != image.count())
+		return false;
+
+	for (size_t i = 0; i < commands.size(); i++)
+	{
+		FirmwareSpan span = image.command(i);
+
+		if (span.length != commands[i].size() || memcmp(span.data, commands[i].data(), span.length) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Fastest round (ms)
+static void printParse(const char *method, double time, size_t hexSize)
+{
+	printf("  %-12s %8.2f ms %7.0f MB/s\n", method, time, hexSize / time / 1000);
+}
+
+static bool benchmarkParse(const std::vector<uint8_t> &hex)
+{
+	double perCommand = 0;
+	double plain = 0;
+	double coalesced = 0;
+	size_t commands = 0;
+	size_t coalescedCommands = 0;
+
+	for (int round = 0; round < BENCHMARK_ROUNDS; round++)
+	{
+		std::vector<std::vector<uint8_t>> list;
+		FirmwareImage image;
+		FirmwareImage merged;
+
+		Clock::time_point start = Clock::now();
+		bool parsed = parsePerCommand(hex.data(), hex.size(), list);
+		double time = elapsedSince(start);
+
+		if (round == 0 || time < perCommand)
+			perCommand = time;
+
+		start = Clock::now();
+		parsed = parseFirmware(hex.data(), (uint32_t)hex.size(), 0, 0, image) && parsed;
+		time = elapsedSince(start);
+
+		if (round == 0 || time < plain)
+			plain = time;
+
+		start = Clock::now();
+		parsed = parseFirmware(hex.data(), (uint32_t)hex.size(), 0, 0, merged, kParseCoalesce) && parsed;
+		time = elapsedSince(start);
+
+		if (round == 0 || time < coalesced)
+			coalesced = time;
+
+		if (!parsed || !sameCommands(list, image))
+		{
+			fprintf(stderr, "Benchmark: the parsers disagree on the firmware\n");
+			return false;
+		}
+
+		commands = image.count();
+		coalescedCommands = merged.count();
+	}
+
+	printf("Parse: %zu commands, %zu coalesced, fastest of %d rounds\n\n", commands, coalescedCommands, BENCHMARK_ROUNDS);
+	printf("  %-12s %11s\n", "method", "parse");
+	printParse("per command", perCommand, hex.size());
+	printParse("image", plain, hex.size());
+	printParse("coalesced", coalesced, hex.size());
+	printf("\n");
+
+	return true;
+}
+
+// Decode throughput of every hex decoder this CPU has, a record at a time and in one call
+static bool benchmarkHexDecode()
+{
+	std::mt19937 random(1);
+	std::vector<uint8_t> hex(2 * HEX_DECODE_BYTES);
+	std::vector<uint8_t> output(HEX_DECODE_BYTES);
+
+	for (size_t i = 0; i < hex.size(); i++)
+		hex[i] = "0123456789ABCDEF"[random() % 16];
+
+	printf("Hex decode: fastest of %d rounds\n\n", BENCHMARK_ROUNDS);
+	printf("  %-8s %12s  %12s\n", "kernel", "records", "bulk");
+
+	for (const char *name : hexDecoders)
+	{
+		HexDecodeFunc decode = hexDecodeFunction(name);
+		double recordTime = 0;
+		double bulkTime = 0;
+
+		if (decode == NULL)
+		{
+			printf("  %-8s  not supported\n", name);
+			continue;
+		}
+
+		for (int round = 0; round < BENCHMARK_ROUNDS; round++)
+		{
+			// Records with 16 data bytes, the usual line length
+			const size_t record = HEX_HEADER_SIZE + 16 + 1;
+			uint32_t sum;
+			bool valid = true;
+
+			Clock::time_point start = Clock::now();
+
+			for (size_t i = 0; i + record <= output.size(); i += record)
+				valid = decode(&hex[i * 2], record, &output[i], &sum) && valid;
+
+			double time = elapsedSince(start);
+
+			if (round == 0 || time < recordTime)
+				recordTime = time;
+
+			start = Clock::now();
+			valid = decode(hex.data(), output.size(), output.data(), &sum) && valid;
+			time = elapsedSince(start);
+
+			if (round == 0 || time < bulkTime)
+				bulkTime = time;
+
+			if (!valid)
+				return false;
+		}
+
+		printf("  %-8s %7.2f GB/s  %7.2f GB/s%s\n", name, hex.size() / recordTime / 1e6, hex.size() / bulkTime / 1e6, strcmp(name, hexDecodeImplementation()) == 0 ? "  (used)" : "");
+	}
+
+	printf("\n");
+
+	return true;
+}
+
+// Temporary file for a converted firmware, removed by the caller
+static bool temporaryFile(char *path, size_t size)
+{
+	const char *directory = getenv("TMPDIR");
+
+	snprintf(path, size, "%s/patchram-XXXXXX", directory && *directory ? directory : "/tmp");
+
+	int file = mkstemp(path);
+
+	if (file < 0)
+	{
+		fprintf(stderr, "Benchmark: cannot create a temporary file in '%s'\n", path);
+		return false;
+	}
+
+	close(file);
+
+	return true;
+}
+
+static size_t sizeOfFile(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	long size = -1;
+
+	if (file != NULL && fseek(file, 0, SEEK_END) == 0)
+		size = ftell(file);
+
+	if (file != NULL)
+		fclose(file);
+
+	return size > 0 ? (size_t)size : 0;
+}
+
+/*
+ *  Load the firmware from the file as given, and converted to .hcd and .prb
+ *
+ *  The conversions are written to temporary files with the commands of the
+ *  plain parse, every load has to produce the same commands.
+ */
+static bool benchmarkLoad(const char *fileName, const std::vector<uint8_t> &hex)
+{
+	FirmwareImage image;
+	char hcdPath[256];
+	char binaryPath[256];
+
+	if (!parseFirmware(hex.data(), (uint32_t)hex.size(), 0, 0, image) || !temporaryFile(hcdPath, sizeof(hcdPath)))
+		return false;
+
+	if (!temporaryFile(binaryPath, sizeof(binaryPath)))
+	{
+		remove(hcdPath);
+		return false;
+	}
+
+	bool result = writeHcdFirmware(hcdPath, image) && writeFirmwareBinary(binaryPath, image, 0, 0, 0, kParseDefault);
+	double times[3] = { 0, 0, 0 };
+	uint64_t hash = hashBytes(image.data(), image.size());
+
+	for (int round = 0; round < BENCHMARK_ROUNDS && result; round++)
+	{
+		for (int method = 0; method < 3 && result; method++)
+		{
+			FirmwareImage loaded;
+			Clock::time_point start = Clock::now();
+
+			if (method == 0)
+				result = loadFirmware(fileName, 0, 0, kParseDefault, loaded, NULL);
+			else if (method == 1)
+				result = loadHcdFirmware(hcdPath, loaded);
+			else
+				result = loadFirmwareBinary(binaryPath, loaded, NULL);
+
+			double time = elapsedSince(start);
+
+			if (round == 0 || time < times[method])
+				times[method] = time;
+
+			// Mapped images index the file, compare the commands rather than the buffer
+			uint64_t loadedHash = FNV1A64_OFFSET;
+
+			for (size_t i = 0; result && i < loaded.count(); i++)
+			{
+				FirmwareSpan span = loaded.command(i);
+				loadedHash = hashBytes(span.data, span.length, loadedHash);
+			}
+
+			if (result && (loaded.count() != image.count() || loadedHash != hash))
+			{
+				fprintf(stderr, "Benchmark: loading the firmware converted to .hcd or .prb gives other commands\n");
+				result = false;
+			}
+		}
+	}
+
+	if (result)
+	{
+		printf("Load: the whole firmware until it can be sent, fastest of %d rounds\n\n", BENCHMARK_ROUNDS);
+		printf("  %-8s %10s  %11s\n", "format", "bytes", "load");
+		printf("  %-8s %10zu  %8.3f ms\n", "source", sizeOfFile(fileName), times[0]);
+		printf("  %-8s %10zu  %8.3f ms\n", "hcd", sizeOfFile(hcdPath), times[1]);
+		printf("  %-8s %10zu  %8.3f ms\n", "prb", sizeOfFile(binaryPath), times[2]);
+		printf("\n");
+	}
+
+	remove(hcdPath);
+	remove(binaryPath);
+
+	return result;
+}
+
+bool benchmarkFirmware(const char *fileName)
+{
+	CompressionFormat format;
+	size_t fileSize;
+	std::vector<uint8_t> hex;
+
+	if (!readFirmwareHex(fileName, format, fileSize, hex))
+		return false;
+
+	printf("'%s': %s, %zu bytes, %zu bytes of HEX\n\n", fileName, compressionName(format), fileSize, hex.size());
+
+	return benchmarkHexDecode() && benchmarkParse(hex) && benchmarkLoad(fileName, hex) && benchmarkCompression(hex);
+}
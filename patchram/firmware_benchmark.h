@@ -0,0 +1,38 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_benchmark_h
+#define firmware_benchmark_h
+
+/*
+ *  Time loading a firmware file
+ *
+ *  Prints the throughput of every hex decoder the CPU supports, then parses
+ *  the Intel HEX of the file into a FirmwareImage, plain and coalesced, and
+ *  the way it was parsed before FirmwareImage: a buffer of its own for
+ *  every LAUNCH_RAM command. Prints the fastest of BENCHMARK_ROUNDS parses,
+ *  then compares the compression formats, see benchmarkCompression().
+ *  Decoder correctness and parse allocations are checked by the programs
+ *  in tests instead.
+ *
+ *  returns true or false on error
+ */
+bool benchmarkFirmware(const char *fileName);
+
+#endif
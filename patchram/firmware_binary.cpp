@@ -0,0 +1,200 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_binary.h"
+#include "hci_codec.h"
+#include "intel_firmware.h"
+#include "mapped_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+
+static_assert(offsetof(FirmwareBinaryHeader, lmpSubversion) == FIRMWARE_BINARY_HEADER_V1_SIZE, "Version 1 header layout changed");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Precompiled firmware is stored in host byte order, only little endian hosts are supported"
+#endif
+
+static uint32_t alignUp(uint32_t value, uint32_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Only the commands a firmware download consists of may be sent from a precompiled file
+static bool downloadCommand(uint16_t opcode)
+{
+	return opcode == HCI_OPCODE_LAUNCH_RAM || opcode == HCI_OPCODE_END_OF_RECORD || opcode == HCI_OPCODE_DOWNLOAD_MINIDRIVER;
+}
+
+bool writeFirmwareBinary(const char *path, const FirmwareImage &image, uint64_t sourceHash, uint16_t vendorId, uint16_t productId, uint32_t parseFlags)
+{
+	FirmwareBinaryHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = FIRMWARE_BINARY_MAGIC;
+	header.version = FIRMWARE_BINARY_VERSION;
+	header.headerSize = sizeof(header);
+	header.sourceHash = sourceHash;
+	header.dataHash = hashBytes(image.data(), image.size());
+	header.vendorId = vendorId;
+	header.productId = productId;
+	header.parseFlags = parseFlags;
+	header.commandCount = (uint32_t)image.count();
+	header.tableOffset = sizeof(header);
+	header.dataOffset = alignUp(header.tableOffset + header.commandCount * sizeof(FirmwareBinaryEntry), FIRMWARE_BINARY_ALIGNMENT);
+	header.dataSize = (uint32_t)image.size();
+	header.lmpSubversion = image.version().lmpSubversion;
+	header.build = image.version().build;
+
+	std::vector<FirmwareBinaryEntry> table(image.count());
+
+	for (size_t i = 0; i < image.count(); i++)
+	{
+		FirmwareSpan span = image.command(i);
+		table[i].offset = (uint32_t)(span.data - image.data());
+		table[i].length = span.length;
+	}
+
+	FILE *file = fopen(path, "wb");
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", path);
+		return false;
+	}
+
+	std::vector<uint8_t> padding(header.dataOffset - header.tableOffset - table.size() * sizeof(FirmwareBinaryEntry));
+	bool result = fwrite(&header, sizeof(header), 1, file) == 1
+		&& (table.empty() || fwrite(table.data(), sizeof(FirmwareBinaryEntry), table.size(), file) == table.size())
+		&& (padding.empty() || fwrite(padding.data(), 1, padding.size(), file) == padding.size())
+		&& (image.size() == 0 || fwrite(image.data(), 1, image.size(), file) == image.size());
+
+	if (fclose(file) != 0)
+		result = false;
+
+	if (!result)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", path);
+		remove(path);
+	}
+
+	return result;
+}
+
+bool loadFirmwareBinary(const char *path, FirmwareImage &image, FirmwareBinaryHeader *header)
+{
+	std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+
+	if (!mapping->open(path))
+		return false;
+
+	const uint8_t *base = mapping->data();
+	size_t size = mapping->size();
+	FirmwareBinaryHeader headerCopy;
+
+	if (size < FIRMWARE_BINARY_HEADER_V1_SIZE || ((const FirmwareBinaryHeader *)base)->magic != FIRMWARE_BINARY_MAGIC)
+	{
+		fprintf(stderr, "loadFirmwareBinary: '%s' is not a precompiled firmware.\n", path);
+		return false;
+	}
+
+	// Fields added after version 1 read as zero from older files
+	memset(&headerCopy, 0, sizeof(headerCopy));
+	memcpy(&headerCopy, base, FIRMWARE_BINARY_HEADER_V1_SIZE);
+
+	uint16_t minimumSize = headerCopy.version == 1 ? FIRMWARE_BINARY_HEADER_V1_SIZE : sizeof(FirmwareBinaryHeader);
+
+	if (headerCopy.version < 1 || headerCopy.version > FIRMWARE_BINARY_VERSION || headerCopy.headerSize < minimumSize || headerCopy.headerSize > size)
+	{
+		fprintf(stderr, "loadFirmwareBinary: Unsupported version %d.\n", headerCopy.version);
+		return false;
+	}
+
+	memcpy(&headerCopy, base, minimumSize);
+
+	const FirmwareBinaryHeader *fileHeader = &headerCopy;
+
+	uint64_t tableEnd = (uint64_t)fileHeader->tableOffset + (uint64_t)fileHeader->commandCount * sizeof(FirmwareBinaryEntry);
+	uint64_t dataEnd = (uint64_t)fileHeader->dataOffset + fileHeader->dataSize;
+
+	if (tableEnd > fileHeader->dataOffset || dataEnd > size)
+	{
+		fprintf(stderr, "loadFirmwareBinary: Invalid firmware, truncated file.\n");
+		return false;
+	}
+
+	if (fileHeader->tableOffset < fileHeader->headerSize)
+	{
+		fprintf(stderr, "loadFirmwareBinary: Invalid firmware, command table overlaps the header.\n");
+		return false;
+	}
+
+	const uint8_t *data = base + fileHeader->dataOffset;
+
+	if (hashBytes(data, fileHeader->dataSize) != fileHeader->dataHash)
+	{
+		fprintf(stderr, "loadFirmwareBinary: Invalid firmware, data hash mismatch.\n");
+		return false;
+	}
+
+	const FirmwareBinaryEntry *table = (const FirmwareBinaryEntry *)(base + fileHeader->tableOffset);
+
+	if (header != NULL)
+		*header = *fileHeader;
+
+	image.attach(mapping, data, fileHeader->dataSize);
+	image.reserve(0, fileHeader->commandCount);
+
+	for (uint32_t i = 0; i < fileHeader->commandCount; i++)
+	{
+		FirmwareBinaryEntry entry;
+		memcpy(&entry, &table[i], sizeof(entry));
+
+		// Each entry must hold exactly one well formed command
+		if (entry.length < HCI_COMMAND_HEADER_SIZE || entry.length > HCI_COMMAND_HEADER_SIZE + 0xFF
+			|| (uint64_t)entry.offset + entry.length > fileHeader->dataSize
+			|| data[entry.offset + 2] != entry.length - HCI_COMMAND_HEADER_SIZE)
+		{
+			fprintf(stderr, "loadFirmwareBinary: Invalid firmware, malformed command %u.\n", i);
+			image.clear();
+			return false;
+		}
+
+		uint16_t opcode = data[entry.offset] | data[entry.offset + 1] << 8;
+
+		if (!downloadCommand(opcode))
+		{
+			fprintf(stderr, "loadFirmwareBinary: Invalid firmware, command %u (0x%04x) is not LAUNCH_RAM, END_OF_RECORD or DOWNLOAD_MINIDRIVER.\n", i, opcode);
+			image.clear();
+			return false;
+		}
+
+		if (opcode == HCI_OPCODE_LAUNCH_RAM && entry.length < HCI_COMMAND_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE)
+		{
+			fprintf(stderr, "loadFirmwareBinary: Invalid firmware, LAUNCH_RAM command %u has no address.\n", i);
+			image.clear();
+			return false;
+		}
+
+		image.addCommand(entry.offset, (uint16_t)entry.length);
+	}
+
+	return true;
+}
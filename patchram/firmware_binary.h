@@ -0,0 +1,73 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_binary_h
+#define firmware_binary_h
+
+#include <stdint.h>
+#include "firmware_image.h"
+
+/*
+ *  Precompiled firmware (.prb)
+ *
+ *  A parsed and checksum verified command stream, stored little endian as:
+ *
+ *    FirmwareBinaryHeader
+ *    FirmwareBinaryEntry[commandCount]   (offset relative to dataOffset)
+ *    padding up to FIRMWARE_BINARY_ALIGNMENT
+ *    command data                        (opcode, length, parameters)...
+ *
+ *  Loading maps the file and sends the commands straight from the mapping.
+ */
+#define FIRMWARE_BINARY_MAGIC 0x4d415250 // 'PRAM'
+#define FIRMWARE_BINARY_VERSION 2
+#define FIRMWARE_BINARY_ALIGNMENT 4096
+#define FIRMWARE_BINARY_EXTENSION ".prb"
+
+struct __attribute__((packed)) FirmwareBinaryHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerSize;
+	uint64_t sourceHash;   // hashBytes() of the source file as read from disk
+	uint64_t dataHash;     // hashBytes() of the command data
+	uint16_t vendorId;
+	uint16_t productId;
+	uint32_t parseFlags;   // parseFirmware flags used to build the image
+	uint32_t commandCount;
+	uint32_t tableOffset;
+	uint32_t dataOffset;
+	uint32_t dataSize;
+	uint16_t lmpSubversion; // FirmwareVersion of the image, 0 if unknown (added in version 2)
+	uint16_t build;
+};
+
+// Version 1 headers end before lmpSubversion
+#define FIRMWARE_BINARY_HEADER_V1_SIZE 48
+
+struct __attribute__((packed)) FirmwareBinaryEntry
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+bool writeFirmwareBinary(const char *path, const FirmwareImage &image, uint64_t sourceHash, uint16_t vendorId, uint16_t productId, uint32_t parseFlags);
+bool loadFirmwareBinary(const char *path, FirmwareImage &image, FirmwareBinaryHeader *header);
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_bundle.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "decompress_stream.h"
+#include "firmware_catalog.h"
+#include "hcd_firmware.h"
+#include "hci.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Firmware bundles are stored in host byte order, only little endian hosts are supported"
+#endif
+
+// A bundled firmware that is not written as is saves at least this fraction of it
+#define BUNDLE_MIN_SAVING 8
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static uint64_t entryKey(const FirmwareBundleEntry &entry)
+{
+	return firmwareKey(entry.lmpSubversion, entry.vendorId, entry.productId);
+}
+
+static void printEntry(const FirmwareBundleEntry &entry, const char *name)
+{
+	printf("  %-12s %3.3u.%3.3u.%3.3u  build %4u  ", entry.chip[0] ? entry.chip : "?", (entry.lmpSubversion & 0xe000) >> 13, (entry.lmpSubversion & 0x1f00) >> 8, entry.lmpSubversion & 0xff, entry.build);
+
+	if (entry.vendorId != 0)
+		printf("[%04x:%04x]  ", entry.vendorId, entry.productId);
+	else
+		printf("any device   ");
+
+	printf("%-6s %8llu of %8llu bytes  %s\n", entry.compression == kCompressionNone ? "stored" : compressionName((CompressionFormat)entry.compression), (unsigned long long)entry.storedSize, (unsigned long long)entry.dataSize, name);
+}
+
+bool isFirmwareBundle(const char *fileName)
+{
+	const char *ext = strrchr(fileName, '.');
+
+	return ext != NULL && strcmp(ext, FIRMWARE_BUNDLE_EXTENSION) == 0;
+}
+
+bool packFirmwareBundle(const char *directory, const char *bundlePath, uint32_t threads, uint32_t parseFlags, CompressionFormat compression)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<FirmwareFile> files;
+
+	if (!scanFirmwareDirectory(directory, threads, parseFlags, true, files))
+		return false;
+
+	// One file per key, the map keeps the index sorted
+	std::map<uint64_t, size_t> best;
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].skipped != NULL)
+			continue;
+
+		uint64_t key = firmwareKey(files[i].entry);
+		std::map<uint64_t, size_t>::iterator found = best.find(key);
+
+		if (found == best.end())
+			best[key] = i;
+		else if (betterFirmware(files[i].entry, files[found->second].entry))
+			found->second = i;
+	}
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].skipped != NULL)
+			continue;
+
+		size_t chosen = best[firmwareKey(files[i].entry)];
+
+		if (chosen != i)
+			fprintf(stderr, "Skipping '%s', superseded by '%s'\n", files[i].path.c_str(), strrchr(files[chosen].path.c_str(), '/') + 1);
+	}
+
+	std::vector<FirmwareBundleEntry> entries;
+	std::vector<std::vector<uint8_t>> payloads;
+	std::string names;
+
+	for (std::map<uint64_t, size_t>::const_iterator it = best.begin(); it != best.end(); ++it)
+	{
+		const FirmwareFile &file = files[it->second];
+		const FirmwareImage &image = file.image;
+		FirmwareBundleEntry entry;
+		memset(&entry, 0, sizeof(entry));
+
+		// Stored under the key it was selected by
+		entry.lmpSubversion = (uint16_t)(it->first >> 32);
+		entry.vendorId = (uint16_t)(it->first >> 16);
+		entry.productId = (uint16_t)it->first;
+		entry.build = file.entry.build;
+		memcpy(entry.chip, file.entry.chip, sizeof(entry.chip));
+		entry.name = (uint32_t)names.size();
+		entry.commandCount = (uint32_t)image.count();
+		entry.sourceHash = file.entry.sourceHash;
+
+		names += strrchr(file.path.c_str(), '/') + 1;
+		names += '\0';
+
+		// .hcd images index the commands of the file, which ends with a launch that is not one of them
+		std::vector<uint8_t> data;
+		data.reserve(image.size());
+
+		for (size_t i = 0; i < image.count(); i++)
+		{
+			FirmwareSpan span = image.command(i);
+			data.insert(data.end(), span.data, span.data + span.length);
+		}
+
+		entry.compression = kCompressionNone;
+		entry.dataSize = data.size();
+		entry.dataHash = hashBytes(data.data(), data.size());
+
+		if (compression != kCompressionNone)
+		{
+			std::vector<uint8_t> compressed;
+
+			if (!compressBuffer(compression, data.data(), data.size(), compressed))
+				return false;
+
+			if (compressed.size() <= data.size() - data.size() / BUNDLE_MIN_SAVING)
+			{
+				data.swap(compressed);
+				entry.compression = (uint8_t)compression;
+			}
+		}
+
+		entry.storedSize = data.size();
+		entries.push_back(entry);
+		payloads.push_back(std::move(data));
+	}
+
+	FirmwareBundleHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = FIRMWARE_BUNDLE_MAGIC;
+	header.version = FIRMWARE_BUNDLE_VERSION;
+	header.headerSize = sizeof(header);
+	header.entryCount = (uint32_t)entries.size();
+	header.entryOffset = sizeof(header);
+	header.nameOffset = header.entryOffset + header.entryCount * sizeof(FirmwareBundleEntry);
+	header.nameSize = (uint32_t)names.size();
+	header.parseFlags = parseFlags;
+
+	uint64_t offset = (uint64_t)header.nameOffset + header.nameSize;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		entries[i].offset = alignUp(offset, FIRMWARE_BUNDLE_ALIGNMENT);
+		offset = entries[i].offset + entries[i].storedSize;
+	}
+
+	header.indexHash = hashBytes(entries.data(), entries.size() * sizeof(FirmwareBundleEntry));
+	header.indexHash = hashBytes(names.data(), names.size(), header.indexHash);
+
+	// Written aside and renamed, so a bundle in use is never seen half written
+	std::string temporary = std::string(bundlePath) + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", bundlePath);
+		return false;
+	}
+
+	static const uint8_t padding[FIRMWARE_BUNDLE_ALIGNMENT] = { 0 };
+	uint64_t written = (uint64_t)header.nameOffset + header.nameSize;
+	bool result = fwrite(&header, sizeof(header), 1, file) == 1
+		&& (entries.empty() || fwrite(entries.data(), sizeof(FirmwareBundleEntry), entries.size(), file) == entries.size())
+		&& (names.empty() || fwrite(names.data(), 1, names.size(), file) == names.size());
+
+	for (size_t i = 0; i < entries.size() && result; i++)
+	{
+		size_t gap = (size_t)(entries[i].offset - written);
+
+		result = (gap == 0 || fwrite(padding, 1, gap, file) == gap)
+			&& (payloads[i].empty() || fwrite(payloads[i].data(), 1, payloads[i].size(), file) == payloads[i].size());
+
+		written = entries[i].offset + entries[i].storedSize;
+	}
+
+	if (fclose(file) != 0)
+		result = false;
+
+	if (!result || rename(temporary.c_str(), bundlePath) != 0)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", bundlePath);
+		remove(temporary.c_str());
+		return false;
+	}
+
+	size_t compressed = 0;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		printEntry(entries[i], names.c_str() + entries[i].name);
+
+		if (entries[i].compression != kCompressionNone)
+			compressed++;
+	}
+
+	uint32_t workerCount = threads < files.size() ? threads : (uint32_t)files.size();
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Packed %zu of %zu firmware files (%zu compressed, %llu bytes) in %.1f ms on %u threads into '%s'\n", entries.size(), files.size(), compressed, (unsigned long long)written, elapsed, workerCount, bundlePath);
+
+	return true;
+}
+
+bool listFirmwareBundle(const char *bundlePath)
+{
+	FirmwareBundle bundle;
+
+	if (!bundle.open(bundlePath))
+		return false;
+
+	uint64_t dataSize = 0;
+	uint64_t storedSize = 0;
+
+	for (size_t i = 0; i < bundle.count(); i++)
+	{
+		const FirmwareBundleEntry &entry = bundle.entry(i);
+
+		printEntry(entry, bundle.name(entry));
+		dataSize += entry.dataSize;
+		storedSize += entry.storedSize;
+	}
+
+	printf("%zu firmware in '%s', %llu bytes of commands stored in %llu bytes\n", bundle.count(), bundlePath, (unsigned long long)dataSize, (unsigned long long)storedSize);
+
+	return true;
+}
+
+bool extractFirmwareBundle(const char *bundlePath, const char *directory)
+{
+	FirmwareBundle bundle;
+
+	if (!bundle.open(bundlePath))
+		return false;
+
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Error creating directory '%s' (%s)\n", directory, strerror(errno));
+		return false;
+	}
+
+	for (size_t i = 0; i < bundle.count(); i++)
+	{
+		const FirmwareBundleEntry &entry = bundle.entry(i);
+		std::string name = bundle.name(entry);
+		size_t dot = name.rfind('.');
+
+		// The name keeps the chip, version and USB ids a catalog or bundle identifies it by
+		std::string path = std::string(directory) + "/" + name.substr(0, dot) + HCD_EXTENSION;
+		FirmwareImage image;
+
+		if (!bundle.load(entry, image) || !writeHcdFirmware(path.c_str(), image))
+			return false;
+
+		printf("  %s -> %s (%zu commands)\n", name.c_str(), path.c_str(), image.count());
+	}
+
+	printf("Extracted %zu firmware from '%s'\n", bundle.count(), bundlePath);
+
+	return true;
+}
+
+FirmwareBundle::FirmwareBundle() :
+	mHeader(NULL), mEntries(NULL), mNames(NULL)
+{
+}
+
+bool FirmwareBundle::open(const char *path)
+{
+	std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+
+	if (!mapping->open(path))
+		return false;
+
+	const uint8_t *base = mapping->data();
+	size_t size = mapping->size();
+	const FirmwareBundleHeader *header = (const FirmwareBundleHeader *)base;
+
+	if (size < sizeof(FirmwareBundleHeader) || header->magic != FIRMWARE_BUNDLE_MAGIC)
+	{
+		fprintf(stderr, "FirmwareBundle: '%s' is not a firmware bundle.\n", path);
+		return false;
+	}
+
+	if (header->version != FIRMWARE_BUNDLE_VERSION || header->headerSize != sizeof(FirmwareBundleHeader))
+	{
+		fprintf(stderr, "FirmwareBundle: Unsupported version %d.\n", header->version);
+		return false;
+	}
+
+	uint64_t entryEnd = (uint64_t)header->entryOffset + (uint64_t)header->entryCount * sizeof(FirmwareBundleEntry);
+	uint64_t nameEnd = (uint64_t)header->nameOffset + header->nameSize;
+
+	if (header->entryOffset < header->headerSize || entryEnd > header->nameOffset || nameEnd > size || (header->nameSize > 0 && base[nameEnd - 1] != '\0')
+		|| hashBytes(base + header->entryOffset, nameEnd - header->entryOffset) != header->indexHash)
+	{
+		fprintf(stderr, "FirmwareBundle: '%s' is truncated or corrupt.\n", path);
+		return false;
+	}
+
+	const FirmwareBundleEntry *entries = (const FirmwareBundleEntry *)(base + header->entryOffset);
+
+	for (uint32_t i = 0; i < header->entryCount; i++)
+	{
+		const FirmwareBundleEntry &entry = entries[i];
+
+		// Payloads past the end or out of order would make lookups and loads read garbage
+		if (entry.name >= header->nameSize || entry.offset < nameEnd || entry.storedSize > size || entry.offset > size - entry.storedSize
+			|| (entry.compression != kCompressionNone && entry.compression != kCompressionZlib && entry.compression != kCompressionZstd && entry.compression != kCompressionLz4)
+			|| (i > 0 && entryKey(entries[i - 1]) >= entryKey(entry)))
+		{
+			fprintf(stderr, "FirmwareBundle: '%s' is truncated or corrupt.\n", path);
+			return false;
+		}
+	}
+
+	mMapping = mapping;
+	mHeader = header;
+	mEntries = entries;
+	mNames = (const char *)base + header->nameOffset;
+
+	return true;
+}
+
+const FirmwareBundleEntry *FirmwareBundle::lookup(uint64_t key) const
+{
+	size_t low = 0;
+	size_t high = mHeader->entryCount;
+
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+
+		if (entryKey(mEntries[middle]) < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low < mHeader->entryCount && entryKey(mEntries[low]) == key ? &mEntries[low] : NULL;
+}
+
+const FirmwareBundleEntry *FirmwareBundle::find(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId) const
+{
+	const FirmwareBundleEntry *entry = NULL;
+
+	if (mHeader == NULL)
+		return NULL;
+
+	if (lmpSubversion != 0 && vendorId != 0)
+		entry = lookup(firmwareKey(lmpSubversion, vendorId, productId));
+
+	if (entry == NULL && lmpSubversion != 0)
+		entry = lookup(firmwareKey(lmpSubversion, 0, 0));
+
+	if (entry == NULL && vendorId != 0)
+		entry = lookup(firmwareKey(0, vendorId, productId));
+
+	return entry;
+}
+
+bool FirmwareBundle::load(const FirmwareBundleEntry &entry, FirmwareImage &image) const
+{
+	const uint8_t *data = mMapping->data() + entry.offset;
+	const char *name = this->name(entry);
+	std::vector<uint8_t> decompressed;
+
+	image.clear();
+
+	if (entry.compression != kCompressionNone)
+	{
+		DecompressStream stream;
+		decompressed.reserve(entry.dataSize);
+
+		DecompressStream::Sink sink = [&decompressed, &entry](const uint8_t *chunk, size_t length)
+		{
+			if (decompressed.size() + length > entry.dataSize)
+				return false;
+
+			decompressed.insert(decompressed.end(), chunk, chunk + length);
+			return true;
+		};
+
+		if (!stream.begin((CompressionFormat)entry.compression))
+			return false;
+
+		if (!stream.push(data, entry.storedSize, sink) || !stream.finished() || decompressed.size() != entry.dataSize)
+		{
+			fprintf(stderr, "FirmwareBundle: Invalid firmware '%s', corrupt %s payload.\n", name, compressionName((CompressionFormat)entry.compression));
+			return false;
+		}
+
+		data = decompressed.data();
+	}
+	else if (entry.storedSize != entry.dataSize)
+	{
+		fprintf(stderr, "FirmwareBundle: Invalid firmware '%s', truncated payload.\n", name);
+		return false;
+	}
+
+	if (hashBytes(data, entry.dataSize) != entry.dataHash)
+	{
+		fprintf(stderr, "FirmwareBundle: Invalid firmware '%s', data hash mismatch.\n", name);
+		return false;
+	}
+
+	// Stored commands are used where they are mapped, decompressed ones copied into the image
+	if (entry.compression == kCompressionNone)
+		image.attach(mMapping, data, entry.dataSize);
+
+	image.reserve(entry.compression == kCompressionNone ? 0 : entry.dataSize, entry.commandCount);
+
+	uint64_t offset = 0;
+
+	while (offset < entry.dataSize)
+	{
+		uint16_t length = HCI_COMMAND_HEADER_SIZE + (entry.dataSize - offset >= HCI_COMMAND_HEADER_SIZE ? data[offset + 2] : 0);
+
+		if (entry.dataSize - offset < length || image.count() == entry.commandCount)
+			break;
+
+		if (entry.compression == kCompressionNone)
+			image.addCommand((uint32_t)offset, length);
+		else
+			memcpy(image.appendCommand(data[offset] | data[offset + 1] << 8, data[offset + 2]), data + offset + HCI_COMMAND_HEADER_SIZE, length - HCI_COMMAND_HEADER_SIZE);
+
+		offset += length;
+	}
+
+	if (offset != entry.dataSize || image.count() != entry.commandCount)
+	{
+		fprintf(stderr, "FirmwareBundle: Invalid firmware '%s', malformed command at offset %llu.\n", name, (unsigned long long)offset);
+		image.clear();
+		return false;
+	}
+
+	FirmwareVersion version;
+	version.lmpSubversion = entry.lmpSubversion;
+	version.build = entry.build;
+	image.setVersion(version);
+
+	return true;
+}
+
+const FirmwareBundleEntry *FirmwareBundle::select(const FirmwareVersion &device, uint16_t vendorId, uint16_t productId, FirmwareImage &image) const
+{
+	const FirmwareBundleEntry *entry = find(device.lmpSubversion, vendorId, productId);
+
+	if (entry == NULL)
+	{
+		const char *chip = chipName(device.lmpSubversion);
+
+		fprintf(stderr, "[%04x:%04x]: No firmware for %s (subversion 0x%04x) in the bundle, aborting.\n", vendorId, productId, chip ? chip : "BCM", device.lmpSubversion);
+		return NULL;
+	}
+
+	return load(*entry, image) ? entry : NULL;
+}
@@ -0,0 +1,165 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_bundle_h
+#define firmware_bundle_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include "decompress_stream.h"
+#include "firmware_image.h"
+#include "mapped_file.h"
+
+/*
+ *  Firmware bundle (.prp)
+ *
+ *  Every firmware of a directory packed into one file, stored little endian as:
+ *
+ *    FirmwareBundleHeader
+ *    FirmwareBundleEntry[entryCount]    sorted by key, one per key
+ *    names                              NUL terminated file names
+ *    padding up to FIRMWARE_BUNDLE_ALIGNMENT
+ *    payloads                           each aligned to FIRMWARE_BUNDLE_ALIGNMENT
+ *
+ *  A payload is the parsed command stream of one firmware (opcode, length,
+ *  parameters)..., stored as is or compressed on its own with zlib, zstd or
+ *  LZ4. The key is the one firmwareKey() gives the file it was packed from,
+ *  so a bundle selects the same firmware a catalog of the directory would.
+ *  Opening maps the file and a lookup is a binary search of the index;
+ *  stored payloads are then used in place, so every upgrade running from the
+ *  bundle shares its pages.
+ */
+#define FIRMWARE_BUNDLE_MAGIC 0x444e4250 // 'PBND'
+#define FIRMWARE_BUNDLE_VERSION 1
+#define FIRMWARE_BUNDLE_ALIGNMENT 4096
+#define FIRMWARE_BUNDLE_EXTENSION ".prp"
+
+struct __attribute__((packed)) FirmwareBundleHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerSize;
+	uint32_t entryCount;
+	uint32_t entryOffset;
+	uint32_t nameOffset;
+	uint32_t nameSize;
+	uint32_t parseFlags;	// parseFirmware flags the HEX firmware was packed with
+	uint32_t reserved;
+	uint64_t indexHash;		// hashBytes() of the entries and names
+};
+
+struct __attribute__((packed)) FirmwareBundleEntry
+{
+	uint16_t lmpSubversion;	// Key, see firmwareKey()
+	uint16_t vendorId;
+	uint16_t productId;
+	uint16_t build;			// 0 if unknown
+	char chip[16];			// e.g. BCM20702A1, NUL terminated, empty if unknown
+	uint32_t name;			// Offset into the names
+	uint32_t commandCount;
+	uint8_t compression;	// CompressionFormat of the payload: none, zlib, zstd or lz4
+	uint8_t reserved[7];
+	uint64_t offset;		// Payload, from the start of the file
+	uint64_t storedSize;	// Bytes of payload in the file
+	uint64_t dataSize;		// Bytes of commands once decompressed
+	uint64_t dataHash;		// hashBytes() of the commands
+	uint64_t sourceHash;	// hashBytes() of the file as read from disk
+};
+
+bool isFirmwareBundle(const char *fileName);
+
+/*
+ *  Pack every firmware file in a directory into a bundle
+ *
+ *  The directory is scanned like for a catalog and the best file for each
+ *  key is packed, the others are reported as superseded.
+ *
+ *  directory   - Directory to scan, not recursive
+ *  bundlePath  - Bundle to write
+ *  threads     - Files parsed at the same time
+ *  parseFlags  - kParse* flags for Intel HEX firmware
+ *  compression - Format the payloads that shrink by at least an eighth are
+ *                compressed with, kCompressionNone stores all of them
+ *
+ *  returns true or false on error
+ */
+bool packFirmwareBundle(const char *directory, const char *bundlePath, uint32_t threads, uint32_t parseFlags, CompressionFormat compression);
+
+// Print the index of a bundle
+bool listFirmwareBundle(const char *bundlePath);
+
+// Write every firmware of a bundle to a directory as .hcd files
+bool extractFirmwareBundle(const char *bundlePath, const char *directory);
+
+// Mapped bundle
+class FirmwareBundle
+{
+public:
+	FirmwareBundle();
+
+	bool open(const char *path);
+
+	/*
+	 *  Best firmware for a controller
+	 *
+	 *  Tries the subversion with the vendor/product id, then the subversion
+	 *  alone, then the vendor/product id of firmware for which the chip is
+	 *  not known.
+	 *
+	 *  returns the entry, or NULL if no firmware fits
+	 */
+	const FirmwareBundleEntry *find(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId) const;
+
+	/*
+	 *  Load the firmware of an entry
+	 *
+	 *  Stored payloads are indexed in place and keep the mapping alive,
+	 *  compressed ones are decompressed into the image. Safe to call from any
+	 *  number of threads at once.
+	 *
+	 *  returns true or false if the payload is corrupt
+	 */
+	bool load(const FirmwareBundleEntry &entry, FirmwareImage &image) const;
+
+	/*
+	 *  Find and load the firmware for a controller, see UpgradeOptions::selectFirmware
+	 *
+	 *  returns the entry, or NULL if no firmware fits or it could not be loaded
+	 */
+	const FirmwareBundleEntry *select(const FirmwareVersion &device, uint16_t vendorId, uint16_t productId, FirmwareImage &image) const;
+
+	size_t count() const { return mHeader ? mHeader->entryCount : 0; }
+	const FirmwareBundleEntry &entry(size_t index) const { return mEntries[index]; }
+	const char *name(const FirmwareBundleEntry &entry) const { return mNames + entry.name; }
+	uint32_t parseFlags() const { return mHeader->parseFlags; }
+
+private:
+	FirmwareBundle(const FirmwareBundle &);
+	FirmwareBundle &operator=(const FirmwareBundle &);
+
+	const FirmwareBundleEntry *lookup(uint64_t key) const;
+
+	std::shared_ptr<MappedFile> mMapping;
+	const FirmwareBundleHeader *mHeader;
+	const FirmwareBundleEntry *mEntries;
+	const char *mNames;
+};
+
+#endif
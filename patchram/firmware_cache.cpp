@@ -0,0 +1,165 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <tuple>
+#include "firmware_binary.h"
+#include "firmware_bundle.h"
+#include "firmware_loader.h"
+#include "mapped_file.h"
+
+bool FirmwareCache::Key::operator<(const Key &other) const
+{
+	return std::tie(hash, size, parseFlags, target, version) < std::tie(other.hash, other.size, other.parseFlags, other.target, other.version);
+}
+
+FirmwareCache &FirmwareCache::shared()
+{
+	static FirmwareCache cache;
+
+	return cache;
+}
+
+std::shared_ptr<const FirmwareImage> FirmwareCache::acquire(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags)
+{
+	Key key;
+
+	{
+		// Only hashed here, the loader reads the file again on a miss
+		MappedFile file;
+
+		if (!file.open(fileName))
+			return NULL;
+
+		const char *ext = strrchr(fileName, '.');
+		bool binary = ext != NULL && strcmp(ext, FIRMWARE_BINARY_EXTENSION) == 0;
+
+		key.hash = hashBytes(file.data(), file.size());
+		key.size = file.size();
+		key.parseFlags = parseFlags;
+		key.target = binary ? ((uint32_t)vendorId << 16 | productId) : 0;
+
+		FirmwareVersion version;
+		parseFirmwareVersion(fileName, version);
+		key.version = (uint32_t)version.lmpSubversion << 16 | version.build;
+	}
+
+	std::unique_lock<std::mutex> lock(mLock);
+
+	while (true)
+	{
+		std::map<Key, Entry>::iterator it = mEntries.find(key);
+
+		if (it == mEntries.end())
+			break;
+
+		std::shared_ptr<const FirmwareImage> image = it->second.image.lock();
+
+		if (image)
+		{
+#ifdef DEBUG
+			printf("[%04x:%04x]: Using cached firmware for '%s'\n", vendorId, productId, fileName);
+#endif
+			return image;
+		}
+
+		if (!it->second.loading)
+		{
+			mEntries.erase(it);
+			break;
+		}
+
+		mSignal.wait(lock);
+	}
+
+	prune();
+	mEntries[key].loading = true;
+	lock.unlock();
+
+	std::shared_ptr<FirmwareImage> image(new FirmwareImage());
+	bool loaded = loadFirmware(fileName, vendorId, productId, parseFlags, *image, NULL);
+
+	lock.lock();
+
+	// Threads waiting on a failed load try for themselves
+	if (loaded)
+	{
+		Entry &entry = mEntries[key];
+		entry.image = image;
+		entry.loading = false;
+	}
+	else
+	{
+		mEntries.erase(key);
+		image.reset();
+	}
+
+	mSignal.notify_all();
+
+	return image;
+}
+
+std::shared_ptr<const FirmwareBundle> FirmwareCache::acquireBundle(const char *fileName)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	std::weak_ptr<const FirmwareBundle> &cached = mBundles[fileName];
+	std::shared_ptr<const FirmwareBundle> bundle = cached.lock();
+
+	if (bundle)
+		return bundle;
+
+	// Only maps the file and checks the index, quick enough to hold the lock for
+	std::shared_ptr<FirmwareBundle> opened(new FirmwareBundle());
+
+	if (!opened->open(fileName))
+	{
+		mBundles.erase(fileName);
+		return NULL;
+	}
+
+	cached = opened;
+
+	return opened;
+}
+
+size_t FirmwareCache::size()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+
+	prune();
+
+	return mEntries.size();
+}
+
+// Drop entries whose image has been freed, called with mLock held
+void FirmwareCache::prune()
+{
+	std::map<Key, Entry>::iterator it = mEntries.begin();
+
+	while (it != mEntries.end())
+	{
+		if (!it->second.loading && it->second.image.expired())
+			it = mEntries.erase(it);
+		else
+			++it;
+	}
+}
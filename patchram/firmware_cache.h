@@ -0,0 +1,100 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_cache_h
+#define firmware_cache_h
+
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "firmware_image.h"
+
+class FirmwareBundle;
+
+/*
+ *  Process-wide cache of loaded firmware images
+ *
+ *  Images are keyed by the hash and size of the file contents, the parse
+ *  flags and the version in the file name, so every session flashing the
+ *  same firmware shares one read-only image even when it is found under
+ *  different paths. The cache only holds weak references: an image is freed
+ *  once the last session using it lets go.
+ *  When several threads ask for the same firmware at once, one loads it and
+ *  the others wait for the result.
+ */
+class FirmwareCache
+{
+public:
+	static FirmwareCache &shared();
+
+	/*
+	 *  Load a firmware file or return the image already loaded from the same contents
+	 *
+	 *  fileName   - Firmware file, any format loadFirmware() accepts
+	 *  vendorId   - USB device vendor the firmware is loaded for
+	 *  productId  - USB device product the firmware is loaded for
+	 *  parseFlags - kParse* flags for Intel HEX firmware
+	 *
+	 *  returns the image, or NULL on error
+	 */
+	std::shared_ptr<const FirmwareImage> acquire(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags);
+
+	/*
+	 *  Open a firmware bundle or return the one already open from the same path
+	 *
+	 *  Sessions then load their firmware from the bundle once their controller
+	 *  is known, see FirmwareBundle::select().
+	 *
+	 *  returns the bundle, or NULL on error
+	 */
+	std::shared_ptr<const FirmwareBundle> acquireBundle(const char *fileName);
+
+	// Number of images currently in use
+	size_t size();
+
+private:
+	struct Key
+	{
+		uint64_t hash;
+		uint64_t size;
+		uint32_t parseFlags;
+		uint32_t target;			// Vendor and product for precompiled files, which are checked against it
+		uint32_t version;			// Subversion and build from the file name, which the image carries
+
+		bool operator<(const Key &other) const;
+	};
+
+	struct Entry
+	{
+		std::weak_ptr<const FirmwareImage> image;
+		bool loading = false;
+	};
+
+	void prune();
+
+	std::mutex mLock;
+	std::condition_variable mSignal;
+	std::map<Key, Entry> mEntries;
+	std::map<std::string, std::weak_ptr<const FirmwareBundle>> mBundles;
+};
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_catalog.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "firmware_binary.h"
+#include "firmware_loader.h"
+#include "hcd_firmware.h"
+#include "hci.h"
+#include "intel_firmware.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The firmware catalog is stored in host byte order, only little endian hosts are supported"
+#endif
+
+// Files taken for firmware when a directory is scanned
+static const char *const firmwareExtensions[] =
+{
+	".hex", ".dfu", ".zhx", ".gz", ".zst", ".lz4", FIRMWARE_BINARY_EXTENSION, HCD_EXTENSION, NULL
+};
+
+uint64_t firmwareKey(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId)
+{
+	return (uint64_t)lmpSubversion << 32 | (uint32_t)vendorId << 16 | productId;
+}
+
+uint64_t firmwareKey(const FirmwareCatalogEntry &entry)
+{
+	if (entry.lmpSubversion != 0 && entry.vendorId != 0)
+		return firmwareKey(entry.lmpSubversion, entry.vendorId, entry.productId);
+
+	if (entry.lmpSubversion != 0)
+		return firmwareKey(entry.lmpSubversion, 0, 0);
+
+	return firmwareKey(0, entry.vendorId, entry.productId);
+}
+
+static uint32_t slotIndex(uint64_t key, uint32_t slotCount)
+{
+	return (uint32_t)hashBytes(&key, sizeof(key)) & (slotCount - 1);
+}
+
+bool isFirmwareCatalog(const char *fileName)
+{
+	const char *ext = strrchr(fileName, '.');
+
+	return ext != NULL && strcmp(ext, FIRMWARE_CATALOG_EXTENSION) == 0;
+}
+
+static bool hasFirmwareExtension(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	for (int i = 0; ext != NULL && firmwareExtensions[i]; i++)
+	{
+		if (strcasecmp(ext, firmwareExtensions[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// Chip and USB ids from names like BCM20702A1_001.002.014.1443.1572_v5668.zhx or BCM20702A1-0a5c-21e8.hcd
+static void parseFirmwareName(const char *name, FirmwareCatalogEntry &entry)
+{
+	size_t length = strcspn(name, "_-.");
+
+	if (strncasecmp(name, "BCM", 3) == 0 && length < sizeof(entry.chip))
+	{
+		memcpy(entry.chip, name, length);
+		entry.chip[length] = '\0';
+	}
+
+	for (const char *field = strchr(name, '-'); field != NULL; field = strchr(field + 1, '-'))
+	{
+		unsigned int vendorId, productId;
+		int end = 0;
+
+		if (sscanf(field, "-%4x-%4x%n", &vendorId, &productId, &end) == 2 && end == 10 && vendorId != 0)
+		{
+			entry.vendorId = (uint16_t)vendorId;
+			entry.productId = (uint16_t)productId;
+			break;
+		}
+	}
+}
+
+// Load a file and fill in its entry, or the reason it cannot be used
+static void describeFirmware(FirmwareFile &file, uint32_t parseFlags, bool keepImage)
+{
+	const char *path = file.path.c_str();
+	const char *name = strrchr(path, '/') + 1;
+	FirmwareCatalogEntry &entry = file.entry;
+	struct stat st;
+
+	file.skipped = "not valid firmware";
+
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	parseFirmwareName(name, entry);
+
+	FirmwareImage &image = file.image;
+	uint64_t sourceHash = 0;
+	const char *ext = strrchr(name, '.');
+
+	if (strcmp(ext, FIRMWARE_BINARY_EXTENSION) == 0)
+	{
+		// Compiled for one device, the header knows which
+		FirmwareBinaryHeader header;
+
+		if (!loadFirmwareBinary(path, image, &header))
+			return;
+
+		FirmwareVersion version;
+		version.lmpSubversion = header.lmpSubversion;
+		version.build = header.build;
+
+		if (version.known() || parseFirmwareVersion(path, version))
+			image.setVersion(version);
+
+		entry.vendorId = header.vendorId;
+		entry.productId = header.productId;
+		sourceHash = header.sourceHash;
+	}
+	else if (!loadFirmware(path, entry.vendorId, entry.productId, parseFlags, image, &sourceHash))
+	{
+		return;
+	}
+
+	entry.lmpSubversion = image.version().lmpSubversion;
+	entry.build = image.version().build;
+
+	// Names like BCM20702A1-0a5c-21e8.hcd only carry the chip
+	if (entry.lmpSubversion == 0 && entry.chip[0] != '\0')
+		entry.lmpSubversion = chipSubversion(entry.chip, strlen(entry.chip));
+
+	const char *chip = chipName(entry.lmpSubversion);
+
+	if (entry.chip[0] == '\0' && chip != NULL)
+		strncpy(entry.chip, chip, sizeof(entry.chip) - 1);
+
+	entry.commandCount = (uint32_t)image.count();
+	entry.dataSize = (uint32_t)image.size();
+	entry.fileSize = (uint64_t)st.st_size;
+	entry.modified = (int64_t)st.st_mtime;
+	entry.sourceHash = sourceHash;
+
+	// Nothing a controller could be matched with
+	file.skipped = entry.lmpSubversion != 0 || entry.vendorId != 0 ? NULL : "no chip or USB ids in its name";
+
+	if (file.skipped != NULL || !keepImage)
+		image.clear();
+}
+
+bool betterFirmware(const FirmwareCatalogEntry &a, const FirmwareCatalogEntry &b)
+{
+	if (a.build != b.build)
+		return a.build > b.build;
+
+	return a.modified > b.modified;
+}
+
+bool scanFirmwareDirectory(const char *directory, uint32_t threads, uint32_t parseFlags, bool keepImages, std::vector<FirmwareFile> &files)
+{
+	char resolved[PATH_MAX];
+	DIR *dir;
+
+	if (realpath(directory, resolved) == NULL || (dir = opendir(resolved)) == NULL)
+	{
+		fprintf(stderr, "Error reading directory '%s'\n", directory);
+		return false;
+	}
+
+	struct dirent *dirEntry;
+
+	while ((dirEntry = readdir(dir)) != NULL)
+	{
+		if (dirEntry->d_name[0] == '.' || !hasFirmwareExtension(dirEntry->d_name))
+			continue;
+
+		FirmwareFile file;
+		file.path = std::string(resolved) + "/" + dirEntry->d_name;
+		file.skipped = NULL;
+		memset(&file.entry, 0, sizeof(file.entry));
+		files.push_back(std::move(file));
+	}
+
+	closedir(dir);
+
+	// Equal firmware resolves the same way every time
+	std::sort(files.begin(), files.end(), [](const FirmwareFile &a, const FirmwareFile &b) { return a.path < b.path; });
+
+	uint32_t workerCount = threads < files.size() ? threads : (uint32_t)files.size();
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next(0);
+
+	for (uint32_t i = 0; i < workerCount; i++)
+	{
+		workers.push_back(std::thread([&files, &next, parseFlags, keepImages]
+		{
+			size_t index;
+
+			while ((index = next++) < files.size())
+				describeFirmware(files[index], parseFlags, keepImages);
+		}));
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].skipped != NULL)
+			fprintf(stderr, "Skipping '%s', %s\n", files[i].path.c_str(), files[i].skipped);
+	}
+
+	return true;
+}
+
+bool buildFirmwareCatalog(const char *directory, const char *indexPath, uint32_t threads)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<FirmwareFile> files;
+
+	if (!scanFirmwareDirectory(directory, threads, kParseDefault, false, files))
+		return false;
+
+	uint32_t workerCount = threads < files.size() ? threads : (uint32_t)files.size();
+	std::vector<FirmwareCatalogEntry> entries;
+	std::string paths;
+	std::map<uint64_t, uint32_t> best;
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].skipped != NULL)
+			continue;
+
+		FirmwareCatalogEntry entry = files[i].entry;
+		entry.path = (uint32_t)paths.size();
+		paths += files[i].path;
+		paths += '\0';
+
+		// A file for one device is only found for it, one without ids for its chip on any device
+		uint64_t key = firmwareKey(entry);
+		std::map<uint64_t, uint32_t>::iterator found = best.find(key);
+
+		if (found == best.end())
+			best[key] = (uint32_t)entries.size();
+		else if (betterFirmware(entry, entries[found->second]))
+			found->second = (uint32_t)entries.size();
+
+		entries.push_back(entry);
+	}
+
+	// At most half full keeps the probe sequences short
+	uint32_t slotCount = 2;
+
+	while (slotCount < 2 * best.size())
+		slotCount *= 2;
+
+	std::vector<FirmwareCatalogSlot> slots(slotCount);
+
+	for (uint32_t i = 0; i < slotCount; i++)
+	{
+		slots[i].key = 0;
+		slots[i].entry = FIRMWARE_CATALOG_EMPTY;
+		slots[i].reserved = 0;
+	}
+
+	for (std::map<uint64_t, uint32_t>::const_iterator it = best.begin(); it != best.end(); ++it)
+	{
+		uint32_t index = slotIndex(it->first, slotCount);
+
+		while (slots[index].entry != FIRMWARE_CATALOG_EMPTY)
+			index = (index + 1) & (slotCount - 1);
+
+		slots[index].key = it->first;
+		slots[index].entry = it->second;
+	}
+
+	FirmwareCatalogHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = FIRMWARE_CATALOG_MAGIC;
+	header.version = FIRMWARE_CATALOG_VERSION;
+	header.headerSize = sizeof(header);
+	header.entryCount = (uint32_t)entries.size();
+	header.entryOffset = sizeof(header);
+	header.slotCount = slotCount;
+	header.slotOffset = header.entryOffset + header.entryCount * sizeof(FirmwareCatalogEntry);
+	header.pathOffset = header.slotOffset + slotCount * sizeof(FirmwareCatalogSlot);
+	header.pathSize = (uint32_t)paths.size();
+
+	// Written aside and renamed, so a catalog in use is never seen half written
+	std::string temporary = std::string(indexPath) + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", indexPath);
+		return false;
+	}
+
+	bool result = fwrite(&header, sizeof(header), 1, file) == 1
+		&& (entries.empty() || fwrite(entries.data(), sizeof(FirmwareCatalogEntry), entries.size(), file) == entries.size())
+		&& fwrite(slots.data(), sizeof(FirmwareCatalogSlot), slots.size(), file) == slots.size()
+		&& (paths.empty() || fwrite(paths.data(), 1, paths.size(), file) == paths.size());
+
+	if (fclose(file) != 0)
+		result = false;
+
+	if (!result || rename(temporary.c_str(), indexPath) != 0)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", indexPath);
+		remove(temporary.c_str());
+		return false;
+	}
+
+	for (std::map<uint64_t, uint32_t>::const_iterator it = best.begin(); it != best.end(); ++it)
+	{
+		const FirmwareCatalogEntry &entry = entries[it->second];
+
+		printf("  %-12s %3.3u.%3.3u.%3.3u  build %4u  ", entry.chip[0] ? entry.chip : "?", (entry.lmpSubversion & 0xe000) >> 13, (entry.lmpSubversion & 0x1f00) >> 8, entry.lmpSubversion & 0xff, entry.build);
+
+		if (entry.vendorId != 0)
+			printf("[%04x:%04x]  ", entry.vendorId, entry.productId);
+		else
+			printf("any device   ");
+
+		printf("%s\n", strrchr(paths.c_str() + entry.path, '/') + 1);
+	}
+
+	double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Cataloged %zu of %zu firmware files (%zu selectable) in %.1f ms on %u threads into '%s'\n", entries.size(), files.size(), best.size(), elapsed, workerCount, indexPath);
+
+	return true;
+}
+
+FirmwareCatalog::FirmwareCatalog() :
+	mHeader(NULL), mEntries(NULL), mSlots(NULL), mPaths(NULL)
+{
+}
+
+bool FirmwareCatalog::open(const char *path)
+{
+	if (!mMapping.open(path))
+		return false;
+
+	const uint8_t *base = mMapping.data();
+	size_t size = mMapping.size();
+	const FirmwareCatalogHeader *header = (const FirmwareCatalogHeader *)base;
+
+	if (size < sizeof(FirmwareCatalogHeader) || header->magic != FIRMWARE_CATALOG_MAGIC)
+	{
+		fprintf(stderr, "FirmwareCatalog: '%s' is not a firmware catalog.\n", path);
+		return false;
+	}
+
+	if (header->version != FIRMWARE_CATALOG_VERSION || header->headerSize != sizeof(FirmwareCatalogHeader))
+	{
+		fprintf(stderr, "FirmwareCatalog: Unsupported version %d.\n", header->version);
+		return false;
+	}
+
+	uint64_t entryEnd = (uint64_t)header->entryOffset + (uint64_t)header->entryCount * sizeof(FirmwareCatalogEntry);
+	uint64_t slotEnd = (uint64_t)header->slotOffset + (uint64_t)header->slotCount * sizeof(FirmwareCatalogSlot);
+	uint64_t pathEnd = (uint64_t)header->pathOffset + header->pathSize;
+
+	if (entryEnd > header->slotOffset || slotEnd > header->pathOffset || pathEnd > size
+		|| header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0
+		|| (header->pathSize > 0 && base[pathEnd - 1] != '\0'))
+	{
+		fprintf(stderr, "FirmwareCatalog: '%s' is truncated or corrupt.\n", path);
+		return false;
+	}
+
+	const FirmwareCatalogEntry *entries = (const FirmwareCatalogEntry *)(base + header->entryOffset);
+	const FirmwareCatalogSlot *slots = (const FirmwareCatalogSlot *)(base + header->slotOffset);
+
+	for (uint32_t i = 0; i < header->entryCount; i++)
+	{
+		if (entries[i].path >= header->pathSize)
+		{
+			fprintf(stderr, "FirmwareCatalog: '%s' is truncated or corrupt.\n", path);
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < header->slotCount; i++)
+	{
+		if (slots[i].entry != FIRMWARE_CATALOG_EMPTY && slots[i].entry >= header->entryCount)
+		{
+			fprintf(stderr, "FirmwareCatalog: '%s' is truncated or corrupt.\n", path);
+			return false;
+		}
+	}
+
+	mHeader = header;
+	mEntries = entries;
+	mSlots = slots;
+	mPaths = (const char *)base + header->pathOffset;
+
+	return true;
+}
+
+const FirmwareCatalogEntry *FirmwareCatalog::lookup(uint64_t key) const
+{
+	uint32_t mask = mHeader->slotCount - 1;
+	uint32_t index = slotIndex(key, mHeader->slotCount);
+
+	for (uint32_t probe = 0; probe < mHeader->slotCount; probe++)
+	{
+		const FirmwareCatalogSlot &slot = mSlots[index];
+
+		if (slot.entry == FIRMWARE_CATALOG_EMPTY)
+			break;
+
+		if (slot.key == key)
+			return &mEntries[slot.entry];
+
+		index = (index + 1) & mask;
+	}
+
+	return NULL;
+}
+
+const FirmwareCatalogEntry *FirmwareCatalog::find(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId) const
+{
+	const FirmwareCatalogEntry *entry = NULL;
+
+	if (mHeader == NULL)
+		return NULL;
+
+	if (lmpSubversion != 0 && vendorId != 0)
+		entry = lookup(firmwareKey(lmpSubversion, vendorId, productId));
+
+	if (entry == NULL && lmpSubversion != 0)
+		entry = lookup(firmwareKey(lmpSubversion, 0, 0));
+
+	if (entry == NULL && vendorId != 0)
+		entry = lookup(firmwareKey(0, vendorId, productId));
+
+	return entry;
+}
+
+bool FirmwareCatalog::current(const FirmwareCatalogEntry &entry) const
+{
+	struct stat st;
+
+	return stat(path(entry), &st) == 0 && (uint64_t)st.st_size == entry.fileSize && (int64_t)st.st_mtime == entry.modified;
+}
@@ -0,0 +1,183 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_catalog_h
+#define firmware_catalog_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "firmware_image.h"
+#include "mapped_file.h"
+
+/*
+ *  Firmware catalog (.prc)
+ *
+ *  Index of a directory of firmware files, stored little endian as:
+ *
+ *    FirmwareCatalogHeader
+ *    FirmwareCatalogEntry[entryCount]    one per usable firmware file
+ *    FirmwareCatalogSlot[slotCount]      open addressing hash table, power of two
+ *    paths                               NUL terminated, absolute
+ *
+ *  A slot maps a key made of the LMP subversion and the USB vendor/product
+ *  id, either of which may be 0 for "any", to the best entry for it: the
+ *  highest build, then the newest file. The file is mapped and used in
+ *  place, a lookup hashes the key and probes a few slots.
+ */
+#define FIRMWARE_CATALOG_MAGIC 0x54414350 // 'PCAT'
+#define FIRMWARE_CATALOG_VERSION 1
+#define FIRMWARE_CATALOG_EXTENSION ".prc"
+
+// Written into the scanned directory when no index path is given
+#define FIRMWARE_CATALOG_NAME "firmware" FIRMWARE_CATALOG_EXTENSION
+
+// Marks an unused slot
+#define FIRMWARE_CATALOG_EMPTY 0xffffffff
+
+struct __attribute__((packed)) FirmwareCatalogHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t headerSize;
+	uint32_t entryCount;
+	uint32_t entryOffset;
+	uint32_t slotCount;
+	uint32_t slotOffset;
+	uint32_t pathOffset;
+	uint32_t pathSize;
+};
+
+struct __attribute__((packed)) FirmwareCatalogEntry
+{
+	uint32_t path;			// Offset into the paths
+	char chip[16];			// e.g. BCM20702A1, NUL terminated, empty if unknown
+	uint16_t lmpSubversion;	// 0 if unknown
+	uint16_t build;			// 0 if unknown
+	uint16_t vendorId;		// 0 unless the file is for one device only
+	uint16_t productId;
+	uint32_t commandCount;
+	uint32_t dataSize;		// Bytes of HCI commands
+	uint64_t fileSize;
+	int64_t modified;		// st_mtime when indexed
+	uint64_t sourceHash;	// hashBytes() of the file as read from disk
+};
+
+struct __attribute__((packed)) FirmwareCatalogSlot
+{
+	uint64_t key;
+	uint32_t entry;			// FIRMWARE_CATALOG_EMPTY if unused
+	uint32_t reserved;
+};
+
+bool isFirmwareCatalog(const char *fileName);
+
+// Key firmware is selected by, either the subversion or the vendor/product id may be 0 for "any"
+uint64_t firmwareKey(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId);
+
+// The one key a firmware file is found under: its device, or else its chip, or else its USB ids
+uint64_t firmwareKey(const FirmwareCatalogEntry &entry);
+
+// Higher build first, then the newer file
+bool betterFirmware(const FirmwareCatalogEntry &a, const FirmwareCatalogEntry &b);
+
+// A file found by scanFirmwareDirectory()
+struct FirmwareFile
+{
+	std::string path;
+	const char *skipped;			// Why the file cannot be used, NULL if it can
+	FirmwareCatalogEntry entry;		// Everything but the path offset
+	FirmwareImage image;			// Only kept when asked for
+};
+
+/*
+ *  Parse every firmware file in a directory
+ *
+ *  Files are parsed in parallel and identified by the LMP subversion and
+ *  build in their names (or the header of precompiled firmware), the chip
+ *  name (BCM20702A1_..., with the subversion taken from the chip table if
+ *  the name carries none) and the USB ids of names like
+ *  BCM20702A1-0a5c-21e8.hcd. Files that cannot be used are reported.
+ *
+ *  directory  - Directory to scan, not recursive
+ *  threads    - Files parsed at the same time
+ *  parseFlags - kParse* flags for Intel HEX firmware
+ *  keepImages - Keep the parsed commands of every usable file
+ *  files      - Receives every file with a firmware extension, sorted by path
+ *
+ *  returns false if the directory cannot be read
+ */
+bool scanFirmwareDirectory(const char *directory, uint32_t threads, uint32_t parseFlags, bool keepImages, std::vector<FirmwareFile> &files);
+
+/*
+ *  Index every firmware file in a directory
+ *
+ *  The files scanFirmwareDirectory() can use are indexed under their key. A
+ *  file for a single device is only found for that device, a file without
+ *  ids for any device with its chip.
+ *
+ *  directory - Directory to scan, not recursive
+ *  indexPath - Catalog to write
+ *  threads   - Files parsed at the same time
+ *
+ *  returns true or false on error
+ */
+bool buildFirmwareCatalog(const char *directory, const char *indexPath, uint32_t threads);
+
+// Mapped catalog
+class FirmwareCatalog
+{
+public:
+	FirmwareCatalog();
+
+	bool open(const char *path);
+
+	/*
+	 *  Best firmware for a controller
+	 *
+	 *  Tries the subversion with the vendor/product id, then the subversion
+	 *  alone, then the vendor/product id of files for which the chip is not
+	 *  known.
+	 *
+	 *  returns the entry, or NULL if no firmware fits
+	 */
+	const FirmwareCatalogEntry *find(uint16_t lmpSubversion, uint16_t vendorId, uint16_t productId) const;
+
+	size_t count() const { return mHeader ? mHeader->entryCount : 0; }
+	const FirmwareCatalogEntry &entry(size_t index) const { return mEntries[index]; }
+	const char *path(const FirmwareCatalogEntry &entry) const { return mPaths + entry.path; }
+
+	// The file is still the one that was indexed (size and modification time)
+	bool current(const FirmwareCatalogEntry &entry) const;
+
+private:
+	FirmwareCatalog(const FirmwareCatalog &);
+	FirmwareCatalog &operator=(const FirmwareCatalog &);
+
+	const FirmwareCatalogEntry *lookup(uint64_t key) const;
+
+	MappedFile mMapping;
+	const FirmwareCatalogHeader *mHeader;
+	const FirmwareCatalogEntry *mEntries;
+	const FirmwareCatalogSlot *mSlots;
+	const char *mPaths;
+};
+
+#endif
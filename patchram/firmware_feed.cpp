@@ -0,0 +1,334 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_feed.h"
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "firmware_loader.h"
+#include "intel_firmware.h"
+
+static double millisecondsSince(FirmwareFeed::Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(FirmwareFeed::Clock::now() - start).count();
+}
+
+FirmwareFeed::FirmwareFeed(FirmwareImage &image) :
+	mImage(image), mFileName(NULL), mVendorId(0), mProductId(0), mParseFlags(kParseDefault), mFile(NULL),
+	mStop(false), mReadWait(0), mReadFailed(false), mTruncated(false), mInflated(0), mCount(0), mLoading(false), mResult(false)
+{
+	memset(&mStats, 0, sizeof(mStats));
+}
+
+FirmwareFeed::~FirmwareFeed()
+{
+	mStop = true;
+
+	if (mReadThread.joinable())
+		mReadThread.join();
+
+	if (mParseThread.joinable())
+		mParseThread.join();
+}
+
+bool FirmwareFeed::start(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags)
+{
+	// Precompiled and .hcd firmware is mapped, there is nothing to overlap
+	if (!isHexFirmware(fileName))
+	{
+		mStarted = Clock::now();
+
+		bool result = loadFirmware(fileName, vendorId, productId, parseFlags, mImage, NULL);
+
+		mStats.commands = mImage.count();
+		mStats.loaded = millisecondsSince(mStarted);
+
+		std::lock_guard<std::mutex> lock(mLock);
+		mCount = mImage.count();
+		mResult = result;
+
+		return result;
+	}
+
+	mFile = fopen(fileName, "rb");
+
+	if (mFile == NULL)
+	{
+		fprintf(stderr, "Error reading file '%s'\n", fileName);
+		return false;
+	}
+
+	mFileName = fileName;
+	mVendorId = vendorId;
+	mProductId = productId;
+	mParseFlags = parseFlags;
+
+	// Clears the image, the version has to be set afterwards
+	mParser.reset(new HexParser(mImage, vendorId, productId, parseFlags));
+
+	FirmwareVersion version;
+
+	if (parseFirmwareVersion(fileName, version))
+		mImage.setVersion(version);
+
+	mRing.reset(new SpscRing<Chunk, FEED_RING_SIZE>());
+	mLoading = true;
+	mStarted = Clock::now();
+	mReadThread = std::thread(&FirmwareFeed::read, this);
+	mParseThread = std::thread(&FirmwareFeed::parse, this);
+
+	return true;
+}
+
+size_t FirmwareFeed::available(size_t index, bool wait, bool *loaded)
+{
+	std::unique_lock<std::mutex> lock(mLock);
+
+	if (wait)
+		mSignal.wait(lock, [this, index] { return mCount > index || !mLoading; });
+
+	*loaded = !mLoading;
+
+	return mCount;
+}
+
+uint16_t FirmwareFeed::copyCommand(size_t index, uint8_t *buffer)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	FirmwareSpan command = mImage.command(index);
+
+	memcpy(buffer, command.data, command.length);
+
+	return (uint16_t)command.length;
+}
+
+bool FirmwareFeed::finish()
+{
+	if (mReadThread.joinable())
+		mReadThread.join();
+
+	if (mParseThread.joinable())
+		mParseThread.join();
+
+	std::lock_guard<std::mutex> lock(mLock);
+
+	return mResult;
+}
+
+FirmwareFeed::Chunk *FirmwareFeed::nextSlot()
+{
+	Chunk *slot = mRing->back();
+
+	if (slot != NULL)
+		return slot;
+
+	Clock::time_point start = Clock::now();
+
+	while ((slot = mRing->back()) == NULL && !mStop)
+	{
+		// Parser is behind
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	mReadWait += millisecondsSince(start);
+
+	return slot;
+}
+
+bool FirmwareFeed::queue(const uint8_t *data, size_t length)
+{
+	Chunk *slot = nextSlot();
+
+	if (slot == NULL)
+		return false;
+
+	memcpy(slot->data, data, length);
+	slot->length = (uint32_t)length;
+	slot->last = false;
+	mRing->push();
+
+	return true;
+}
+
+void FirmwareFeed::read()
+{
+	std::vector<uint8_t> buffer(FIRMWARE_READ_CHUNK_SIZE);
+	DecompressStream decompress;
+	DecompressStream::Sink sink = [this](const uint8_t *data, size_t length) { return queue(data, length); };
+	CompressionFormat format = kCompressionNone;
+	Clock::time_point start = Clock::now();
+	uint64_t fileSize = 0;
+	bool result = true;
+	size_t length;
+
+	static_assert(FIRMWARE_READ_CHUNK_SIZE <= DECOMPRESS_CHUNK_SIZE, "A read has to fit a chunk");
+
+	while (result && !mStop && (length = fread(buffer.data(), 1, buffer.size(), mFile)) > 0)
+	{
+		if (fileSize == 0)
+		{
+			format = detectCompression(buffer.data(), length);
+
+			if (format == kCompressionNone)
+			{
+				// Plain HEX, the file size bounds the image. The parser has not seen any input yet.
+				if (fseek(mFile, 0, SEEK_END) == 0)
+				{
+					std::lock_guard<std::mutex> lock(mLock);
+					mParser->expect((size_t)ftell(mFile));
+				}
+
+				fseek(mFile, (long)length, SEEK_SET);
+			}
+			else
+			{
+				result = decompress.begin(format);
+			}
+		}
+
+		fileSize += length;
+
+		if (!result)
+			break;
+
+		if (format == kCompressionNone)
+			result = queue(buffer.data(), length);
+		else
+			result = decompress.push(buffer.data(), length, sink);
+	}
+
+	if (ferror(mFile))
+	{
+		fprintf(stderr, "Error reading file '%s'\n", mFileName);
+		result = false;
+	}
+
+	fclose(mFile);
+	mFile = NULL;
+
+	mReadFailed = !result;
+	mTruncated = format != kCompressionNone && !decompress.finished();
+	mInflated = decompress.totalIn();
+
+	mStats.format = format;
+	mStats.fileBytes = fileSize;
+	mStats.hexBytes = format == kCompressionNone ? fileSize : decompress.totalOut();
+	mStats.readTime = millisecondsSince(start) - mReadWait;
+
+	// Published with the slot, the parser reads the results above once it gets here
+	Chunk *slot = nextSlot();
+
+	if (slot != NULL)
+	{
+		slot->length = 0;
+		slot->last = true;
+		mRing->push();
+	}
+}
+
+void FirmwareFeed::parse()
+{
+	bool result = true;
+
+	while (true)
+	{
+		Chunk *chunk = mRing->front();
+
+		if (chunk == NULL)
+		{
+			// Only stopped before the reader got to the end when the feed is destroyed
+			if (mStop)
+			{
+				result = false;
+				break;
+			}
+
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		if (chunk->last)
+		{
+			if (mReadFailed)
+			{
+				result = false;
+			}
+			else if (mTruncated && !mParser->done())
+			{
+				fprintf(stderr, "[%04x:%04x]: Firmware '%s' is not valid %s compressed data (%llu of %llu bytes used)\n", mVendorId, mProductId, mFileName, compressionName(mStats.format), (unsigned long long)mInflated, (unsigned long long)mStats.fileBytes);
+				result = false;
+			}
+
+			mRing->pop();
+			break;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		// Hand over what was parsed every FEED_PUBLISH_SIZE characters, not only at the end of a chunk
+		for (uint32_t offset = 0; result && offset < chunk->length && !mParser->done(); offset += FEED_PUBLISH_SIZE)
+		{
+			uint32_t length = std::min<uint32_t>(FEED_PUBLISH_SIZE, chunk->length - offset);
+
+			{
+				std::lock_guard<std::mutex> lock(mLock);
+				result = mParser->push(chunk->data + offset, length);
+
+				// Coalescing may still extend the last command, only the ones before it are final
+				mCount = mImage.count() > 0 ? mImage.count() - 1 : 0;
+			}
+
+			if (mStats.firstCommand == 0 && mCount > 0)
+				mStats.firstCommand = millisecondsSince(mStarted);
+
+			mSignal.notify_all();
+		}
+
+		mStats.parseTime += millisecondsSince(start);
+		mRing->pop();
+
+		// Anything after the End of File record is ignored
+		if (!result || mParser->done())
+			break;
+	}
+
+	// No more input needed, release the reader
+	mStop = true;
+
+	std::unique_lock<std::mutex> lock(mLock);
+
+	if (result)
+		result = mParser->finish();
+
+	mStats.commands = mImage.count();
+	mStats.loaded = millisecondsSince(mStarted);
+
+#ifdef DEBUG
+	if (result)
+		printf("[%04x:%04x]: Parsed %zu commands (%zu bytes) in %.1f ms\n", mVendorId, mProductId, mImage.count(), mImage.size(), mStats.loaded);
+#endif
+
+	mCount = mImage.count();
+	mLoading = false;
+	mResult = result;
+	lock.unlock();
+
+	mSignal.notify_all();
+}
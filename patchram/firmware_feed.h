@@ -0,0 +1,143 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_feed_h
+#define firmware_feed_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "decompress_stream.h"
+#include "firmware_image.h"
+#include "spsc_ring.h"
+
+class HexParser;
+
+// Decompressed chunks the reader can be ahead of the parser
+#define FEED_RING_SIZE 4
+
+// HEX characters parsed between two hand-overs of new commands to the upgrade
+#define FEED_PUBLISH_SIZE (4 * 1024)
+
+struct FeedStats
+{
+	CompressionFormat format;
+	uint64_t fileBytes;
+	uint64_t hexBytes;					// Intel HEX after decompression
+	size_t commands;
+	double readTime;					// Reader thread busy reading and inflating (ms)
+	double parseTime;					// Parser thread busy parsing (ms)
+	double firstCommand;				// First command parsed, since start() (ms)
+	double loaded;						// Whole firmware parsed, since start() (ms)
+};
+
+/*
+ *  Intel HEX firmware loaded while the upgrade is already running
+ *
+ *  Loading is split into three stages that overlap: a reader thread reads
+ *  and decompresses the file, a parser thread turns the Intel HEX into
+ *  commands, and the upgrade sends each command as soon as it is parsed.
+ *  Reader and parser hand over decompressed chunks through a ring of
+ *  FEED_RING_SIZE slots, so neither runs away from the other and memory use
+ *  does not depend on the size of the file. Parsed commands stay in the
+ *  image, a resumed or verified write needs all of them again.
+ *
+ *  The image may reallocate while it grows, so until loading has ended the
+ *  upgrade copies commands out with copyCommand() instead of holding spans.
+ */
+class FirmwareFeed
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit FirmwareFeed(FirmwareImage &image);
+	~FirmwareFeed();
+
+	// Open the file and start loading it into the image, returns false if it cannot be read.
+	// Precompiled and .hcd firmware is loaded right away, see loadFirmware().
+	bool start(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags);
+
+	// Commands parsed so far. With wait, blocks until there are more than index or loading has
+	// ended. loaded receives whether loading has ended, the count is final then.
+	size_t available(size_t index, bool wait, bool *loaded);
+
+	// Copy a parsed command into buffer (HCI_COMMAND_HEADER_SIZE + 255 bytes), returns its length
+	uint16_t copyCommand(size_t index, uint8_t *buffer);
+
+	// Wait for loading to end, returns true if the whole firmware was parsed
+	bool finish();
+
+	// Valid once finish() returned
+	const FeedStats &stats() const { return mStats; }
+	Clock::time_point started() const { return mStarted; }
+
+private:
+	struct Chunk
+	{
+		uint32_t length;
+		bool last;						// End of input, length is 0
+		uint8_t data[DECOMPRESS_CHUNK_SIZE];
+	};
+
+	FirmwareFeed(const FirmwareFeed &);
+	FirmwareFeed &operator=(const FirmwareFeed &);
+
+	void read();
+	void parse();
+
+	// Reader: the next free slot, NULL once loading is stopped
+	Chunk *nextSlot();
+
+	// Reader: copy decompressed data into the next slot
+	bool queue(const uint8_t *data, size_t length);
+
+	FirmwareImage &mImage;
+	const char *mFileName;
+	uint16_t mVendorId;
+	uint16_t mProductId;
+	uint32_t mParseFlags;
+	FILE *mFile;
+	std::unique_ptr<HexParser> mParser;
+	std::unique_ptr<SpscRing<Chunk, FEED_RING_SIZE>> mRing;
+	std::thread mReadThread;
+	std::thread mParseThread;
+	std::atomic<bool> mStop;			// Stop reading, set by the parser once it needs no more input
+	Clock::time_point mStarted;
+	FeedStats mStats;
+	double mReadWait;					// Reader waiting for a free slot (ms)
+
+	// Reader results, published to the parser with the last chunk
+	bool mReadFailed;
+	bool mTruncated;					// Compressed stream ended early
+	uint64_t mInflated;					// Compressed bytes used
+
+	// Guards the image and what the upgrade sees of it
+	std::mutex mLock;
+	std::condition_variable mSignal;
+	size_t mCount;
+	bool mLoading;
+	bool mResult;
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_image.h"
+#include "mapped_file.h"
+
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV1A64_PRIME;
+	}
+
+	return hash;
+}
+
+void FirmwareImage::reserve(size_t dataCapacity, size_t commandCapacity)
+{
+	mData.reserve(dataCapacity);
+	mIndex.reserve(commandCapacity);
+}
+
+void FirmwareImage::clear()
+{
+	mData.clear();
+	mIndex.clear();
+	mMapping.reset();
+	mExternal = NULL;
+	mExternalSize = 0;
+	mVersion = FirmwareVersion();
+}
+
+uint8_t *FirmwareImage::appendCommand(uint16_t opcode, uint32_t paramLength)
+{
+	if (paramLength > HCI_MAX_PARAM_LENGTH)
+		return NULL;
+
+	Entry entry;
+	entry.offset = (uint32_t)mData.size();
+	entry.length = HCI_COMMAND_HEADER_SIZE + paramLength;
+
+	mData.resize(mData.size() + entry.length);
+	mIndex.push_back(entry);
+
+	uint8_t *header = &mData[entry.offset];
+	header[0] = opcode & 0xFF;
+	header[1] = opcode >> 8;
+	header[2] = (uint8_t)paramLength;
+
+	return header + HCI_COMMAND_HEADER_SIZE;
+}
+
+uint8_t *FirmwareImage::extendLastCommand(uint32_t extraLength)
+{
+	Entry &entry = mIndex.back();
+	size_t tail = mData.size();
+
+	if (mData[entry.offset + 2] + extraLength > HCI_MAX_PARAM_LENGTH)
+		return NULL;
+
+	mData.resize(tail + extraLength);
+	mData[entry.offset + 2] += (uint8_t)extraLength;
+	entry.length += extraLength;
+
+	return &mData[tail];
+}
+
+void FirmwareImage::attach(const std::shared_ptr<MappedFile> &mapping, const uint8_t *data, size_t length)
+{
+	clear();
+	mMapping = mapping;
+	mExternal = data;
+	mExternalSize = length;
+}
+
+void FirmwareImage::addCommand(uint32_t offset, uint16_t length)
+{
+	Entry entry;
+	entry.offset = offset;
+	entry.length = length;
+	mIndex.push_back(entry);
+}
+
+FirmwareSpan FirmwareImage::command(size_t index) const
+{
+	FirmwareSpan span;
+	span.data = data() + mIndex[index].offset;
+	span.length = mIndex[index].length;
+	return span;
+}
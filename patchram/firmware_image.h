@@ -0,0 +1,112 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_image_h
+#define firmware_image_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+class MappedFile;
+
+// Opcode (2 bytes) + parameter length (1 byte)
+#define HCI_COMMAND_HEADER_SIZE 3
+#define HCI_MAX_PARAM_LENGTH 0xFF
+
+#define FNV1A64_OFFSET 0xcbf29ce484222325ULL
+#define FNV1A64_PRIME 0x00000100000001b3ULL
+
+// 64-bit FNV-1a hash, pass a previous result as hash to continue it
+uint64_t hashBytes(const void *data, size_t length, uint64_t hash = FNV1A64_OFFSET);
+
+// Read-only view of a single HCI command (opcode, length, parameters)
+struct FirmwareSpan
+{
+	const uint8_t *data;
+	uint32_t length;
+};
+
+// Controller version a firmware produces once it is running, 0 where unknown
+struct FirmwareVersion
+{
+	uint16_t lmpSubversion = 0;			// READ_LOCAL_VERSION, identifies the chip
+	uint16_t build = 0;					// READ_VERBOSE_CONFIG build number after patching
+
+	bool known() const { return build != 0; }
+};
+
+/*
+ *  Firmware image holding every command in one contiguous buffer
+ *
+ *  Commands are appended back-to-back into a single byte buffer and located
+ *  through a compact offset/length index. Call reserve() with an upper bound
+ *  before building so that no further allocation happens per command.
+ *
+ *  Alternatively the commands can live in a memory mapped file, in which case
+ *  the image only holds the index and keeps the mapping alive.
+ */
+class FirmwareImage
+{
+public:
+	void reserve(size_t dataCapacity, size_t commandCapacity);
+	void clear();
+
+	// Append a command header and return a pointer to its parameter bytes, NULL if
+	// paramLength does not fit the length byte (HCI_MAX_PARAM_LENGTH)
+	uint8_t *appendCommand(uint16_t opcode, uint32_t paramLength);
+
+	// Grow the last command by extraLength parameter bytes and return a pointer to them,
+	// NULL if its parameters would no longer fit the length byte
+	uint8_t *extendLastCommand(uint32_t extraLength);
+
+	// Use commands stored in a mapping instead of the internal buffer
+	void attach(const std::shared_ptr<MappedFile> &mapping, const uint8_t *data, size_t length);
+
+	// Index a command already present in the attached data
+	void addCommand(uint32_t offset, uint16_t length);
+
+	size_t count() const { return mIndex.size(); }
+	size_t size() const { return mMapping ? mExternalSize : mData.size(); }
+	bool empty() const { return mIndex.empty(); }
+	const uint8_t *data() const { return mMapping ? mExternal : mData.data(); }
+
+	FirmwareSpan command(size_t index) const;
+
+	// Version metadata taken from the firmware file, see parseFirmwareVersion()
+	const FirmwareVersion &version() const { return mVersion; }
+	void setVersion(const FirmwareVersion &version) { mVersion = version; }
+
+private:
+	struct Entry
+	{
+		uint32_t offset;
+		uint16_t length;
+	};
+
+	std::vector<uint8_t> mData;
+	std::vector<Entry> mIndex;
+	std::shared_ptr<MappedFile> mMapping;
+	const uint8_t *mExternal = NULL;
+	size_t mExternalSize = 0;
+	FirmwareVersion mVersion;
+};
+
+#endif
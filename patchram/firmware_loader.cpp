@@ -0,0 +1,216 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_loader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "decompress_stream.h"
+#include "intel_firmware.h"
+#include "firmware_binary.h"
+#include "hcd_firmware.h"
+
+// Read an Intel HEX file, compressed or not, a chunk at a time and parse it as it is decompressed
+static bool streamFirmware(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags, FirmwareImage &image, uint64_t *sourceHash)
+{
+	FILE *file = fopen(fileName, "rb");
+	
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error reading file '%s'\n", fileName);
+		return false;
+	}
+	
+	std::vector<uint8_t> buffer(FIRMWARE_READ_CHUNK_SIZE);
+	HexParser parser(image, vendorId, productId, parseFlags);
+	DecompressStream decompress;
+	DecompressStream::Sink sink = [&parser](const uint8_t *data, size_t length) { return parser.push(data, length); };
+	CompressionFormat format = kCompressionNone;
+	uint64_t hash = FNV1A64_OFFSET;
+	uint64_t fileSize = 0;
+	bool result = true;
+	size_t length;
+	
+	while (result && (length = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+	{
+		if (fileSize == 0)
+		{
+			format = detectCompression(buffer.data(), length);
+			
+			if (format == kCompressionNone)
+			{
+				// Plain HEX, the file size bounds the image
+				if (fseek(file, 0, SEEK_END) == 0)
+					parser.expect((size_t)ftell(file));
+				
+				fseek(file, (long)length, SEEK_SET);
+			}
+			else
+			{
+				result = decompress.begin(format);
+			}
+		}
+		
+		hash = hashBytes(buffer.data(), length, hash);
+		fileSize += length;
+		
+		if (!result)
+			break;
+		
+		if (format == kCompressionNone)
+			result = parser.push(buffer.data(), length);
+		else
+			result = decompress.push(buffer.data(), length, sink);
+	}
+	
+	if (ferror(file))
+	{
+		fprintf(stderr, "Error reading file '%s'\n", fileName);
+		result = false;
+	}
+	
+	fclose(file);
+	
+	if (result && format != kCompressionNone && !decompress.finished() && !parser.done())
+	{
+		fprintf(stderr, "[%04x:%04x]: Firmware '%s' is not valid %s compressed data (%llu of %llu bytes used)\n", vendorId, productId, fileName, compressionName(format), (unsigned long long)decompress.totalIn(), (unsigned long long)fileSize);
+		result = false;
+	}
+	
+	if (result)
+		result = parser.finish();
+	
+#ifdef DEBUG
+	if (result && format != kCompressionNone)
+		printf("[%04x:%04x]: Inflated %llu bytes of %s into %llu\n", vendorId, productId, (unsigned long long)decompress.totalIn(), compressionName(format), (unsigned long long)decompress.totalOut());
+#endif
+	
+	if (sourceHash)
+		*sourceHash = hash;
+	
+	return result;
+}
+
+bool isHexFirmware(const char *fileName)
+{
+	const char *ext = strrchr(fileName, '.');
+	
+	return ext == NULL || (strcmp(ext, FIRMWARE_BINARY_EXTENSION) != 0 && strcmp(ext, HCD_EXTENSION) != 0);
+}
+
+bool loadFirmware(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags, FirmwareImage &image, uint64_t *sourceHash)
+{
+	const char *ext = strrchr(fileName, '.');
+	
+	if (ext != NULL && strcmp(ext, FIRMWARE_BINARY_EXTENSION) == 0)
+	{
+		FirmwareBinaryHeader header;
+		
+		if (!loadFirmwareBinary(fileName, image, &header))
+			return false;
+		
+		if (header.vendorId != vendorId || header.productId != productId)
+		{
+			fprintf(stderr, "[%04x:%04x]: Firmware '%s' was compiled for [%04x:%04x]\n", vendorId, productId, fileName, header.vendorId, header.productId);
+			image.clear();
+			return false;
+		}
+		
+		if (sourceHash)
+			*sourceHash = header.sourceHash;
+		
+		// Recorded at compile time from the source file name
+		FirmwareVersion version;
+		version.lmpSubversion = header.lmpSubversion;
+		version.build = header.build;
+		
+		if (version.known() || parseFirmwareVersion(fileName, version))
+			image.setVersion(version);
+		
+		return true;
+	}
+	
+	if (ext != NULL && strcmp(ext, HCD_EXTENSION) == 0)
+	{
+		if (!loadHcdFirmware(fileName, image))
+			return false;
+		
+		// The image references the whole mapped file
+		if (sourceHash)
+			*sourceHash = hashBytes(image.data(), image.size());
+		
+		FirmwareVersion version;
+		
+		if (parseFirmwareVersion(fileName, version))
+			image.setVersion(version);
+		
+		return true;
+	}
+	
+	bool result = streamFirmware(fileName, vendorId, productId, parseFlags, image, sourceHash);
+	
+	FirmwareVersion version;
+	
+	if (result && parseFirmwareVersion(fileName, version))
+		image.setVersion(version);
+	
+#ifdef DEBUG
+	if (result)
+		printf("[%04x:%04x]: Parsed %zu commands (%zu bytes)\n", vendorId, productId, image.count(), image.size());
+#endif
+	
+	return result;
+}
+
+bool parseFirmwareVersion(const char *fileName, FirmwareVersion &version)
+{
+	const char *name = strrchr(fileName, '/');
+	name = name ? name + 1 : fileName;
+	
+	FirmwareVersion parsed;
+	const char *field = strchr(name, '_');
+	
+	while (field != NULL)
+	{
+		field++;
+		
+		unsigned int major, minor, subminor, revision, build, firmwareVersion;
+		int length = 0;
+		
+		if (sscanf(field, "%3u.%3u.%3u.%4u.%4u%n", &major, &minor, &subminor, &revision, &build, &length) == 5 && length > 0)
+		{
+			// Inverse of the "Local Version" decoding in completeLocalVersion() (hci.cpp)
+			parsed.lmpSubversion = (uint16_t)((major & 0x7) << 13 | (minor & 0x1f) << 8 | (subminor & 0xff));
+			parsed.build = (uint16_t)build;
+		}
+		else if (sscanf(field, "v%u%n", &firmwareVersion, &length) == 1 && length > 0 && firmwareVersion > 0x1000 && !parsed.known())
+		{
+			parsed.build = (uint16_t)(firmwareVersion - 0x1000);
+		}
+		
+		field = strchr(field, '_');
+	}
+	
+	if (!parsed.known())
+		return false;
+	
+	version = parsed;
+	return true;
+}
@@ -0,0 +1,66 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_loader_h
+#define firmware_loader_h
+
+#include <stdint.h>
+#include "firmware_image.h"
+
+// Compressed or plain HEX input read from the file at a time
+#define FIRMWARE_READ_CHUNK_SIZE (64 * 1024)
+
+/*
+ *  Load a firmware file into an image
+ *
+ *  Precompiled and .hcd firmware are mapped and used as-is. Anything else is
+ *  Intel HEX, either plain or zlib, gzip or raw deflate compressed as told by
+ *  its first bytes. It is read FIRMWARE_READ_CHUNK_SIZE bytes at a time and
+ *  each decompressed chunk is parsed before the next one is inflated, so only
+ *  the image grows with the size of the firmware.
+ *
+ *  fileName   - Firmware file
+ *  vendorId   - USB device vendor the firmware is loaded for
+ *  productId  - USB device product the firmware is loaded for
+ *  parseFlags - kParse* flags for Intel HEX firmware
+ *  image      - Receives the firmware commands
+ *  sourceHash - Optional, receives the hash of the file as read from disk
+ *
+ *  returns true or false on error
+ */
+bool loadFirmware(const char *fileName, uint16_t vendorId, uint16_t productId, uint32_t parseFlags, FirmwareImage &image, uint64_t *sourceHash);
+
+// Intel HEX firmware, plain or compressed, as opposed to precompiled and .hcd firmware that is mapped
+bool isHexFirmware(const char *fileName);
+
+/*
+ *  Take the firmware version from a file name
+ *
+ *  Broadcom names firmware <chip>_<subver>.<hci rev>.<build>_v<version>, e.g.
+ *  BCM20702A1_001.002.014.1443.1572_v5668.zhx, where the three subversion
+ *  fields encode the LMP subversion and v<version> is the build plus 4096.
+ *
+ *  fileName - Firmware file, the directory is ignored
+ *  version  - Receives the LMP subversion and build
+ *
+ *  returns false if the name carries no build number
+ */
+bool parseFirmwareVersion(const char *fileName, FirmwareVersion &version);
+
+#endif
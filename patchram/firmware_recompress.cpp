@@ -0,0 +1,216 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "firmware_recompress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "firmware_image.h"
+#include "intel_firmware.h"
+#include "mapped_file.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedSince(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Decompress a whole buffer, or copy it if it is not compressed
+static bool decompressBuffer(CompressionFormat format, const uint8_t *data, size_t length, std::vector<uint8_t> &output)
+{
+	output.clear();
+
+	if (format == kCompressionNone)
+	{
+		output.assign(data, data + length);
+		return true;
+	}
+
+	DecompressStream stream;
+	DecompressStream::Sink sink = [&output](const uint8_t *chunk, size_t size)
+	{
+		output.insert(output.end(), chunk, chunk + size);
+		return true;
+	};
+
+	if (!stream.begin(format) || !stream.push(data, length, sink))
+		return false;
+
+	if (!stream.finished())
+	{
+		fprintf(stderr, "Decompress: truncated %s data (%zu bytes)\n", compressionName(format), length);
+		return false;
+	}
+
+	return true;
+}
+
+// Decompress and parse, as loading the firmware does
+static bool decodeFirmware(CompressionFormat format, const uint8_t *data, size_t length, FirmwareImage &image)
+{
+	HexParser parser(image, 0, 0);
+
+	if (format == kCompressionNone)
+		return parser.push(data, length) && parser.finish();
+
+	DecompressStream stream;
+	DecompressStream::Sink sink = [&parser](const uint8_t *chunk, size_t size) { return parser.push(chunk, size); };
+
+	return stream.begin(format) && stream.push(data, length, sink) && parser.finish();
+}
+
+bool readFirmwareHex(const char *fileName, CompressionFormat &format, size_t &fileSize, std::vector<uint8_t> &hex)
+{
+	MappedFile file;
+
+	if (!file.open(fileName))
+		return false;
+
+	format = detectCompression(file.data(), file.size());
+	fileSize = file.size();
+
+	if (!decompressBuffer(format, file.data(), file.size(), hex))
+	{
+		fprintf(stderr, "Firmware '%s' is not valid %s compressed data\n", fileName, compressionName(format));
+		return false;
+	}
+
+	FirmwareImage image;
+	HexParser parser(image, 0, 0);
+
+	if (!parser.push(hex.data(), hex.size()) || !parser.finish())
+	{
+		fprintf(stderr, "Firmware '%s' is not valid Intel HEX\n", fileName);
+		return false;
+	}
+
+	return true;
+}
+
+bool recompressFirmware(const char *fileName, const char *outputPath, CompressionFormat format)
+{
+	CompressionFormat sourceFormat;
+	size_t sourceSize;
+	std::vector<uint8_t> hex;
+
+	if (!readFirmwareHex(fileName, sourceFormat, sourceSize, hex))
+		return false;
+
+	std::vector<uint8_t> compressed;
+	std::vector<uint8_t> check;
+
+	if (!compressBuffer(format, hex.data(), hex.size(), compressed))
+		return false;
+
+	if (!decompressBuffer(format, compressed.data(), compressed.size(), check) || check != hex)
+	{
+		fprintf(stderr, "Compress: %s output of '%s' does not decompress to the same firmware\n", compressionName(format), fileName);
+		return false;
+	}
+
+	FILE *file = fopen(outputPath, "wb");
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", outputPath);
+		return false;
+	}
+
+	bool result = fwrite(compressed.data(), 1, compressed.size(), file) == compressed.size();
+
+	if (fclose(file) != 0)
+		result = false;
+
+	if (!result)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", outputPath);
+		remove(outputPath);
+		return false;
+	}
+
+	printf("Recompressed '%s' (%s, %zu bytes) to '%s' (%s, %zu bytes) from %zu bytes of HEX\n", fileName, compressionName(sourceFormat), sourceSize, outputPath, compressionName(format), compressed.size(), hex.size());
+
+	return true;
+}
+
+bool benchmarkCompression(const std::vector<uint8_t> &hex)
+{
+	static const CompressionFormat formats[] = { kCompressionZlib, kCompressionZstd, kCompressionLz4 };
+
+	printf("Compression: fastest of %d rounds\n\n", BENCHMARK_ROUNDS);
+	printf("  %-6s %10s  %7s  %11s  %11s %12s  %11s\n", "format", "bytes", "ratio", "compress", "decode", "", "with parse");
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		CompressionFormat format = formats[i];
+
+		if (!compressionAvailable(format))
+		{
+			printf("  %-6s  not built in\n", compressionName(format));
+			continue;
+		}
+
+		std::vector<uint8_t> compressed;
+		std::vector<uint8_t> output;
+		Clock::time_point start = Clock::now();
+
+		if (!compressBuffer(format, hex.data(), hex.size(), compressed))
+			return false;
+
+		double compressTime = elapsedSince(start);
+		double decodeTime = 0;
+		double loadTime = 0;
+
+		for (int round = 0; round < BENCHMARK_ROUNDS; round++)
+		{
+			FirmwareImage image;
+
+			start = Clock::now();
+
+			bool decoded = decompressBuffer(format, compressed.data(), compressed.size(), output);
+			double decode = elapsedSince(start);
+
+			if (!decoded || output != hex)
+			{
+				fprintf(stderr, "Compress: %s output does not decompress to the same firmware\n", compressionName(format));
+				return false;
+			}
+
+			start = Clock::now();
+
+			if (!decodeFirmware(format, compressed.data(), compressed.size(), image))
+				return false;
+
+			double load = elapsedSince(start);
+
+			if (round == 0 || decode < decodeTime)
+				decodeTime = decode;
+
+			if (round == 0 || load < loadTime)
+				loadTime = load;
+		}
+
+		printf("  %-6s %10zu  %5.1f %%  %8.1f ms  %8.2f ms %7.0f MB/s  %8.2f ms\n", compressionName(format), compressed.size(), 100.0 * compressed.size() / hex.size(), compressTime, decodeTime, hex.size() / decodeTime / 1000, loadTime);
+	}
+
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef firmware_recompress_h
+#define firmware_recompress_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "decompress_stream.h"
+
+// Decodes of each format timed by benchmarkCompression, the fastest counts
+#define BENCHMARK_ROUNDS 10
+
+/*
+ *  Read a firmware file and decompress its Intel HEX
+ *
+ *  format and fileSize receive the compression and size of the file. The
+ *  HEX is checked to parse before it is returned.
+ *
+ *  returns true or false on error
+ */
+bool readFirmwareHex(const char *fileName, CompressionFormat &format, size_t &fileSize, std::vector<uint8_t> &hex);
+
+/*
+ *  Convert an Intel HEX firmware file to another compression
+ *
+ *  The file is decompressed as told by its first bytes, checked to parse as
+ *  Intel HEX, compressed as format and decompressed again to make sure the
+ *  result round trips before it is written.
+ *
+ *  fileName   - Firmware file, plain or compressed Intel HEX (.hex, .zhx, ...)
+ *  outputPath - File to write
+ *  format     - kCompressionZlib, kCompressionZstd or kCompressionLz4
+ *
+ *  returns true or false on error
+ */
+bool recompressFirmware(const char *fileName, const char *outputPath, CompressionFormat format);
+
+/*
+ *  Compare the formats this build supports on a firmware
+ *
+ *  The Intel HEX is compressed with each format and the size, compression
+ *  time, and the fastest of BENCHMARK_ROUNDS decompressions with and without
+ *  parsing the HEX are printed.
+ *
+ *  returns true or false on error
+ */
+bool benchmarkCompression(const std::vector<uint8_t> &hex);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "fleet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "firmware_bundle.h"
+#include "firmware_cache.h"
+#include "upgrade_engine.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct FleetDevice
+{
+	const FleetJob *job;
+	std::shared_ptr<const FirmwareImage> image;
+	std::shared_ptr<const FirmwareBundle> bundle;	// Fills in image once the controller is known
+	std::shared_ptr<FirmwareImage> selected;		// The device's own image when bundled
+	std::unique_ptr<HciTransport> transport;
+	uint32_t location;
+	bool result;
+	bool current;						// Already ran the firmware, nothing was written
+	double elapsed;
+};
+
+bool readManifest(const char *path, std::vector<FleetJob> &jobs)
+{
+	std::ifstream manifest(path);
+
+	if (!manifest)
+	{
+		fprintf(stderr, "Error reading manifest '%s'\n", path);
+		return false;
+	}
+
+	std::string directory(path);
+	size_t slash = directory.rfind('/');
+	directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+
+	std::string line;
+	int lineNumber = 0;
+
+	while (std::getline(manifest, line))
+	{
+		lineNumber++;
+
+		size_t comment = line.find('#');
+
+		if (comment != std::string::npos)
+			line.erase(comment);
+
+		std::istringstream fields(line);
+		std::string vendorId, productId, fileName;
+
+		if (!(fields >> vendorId))
+			continue;
+
+		if (!(fields >> productId >> fileName))
+		{
+			fprintf(stderr, "%s:%d: expected <vendorId hex> <productId hex> <firmware>\n", path, lineNumber);
+			return false;
+		}
+
+		FleetJob job;
+		job.vendorId = (uint16_t)strtoul(vendorId.c_str(), NULL, 16);
+		job.productId = (uint16_t)strtoul(productId.c_str(), NULL, 16);
+		job.fileName = fileName[0] == '/' ? fileName : directory + fileName;
+		jobs.push_back(job);
+	}
+
+	if (jobs.empty())
+	{
+		fprintf(stderr, "Manifest '%s' has no jobs\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// Fleet options with the handshake and delay quirks of the job's device
+static UpgradeOptions deviceOptions(const FleetDevice &device, const FleetOptions &options)
+{
+	const FleetJob &job = *device.job;
+	UpgradeOptions upgradeOptions = options.upgrade;
+	upgradeOptions.useHandshake = supportsHandshake(job.vendorId, job.productId);
+	upgradeOptions.fixedDelays = upgradeOptions.fixedDelays || needsFixedDelays(job.vendorId, job.productId);
+
+	if (device.bundle)
+	{
+		const FirmwareBundle *bundle = device.bundle.get();
+		FirmwareImage *image = device.selected.get();
+		uint16_t vendorId = job.vendorId;
+		uint16_t productId = job.productId;
+
+		upgradeOptions.selectFirmware = [bundle, image, vendorId, productId](const FirmwareVersion &version)
+		{
+			return bundle->select(version, vendorId, productId, *image) != NULL;
+		};
+	}
+
+	return upgradeOptions;
+}
+
+static void flashDevice(FleetDevice &device, const FleetOptions &options)
+{
+	UpgradeSession session(*device.transport, *device.image, deviceOptions(device, options));
+
+	device.result = session.run();
+	device.current = session.state() == kUpdateNotNeeded;
+	device.elapsed = session.stats().elapsed;
+
+	// The device re-enumerates with the new firmware, let it go right away
+	device.transport.reset();
+}
+
+static void flashOnWorkers(std::vector<FleetDevice> &devices, const FleetOptions &options)
+{
+	uint32_t workerCount = options.workers < devices.size() ? options.workers : (uint32_t)devices.size();
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next(0);
+
+	printf("Flashing %zu devices on %u workers\n", devices.size(), workerCount);
+
+	for (uint32_t i = 0; i < workerCount; i++)
+	{
+		workers.push_back(std::thread([&devices, &next, &options]
+		{
+			size_t index;
+
+			while ((index = next++) < devices.size())
+				flashDevice(devices[index], options);
+		}));
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+static void flashOnEventLoop(std::vector<FleetDevice> &devices, const FleetOptions &options)
+{
+	UpgradeEngine engine;
+
+	printf("Flashing %zu devices on one event loop\n", devices.size());
+
+	for (size_t i = 0; i < devices.size(); i++)
+		engine.add(*devices[i].transport, *devices[i].image, deviceOptions(devices[i], options));
+
+	engine.run();
+
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		devices[i].result = engine.result(i);
+		devices[i].current = engine.state(i) == kUpdateNotNeeded;
+		devices[i].elapsed = engine.stats(i).elapsed;
+	}
+}
+
+bool runFleet(const std::vector<FleetJob> &jobs, const FleetOptions &options)
+{
+	Clock::time_point start = Clock::now();
+	std::unique_ptr<SimulatorScheduler> scheduler(options.simulator && options.eventLoop ? new SimulatorScheduler() : NULL);
+	std::vector<FleetDevice> devices;
+	bool result = true;
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		const FleetJob &job = jobs[i];
+		std::vector<std::unique_ptr<HciTransport>> transports;
+
+		std::shared_ptr<const FirmwareImage> image;
+		std::shared_ptr<const FirmwareBundle> bundle;
+
+		// Each device gets the bundled firmware for its chip, the bundle is only opened here
+		if (isFirmwareBundle(job.fileName.c_str()))
+			bundle = FirmwareCache::shared().acquireBundle(job.fileName.c_str());
+		else
+			image = FirmwareCache::shared().acquire(job.fileName.c_str(), job.vendorId, job.productId, options.parseFlags);
+
+		if (!image && !bundle)
+		{
+			result = false;
+			continue;
+		}
+
+		if (options.simulator)
+		{
+			for (uint32_t n = 0; n < options.simulator->devices; n++)
+			{
+				SimulatorConfig config = *options.simulator;
+				config.vendorId = job.vendorId;
+				config.productId = job.productId;
+				config.handshake = supportsHandshake(job.vendorId, job.productId);
+				config.seed += n;
+				transports.push_back(std::unique_ptr<HciTransport>(new SimulatedTransport(config, scheduler.get())));
+			}
+		}
+		else
+		{
+			openUsbTransports(job.vendorId, job.productId, transports);
+		}
+
+		if (transports.empty())
+		{
+			fprintf(stderr, "[%04x:%04x]: No matching devices\n", job.vendorId, job.productId);
+			result = false;
+			continue;
+		}
+
+		for (size_t n = 0; n < transports.size(); n++)
+		{
+			FleetDevice device;
+			device.job = &job;
+			device.image = image;
+			device.bundle = bundle;
+
+			if (bundle)
+			{
+				device.selected = std::make_shared<FirmwareImage>();
+				device.image = device.selected;
+			}
+
+			device.location = options.simulator ? (uint32_t)n + 1 : transports[n]->location();
+			device.transport = std::move(transports[n]);
+			device.result = false;
+			device.current = false;
+			device.elapsed = 0;
+			devices.push_back(std::move(device));
+		}
+	}
+
+	if (devices.empty())
+		return false;
+
+	double setup = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	if (options.eventLoop)
+		flashOnEventLoop(devices, options);
+	else
+		flashOnWorkers(devices, options);
+
+	double elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	double serial = 0;
+	size_t succeeded = 0;
+
+	printf("\n");
+
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		const FleetDevice &device = devices[i];
+
+		const char *status = !device.result ? "FAILED" : device.current ? "current" : "ok";
+
+		printf("[%04x:%04x] 0x%08x  %-7s %8.1f ms  %s\n", device.job->vendorId, device.job->productId, device.location, status, device.elapsed, device.job->fileName.c_str());
+
+		serial += device.elapsed;
+
+		if (device.result)
+			succeeded++;
+		else
+			result = false;
+	}
+
+	printf("\n%zu/%zu devices upgraded in %.1f ms (%.1f ms loading and enumerating, %.1f ms if run serially)\n", succeeded, devices.size(), elapsed, setup, serial);
+
+	return result;
+}
@@ -0,0 +1,72 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef fleet_h
+#define fleet_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hci.h"
+#include "transport_sim.h"
+
+#define FLEET_DEFAULT_WORKERS 8
+
+// One manifest line: flash every device with this vendor/product id
+struct FleetJob
+{
+	uint16_t vendorId;
+	uint16_t productId;
+	std::string fileName;
+};
+
+struct FleetOptions
+{
+	uint32_t parseFlags;
+	UpgradeOptions upgrade;				// Handshake and fixed delays are set per device
+	uint32_t workers;
+	bool eventLoop;						// Run every upgrade on one UpgradeEngine instead of workers
+
+	// Flash simulated controllers instead of USB devices when set
+	const SimulatorConfig *simulator;
+};
+
+/*
+ *  Read a fleet manifest
+ *
+ *  One job per line: <vendorId hex> <productId hex> <firmware file>. Blank
+ *  lines and text after '#' are ignored, relative firmware paths are taken
+ *  from the directory of the manifest.
+ *
+ *  returns true or false on error
+ */
+bool readManifest(const char *path, std::vector<FleetJob> &jobs);
+
+/*
+ *  Flash every device matching the jobs in parallel
+ *
+ *  Firmware is loaded once per job, then all matching devices are opened
+ *  and their upgrades run on a pool of options.workers threads, or all on
+ *  the calling thread with options.eventLoop.
+ *
+ *  returns true if every job found devices and every upgrade succeeded
+ */
+bool runFleet(const std::vector<FleetJob> &jobs, const FleetOptions &options);
+
+#endif
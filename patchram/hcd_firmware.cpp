@@ -0,0 +1,166 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "hcd_firmware.h"
+#include "mapped_file.h"
+#include <stdio.h>
+
+// Vendor Specific: Launch RAM / End of Record / Download mini driver
+#define HCD_OPCODE_LAUNCH_RAM 0xfc4c
+#define HCD_OPCODE_END_OF_RECORD 0xfc4e
+#define HCD_OPCODE_DOWNLOAD_MINIDRIVER 0xfc2e
+
+struct HcdCommandName
+{
+	uint16_t opcode;
+	const char *name;
+};
+
+// Other vendor commands found in .hcd files, named when one is refused
+static const HcdCommandName hcdCommandNames[] =
+{
+	{ 0xfc01, "WRITE_BD_ADDR" },
+	{ 0xfc18, "UPDATE_UART_BAUD_RATE" },
+	{ 0xfc27, "WRITE_SLEEP_MODE" },
+	{ 0xfc45, "WRITE_UART_CLOCK_SETTING" },
+	{ 0xfc6d, "WRITE_I2SPCM_INTERFACE_PARAM" },
+	{ HCD_OPCODE_DOWNLOAD_MINIDRIVER, "DOWNLOAD_MINIDRIVER" },
+	{ 0, NULL }
+};
+
+static const char *hcdCommandName(uint16_t opcode)
+{
+	for (int i = 0; hcdCommandNames[i].name; i++)
+	{
+		if (hcdCommandNames[i].opcode == opcode)
+			return hcdCommandNames[i].name;
+	}
+
+	return "unknown command";
+}
+
+// End of record as Broadcom's tools write it, launching from address 0xffffffff
+static const uint8_t endOfRecord[] = { HCD_OPCODE_END_OF_RECORD & 0xff, HCD_OPCODE_END_OF_RECORD >> 8, 0x04, 0xff, 0xff, 0xff, 0xff };
+
+bool loadHcdFirmware(const char *path, FirmwareImage &image)
+{
+	std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+
+	if (!mapping->open(path))
+		return false;
+
+	const uint8_t *data = mapping->data();
+	size_t size = mapping->size();
+	size_t offset = 0;
+
+	image.attach(mapping, data, size);
+
+	// Smallest LAUNCH_RAM command is the header plus a 4 byte address
+	image.reserve(0, size / (HCI_COMMAND_HEADER_SIZE + 4) + 1);
+
+	while (offset < size)
+	{
+		if (size - offset < HCI_COMMAND_HEADER_SIZE)
+		{
+			fprintf(stderr, "loadHcdFirmware: Invalid firmware, truncated command header at offset %zu.\n", offset);
+			break;
+		}
+
+		uint16_t opcode = data[offset] | data[offset + 1] << 8;
+		uint16_t length = HCI_COMMAND_HEADER_SIZE + data[offset + 2];
+
+		if (size - offset < length)
+		{
+			fprintf(stderr, "loadHcdFirmware: Invalid firmware, truncated command at offset %zu.\n", offset);
+			break;
+		}
+
+		switch (opcode)
+		{
+			case HCD_OPCODE_LAUNCH_RAM:
+				if (length < HCI_COMMAND_HEADER_SIZE + 4)
+				{
+					fprintf(stderr, "loadHcdFirmware: Invalid firmware, LAUNCH_RAM without an address at offset %zu.\n", offset);
+					image.clear();
+					return false;
+				}
+
+				image.addCommand((uint32_t)offset, length);
+				break;
+			case HCD_OPCODE_END_OF_RECORD:
+				if (image.empty())
+				{
+					fprintf(stderr, "loadHcdFirmware: Invalid firmware, no LAUNCH_RAM commands.\n");
+					image.clear();
+					return false;
+				}
+				return true;
+			case HCD_OPCODE_DOWNLOAD_MINIDRIVER:
+				// The upgrade downloads the mini-driver itself before the firmware
+				if (image.empty())
+					break;
+
+				// fall through
+			default:
+				fprintf(stderr, "loadHcdFirmware: Unsupported firmware, %s (0x%04x) at offset %zu, only LAUNCH_RAM commands can be sent.\n", hcdCommandName(opcode), opcode, offset);
+				image.clear();
+				return false;
+		}
+
+		offset += length;
+	}
+
+	if (offset == size)
+		fprintf(stderr, "loadHcdFirmware: Invalid firmware, missing end of record.\n");
+
+	image.clear();
+	return false;
+}
+
+bool writeHcdFirmware(const char *path, const FirmwareImage &image)
+{
+	FILE *file = fopen(path, "wb");
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", path);
+		return false;
+	}
+
+	bool result = true;
+
+	for (size_t i = 0; i < image.count() && result; i++)
+	{
+		FirmwareSpan span = image.command(i);
+		result = fwrite(span.data, 1, span.length, file) == span.length;
+	}
+
+	result = result && fwrite(endOfRecord, 1, sizeof(endOfRecord), file) == sizeof(endOfRecord);
+
+	if (fclose(file) != 0)
+		result = false;
+
+	if (!result)
+	{
+		fprintf(stderr, "Error writing file '%s'\n", path);
+		remove(path);
+	}
+
+	return result;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef hcd_firmware_h
+#define hcd_firmware_h
+
+#include "firmware_image.h"
+
+#define HCD_EXTENSION ".hcd"
+
+/*
+ *  Load a Broadcom .hcd firmware file
+ *
+ *  .hcd files are a raw concatenation of HCI commands (opcode, length,
+ *  parameters). The file is mapped and its framing validated in a single
+ *  pass; the image then indexes the LAUNCH_RAM commands in place. The
+ *  trailing launch (0xfc4e) and a leading DOWNLOAD_MINIDRIVER (0xfc2e) are
+ *  dropped as UpgradeSession issues its own. Any other command, such as a
+ *  baud rate or BD_ADDR write, is refused by name: the upgrade only sends
+ *  LAUNCH_RAM commands on the bulk endpoint.
+ *
+ *  returns true or false on error
+ */
+bool loadHcdFirmware(const char *path, FirmwareImage &image);
+
+// Write the commands of an image as a .hcd file, followed by the launch
+bool writeHcdFirmware(const char *path, const FirmwareImage &image);
+
+#endif
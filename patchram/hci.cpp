@@ -17,38 +17,25 @@
  *
  */
 
-#include <mach/mach.h>
-#include <IOKit/usb/IOUSBLib.h>
-#include <IOKit/IOCFPlugIn.h>
+#include <math.h>
 #include <stdio.h>
-extern "C"
-{
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <chrono>
 #include "hci.h"
-}
+#include "firmware_feed.h"
+#include "readiness.h"
 
-#define FORCE_UPDATE	1
-#define BUFFER_SIZE		0x200
+typedef std::chrono::steady_clock Clock;
 
-static int hci_timeout = 5000;  // 5 seconds - default
-
-const char *usb_dir[] =
-{
-	"out",
-	"in",
-	"none",
-	"any"
-};
+// Longer deadlines a command gets before its timeout is final, unless the firmware write can resume cheaply
+static const uint32_t kTimeoutBackoffs = 3;
 
-const char *usb_ctrl[] =
-{
-	"control",
-	"isoc",
-	"bulk",
-	"interrupt",
-	"any"
-};
+// Pipelined LAUNCH_RAM commands sent before the ones in flight have to complete, see mAcked
+static const uint32_t kCheckpointInterval = 128;
 
-static DeviceHskSupport hskSupport[] =
+static const DeviceHskSupport hskSupport[] =
 {
 	{ 0x0a5c, 0x216f },
 	{ 0x0a5c, 0x21ec },
@@ -58,6 +45,12 @@ static DeviceHskSupport hskSupport[] =
 	{ 0x0,    0x0    }
 };
 
+// Devices that need the fixed delays instead of readiness probes
+static const DeviceQuirk fixedDelayQuirks[] =
+{
+	{ 0x0,    0x0    }
+};
+
 struct bcm_subver_table
 {
 	uint16_t subver;
@@ -81,38 +74,14 @@ static const struct bcm_subver_table bcm_usb_subver_table[] =
 	{ }
 };
 
-// Standard HCI commands
-uint8_t HCI_READ_LOCAL_VERSION[] = { 0x01, 0x10, 0x00 };
-uint8_t HCI_READ_LOCAL_COMMANDS[] = { 0x02, 0x10, 0x00 };
-uint8_t HCI_READ_FEATURES[] = { 0x03, 0x10, 0x00 };
-uint8_t HCI_READ_LOCAL_FEATURES[] = { 0x04, 0x10, 0x00 };
-uint8_t HCI_READ_LOCAL_NAME[] = { 0x14, 0x0c, 0x00 };
-uint8_t HCI_RESET[] = { 0x03, 0x0c, 0x00 };
-
-// Broadcom vendor specific commands
-
-// Vendor Specific: Read chip-id and other Broadcom specific configuration variables
-uint8_t HCI_VSC_READ_VERBOSE_CONFIG[] = { 0x79, 0xfc, 0x00 };
-
-// Vendor Specific: Read controller features
-uint8_t HCI_VSC_READ_CONTROLLER_FEATURES[] = { 0x6e, 0xfc, 0x00 };
-
-// Vendor Specific: Read USB product
-uint8_t HCI_VSC_READ_USB_PRODUCT[] = { 0x5a, 0xfc, 0x00 };
-
-// Vendor Specific: Download mini driver
-uint8_t HCI_VSC_DOWNLOAD_MINIDRIVER[] = { 0x2e, 0xfc, 0x00 };
-
-// Vendor Specific: End of Record
-uint8_t HCI_VSC_END_OF_RECORD[] = { 0x4e, 0xfc, 0x04, 0xff, 0xff, 0xff, 0xff };
-
-// Vendor Specific: Wake up
-uint8_t HCI_VSC_WAKEUP[] = { 0x53, 0xfc, 0x01, 0x13 };
-
 #ifdef DEBUG
 const char* getState(enum DeviceState deviceState)
 {
-	static const IONamedValue state_values[] = {
+	static const struct
+	{
+		int value;
+		const char *name;
+	} state_values[] = {
 		{ kUnknown,            "Unknown"              },
 		{ kPreInitialize,      "PreInitialize"        },
 		{ kLocalVersion,       "Local version"        },
@@ -128,6 +97,8 @@ const char* getState(enum DeviceState deviceState)
 		{ kUpdateComplete,     "Update complete"      },
 		{ kUpdateNotNeeded,    "Update not needed"    },
 		{ kUpdateAborted,      "Update aborted"       },
+		{ kResume,             "Resume"               },
+		{ kVerifyRam,          "Verify RAM"           },
 		{ 0,                   NULL                   }
 	};
 	
@@ -141,404 +112,190 @@ const char* getState(enum DeviceState deviceState)
 }
 #endif // DEBUG
 
-const char* stringFromReturn(IOReturn rtn)
-{
-	static const IONamedValue IOReturn_values[] = {
-		{ kIOReturnIsoTooOld,          "Isochronous I/O request for distant past"     },
-		{ kIOReturnIsoTooNew,          "Isochronous I/O request for distant future"   },
-		{ kIOReturnNotFound,           "Data was not found"                           },
-		// REVIEW: new error identifiers?
-#ifndef TARGET_ELCAPITAN
-		{ kIOUSBUnknownPipeErr,        "Pipe ref not recognized"                      },
-		{ kIOUSBTooManyPipesErr,       "Too many pipes"                               },
-		{ kIOUSBNoAsyncPortErr,        "No async port"                                },
-		{ kIOUSBNotEnoughPowerErr,     "Not enough power for selected configuration"  },
-		{ kIOUSBEndpointNotFound,      "Endpoint not found"                           },
-		{ kIOUSBConfigNotFound,        "Configuration not found"                      },
-		{ kIOUSBTransactionTimeout,    "Transaction timed out"                        },
-		{ kIOUSBTransactionReturned,   "Transaction has been returned to the caller"  },
-		{ kIOUSBPipeStalled,           "Pipe has stalled, error needs to be cleared"  },
-		{ kIOUSBInterfaceNotFound,     "Interface reference not recognized"           },
-		{ kIOUSBLowLatencyBufferNotPreviouslyAllocated,
-			"Attempted to user land low latency isoc calls w/out calling PrepareBuffer" },
-		{ kIOUSBLowLatencyFrameListNotPreviouslyAllocated,
-			"Attempted to user land low latency isoc calls w/out calling PrepareBuffer" },
-		{ kIOUSBHighSpeedSplitError,   "Error on hi-speed bus doing split transaction"},
-		{ kIOUSBSyncRequestOnWLThread, "Synchronous USB request on workloop thread."  },
-		{ kIOUSBDeviceNotHighSpeed,    "The device is not a high speed device."       },
-		{ kIOUSBClearPipeStallNotRecursive,
-			"IOUSBPipe::ClearPipeStall should not be called rescursively"               },
-		{ kIOUSBLinkErr,               "USB link error"                               },
-		{ kIOUSBNotSent2Err,           "Transaction not sent"                         },
-		{ kIOUSBNotSent1Err,           "Transaction not sent"                         },
-		{ kIOUSBNotEnoughPipesErr,     "Not enough pipes in interface"                },
-		{ kIOUSBBufferUnderrunErr,     "Buffer Underrun (Host hardware failure)"      },
-		{ kIOUSBBufferOverrunErr,      "Buffer Overrun (Host hardware failure"        },
-		{ kIOUSBReserved2Err,          "Reserved"                                     },
-		{ kIOUSBReserved1Err,          "Reserved"                                     },
-		{ kIOUSBWrongPIDErr,           "Pipe stall, Bad or wrong PID"                 },
-		{ kIOUSBPIDCheckErr,           "Pipe stall, PID CRC error"                    },
-		{ kIOUSBDataToggleErr,         "Pipe stall, Bad data toggle"                  },
-		{ kIOUSBBitstufErr,            "Pipe stall, bitstuffing"                      },
-		{ kIOUSBCRCErr,                "Pipe stall, bad CRC"                          },
-#endif
-		{ 0,                           NULL                                           }
-	};
+bool supportsHandshake(uint16_t vid, uint16_t pid)
+{
+	uint32_t i;
 	
-	for(int i = 0; IOReturn_values[i].name; i++)
-	{
-		if (IOReturn_values[i].value == rtn)
-			return IOReturn_values[i].name;
+	for (i = 0; hskSupport[i].vid != 0; i++) {
+		if ((hskSupport[i].vid == vid) && (hskSupport[i].pid == pid))
+			return true;
 	}
 	
-	return NULL;
+	return false;
 }
 
-bool supportsHandshake(UInt16 vid, UInt16 pid)
+bool needsFixedDelays(uint16_t vid, uint16_t pid)
 {
-	UInt32 i;
-	
-	for (i = 0; hskSupport[i].vid != 0; i++) {
-		if ((hskSupport[i].vid == vid) && (hskSupport[i].pid == pid))
+	for (uint32_t i = 0; fixedDelayQuirks[i].vid != 0; i++)
+	{
+		if (fixedDelayQuirks[i].vid == vid && fixedDelayQuirks[i].pid == pid)
 			return true;
 	}
 	
 	return false;
 }
 
-IOReturn findInterfaces(IOUSBDeviceInterface300 **device)
-{
-	IOReturn                    kr;
-	IOUSBFindInterfaceRequest   request;
-	io_iterator_t               iterator;
-	io_service_t                usbInterface;
-	IOCFPlugInInterface         **plugInInterface = NULL;
-	IOUSBInterfaceInterface     **interface = NULL;
-	HRESULT                     result;
-	SInt32                      score;
-	UInt8                       interfaceClass;
-	UInt8                       interfaceSubClass;
-	UInt8                       interfaceNumEndpoints;
-	int                         pipeRef;
-	// Placing the constant kIOUSBFindInterfaceDontCare into the following
-	// fields of the IOUSBFindInterfaceRequest structure will allow you
-	// to find all the interfaces
-	request.bInterfaceClass = kIOUSBFindInterfaceDontCare;
-	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
-	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
-	request.bAlternateSetting = kIOUSBFindInterfaceDontCare;
-	// Get an iterator for the interfaces on the device
-	kr = (*device)->CreateInterfaceIterator(device,
-										&request, &iterator);
-	while ((usbInterface = IOIteratorNext(iterator)))
+const char *chipName(uint16_t lmpSubversion)
+{
+	for (int i = 0; bcm_usb_subver_table[i].name; i++)
 	{
-		// Create an intermediate plug-in
-		kr = IOCreatePlugInInterfaceForService(usbInterface,
-							kIOUSBInterfaceUserClientTypeID,
-							kIOCFPlugInInterfaceID,
-							&plugInInterface, &score);
-		// Release the usbInterface object after getting the plug-in
-		kr = IOObjectRelease(usbInterface);
-		if ((kr != kIOReturnSuccess) || !plugInInterface)
-		{
-			fprintf(stderr, "Unable to create a plug-in (%08x)\n", kr);
-			break;
-		}
-		// Now create the device interface for the interface
-		result = (*plugInInterface)->QueryInterface(plugInInterface,
-					CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID),
-					(LPVOID *) &interface);
-		// No longer need the intermediate plug-in
-		(*plugInInterface)->Release(plugInInterface);
-		if (result || !interface)
-		{
-			fprintf(stderr, "Couldn’t create a device interface for the interface (%08x)\n", (int) result);
-			break;
-		}
-		// Get interface class and subclass
-		kr = (*interface)->GetInterfaceClass(interface,
-													&interfaceClass);
-		kr = (*interface)->GetInterfaceSubClass(interface,
-												&interfaceSubClass);
-		printf("Interface class %d, subclass %d\n", interfaceClass,
-													interfaceSubClass);
-		// Now open the interface. This will cause the pipes associated with
-		// the endpoints in the interface descriptor to be instantiated
-		kr = (*interface)->USBInterfaceOpen(interface);
-		if (kr != kIOReturnSuccess)
-		{
-			fprintf(stderr, "Unable to open interface (%08x)\n", kr);
-			(void) (*interface)->Release(interface);
-			break;
-		}
-		// Get the number of endpoints associated with this interface
-		kr = (*interface)->GetNumEndpoints(interface,
-										&interfaceNumEndpoints);
-		if (kr != kIOReturnSuccess)
-		{
-			fprintf(stderr, "Unable to get number of endpoints (%08x)\n", kr);
-			(void) (*interface)->USBInterfaceClose(interface);
-			(void) (*interface)->Release(interface);
-			break;
-		}
-		printf("Interface has %d endpoints\n", interfaceNumEndpoints);
-		// Access each pipe in turn, starting with the pipe at index 1
-		// The pipe at index 0 is the default control pipe and should be
-		// accessed using (*usbDevice)->DeviceRequest() instead
-		for (pipeRef = 1; pipeRef <= interfaceNumEndpoints; pipeRef++)
-		{
-			IOReturn        kr2;
-			UInt8           direction;
-			UInt8           number;
-			UInt8           transferType;
-			UInt16          maxPacketSize;
-			UInt8           interval;
-			kr2 = (*interface)->GetPipeProperties(interface,
-										pipeRef, &direction,
-										&number, &transferType,
-										&maxPacketSize, &interval);
-			if (kr2 != kIOReturnSuccess && kr2 != kIOReturnNotOpen)
-				fprintf(stderr, "Unable to get properties of pipe %d (%08x)\n", pipeRef, kr2);
-			else
-			{
-				printf("PipeRef %d: ", pipeRef);
-				printf("direction %s, ", usb_dir[direction]);
-				printf("transfer type %s, maxPacketSize %d\n", usb_ctrl[direction], maxPacketSize);
-			}
-		}
-		
-		(void) (*interface)->USBInterfaceClose(interface);
-		(void) (*interface)->Release(interface);
+		if (lmpSubversion == bcm_usb_subver_table[i].subver)
+			return bcm_usb_subver_table[i].name;
 	}
 	
-	return kr;
+	return NULL;
 }
 
-int findPipe(IOUSBInterfaceInterface300** interface, UInt8 type, UInt8 direction)
+uint16_t chipSubversion(const char *name, size_t length)
 {
-	IOReturn kr;
-	UInt8 interfaceNumEndpoints, findDirection, number, transferType, interval;
-	UInt16 maxPacketSize;
-	
-	if ((*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints) != KERN_SUCCESS)
-		return 0;
-	
-	for (UInt8 pipeRef = 1; pipeRef <= interfaceNumEndpoints; pipeRef++)
+	for (int i = 0; bcm_usb_subver_table[i].name; i++)
 	{
-		kr = (*interface)->GetPipeProperties(interface, pipeRef, &findDirection, &number, &transferType, &maxPacketSize, &interval);
-		
-		if (kr != kIOReturnSuccess)
-		{
-			fprintf(stderr, "GetPipeProperties Failure (0x%08x)\n", kr);
-			
-			return 0;
-		}
-		
-#ifdef DEBUG
-		printf("pipeRef: %d direction: %d number: %d transferType: %d maxPacketSize: %d interval: %d\n", pipeRef, findDirection, number, transferType, maxPacketSize, interval);
-#endif
-		
-		if (type == transferType && direction == findDirection)
-		{
-#ifdef DEBUG
-			printf("Found matching endpoint\n");
-#endif
-			
-			return pipeRef;
-		}
+		if (strlen(bcm_usb_subver_table[i].name) == length && strncasecmp(bcm_usb_subver_table[i].name, name, length) == 0)
+			return bcm_usb_subver_table[i].subver;
 	}
 	
 	return 0;
 }
 
-IOReturn hciCommand(IOUSBInterfaceInterface300** interface, void* command, UInt16 length)
+static DeviceState completeLocalVersion(const HciCommandCompleteView &complete, DeviceState)
 {
-	IOUSBDevRequestTO request;
-	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBDevice);
-	request.bRequest = 0;
-	request.wValue = 0;
-	request.wIndex = 0;
-	request.wLength = length;
-	request.pData = command;
-	request.completionTimeout = hci_timeout;
-	request.noDataTimeout = hci_timeout;
-	IOReturn result = (*interface)->ControlRequestTO(interface, 0, &request);
+	HciLocalVersionView ver(complete);
+	uint16_t subver = ver.lmpSubversion();
+	const char *hw_name = chipName(subver);
 	
-	if (result != kIOReturnSuccess)
-	{
-		fprintf(stderr, "hciCommand failed ('%s' 0x%08x).\n", stringFromReturn(result), result);
-	}
-#ifdef DEBUG
-	else
+	printf("Local Version: %s_%3.3u.%3.3u.%3.3u.%4.4u\n", hw_name ? hw_name : "BCM", (subver & 0x7000) >> 13, (subver & 0x1f00) >> 8, (subver & 0x00ff), ver.hciRevision() & 0x0fff);
+	
+	return kUSBProduct;
+}
+
+static DeviceState completeUsbProduct(const HciCommandCompleteView &complete, DeviceState)
+{
+	HciUsbProductView product(complete);
+	
+	printf("USB Product VendorId: 0x%04x ProductId: 0x%04x\n", product.vendorId(), product.productId());
+	
+	return kFirmwareVersion;
+}
+
+static DeviceState completeVerboseConfig(const HciCommandCompleteView &complete, DeviceState)
+{
+	HciVerboseConfigView config(complete);
+	uint16_t build = config.build();
+	
+	printf("ChipsetID: %d Build: %4.4u Firmware: v%d\n", config.chipsetId(), build, build + 0x1000);
+	
+	// Whether the download is needed is up to the caller, see UpgradeContext::checkVersion()
+	return kDownloadMiniDriver;
+}
+
+static DeviceState completeMiniDriver(const HciCommandCompleteView &, DeviceState)
+{
+	return kMiniDriverComplete;
+}
+
+static DeviceState completeLaunchRam(const HciCommandCompleteView &, DeviceState)
+{
+	return kInstructionWritten;
+}
+
+static DeviceState completeEndOfRecord(const HciCommandCompleteView &, DeviceState)
+{
+	return kFirmwareWritten;
+}
+
+static DeviceState completeReset(const HciCommandCompleteView &, DeviceState state)
+{
+	return state == kPreInitialize ? kLocalVersion : kResetComplete;
+}
+
+struct HciOpcodeEntry
+{
+	uint16_t opcode;
+	const char *name;
+	RttClass rtt;
+	uint32_t returnSize;			// Return parameters after the status, a shorter completion is ignored
+	DeviceState (*complete)(const HciCommandCompleteView &complete, DeviceState state);	// NULL leaves the state alone
+};
+
+// Command Complete dispatch, and the round trip class of every command that is sent
+static constexpr HciOpcodeEntry opcodeTable[] =
+{
+	{ HCI_OPCODE_RESET,               "HCI_RESET",                   kRttBoot,      0,                                 completeReset },
+	{ HCI_OPCODE_READ_LOCAL_VERSION,  "HCI_READ_LOCAL_VERSION",      kRttCommand,   HciLocalVersionView::kReturnSize,  completeLocalVersion },
+	{ HCI_OPCODE_READ_FEATURES,       "HCI_READ_FEATURES",           kRttCommand,   0,                                 NULL },
+	{ HCI_OPCODE_READ_USB_PRODUCT,    "HCI_VSC_READ_USB_PRODUCT",    kRttCommand,   HciUsbProductView::kReturnSize,    completeUsbProduct },
+	{ HCI_OPCODE_READ_VERBOSE_CONFIG, "HCI_VSC_READ_VERBOSE_CONFIG", kRttCommand,   HciVerboseConfigView::kReturnSize, completeVerboseConfig },
+	{ HCI_OPCODE_DOWNLOAD_MINIDRIVER, "HCI_VSC_DOWNLOAD_MINIDRIVER", kRttBoot,      0,                                 completeMiniDriver },
+	{ HCI_OPCODE_LAUNCH_RAM,          "HCI_VSC_LAUNCH_RAM",          kRttLaunchRam, 0,                                 completeLaunchRam },
+	// Checked by UpgradeContext, the state only changes once every read is in
+	{ HCI_OPCODE_READ_RAM,            "HCI_VSC_READ_RAM",            kRttReadRam,   0,                                 NULL },
+	{ HCI_OPCODE_END_OF_RECORD,       "HCI_VSC_END_OF_RECORD",       kRttBoot,      0,                                 completeEndOfRecord },
+};
+
+static constexpr const HciOpcodeEntry *findOpcode(uint16_t opcode)
+{
+	for (const HciOpcodeEntry &entry : opcodeTable)
 	{
-		printf("hciCommand success (%d bytes sent).\n", request.wLenDone);
+		if (entry.opcode == opcode)
+			return &entry;
 	}
-#endif
 	
-	return result;
+	return NULL;
 }
 
-IOReturn getDeviceStatus(IOUSBInterfaceInterface300** interface, USBStatus *status)
+static_assert(findOpcode(HCI_OPCODE_LAUNCH_RAM)->rtt == kRttLaunchRam, "LAUNCH_RAM needs its own round trip estimate");
+
+RttClass rttClass(uint16_t opcode)
 {
-	uint16_t stat = 0;
-	IOUSBDevRequestTO request;
-	request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
-	request.bRequest = kUSBRqGetStatus;
-	request.wValue = 0;
-	request.wIndex = 0;
-	request.wLength = sizeof(stat);
-	request.pData = &stat;
-	request.completionTimeout = hci_timeout;
-	request.noDataTimeout = hci_timeout;
-	IOReturn result = (*interface)->ControlRequestTO(interface, 0, &request);
-	*status = stat;
-	return result;
+	const HciOpcodeEntry *entry = findOpcode(opcode);
+	
+	return entry ? entry->rtt : kRttCommand;
 }
 
-IOReturn hciParseResponse(IOUSBInterfaceInterface300** interface, void* response, UInt16 length, bool useHandshake, void* output, UInt32* outputLength, enum DeviceState *deviceState)
+static void hciParseCommandComplete(const HciCommandCompleteView &complete, enum DeviceState *deviceState)
 {
-	HCI_RESPONSE* header = (HCI_RESPONSE*)response;
-	IOReturn result = kIOReturnSuccess;
+	const HciOpcodeEntry *entry = findOpcode(complete.opcode());
 	
-	switch (header->eventCode)
+	if (entry == NULL)
 	{
-		case HCI_EVENT_COMMAND_COMPLETE:
-		{
-			struct HCI_COMMAND_COMPLETE* event = (struct HCI_COMMAND_COMPLETE*)response;
-			
-			switch (event->opcode)
-			{
-				case HCI_OPCODE_READ_LOCAL_VERSION:
-				{
-#ifdef DEBUG
-					printf("READ LOCAL VERSION complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
-#endif
-					
-					HCI_RP_READ_LOCAL_VERSION* ver = (HCI_RP_READ_LOCAL_VERSION*)((char*)response + 5);
-					const char *hw_name = NULL;
-
-					for (int i = 0; bcm_usb_subver_table[i].name; i++)
-					{
-						if (ver->lmp_subver == bcm_usb_subver_table[i].subver)
-						{
-							hw_name = bcm_usb_subver_table[i].name;
-							break;
-						}
-					}
-					
-					printf("Local Version: %s_%3.3u.%3.3u.%3.3u.%4.4u\n", hw_name ? hw_name : "BCM", (ver->lmp_subver & 0x7000) >> 13, (ver->lmp_subver & 0x1f00) >> 8, (ver->lmp_subver & 0x00ff), ver->hci_rev & 0x0fff);
-					
-					*deviceState = kUSBProduct;
-					
-					break;
-				}
-				case HCI_OPCODE_READ_USB_PRODUCT:
-				{
-#ifdef DEBUG
-					printf("READ USB PRODUCT complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
-#endif
-					
-					// Read USB Product Info
-					UInt16 vid = *(UInt16*)((char*)response + 6);
-					UInt16 pid = *(UInt16*)((char*)response + 8);
-
-					printf("USB Product VendorId: 0x%04x ProductId: 0x%04x\n", vid, pid);
-					
-					*deviceState = kFirmwareVersion;
-					
-					break;
-				}
-				case HCI_OPCODE_READ_VERBOSE_CONFIG:
-				{
-#ifdef DEBUG
-					printf("READ VERBOSE CONFIG complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
-#endif
-					
-					UInt8 chipsetID = *((char*)response + 6);
-					UInt16 build = *(UInt16*)((char*)response + 10);
-					UInt16 firmwareVersion = build + 0x1000;
-					
-					printf("ChipsetID: %d Build: %4.4u Firmware: v%d\n", chipsetID, build, firmwareVersion);
-					
-					// Device does not require a firmware patch at this time
-#if (FORCE_UPDATE == 0)
-					if (build > 0)
-					{
-						printf("Update Not Needed.\nDone.\n");
-						
-						*deviceState = kUpdateNotNeeded;
-					}
-					else
-#endif
-					{
-						*deviceState = kDownloadMiniDriver;
-					}
-					break;
-				}
-				case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
-				{
-#ifdef DEBUG
-					printf("DOWNLOAD MINIDRIVER complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
-#endif
-					
-					*deviceState = kMiniDriverComplete;
-					break;
-				}
-				case HCI_OPCODE_LAUNCH_RAM:
-				{
-#ifdef DEBUG
-					printf("LAUNCH RAM complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
-#endif
-					
-					*deviceState = kInstructionWritten;
-					break;
-				}
-				case HCI_OPCODE_END_OF_RECORD:
-				{
 #ifdef DEBUG
-					printf("END OF RECORD complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
+		printf("Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n", complete.opcode(), complete.status(), complete.parameterLength());
 #endif
-					
-					*deviceState = kFirmwareWritten;
-					break;
-				}
-				case HCI_OPCODE_RESET:
-				{
+		return;
+	}
+	
 #ifdef DEBUG
-					printf("RESET complete (status: 0x%02x, length: %d bytes).\n", event->status, header->length);
+	printf("%s complete (status: 0x%02x, length: %d bytes).\n", entry->name, complete.status(), complete.parameterLength());
 #endif
+	
+	if (complete.returnLength() < entry->returnSize)
+	{
+		fprintf(stderr, "%s complete with %u of %u bytes (status 0x%02x), ignored.\n", entry->name, complete.returnLength(), entry->returnSize, complete.status());
+		return;
+	}
+	
+	if (entry->complete)
+		*deviceState = entry->complete(complete, *deviceState);
+}
 
-					*deviceState = *deviceState == kPreInitialize ? kLocalVersion : kResetComplete;
-					break;
-				}
-				default:
-				{
-#ifdef DEBUG
-					printf("Event COMMAND COMPLETE (opcode 0x%04x, status: 0x%02x, length: %d bytes).\n", event->opcode, event->status, header->length);
-#endif
-					break;
-				}
-			}
+void hciParseResponse(const uint8_t *response, uint32_t length, bool useHandshake, enum DeviceState *deviceState)
+{
+	HciEventView event(response, length);
+	
+	if (!event.valid())
+	{
+		fprintf(stderr, "Truncated event (%u bytes).\n", length);
+		return;
+	}
+	
+	switch (event.code())
+	{
+		case HCI_EVENT_COMMAND_COMPLETE:
+		{
+			HciCommandCompleteView complete(response, length);
 			
-			if (output && outputLength)
-			{
-				bzero(output, *outputLength);
-				
-				// Return the received data
-				if (*outputLength >= length)
-				{
-#ifdef DEBUG
-					printf("Returning output data %d bytes.\n", length);
-#endif
-					
-					*outputLength = length;
-					memcpy(output, response, length);
-				} else
-				{
-					// Not enough buffer space for data
-					result = kIOReturnMessageTooLarge;
-				}
-			}
+			if (complete.valid())
+				hciParseCommandComplete(complete, deviceState);
 			break;
 		}
 			
@@ -589,236 +346,810 @@ IOReturn hciParseResponse(IOUSBInterfaceInterface300** interface, void* response
 			break;
 			
 		default:
-			fprintf(stderr, "Unknown event code (0x%02x).\n", header->eventCode);
+			fprintf(stderr, "Unknown event code (0x%02x).\n", event.code());
 			break;
 	}
+}
+
+UpgradeContext::UpgradeContext(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed) :
+	mTransport(transport), mImage(image), mFeed(feed), mFeedCount(0), mOptions(options),
+	mState(options.initialReset ? kPreInitialize : kLocalVersion), mNotedState(kUnknown), mResetSent(false), mFirmwareSelected(false),
+	mDataIndex(0), mAcked(0), mResyncSent(false), mCredits(1), mCreditsSent(0), mCommandsSent(0), mInFlight(0), mReadsInFlight(0), mVerifyMismatch(false), mVerified(false), mBackoffs(0)
+{
+	memset(&mStats, 0, sizeof(mStats));
+	mStarted = Clock::now();
+	
+	for (int i = 0; i < kRttClassCount; i++)
+		mRtt[i].setBounds(options.timeoutFloor, options.timeout);
+}
+
+void UpgradeContext::checkVersion()
+{
+	if (mOptions.selectFirmware && !mFirmwareSelected)
+	{
+		mFirmwareSelected = true;
+		
+		if (!mOptions.selectFirmware(mDevice))
+		{
+			mState = kUpdateAborted;
+			return;
+		}
+	}
+	
+	const FirmwareVersion &target = mImage.version();
+	bool current = false;
+	
+	if (mOptions.skipCurrent)
+	{
+		// Without a version in the firmware any patched build is taken as current
+		if (target.known())
+			current = mDevice.build == target.build && (target.lmpSubversion == 0 || mDevice.lmpSubversion == target.lmpSubversion);
+		else
+			current = mDevice.build > 0;
+	}
+	
+	if (current)
+	{
+		printf("Update Not Needed.\nDone.\n");
+		mState = kUpdateNotNeeded;
+	}
+	else if (!mResetSent)
+	{
+		// Probed without a reset, put the controller in a defined state before the download
+		mState = kPreInitialize;
+	}
+}
+
+void UpgradeContext::startVerify()
+{
+	mVerifier.start(mImage);
+	mReadsInFlight = 0;
+	mVerifyMismatch = false;
+	mVerifyStart = Clock::now();
+	mState = kVerifyRam;
+}
+
+uint32_t UpgradeContext::window() const
+{
+	uint32_t depth = mOptions.pipelineDepth > 0 ? (uint32_t)mOptions.pipelineDepth : 1;
+	uint32_t inFlight = mInFlight + mReadsInFlight;
+	uint32_t sent = mCommandsSent - mCreditsSent;
+	
+	// Completions arrive in order, so the commands in flight are the last ones sent
+	if (sent > inFlight)
+		sent = inFlight;
 	
-	return result;
+	uint32_t window = inFlight + (sent < mCredits ? mCredits - sent : 0);
+	
+	// A checkpoint is due, nothing more is sent until the LAUNCH_RAM commands in flight completed
+	if (mDataIndex - mAcked >= kCheckpointInterval)
+		return inFlight;
+	
+	return window < depth ? window : depth;
+}
+
+bool UpgradeContext::drainsEvents() const
+{
+	if (mState == kVerifyRam)
+		return true;
+	
+	return mOptions.pipelineDepth > 0 && (mState == kInstructionWrite || mState == kInstructionWritten);
 }
 
-bool bulkWrite(IOUSBInterfaceInterface300** interface, UInt8 pipeRef, const void* data, UInt32 length)
+bool UpgradeContext::sendReads()
 {
-	IOReturn kr;
-	kr = (*interface)->WritePipeTO(interface, pipeRef, (void*)data, length, hci_timeout, hci_timeout);
+	HciReadRamCommand command(HCI_OPCODE_READ_RAM);
 	
-	if (kr != kIOReturnSuccess)
+	// Keep as many reads in flight as the controller has credits for, none after a mismatch
+	while (!mVerifyMismatch && mReadsInFlight < window() && mVerifier.nextRead(command))
 	{
-		fprintf(stderr, "WritePipeTO failed (0x%02x).\n", kr);
+		TransportStatus status = send(command);
 		
-		return false;
+		if (status != kTransportSuccess)
+		{
+			if (!recover(status))
+				fprintf(stderr, "HCI_VSC_READ_RAM failed, aborting.\n");
+			return false;
+		}
+		
+		mReadsInFlight++;
 	}
 	
-	return true;
+	if (mReadsInFlight > 0 || !mVerifier.done())
+		return true;
+	
+	mStats.verifyReads = mVerifier.reads();
+	mStats.verifyBytes = mVerifier.bytes();
+	mStats.verifyElapsed = std::chrono::duration<double, std::milli>(Clock::now() - mVerifyStart).count();
+	
+	printf("RAM verified: %llu bytes in %zu regions, %u reads in %.1f ms (%.1f KB/s).\n", (unsigned long long)mStats.verifyBytes, mVerifier.regions(), mStats.verifyReads, mStats.verifyElapsed, mStats.verifyElapsed > 0 ? mStats.verifyBytes / mStats.verifyElapsed : 0.0);
+	
+	mVerified = true;
+	mState = kInstructionWrite;
+	
+	return false;
 }
 
-bool performUpgrade(IOUSBInterfaceInterface300** interface, CFMutableArrayRef instructions, int initialDelay, int preResetDelay, int postResetDelay, bool useHandshake)
+void UpgradeContext::noteState()
 {
-	static unsigned char buffer[BUFFER_SIZE];
-	UInt32 dataIndex = 0, length = 0;
-	CFMutableDataRef data = (CFMutableDataRef) CFArrayGetValueAtIndex(instructions, dataIndex);
-	CFIndex dataLength = CFDataGetLength(data);
+	if (mState == mNotedState || mState == kInstructionWritten)
+		return;
+	
 #ifdef DEBUG
-	enum DeviceState previousState = kUnknown;
+	printf("State '%s' --> '%s'.\n", getState(mNotedState), getState(mState));
 #endif
 	
-	enum DeviceState deviceState = kPreInitialize;
+	uint8_t state = (uint8_t)mState;
+	
+	mStats.transitionHash = hashBytes(&state, sizeof(state), mStats.transitions == 0 ? FNV1A64_OFFSET : mStats.transitionHash);
+	mStats.transitions++;
+	mNotedState = mState;
+}
+
+TransportStatus UpgradeContext::send(const uint8_t *command, uint16_t length)
+{
+	Clock::time_point start = Clock::now();
+	
+	mStats.commands++;
+	mTransport.setTimeout(mRtt[kRttControl].timeout());
 	
-	UInt8 pipeIn = findPipe(interface, kUSBInterrupt, kUSBIn);
-	UInt8 pipeOut = findPipe(interface, kUSBBulk, kUSBOut);
+	TransportStatus status = mTransport.sendCommand(command, length);
+	transferred(kRttControl, command, start, status);
+	mCommandsSent++;
+	
+	return status;
+}
+
+TransportStatus UpgradeContext::writeInstruction(uint32_t index)
+{
+	FirmwareSpan data;
 	
-	if (pipeIn == 0 || pipeOut == 0)
+	// The image may still grow and move, send a copy
+	if (mFeed != NULL)
 	{
-		fprintf(stderr, "Couldn't find pipes.\n");
-		return false;
+		data.length = mFeed->copyCommand(index, mInstruction);
+		data.data = mInstruction;
+	}
+	else
+	{
+		data = mImage.command(index);
 	}
+	
+	Clock::time_point start = Clock::now();
+	
+	if (mStats.instructions == 0)
+		mStats.firstInstruction = std::chrono::duration<double, std::milli>(start - mStarted).count();
+	
+	mStats.instructions++;
+	mStats.instructionBytes += data.length;
+	mTransport.setTimeout(mRtt[kRttBulk].timeout());
+	
+	TransportStatus status = mTransport.bulkWrite(data.data, data.length);
+	transferred(kRttBulk, data.data, start, status);
+	mCommandsSent++;
+	
+	return status;
+}
 
-	while (true)
+uint32_t UpgradeContext::instructionCount(bool wait)
+{
+	if (mFeed == NULL)
+		return (uint32_t)mImage.count();
+	
+	// Loading failed, nothing more is written
+	if (mState == kUpdateAborted)
+		return mDataIndex;
+	
+	if (mDataIndex < mFeedCount)
+		return mFeedCount;
+	
+	Clock::time_point start = Clock::now();
+	bool loaded;
+	
+	mFeedCount = (uint32_t)mFeed->available(mDataIndex, wait, &loaded);
+	mStats.firmwareWait += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	
+	if (!loaded)
+		return mFeedCount;
+	
+	if (!mFeed->finish())
 	{
-#ifdef DEBUG
-		if (deviceState != kInstructionWrite && deviceState != kInstructionWritten)
-			printf("State '%s' --> '%s'.\n", getState(previousState), getState(deviceState));
-		
-		previousState = deviceState;
-#endif
-		
-		// Break out when done
-		if (deviceState == kUpdateAborted || deviceState == kUpdateComplete || deviceState == kUpdateNotNeeded)
-			break;
-		
-		// Note on following switch/case:
-		//   use 'break' when a response from io completion callback is expected
-		//   use 'continue' when a change of state with no expected response (loop again)
+		fprintf(stderr, "Firmware could not be loaded, aborting.\n");
+		mState = kUpdateAborted;
+		return mDataIndex;
+	}
+	
+	// Complete, the image no longer changes
+	mFeed = NULL;
+	
+	return (uint32_t)mImage.count();
+}
+
+void UpgradeContext::transferred(RttClass transfer, const uint8_t *command, Clock::time_point start, TransportStatus status)
+{
+	if (status == kTransportSuccess)
+	{
+		PendingCommand pending = { hciGet16(command), start };
 		
-		switch (deviceState)
+		mRtt[transfer].sample(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+		mPending.push_back(pending);
+	}
+	else if (status == kTransportTimeout)
+	{
+		mRtt[transfer].backoff();
+		mStats.timeouts++;
+	}
+}
+
+void UpgradeContext::completed(uint16_t opcode)
+{
+	// Completions of commands given up on (and probes) were never pending
+	if (mPending.empty() || mPending.front().opcode != opcode)
+		return;
+	
+	RttClass rtt = rttClass(opcode);
+	
+	if (rtt != kRttBoot)
+		mRtt[rtt].sample(std::chrono::duration<double, std::milli>(Clock::now() - mPending.front().sent).count());
+	
+	mPending.pop_front();
+	mBackoffs = 0;
+	
+	mStats.commandRtt = mRtt[kRttCommand].srtt();
+	mStats.launchRamRtt = mRtt[kRttLaunchRam].srtt();
+	mStats.launchRamTimeout = mRtt[kRttLaunchRam].timeout();
+}
+
+uint32_t UpgradeContext::eventTimeout() const
+{
+	if (mPending.empty())
+		return mOptions.timeout;
+	
+	const PendingCommand &oldest = mPending.front();
+	Clock::time_point deadline = oldest.sent + std::chrono::milliseconds(mRtt[rttClass(oldest.opcode)].timeout());
+	Clock::time_point now = Clock::now();
+	
+	if (deadline <= now)
+		return 1;
+	
+	return (uint32_t)std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+}
+
+uint32_t UpgradeContext::probeInterval() const
+{
+	uint32_t interval = (uint32_t)ceil(mRtt[kRttCommand].estimate());
+	
+	return interval > READY_PROBE_INTERVAL_MIN ? interval : READY_PROBE_INTERVAL_MIN;
+}
+
+void UpgradeContext::handleEvent(const HciEvent *event)
+{
+	TransportStatus status = event ? event->status : kTransportAborted;
+	
+	mStats.events++;
+	
+	switch (status)
+	{
+		case kTransportSuccess:
 		{
-			case kPreInitialize:
-				// Reset the device to put it in a defined state.
-				if (hciCommand(interface, &HCI_RESET, sizeof(HCI_RESET)) != kIOReturnSuccess)
+			HciCommandCompleteView complete(event->data, event->length);
+			bool commandComplete = complete.valid();
+			
+			if (commandComplete)
+				completed(complete.opcode());
+			
+			if (mState == kResume)
+			{
+				// Completions of commands sent before the error are stale, the controller
+				// answers in order so the resync completion is the last of them
+				if (mResyncSent && commandComplete && complete.opcode() == HCI_OPCODE_READ_LOCAL_VERSION)
 				{
-					fprintf(stderr, "HCI_RESET failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					mCredits = complete.numCommands();
+					mCreditsSent = event->sent;
+					mDataIndex = mAcked;
+					mInFlight = 0;
+					mReadsInFlight = 0;
+					mState = kInstructionWrite;
 				}
 				break;
+			}
+			
+			hciParseResponse(event->data, event->length, mOptions.useHandshake, &mState);
+			
+			if (!commandComplete)
+				break;
+			
+			// Number of additional commands the controller is able to accept
+			mCredits = complete.numCommands();
+			mCreditsSent = event->sent;
+			
+			HciLocalVersionView ver(complete);
+			HciVerboseConfigView config(complete);
+			
+			if (ver.valid())
+			{
+				mDevice.lmpSubversion = ver.lmpSubversion();
+			}
+			else if (config.valid())
+			{
+				mDevice.build = config.build();
+				
+				if (mState == kDownloadMiniDriver)
+					checkVersion();
+			}
+			
+			if (complete.opcode() == HCI_OPCODE_READ_RAM && mState == kVerifyRam && mReadsInFlight > 0)
+			{
+				const RamRegion &region = mVerifier.region();
 				
-			case kLocalVersion:
-				// Wait for device to become ready after reset.
-				usleep(postResetDelay * 1000);
+				mReadsInFlight--;
 				
-				if (hciCommand(interface, &HCI_READ_LOCAL_VERSION, sizeof(HCI_READ_LOCAL_VERSION)) != kIOReturnSuccess)
+				if (complete.status() != 0)
 				{
-					fprintf(stderr, "HCI_READ_LOCAL_VERSION failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					fprintf(stderr, "HCI_VSC_READ_RAM in region 0x%08x failed (status 0x%02x), aborting.\n", region.address, complete.status());
+					mState = kUpdateAborted;
+					break;
 				}
-				break;
 				
-			case kUSBProduct:
-				if (hciCommand(interface, &HCI_VSC_READ_USB_PRODUCT, sizeof(HCI_VSC_READ_USB_PRODUCT)) != kIOReturnSuccess)
+				if (!mVerifyMismatch && !mVerifier.check(complete.returnData(), complete.returnLength()))
+					mVerifyMismatch = true;
+				
+				// Completions are matched to chunks by count, so one the controller dropped puts every
+				// later one on the wrong chunk. It also leaves a read that never completes, which times
+				// out and verifies again. Only a mismatch with nothing left outstanding is the RAM's.
+				if (mVerifyMismatch && mReadsInFlight == 0)
 				{
-					fprintf(stderr, "HCI_VSC_READ_USB_PRODUCT failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					fprintf(stderr, "RAM region 0x%08x (%u bytes) does not match the firmware, aborting.\n", region.address, region.length);
+					mState = kUpdateAborted;
 				}
 				break;
-				
-			case kFirmwareVersion:
-				if (hciCommand(interface, &HCI_VSC_READ_VERBOSE_CONFIG, sizeof(HCI_VSC_READ_VERBOSE_CONFIG)) != kIOReturnSuccess)
+			}
+			
+			if (complete.opcode() != HCI_OPCODE_LAUNCH_RAM)
+				break;
+			
+			if (mOptions.pipelineDepth > 0)
+			{
+				// Completions arrive in submission order, match them to the oldest instruction in flight
+				if (mInFlight == 0)
 				{
-					fprintf(stderr, "HCI_VSC_READ_VERBOSE_CONFIG failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					fprintf(stderr, "Unexpected LAUNCH_RAM completion, aborting.\n");
+					mState = kUpdateAborted;
 				}
-				break;
-
-			case kDownloadMiniDriver:
-				// Initiate firmware upgrade
-				if (hciCommand(interface, &HCI_VSC_DOWNLOAD_MINIDRIVER, sizeof(HCI_VSC_DOWNLOAD_MINIDRIVER)) != kIOReturnSuccess)
+				else if (complete.status() != 0)
 				{
-					fprintf(stderr, "HCI_VSC_DOWNLOAD_MINIDRIVER failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					fprintf(stderr, "LAUNCH_RAM %u failed (status 0x%02x), aborting.\n", mDataIndex - mInFlight, complete.status());
+					mState = kUpdateAborted;
 				}
-				break;
-				
-			case kMiniDriverComplete:
-				// If this usleep is not issued, the device is not ready to receive
-				// the firmware instructions and we will deadlock due to lack of
-				// responses.
-				usleep(initialDelay * 1000);
+				else if (--mInFlight == 0)
+				{
+					// Every command the controller dropped would still be in flight, so all sent are written
+					mAcked = mDataIndex;
+				}
+			}
+			else if (complete.status() == 0)
+			{
+				mAcked++;
+			}
+			break;
+		}
+		case kTransportAborted:
+			fprintf(stderr, "Return aborted (%s)\n", transportStatusString(status));
+			mState = kUpdateAborted;
+			break;
+		case kTransportNoDevice:
+			fprintf(stderr, "No such device (%s)\n", transportStatusString(status));
+			mState = kUpdateAborted;
+			break;
+		case kTransportTimeout:
+			fprintf(stderr, "Transaction timeout (%s)\n", transportStatusString(status));
+			recover(status);
+			break;
+		case kTransportStalled:
+			fprintf(stderr, "Pipe stalled (%s)\n", transportStatusString(status));
+			mTransport.clearStall();
+			recover(status);
+			break;
+		case kTransportNotResponding:
+			fprintf(stderr, "Not responding - Delaying next read (%s)\n", transportStatusString(status));
+			mTransport.clearStall();
+			recover(status);
+			break;
+		default:
+			fprintf(stderr, "Unknown error (%s)\n", transportStatusString(status));
+			mState = kUpdateAborted;
+			break;
+	}
+}
+
+bool UpgradeContext::handleTimeout()
+{
+	uint32_t waited = mOptions.timeout;
+	
+	mStats.timeouts++;
+	
+	if (!mPending.empty())
+	{
+		RttEstimator &rtt = mRtt[rttClass(mPending.front().opcode)];
+		
+		waited = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - mPending.front().sent).count();
+		rtt.backoff();
+		
+		// The write resumes from the last checkpoint at little cost. Anything else aborts,
+		// so give the command longer first.
+		if (!resumable() && mBackoffs < kTimeoutBackoffs && waited < rtt.timeout())
+		{
+			mBackoffs++;
+			return true;
+		}
+	}
+	
+	if (!recover(kTransportTimeout))
+		fprintf(stderr, "No event from the device within %u ms, aborting.\n", waited);
+	
+	return false;
+}
+
+bool UpgradeContext::resumable() const
+{
+	bool writing = mState == kInstructionWrite || mState == kInstructionWritten || mState == kResume || mState == kVerifyRam;
+	
+	// END_OF_RECORD may have launched the firmware, there is nothing left to write it to
+	for (const PendingCommand &pending : mPending)
+	{
+		if (pending.opcode == HCI_OPCODE_END_OF_RECORD)
+			return false;
+	}
+	
+	return writing;
+}
+
+bool UpgradeContext::recover(TransportStatus status)
+{
+	bool transient = status == kTransportTimeout || status == kTransportStalled || status == kTransportNotResponding;
+	
+	if (!resumable() || !transient || mStats.resumes >= mOptions.retries)
+	{
+		mState = kUpdateAborted;
+		return false;
+	}
+	
+	mStats.resumes++;
+	mResyncSent = false;
+	mState = kResume;
+	
+	// Nothing sent so far is timed any more, stale completions must not be taken for new ones
+	mPending.clear();
+	mBackoffs = 0;
+	
+	fprintf(stderr, "Transfer error (%s), resuming firmware write at LAUNCH_RAM %u (retry %u of %u).\n", transportStatusString(status), mAcked, mStats.resumes, mOptions.retries);
+	
+	return true;
+}
+
+TransportStatus UpgradeContext::sendResync()
+{
+	mTransport.clearStall();
+	mResyncSent = true;
+	
+	// Never sent during the firmware write, so a late answer cannot be mistaken for it
+	return send(HCI_READ_LOCAL_VERSION);
+}
+
+UpgradeSession::UpgradeSession(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed) :
+	UpgradeContext(transport, image, options, feed), mReader(transport, &mCommandsSent)
+{
+}
+
+/*
+ *  Wait until the controller is ready for the next command
+ *
+ *  delay - Fixed delay (ms), also the upper bound when probing
+ *
+ *  returns false if the transport failed while waiting
+ */
+bool UpgradeSession::waitForController(int delay)
+{
+	if (mOptions.fixedDelays)
+	{
+		usleep(delay * 1000);
+		return true;
+	}
+	
+	return waitForReady(mTransport, mReader, delay, probeInterval()) != kReadyFailed;
+}
+
+// Note on the return value:
+//   return true when a response from the device is expected
+//   return false when a change of state with no expected response (loop again)
+bool UpgradeSession::advance()
+{
+	switch (mState)
+	{
+		case kPreInitialize:
+			// Reset the device to put it in a defined state.
+			mResetSent = true;
+			
+			if (send(HCI_RESET) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_RESET failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kLocalVersion:
+			// Wait for device to become ready after reset.
+			if (mResetSent && !waitForController(mOptions.postResetDelay))
+			{
+				fprintf(stderr, "Device lost after reset, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			
+			if (send(HCI_READ_LOCAL_VERSION) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_READ_LOCAL_VERSION failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kUSBProduct:
+			if (send(HCI_VSC_READ_USB_PRODUCT) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_VSC_READ_USB_PRODUCT failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kFirmwareVersion:
+			if (send(HCI_VSC_READ_VERBOSE_CONFIG) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_VSC_READ_VERBOSE_CONFIG failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+
+		case kDownloadMiniDriver:
+			// Initiate firmware upgrade
+			if (send(HCI_VSC_DOWNLOAD_MINIDRIVER) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_VSC_DOWNLOAD_MINIDRIVER failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kMiniDriverComplete:
+			// If the device is not ready to receive the firmware instructions
+			// we will deadlock due to lack of responses.
+			if (!waitForController(mOptions.initialDelay))
+			{
+				fprintf(stderr, "Device lost after mini-driver download, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			
+			// Late probe answers may still hold controller credits, the first completion reports the real number
+			mCredits = 1;
+			mCreditsSent = mCommandsSent;
+			
+			// Write first instruction(s) to trigger response
+			mState = kInstructionWrite;
+			return false;
+			
+		case kInstructionWrite:
+			if (mOptions.pipelineDepth > 0)
+			{
+				TransportStatus status = kTransportSuccess;
 				
-				// Write first instruction to trigger response
-				if (dataIndex < dataLength)
+				// Keep as many instructions in flight as the controller has credits for
+				while (mDataIndex < instructionCount(mInFlight == 0) && mInFlight < window())
 				{
-					data = (CFMutableDataRef)CFArrayGetValueAtIndex(instructions, dataIndex++);
-					bulkWrite(interface, pipeOut, (const void*)CFDataGetBytePtr(data), (UInt32)CFDataGetLength(data));
+					if ((status = writeInstruction(mDataIndex)) != kTransportSuccess)
+						break;
+					
+					mDataIndex++;
+					mInFlight++;
 				}
-				break;
 				
-			case kInstructionWrite:
-				if (dataIndex < dataLength)
+				// The firmware being loaded turned out to be invalid
+				if (mState == kUpdateAborted)
+					return false;
+				
+				if (status != kTransportSuccess)
 				{
-					data = (CFMutableDataRef)CFArrayGetValueAtIndex(instructions, dataIndex++);
-					bulkWrite(interface, pipeOut, (const void*)CFDataGetBytePtr(data), (UInt32)CFDataGetLength(data));
+					if (!recover(status))
+						fprintf(stderr, "LAUNCH_RAM write failed, aborting.\n");
+					return false;
 				}
-				else
+				
+				// Wait for completions, or for the controller to return credits
+				if (mInFlight > 0 || mDataIndex < instructionCount(false))
+					return true;
+			}
+			else if (mDataIndex < instructionCount(true))
+			{
+				TransportStatus status = writeInstruction(mDataIndex);
+				
+				if (status != kTransportSuccess)
 				{
-					// Firmware data fully written
-					if (hciCommand(interface, &HCI_VSC_END_OF_RECORD, sizeof(HCI_VSC_END_OF_RECORD)) != kIOReturnSuccess)
-					{
-						fprintf(stderr, "HCI_VSC_END_OF_RECORD failed, aborting.\n");
-						deviceState = kUpdateAborted;
-						continue;
-					}
+					if (!recover(status))
+						fprintf(stderr, "LAUNCH_RAM write failed, aborting.\n");
+					return false;
 				}
-				break;
 				
-			case kInstructionWritten:
-				deviceState = kInstructionWrite;
-				continue;
+				mDataIndex++;
+				return true;
+			}
+			
+			if (mState == kUpdateAborted)
+				return false;
+			
+			// Read the firmware back while the mini-driver still owns the RAM, END_OF_RECORD launches it
+			if (mOptions.verify && !mVerified)
+			{
+				startVerify();
+				return false;
+			}
+			
+			// Firmware data fully written
+			if (send(HCI_VSC_END_OF_RECORD) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_VSC_END_OF_RECORD failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kInstructionWritten:
+			mState = kInstructionWrite;
+			return false;
+			
+		case kResume:
+			// Still waiting for the resync to be answered
+			if (mResyncSent)
+				return true;
+			
+			// A failed read ends the event reader, start it again
+			mReader.stop();
+			mReader.start();
+			
+			{
+				TransportStatus status = sendResync();
 				
-			case kFirmwareWritten:
-				if (!useHandshake)
+				if (status != kTransportSuccess)
 				{
-					usleep(preResetDelay * 1000);
-
-					if (hciCommand(interface, &HCI_RESET, sizeof(HCI_RESET)) != kIOReturnSuccess)
-					{
-						fprintf(stderr, "HCI_RESET failed, aborting.\n");
-						deviceState = kUpdateAborted;
-						continue;
-					}
+					if (!recover(status))
+						fprintf(stderr, "Resync failed, aborting.\n");
+					return false;
+				}
+			}
+			return true;
+			
+		case kVerifyRam:
+			return sendReads();
+			
+		case kFirmwareWritten:
+			if (!mOptions.useHandshake)
+			{
+				if (!waitForController(mOptions.preResetDelay))
+				{
+					fprintf(stderr, "Device lost after firmware write, aborting.\n");
+					mState = kUpdateAborted;
+					return false;
 				}
-				break;
 
-			case kResetWrite:
-				if (hciCommand(interface, &HCI_RESET, sizeof(HCI_RESET)) != kIOReturnSuccess)
+				if (send(HCI_RESET) != kTransportSuccess)
 				{
 					fprintf(stderr, "HCI_RESET failed, aborting.\n");
-					deviceState = kUpdateAborted;
-					continue;
+					mState = kUpdateAborted;
+					return false;
 				}
-				break;
-				
-			case kResetComplete:
-				usleep(postResetDelay * 1000);
-				USBStatus status;
-				getDeviceStatus(interface, &status);
+			}
+			return true;
+
+		case kResetWrite:
+			if (send(HCI_RESET) != kTransportSuccess)
+			{
+				fprintf(stderr, "HCI_RESET failed, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			return true;
+			
+		case kResetComplete:
+			if (!waitForController(mOptions.postResetDelay))
+			{
+				fprintf(stderr, "Device lost after reset, aborting.\n");
+				mState = kUpdateAborted;
+				return false;
+			}
+			
+			uint16_t status;
+			mTransport.getDeviceStatus(&status);
 #ifdef DEBUG
-				printf("Reset Complete (0x%08x)\n", status);
+			printf("Reset Complete (0x%08x)\n", status);
 #endif
-				printf("Done.\n");
-				deviceState = kUpdateComplete;
-				continue;
-				
-			case kUnknown:
-			case kUpdateNotNeeded:
-			case kUpdateComplete:
-			case kUpdateAborted:
-				fprintf(stderr, "Error: kUnkown/kUpdateComplete/kUpdateAborted cases should be unreachable.\n");
-				break;
-		}
+			printf("Done.\n");
+			mState = kUpdateComplete;
+			return false;
+			
+		case kUnknown:
+		case kUpdateNotNeeded:
+		case kUpdateComplete:
+		case kUpdateAborted:
+			fprintf(stderr, "Error: kUnkown/kUpdateComplete/kUpdateAborted cases should be unreachable.\n");
+			return true;
+	}
+	
+	return true;
+}
+
+// Next event from the reader thread, skipping late answers to readiness probes
+const HciEvent *UpgradeSession::nextEvent()
+{
+	const HciEvent *event = mReader.next(eventTimeout());
+	
+	while (event && isProbeEvent(event))
+	{
+		mReader.release();
+		event = mReader.next(eventTimeout());
+	}
+	
+	return event;
+}
+
+bool UpgradeSession::run()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	
+	mTransport.setTimeout(mOptions.timeout);
+	
+	// Post the first event read before anything is sent
+	mReader.start();
+	
+	while (true)
+	{
+		noteState();
 		
-		// Read pipe
-		memset(buffer, 0, BUFFER_SIZE);
-		length = BUFFER_SIZE-1;
-		IOReturn status = (*interface)->ReadPipe(interface, pipeIn, buffer, &length);
+		// Break out when done
+		if (mState == kUpdateAborted || mState == kUpdateComplete || mState == kUpdateNotNeeded)
+			break;
+		
+		if (!advance())
+			continue;
+		
+		const HciEvent *event = nextEvent();
+		
+		// Past the deadline: wait longer, resume the firmware write or give up
+		while (event == NULL && mReader.running() && handleTimeout())
+			event = nextEvent();
+		
+		if (event == NULL && mReader.running())
+			continue;
+		
+		handleEvent(event);
+		
+		if (event)
+			mReader.release();
 		
-		switch (status)
+		// Apply completions that queued up meanwhile before sending more
+		while (event && drainsEvents() && (event = mReader.poll()) != NULL)
 		{
-			case kIOReturnSuccess:
-				hciParseResponse(interface, buffer, length, useHandshake, NULL, NULL, &deviceState);
-				break;
-			case kIOReturnAborted:
-				fprintf(stderr, "Return aborted (0x%08x)\n", status);
-				deviceState = kUpdateAborted;
-				break;
-			case kIOReturnNoDevice:
-				fprintf(stderr, "No such device (0x%08x)\n", status);
-				deviceState = kUpdateAborted;
-				break;
-			case kIOUSBTransactionTimeout:
-				fprintf(stderr, "Transaction timeout (0x%08x)\n", status);
-				break;
-			case kIOUSBPipeStalled:
-				fprintf(stderr, "Pipe stalled (0x%08x)\n", status);
-				(*interface)->ClearPipeStall(interface, pipeIn);
-				deviceState = kUpdateAborted;
-				break;
-			case kIOReturnNotResponding:
-				fprintf(stderr, "Not responding - Delaying next read (0x%08x)\n", status);
-				(*interface)->ClearPipeStall(interface, pipeIn);
-				deviceState = kUpdateAborted;
-				break;
-			default:
-				fprintf(stderr, "Unknown error (0x%08x)\n", status);
-				deviceState = kUpdateAborted;
-				break;
+			if (!isProbeEvent(event))
+				handleEvent(event);
+			mReader.release();
 		}
 	}
 	
-	(*interface)->AbortPipe(interface, pipeIn);
-	(*interface)->AbortPipe(interface, pipeOut);
+	mReader.stop();
+	mTransport.abort();
+	
+	mStats.elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 	
-	return deviceState == kUpdateComplete || deviceState == kUpdateNotNeeded;
+	return mState == kUpdateComplete || mState == kUpdateNotNeeded;
 }
@@ -20,7 +20,19 @@
 #ifndef hci_h
 #define hci_h
 
-#include <IOKit/usb/IOUSBLib.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include "firmware_image.h"
+#include "hci_codec.h"
+#include "hci_transport.h"
+#include "event_reader.h"
+#include "ram_image.h"
+#include "rtt_estimator.h"
+
+class FirmwareFeed;
 
 enum DeviceState
 {
@@ -39,14 +51,22 @@ enum DeviceState
 	kUpdateComplete,
 	kUpdateNotNeeded,
 	kUpdateAborted,
+	kResume,			// Resynchronizing after a transient error during the firmware write
+	kVerifyRam,			// Reading the firmware back before END_OF_RECORD
 };
 
 typedef struct DeviceHskSupport
 {
-	UInt16 vid;
-	UInt16 pid;
+	uint16_t vid;
+	uint16_t pid;
 } DeviceHskSupport;
 
+typedef struct DeviceQuirk
+{
+	uint16_t vid;
+	uint16_t pid;
+} DeviceQuirk;
+
 typedef enum
 {
 	HCI_COMMAND = 0x01,
@@ -55,105 +75,254 @@ typedef enum
 	HCI_EVENT   = 0x04
 } HCI_PACKET_TYPE;
 
-typedef enum
-{
-	HCI_EVENT_CONN_COMPLETE = 0x03,
-	HCI_EVENT_DISCONN_COMPLETE = 0x05,
-	HCI_EVENT_COMMAND_COMPLETE = 0x0e,
-	HCI_EVENT_HARDWARE_ERROR = 0x10,
-	HCI_EVENT_NUM_COMPLETED_PACKETS = 0x13,
-	HCI_EVENT_MODE_CHANGE = 0x14,
-	HCI_EVENT_LE_META = 0x3e,
-	HCI_EVENT_VENDOR = 0xff
-} HCI_EVENT_TYPE;
-
-typedef struct __attribute__((packed))
-{
-	union
-	{
-		uint16_t opcode;
-		struct
-		{
-			uint16_t ocf: 10;
-			uint16_t ogf: 6;
-		} op;
-	};
-	unsigned char length;
-} HCI_PACKET;
+// HCI commands are sent as-is, they are never modified
+
+// Standard HCI commands
+constexpr HciCommand<0> HCI_READ_LOCAL_VERSION(HCI_OPCODE_READ_LOCAL_VERSION);
+constexpr HciCommand<0> HCI_READ_LOCAL_COMMANDS(HCI_OPCODE_READ_LOCAL_COMMANDS);
+constexpr HciCommand<0> HCI_READ_FEATURES(HCI_OPCODE_READ_FEATURES);
+constexpr HciCommand<0> HCI_READ_LOCAL_FEATURES(HCI_OPCODE_READ_LOCAL_FEATURES);
+constexpr HciCommand<0> HCI_READ_LOCAL_NAME(HCI_OPCODE_READ_LOCAL_NAME);
+constexpr HciCommand<0> HCI_RESET(HCI_OPCODE_RESET);
+
+// Broadcom vendor specific commands
+
+// Vendor Specific: Read chip-id and other Broadcom specific configuration variables
+constexpr HciCommand<0> HCI_VSC_READ_VERBOSE_CONFIG(HCI_OPCODE_READ_VERBOSE_CONFIG);
+
+// Vendor Specific: Read controller features
+constexpr HciCommand<0> HCI_VSC_READ_CONTROLLER_FEATURES(HCI_OPCODE_READ_CONTROLLER_FEATURES);
+
+// Vendor Specific: Read USB product
+constexpr HciCommand<0> HCI_VSC_READ_USB_PRODUCT(HCI_OPCODE_READ_USB_PRODUCT);
 
-typedef struct __attribute__((packed))
+// Vendor Specific: Download mini driver
+constexpr HciCommand<0> HCI_VSC_DOWNLOAD_MINIDRIVER(HCI_OPCODE_DOWNLOAD_MINIDRIVER);
+
+// Vendor Specific: End of Record
+constexpr HciCommand<4> HCI_VSC_END_OF_RECORD = HciCommand<4>(HCI_OPCODE_END_OF_RECORD).put32<0>(0xffffffff);
+
+// Vendor Specific: Wake up
+constexpr HciCommand<1> HCI_VSC_WAKEUP = HciCommand<1>(HCI_OPCODE_WAKEUP).put8<0>(0x13);
+
+// Requests with their own round trip estimate, see UpgradeContext::eventTimeout()
+enum RttClass
 {
-	unsigned char eventCode;
-	unsigned char length;
-} HCI_RESPONSE;
+	kRttControl,		// Control transfer of a command
+	kRttBulk,			// Bulk transfer of a firmware command
+	kRttCommand,		// Query (and the resync) until its Command Complete
+	kRttLaunchRam,		// Firmware command until its Command Complete
+	kRttReadRam,		// Verification read until its Command Complete
+	kRttBoot,			// RESET, DOWNLOAD_MINIDRIVER and END_OF_RECORD, never sampled so always the ceiling
+	kRttClassCount,
+};
+
+RttClass rttClass(uint16_t opcode);
+
+bool supportsHandshake(uint16_t vid, uint16_t pid);
+bool needsFixedDelays(uint16_t vid, uint16_t pid);
 
-struct __attribute__((packed)) HCI_COMMAND_COMPLETE: HCI_RESPONSE
+// Broadcom chip of an LMP subversion (e.g. BCM20702A1), NULL if unknown
+const char *chipName(uint16_t lmpSubversion);
+
+// LMP subversion of a chip name of length characters, 0 if unknown
+uint16_t chipSubversion(const char *name, size_t length);
+
+struct UpgradeOptions
 {
-	unsigned char numCommands;
-	union
-	{
-		uint16_t opcode;
-		struct
-		{
-			uint16_t ocf: 10;
-			uint16_t ogf: 6;
-		} op;
-	};
-	unsigned char status;
+	int initialDelay = 100;				// After the mini-driver download (ms)
+	int preResetDelay = 250;			// Before the final reset without handshake (ms)
+	int postResetDelay = 100;			// After a reset (ms)
+	bool useHandshake = false;
+	bool fixedDelays = false;
+	int pipelineDepth = 0;				// LAUNCH_RAM commands in flight, 0 waits for each
+	bool skipCurrent = false;			// Stop before the download if the controller already runs the image's version
+	bool initialReset = true;			// Reset before reading the controller version, otherwise only reset if a download is needed
+	uint32_t timeout = HCI_TIMEOUT;		// Ceiling of the adaptive timeouts, used until a request class is measured (ms)
+	uint32_t timeoutFloor = HCI_TIMEOUT_FLOOR;	// Floor of the adaptive timeouts (ms)
+	uint32_t retries = 3;				// Firmware write resumes after transient transfer errors
+	bool verify = false;				// Read the RAM back and compare it with the firmware before END_OF_RECORD
+
+	// Picks and starts loading the firmware once the controller's version is known, before
+	// anything is compared or written. Returns false if there is none for the controller.
+	std::function<bool(const FirmwareVersion &device)> selectFirmware;
 };
 
-struct __attribute__((packed)) HCI_RP_READ_LOCAL_VERSION
+struct UpgradeStats
 {
-	uint8_t status;
-	uint8_t hci_ver;
-	uint16_t hci_rev;
-	uint8_t lmp_ver;
-	uint16_t manufacturer;
-	uint16_t lmp_subver;
+	uint32_t commands;					// HCI commands on the control endpoint
+	uint32_t instructions;				// Firmware commands on the bulk endpoint
+	uint64_t instructionBytes;
+	uint32_t events;
+	uint32_t resumes;					// Firmware write resumed from the last acknowledged LAUNCH_RAM
+	uint32_t timeouts;					// Expired deadlines, transfers and events
+	double commandRtt;					// Smoothed round trips (ms), see RttEstimator
+	double launchRamRtt;
+	uint32_t launchRamTimeout;			// Last deadline of a firmware command (ms)
+	uint32_t verifyReads;				// HCI_VSC_READ_RAM commands of the last verification
+	uint64_t verifyBytes;
+	double verifyElapsed;				// ms
+	double firmwareWait;				// Waiting for a firmware still being loaded to be parsed (ms)
+	double firstInstruction;			// First LAUNCH_RAM sent, since the upgrade started (ms)
+	uint32_t transitions;				// State changes, see UpgradeContext::noteState()
+	uint64_t transitionHash;			// hashBytes() over the states in the order they were entered
+	double elapsed;						// ms
 };
 
-#define HCI_OPCODE_RESET 0x0c03
-#define HCI_OPCODE_READ_VERBOSE_CONFIG 0xfc79
-#define HCI_OPCODE_READ_CONTROLLER_FEATURES 0xfc6e
-#define HCI_OPCODE_READ_USB_PRODUCT 0xfc5a
-#define HCI_OPCODE_READ_LOCAL_NAME 0x0c14
-#define HCI_OPCODE_READ_LOCAL_VERSION 0x1001
-#define HCI_OPCODE_DOWNLOAD_MINIDRIVER 0xfc2e
-#define HCI_OPCODE_LAUNCH_RAM 0xfc4c
-#define HCI_OPCODE_END_OF_RECORD 0xfc4e
-#define HCI_OPCODE_WAKEUP 0xfc53
+/*
+ *  State of one device upgrade, whatever drives it
+ *
+ *  Holds the state machine position, pipelining credits and statistics and
+ *  turns HCI events into state changes, so the threaded UpgradeSession and
+ *  the coroutines of UpgradeEngine go through exactly the same transitions.
+ */
+class UpgradeContext
+{
+public:
+	DeviceState state() const { return mState; }
+	const UpgradeStats &stats() const { return mStats; }
 
-// Standard HCI commands
-extern uint8_t HCI_READ_LOCAL_VERSION[3];
-extern uint8_t HCI_READ_LOCAL_COMMANDS[3];
-extern uint8_t HCI_READ_FEATURES[3];
-extern uint8_t HCI_READ_LOCAL_FEATURES[3];
-extern uint8_t HCI_READ_LOCAL_NAME[3];
-extern uint8_t HCI_RESET[3];
+protected:
+	// With a feed the image is still being loaded into, see FirmwareFeed
+	UpgradeContext(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed);
 
-// Broadcom vendor specific commands
+	// Apply an event (NULL when the reader has stopped) to the state machine
+	void handleEvent(const HciEvent *event);
 
-// Vendor Specific: Read chip-id and other Broadcom specific configuration variables
-extern uint8_t HCI_VSC_READ_VERBOSE_CONFIG[3];
+	// No event arrived within eventTimeout(). Returns true to wait again for the same
+	// event, otherwise the write goes to kResume or the upgrade is aborted.
+	bool handleTimeout();
 
-extern uint8_t HCI_VSC_READ_CONTROLLER_FEATURES[3];
+	// Time left until the oldest command still awaiting its completion is overdue (ms, at
+	// least 1). Without such a command, e.g. for the vendor event, the ceiling.
+	uint32_t eventTimeout() const;
 
-extern uint8_t HCI_VSC_READ_USB_PRODUCT[3];
+	// First wait for a readiness probe answer (ms), the command round trip once measured
+	uint32_t probeInterval() const;
 
-// Vendor Specific: Download mini driver
-extern uint8_t HCI_VSC_DOWNLOAD_MINIDRIVER[3];
+	// True while the firmware is being written or verified and END_OF_RECORD is not outstanding
+	bool resumable() const;
 
-// Vendor Specific: End of Record
-extern uint8_t HCI_VSC_END_OF_RECORD[7];
+	// Transient transfer error: within the retry budget the firmware write goes to kResume
+	// and restarts from mAcked once resynchronized, otherwise the upgrade is aborted.
+	// Returns true if the write will be resumed.
+	bool recover(TransportStatus status);
 
-// Vendor Specific: Wake up
-extern uint8_t HCI_VSC_WAKEUP[4];
-
-bool supportsHandshake(UInt16 vid, UInt16 pid);
-IOReturn findInterfaces(IOUSBDeviceInterface300 **device);
-int findPipe(IOUSBInterfaceInterface300** interface, UInt8 type, UInt8 direction);
-IOReturn hciCommand(IOUSBInterfaceInterface300** interface, void* command, UInt16 length);
-IOReturn getDeviceStatus(IOUSBInterfaceInterface300** interface, USBStatus *status);
-bool performUpgrade(IOUSBInterfaceInterface300** interface, CFMutableArrayRef instructions, int initialDelay, int preResetDelay, int postResetDelay, bool useHandshake);
+	// Clear the error and send the resync command, its completion ends kResume.
+	// The caller restarts its event source first.
+	TransportStatus sendResync();
+
+	// Called once READ_VERBOSE_CONFIG moved on to kDownloadMiniDriver: select the firmware
+	// (once, see UpgradeOptions::selectFirmware), stop if the controller is current, or go
+	// back for the reset that was skipped
+	void checkVersion();
+
+	// Enter kVerifyRam with the reads of the whole image still to send
+	void startVerify();
+
+	// Send reads while the controller has credits, and leave kVerifyRam once all of them
+	// have been checked. Returns true while completions are outstanding.
+	bool sendReads();
+
+	// Commands that may await their completion at once: those in flight plus the additional
+	// ones the last completion allowed, bounded by the pipeline depth. Commands still in flight
+	// that were sent after the read of that completion was posted may not have been counted
+	// by the controller yet, so each of them uses up one of its credits.
+	uint32_t window() const;
+
+	// True while pipelined completions may queue up behind the one just handled. Those are
+	// applied before anything is sent, so the window comes from the newest completion read
+	// rather than from one that waited in the event ring behind it.
+	bool drainsEvents() const;
+
+	// Record the current state in the statistics when it changed. Written
+	// is skipped so LAUNCH_RAM counts as one state for the whole upload.
+	void noteState();
+
+	TransportStatus send(const uint8_t *command, uint16_t length);
+	template <uint8_t ParamSize>
+	TransportStatus send(const HciCommand<ParamSize> &command) { return send(command.data(), command.size()); }
+	TransportStatus writeInstruction(uint32_t index);
+
+	// Firmware commands that can be written: the whole image, or while it is still being
+	// loaded the ones parsed so far. With wait, blocks until the one at mDataIndex is parsed.
+	// A firmware that turns out to be invalid aborts the upgrade and ends the write at mDataIndex.
+	uint32_t instructionCount(bool wait);
+
+	// Sample the transfer and start timing the command's round trip
+	void transferred(RttClass transfer, const uint8_t *command, std::chrono::steady_clock::time_point start, TransportStatus status);
+
+	// Sample the round trip of the oldest pending command if the completion is for it
+	void completed(uint16_t opcode);
+
+	HciTransport &mTransport;
+	const FirmwareImage &mImage;
+	FirmwareFeed *mFeed;				// NULL once the image is complete
+	uint32_t mFeedCount;				// Commands the feed had parsed when last asked
+	uint8_t mInstruction[HCI_COMMAND_HEADER_SIZE + 0xFF];	// Copy of a command from the feed
+	UpgradeOptions mOptions;
+	DeviceState mState;
+	DeviceState mNotedState;
+	FirmwareVersion mDevice;			// As reported by the controller
+	bool mResetSent;					// The initial HCI_RESET has been sent
+	bool mFirmwareSelected;
+	uint32_t mDataIndex;
+	// LAUNCH_RAM commands known to be written, the resume checkpoint. Pipelined completions are
+	// matched to commands by count and one the controller dropped shifts the later ones, so only
+	// the commands sent by the time none is left in flight are known, every kCheckpointInterval.
+	uint32_t mAcked;
+	bool mResyncSent;
+	// Pipelining: command credits of the last completion, the commands sent when its read was
+	// posted, every command sent so far (read by the event reader), and LAUNCH_RAM commands
+	// awaiting completion
+	uint32_t mCredits;
+	uint32_t mCreditsSent;
+	std::atomic<uint32_t> mCommandsSent;
+	uint32_t mInFlight;
+	// Verification reads awaiting completion, and whether the RAM was found to match
+	RamVerifier mVerifier;
+	uint32_t mReadsInFlight;
+	bool mVerifyMismatch;				// A completion did not match its chunk, reported once the others are in
+	bool mVerified;
+	std::chrono::steady_clock::time_point mVerifyStart;
+	// Adaptive timeouts: commands awaiting their completion, oldest first
+	struct PendingCommand
+	{
+		uint16_t opcode;
+		std::chrono::steady_clock::time_point sent;
+	};
+	std::deque<PendingCommand> mPending;
+	RttEstimator mRtt[kRttClassCount];
+	uint32_t mBackoffs;					// Longer deadlines the oldest pending command has been given
+	UpgradeStats mStats;
+	std::chrono::steady_clock::time_point mStarted;
+
+private:
+	UpgradeContext(const UpgradeContext &);
+	UpgradeContext &operator=(const UpgradeContext &);
+};
+
+/*
+ *  A single firmware upgrade of one device
+ *
+ *  The session owns everything the upgrade needs (event reader, state,
+ *  pipelining credits and statistics) so any number of sessions can run
+ *  in one process, each on its own thread.
+ */
+class UpgradeSession : public UpgradeContext
+{
+public:
+	UpgradeSession(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed = NULL);
+
+	// Run the upgrade to completion, returns true if the device was upgraded (or did not need it)
+	bool run();
+
+private:
+	bool advance();
+	bool waitForController(int delay);
+	const HciEvent *nextEvent();
+
+	EventReader mReader;
+};
 
 #endif
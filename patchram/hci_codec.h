@@ -0,0 +1,255 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef hci_codec_h
+#define hci_codec_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "firmware_image.h"
+
+typedef enum
+{
+	HCI_EVENT_CONN_COMPLETE = 0x03,
+	HCI_EVENT_DISCONN_COMPLETE = 0x05,
+	HCI_EVENT_COMMAND_COMPLETE = 0x0e,
+	HCI_EVENT_HARDWARE_ERROR = 0x10,
+	HCI_EVENT_NUM_COMPLETED_PACKETS = 0x13,
+	HCI_EVENT_MODE_CHANGE = 0x14,
+	HCI_EVENT_LE_META = 0x3e,
+	HCI_EVENT_VENDOR = 0xff
+} HCI_EVENT_TYPE;
+
+#define HCI_OPCODE_RESET 0x0c03
+#define HCI_OPCODE_READ_LOCAL_NAME 0x0c14
+#define HCI_OPCODE_READ_LOCAL_VERSION 0x1001
+#define HCI_OPCODE_READ_LOCAL_COMMANDS 0x1002
+#define HCI_OPCODE_READ_FEATURES 0x1003
+#define HCI_OPCODE_READ_LOCAL_FEATURES 0x1004
+#define HCI_OPCODE_DOWNLOAD_MINIDRIVER 0xfc2e
+#define HCI_OPCODE_LAUNCH_RAM 0xfc4c
+#define HCI_OPCODE_READ_RAM 0xfc4d
+#define HCI_OPCODE_END_OF_RECORD 0xfc4e
+#define HCI_OPCODE_WAKEUP 0xfc53
+#define HCI_OPCODE_READ_USB_PRODUCT 0xfc5a
+#define HCI_OPCODE_READ_CONTROLLER_FEATURES 0xfc6e
+#define HCI_OPCODE_READ_VERBOSE_CONFIG 0xfc79
+
+// Event code (1) + parameter length (1)
+#define HCI_EVENT_HEADER_SIZE 2
+
+// Event header + numCommands (1) + opcode (2) + status (1), the return parameters follow
+#define HCI_COMMAND_COMPLETE_SIZE 6
+
+// Little endian fields, byte by byte so any alignment is fine
+constexpr uint16_t hciGet16(const uint8_t *data)
+{
+	return (uint16_t)(data[0] | data[1] << 8);
+}
+
+constexpr uint32_t hciGet32(const uint8_t *data)
+{
+	return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+constexpr void hciPut16(uint8_t *data, uint16_t value)
+{
+	data[0] = value & 0xFF;
+	data[1] = value >> 8;
+}
+
+constexpr void hciPut32(uint8_t *data, uint32_t value)
+{
+	data[0] = value & 0xFF;
+	data[1] = (value >> 8) & 0xFF;
+	data[2] = (value >> 16) & 0xFF;
+	data[3] = value >> 24;
+}
+
+/*
+ *  HCI command with ParamSize parameter bytes
+ *
+ *  Header and parameters are one array of the exact size, sent as it is.
+ *  Parameter offsets are template arguments, so writing past the end of the
+ *  command does not compile. Commands without variable parameters are built
+ *  at compile time.
+ */
+template <uint8_t ParamSize>
+class HciCommand
+{
+public:
+	static constexpr uint8_t kParamSize = ParamSize;
+
+	constexpr explicit HciCommand(uint16_t opcode) : mData { (uint8_t)(opcode & 0xFF), (uint8_t)(opcode >> 8), ParamSize }
+	{
+	}
+
+	template <uint8_t Offset>
+	constexpr HciCommand &put8(uint8_t value)
+	{
+		static_assert(Offset + 1 <= ParamSize, "Parameter past the end of the command");
+		mData[HCI_COMMAND_HEADER_SIZE + Offset] = value;
+		return *this;
+	}
+
+	template <uint8_t Offset>
+	constexpr HciCommand &put16(uint16_t value)
+	{
+		static_assert(Offset + 2 <= ParamSize, "Parameter past the end of the command");
+		hciPut16(mData + HCI_COMMAND_HEADER_SIZE + Offset, value);
+		return *this;
+	}
+
+	template <uint8_t Offset>
+	constexpr HciCommand &put32(uint32_t value)
+	{
+		static_assert(Offset + 4 <= ParamSize, "Parameter past the end of the command");
+		hciPut32(mData + HCI_COMMAND_HEADER_SIZE + Offset, value);
+		return *this;
+	}
+
+	constexpr uint16_t opcode() const { return hciGet16(mData); }
+	constexpr const uint8_t *data() const { return mData; }
+	static constexpr uint16_t size() { return HCI_COMMAND_HEADER_SIZE + ParamSize; }
+
+private:
+	uint8_t mData[HCI_COMMAND_HEADER_SIZE + ParamSize];
+};
+
+// HCI_VSC_READ_RAM: address (4) + length (1)
+typedef HciCommand<5> HciReadRamCommand;
+
+constexpr HciReadRamCommand hciReadRam(uint32_t address, uint8_t length)
+{
+	return HciReadRamCommand(HCI_OPCODE_READ_RAM).put32<0>(address).put8<4>(length);
+}
+
+/*
+ *  Received HCI event
+ *
+ *  A view over the receive buffer, nothing is copied. Fields are read byte
+ *  by byte at their offset into the event and read as 0 past its end, so a
+ *  short event can never be read beyond the bytes that were received.
+ */
+class HciEventView
+{
+public:
+	HciEventView(const uint8_t *data, uint32_t length) : mData(data), mLength(length) {}
+
+	// The header is complete and so are the parameters it announces
+	bool valid() const { return mLength >= HCI_EVENT_HEADER_SIZE && mLength >= HCI_EVENT_HEADER_SIZE + (uint32_t)mData[1]; }
+
+	uint8_t code() const { return get8(0); }
+	uint8_t parameterLength() const { return get8(1); }
+
+	const uint8_t *data() const { return mData; }
+	uint32_t length() const { return mLength; }
+
+protected:
+	uint8_t get8(uint32_t offset) const { return offset < mLength ? mData[offset] : 0; }
+	uint16_t get16(uint32_t offset) const { return offset + 2 <= mLength ? hciGet16(mData + offset) : 0; }
+	uint32_t get32(uint32_t offset) const { return offset + 4 <= mLength ? hciGet32(mData + offset) : 0; }
+
+	const uint8_t *mData;
+	uint32_t mLength;
+};
+
+class HciCommandCompleteView : public HciEventView
+{
+public:
+	HciCommandCompleteView(const uint8_t *data, uint32_t length) : HciEventView(data, length) {}
+
+	bool valid() const { return HciEventView::valid() && code() == HCI_EVENT_COMMAND_COMPLETE && mLength >= HCI_COMMAND_COMPLETE_SIZE; }
+
+	uint8_t numCommands() const { return get8(2); }
+	uint16_t opcode() const { return get16(3); }
+	uint8_t status() const { return get8(5); }
+
+	// Return parameters after the status
+	const uint8_t *returnData() const { return mData + HCI_COMMAND_COMPLETE_SIZE; }
+	uint32_t returnLength() const { return mLength > HCI_COMMAND_COMPLETE_SIZE ? mLength - HCI_COMMAND_COMPLETE_SIZE : 0; }
+};
+
+/*
+ *  Command Complete of one command with ReturnSize bytes of return parameters
+ *
+ *  valid() checks the opcode and that all of the return parameters are there.
+ *  Field offsets into the return parameters are template arguments checked
+ *  against ReturnSize at compile time.
+ */
+template <uint16_t Opcode, uint32_t ReturnSize>
+class HciReturnView : public HciCommandCompleteView
+{
+public:
+	static constexpr uint16_t kOpcode = Opcode;
+	static constexpr uint32_t kReturnSize = ReturnSize;
+
+	explicit HciReturnView(const HciCommandCompleteView &complete) : HciCommandCompleteView(complete) {}
+
+	bool valid() const { return HciCommandCompleteView::valid() && opcode() == Opcode && returnLength() >= ReturnSize; }
+
+protected:
+	template <uint32_t Offset>
+	uint8_t field8() const
+	{
+		static_assert(Offset + 1 <= ReturnSize, "Field past the end of the return parameters");
+		return get8(HCI_COMMAND_COMPLETE_SIZE + Offset);
+	}
+
+	template <uint32_t Offset>
+	uint16_t field16() const
+	{
+		static_assert(Offset + 2 <= ReturnSize, "Field past the end of the return parameters");
+		return get16(HCI_COMMAND_COMPLETE_SIZE + Offset);
+	}
+};
+
+// HCI_READ_LOCAL_VERSION: hci_ver (1), hci_rev (2), lmp_ver (1), manufacturer (2), lmp_subver (2)
+class HciLocalVersionView : public HciReturnView<HCI_OPCODE_READ_LOCAL_VERSION, 8>
+{
+public:
+	using HciReturnView::HciReturnView;
+
+	uint8_t hciVersion() const { return field8<0>(); }
+	uint16_t hciRevision() const { return field16<1>(); }
+	uint8_t lmpVersion() const { return field8<3>(); }
+	uint16_t manufacturer() const { return field16<4>(); }
+	uint16_t lmpSubversion() const { return field16<6>(); }
+};
+
+// HCI_VSC_READ_USB_PRODUCT: vendor id (2), product id (2)
+class HciUsbProductView : public HciReturnView<HCI_OPCODE_READ_USB_PRODUCT, 4>
+{
+public:
+	using HciReturnView::HciReturnView;
+
+	uint16_t vendorId() const { return field16<0>(); }
+	uint16_t productId() const { return field16<2>(); }
+};
+
+// HCI_VSC_READ_VERBOSE_CONFIG: chipset id (1), 3 bytes, build (2)
+class HciVerboseConfigView : public HciReturnView<HCI_OPCODE_READ_VERBOSE_CONFIG, 6>
+{
+public:
+	using HciReturnView::HciReturnView;
+
+	uint8_t chipsetId() const { return field8<0>(); }
+	uint16_t build() const { return field16<4>(); }
+};
+
+#endif
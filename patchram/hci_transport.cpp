@@ -0,0 +1,76 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "hci_transport.h"
+
+#ifdef PATCHRAM_USE_LIBUSB
+#include "transport_libusb.h"
+#else
+#include "transport_iokit.h"
+#endif
+
+const char *transportStatusString(TransportStatus status)
+{
+	switch (status)
+	{
+		case kTransportSuccess:
+			return "Success";
+		case kTransportTimeout:
+			return "Transaction timed out";
+		case kTransportStalled:
+			return "Pipe has stalled, error needs to be cleared";
+		case kTransportNotResponding:
+			return "Device not responding";
+		case kTransportNoDevice:
+			return "No such device";
+		case kTransportAborted:
+			return "Transaction aborted";
+		case kTransportError:
+			break;
+	}
+
+	return "Transport error";
+}
+
+HciTransport *openUsbTransport(uint16_t vendorId, uint16_t productId)
+{
+#ifdef PATCHRAM_USE_LIBUSB
+	return LibusbTransport::open(vendorId, productId);
+#else
+	return IOKitTransport::open(vendorId, productId);
+#endif
+}
+
+size_t openUsbTransports(uint16_t vendorId, uint16_t productId, std::vector<std::unique_ptr<HciTransport>> &transports)
+{
+#ifdef PATCHRAM_USE_LIBUSB
+	return LibusbTransport::openAll(vendorId, productId, transports);
+#else
+	return IOKitTransport::openAll(vendorId, productId, transports);
+#endif
+}
+
+bool watchUsbTransports(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler)
+{
+#ifdef PATCHRAM_USE_LIBUSB
+	return LibusbTransport::watch(matches, stop, handler);
+#else
+	return IOKitTransport::watch(matches, stop, handler);
+#endif
+}
@@ -0,0 +1,129 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef hci_transport_h
+#define hci_transport_h
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// IOKit is used on macOS, libusb-1.0 everywhere else (or when requested)
+#if !defined(__APPLE__) && !defined(PATCHRAM_USE_LIBUSB)
+#define PATCHRAM_USE_LIBUSB 1
+#endif
+
+// Default timeout for commands and data (ms), the ceiling of the adaptive timeouts
+#define HCI_TIMEOUT 5000
+
+// Default floor of the adaptive timeouts (ms)
+#define HCI_TIMEOUT_FLOOR 50
+
+// Longest a hotplug watcher goes without checking its stop flag (ms)
+#define HOTPLUG_POLL_INTERVAL 250
+
+enum TransportStatus
+{
+	kTransportSuccess,
+	kTransportTimeout,
+	kTransportStalled,
+	kTransportNotResponding,
+	kTransportNoDevice,
+	kTransportAborted,
+	kTransportError,
+};
+
+// Completion of readEventAsync, length is the number of bytes read
+typedef std::function<void(TransportStatus status, uint32_t length)> EventCallback;
+
+/*
+ *  USB transport for a Bluetooth HCI controller
+ *
+ *  Commands go out on the control endpoint, firmware data on bulk out and
+ *  events come back on the interrupt in endpoint. Timeouts are in ms.
+ */
+class HciTransport
+{
+public:
+	virtual ~HciTransport() {}
+
+	// HCI command out (control endpoint, class request)
+	virtual TransportStatus sendCommand(const void *command, uint16_t length) = 0;
+
+	// Bulk out
+	virtual TransportStatus bulkWrite(const void *data, uint32_t length) = 0;
+
+	// Interrupt in, length is the buffer size on input and bytes read on output.
+	// A timeout of 0 waits indefinitely.
+	virtual TransportStatus readEvent(void *buffer, uint32_t *length, uint32_t timeout) = 0;
+
+	// USB GET_STATUS of the device
+	virtual TransportStatus getDeviceStatus(uint16_t *status) = 0;
+
+	// Clear a stall on the event pipe
+	virtual void clearStall() = 0;
+
+	// Cancel outstanding transfers
+	virtual void abort() = 0;
+
+	// USB location (bus in the top byte, then one nibble per port), 0 if unknown
+	virtual uint32_t location() const { return 0; }
+
+	// Timeout for sendCommand, bulkWrite and getDeviceStatus (ms)
+	virtual void setTimeout(uint32_t timeout) { (void)timeout; }
+
+	// Interrupt in without blocking: callback runs once, on a backend thread, when
+	// the read completes or is aborted. Returns false if only readEvent is supported.
+	virtual bool readEventAsync(void *buffer, uint32_t length, const EventCallback &callback) { (void)buffer; (void)length; (void)callback; return false; }
+};
+
+const char *transportStatusString(TransportStatus status);
+
+// Open the first device matching vendorId/productId with the platform backend
+HciTransport *openUsbTransport(uint16_t vendorId, uint16_t productId);
+
+// Open every device matching vendorId/productId, returns the number added to transports
+size_t openUsbTransports(uint16_t vendorId, uint16_t productId, std::vector<std::unique_ptr<HciTransport>> &transports);
+
+struct HotplugMatch
+{
+	uint16_t vendorId;
+	uint16_t productId;
+};
+
+// Takes ownership of the transport opened for an arriving device
+typedef std::function<void(std::unique_ptr<HciTransport> transport, uint16_t vendorId, uint16_t productId)> HotplugHandler;
+
+/*
+ *  Watch for USB devices with the platform backend
+ *
+ *  Devices already attached are reported first, then every matching device
+ *  is opened as it enumerates and passed to handler on the calling thread.
+ *
+ *  matches - Vendor/product ids to watch for
+ *  stop    - Checked at least every HOTPLUG_POLL_INTERVAL ms, returns once set
+ *  handler - Receives each opened transport
+ *
+ *  returns false if hotplug notifications could not be set up
+ */
+bool watchUsbTransports(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler);
+
+#endif
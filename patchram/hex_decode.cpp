@@ -0,0 +1,218 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "hex_decode.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HEX_DECODE_X86 1
+#include <immintrin.h>
+#endif
+
+// Convert a single hex character, returns 0xFF when invalid
+static inline uint8_t hexValue(uint8_t hex)
+{
+	if (hex >= '0' && hex <= '9')
+		return hex - '0';
+
+	hex |= 0x20;
+
+	if (hex >= 'a' && hex <= 'f')
+		return 0x0A + (hex - 'a');
+
+	return 0xFF;
+}
+
+bool hexDecodeScalar(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum)
+{
+	uint32_t total = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		uint8_t high = hexValue(hex[i * 2]);
+		uint8_t low = hexValue(hex[i * 2 + 1]);
+
+		if ((high | low) & 0xF0)
+			return false;
+
+		output[i] = high << 4 | low;
+		total += output[i];
+	}
+
+	if (sum)
+		*sum = total;
+
+	return true;
+}
+
+#ifdef HEX_DECODE_X86
+
+/*
+ *  Each character becomes a nibble of (c & 0x0F) plus 9 for letters, with
+ *  validity checked as '0' <= c <= '9' or 'a' <= (c | 0x20) <= 'f'. Nibble
+ *  pairs are merged in 16-bit lanes, packed down to bytes and summed with SAD.
+ */
+static bool hexDecodeSSE2(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum)
+{
+	const __m128i digitLow = _mm_set1_epi8('0' - 1);
+	const __m128i digitHigh = _mm_set1_epi8('9' + 1);
+	const __m128i alphaLow = _mm_set1_epi8('a' - 1);
+	const __m128i alphaHigh = _mm_set1_epi8('f' + 1);
+	const __m128i lowerCase = _mm_set1_epi8(0x20);
+	const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+	const __m128i alphaAdjust = _mm_set1_epi8(9);
+	const __m128i byteMask = _mm_set1_epi16(0x00FF);
+	__m128i invalid = _mm_setzero_si128();
+	__m128i total = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i chars = _mm_loadu_si128((const __m128i *)(hex + i * 2));
+		__m128i lower = _mm_or_si128(chars, lowerCase);
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, digitLow), _mm_cmplt_epi8(chars, digitHigh));
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, alphaLow), _mm_cmplt_epi8(lower, alphaHigh));
+		invalid = _mm_or_si128(invalid, _mm_andnot_si128(_mm_or_si128(digit, alpha), _mm_set1_epi8(-1)));
+
+		__m128i nibbles = _mm_add_epi8(_mm_and_si128(chars, nibbleMask), _mm_and_si128(alpha, alphaAdjust));
+		__m128i bytes = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8)), byteMask);
+
+		total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+		_mm_storel_epi64((__m128i *)(output + i), _mm_packus_epi16(bytes, bytes));
+	}
+
+	if (_mm_movemask_epi8(invalid))
+		return false;
+
+	uint32_t tail = 0;
+
+	if (!hexDecodeScalar(hex + i * 2, count - i, output + i, &tail))
+		return false;
+
+	if (sum)
+		*sum = (uint32_t)(_mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total, total))) + tail;
+
+	return true;
+}
+
+__attribute__((target("avx2")))
+static bool hexDecodeAVX2(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum)
+{
+	const __m256i digitLow = _mm256_set1_epi8('0' - 1);
+	const __m256i digitHigh = _mm256_set1_epi8('9' + 1);
+	const __m256i alphaLow = _mm256_set1_epi8('a' - 1);
+	const __m256i alphaHigh = _mm256_set1_epi8('f' + 1);
+	const __m256i lowerCase = _mm256_set1_epi8(0x20);
+	const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+	const __m256i alphaAdjust = _mm256_set1_epi8(9);
+	const __m256i byteMask = _mm256_set1_epi16(0x00FF);
+	__m256i valid = _mm256_set1_epi8(-1);
+	__m256i total = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i chars = _mm256_loadu_si256((const __m256i *)(hex + i * 2));
+		__m256i lower = _mm256_or_si256(chars, lowerCase);
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(chars, digitLow), _mm256_cmpgt_epi8(digitHigh, chars));
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, alphaLow), _mm256_cmpgt_epi8(alphaHigh, lower));
+		valid = _mm256_and_si256(valid, _mm256_or_si256(digit, alpha));
+
+		__m256i nibbles = _mm256_add_epi8(_mm256_and_si256(chars, nibbleMask), _mm256_and_si256(alpha, alphaAdjust));
+		__m256i bytes = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(nibbles, 4), _mm256_srli_epi16(nibbles, 8)), byteMask);
+
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+
+		// Pack works per 128-bit lane, gather the two low quadwords together
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0xD8);
+		_mm_storeu_si128((__m128i *)(output + i), _mm256_castsi256_si128(packed));
+	}
+
+	if (_mm256_movemask_epi8(valid) != -1)
+		return false;
+
+	uint32_t tail = 0;
+
+	// Remaining bytes go through the SSE2 path, which finishes with the scalar one
+	if (!hexDecodeSSE2(hex + i * 2, count - i, output + i, &tail))
+		return false;
+
+	if (sum)
+	{
+		__m128i folded = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+		*sum = (uint32_t)(_mm_cvtsi128_si32(folded) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(folded, folded))) + tail;
+	}
+
+	return true;
+}
+
+#endif // HEX_DECODE_X86
+
+HexDecodeFunc hexDecodeFunction(const char *name)
+{
+#ifdef HEX_DECODE_X86
+	__builtin_cpu_init();
+
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2") ? hexDecodeAVX2 : NULL;
+
+	if (strcmp(name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2") ? hexDecodeSSE2 : NULL;
+#endif
+
+	return strcmp(name, "scalar") == 0 ? hexDecodeScalar : NULL;
+}
+
+struct HexDecoder
+{
+	const char *name;
+	HexDecodeFunc decode;
+};
+
+static HexDecoder selectHexDecoder()
+{
+	HexDecoder decoder = { "avx2", hexDecodeFunction("avx2") };
+
+	if (decoder.decode == NULL)
+		decoder = { "sse2", hexDecodeFunction("sse2") };
+
+	if (decoder.decode == NULL)
+		decoder = { "scalar", hexDecodeScalar };
+
+	return decoder;
+}
+
+// Picked on first use, a static initializer could run after another translation unit's parses firmware
+static const HexDecoder &hexDecoder()
+{
+	static const HexDecoder decoder = selectHexDecoder();
+
+	return decoder;
+}
+
+bool hexDecode(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum)
+{
+	return hexDecoder().decode(hex, count, output, sum);
+}
+
+const char *hexDecodeImplementation()
+{
+	return hexDecoder().name;
+}
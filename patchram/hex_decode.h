@@ -0,0 +1,49 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef hex_decode_h
+#define hex_decode_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  Validate and decode ASCII hex pairs into bytes
+ *
+ *  hex    - Input characters (2 * count, '0-9', 'a-f', 'A-F')
+ *  count  - Number of output bytes
+ *  output - Output buffer (count bytes)
+ *  sum    - Optional, receives the sum of all decoded bytes
+ *
+ *  returns false if any input character is not a hex digit
+ */
+bool hexDecode(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum);
+
+typedef bool (*HexDecodeFunc)(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum);
+
+// Reference implementation, one nibble at a time
+bool hexDecodeScalar(const uint8_t *hex, size_t count, uint8_t *output, uint32_t *sum);
+
+// Name of the implementation selected for this CPU ("avx2", "sse2" or "scalar")
+const char *hexDecodeImplementation();
+
+// Implementation by name, NULL if this build or CPU does not have it
+HexDecodeFunc hexDecodeFunction(const char *name);
+
+#endif
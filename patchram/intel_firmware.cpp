@@ -0,0 +1,292 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "intel_firmware.h"
+#include "hci_codec.h"
+#include "hex_decode.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Validate if the current character is a valid hexadecimal character
+static inline bool validHexChar(uint8_t hex)
+{
+	return (hex >= 'a' && hex <= 'f') || (hex >= 'A' && hex <= 'F') || (hex >= '0' && hex <= '9');
+}
+
+uint16_t swapNibbles(uint16_t x)
+{
+	return ((x & 0x0F) << 4 | (x & 0xF0) >> 4);
+}
+
+HexParser::HexParser(FirmwareImage &image, uint16_t vendorId, uint16_t productId, uint32_t flags) :
+	mImage(image), mVendorId(vendorId), mProductId(productId), mFlags(flags), mState(kStart), mAddress(0),
+	mChainOpen(false), mChainAddress(0), mChainLength(0), mCarryLength(0), mRecordChars(0)
+{
+	mImage.clear();
+}
+
+void HexParser::expect(size_t length)
+{
+	// Every record is at least 11 characters and expands into a command of 7 bytes
+	// plus one per two more characters, so reserve once and never grow per record
+	mImage.reserve(mImage.size() + length * 7 / 11 + HCI_COMMAND_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE, mImage.count() + length / 11 + 1);
+}
+
+bool HexParser::fail(const char *message)
+{
+	fprintf(stderr, "[%04x:%04x]: parseFirmware: %s\n", mVendorId, mProductId, message);
+	mState = kFailed;
+	
+	return false;
+}
+
+bool HexParser::push(const uint8_t *data, size_t length)
+{
+	const uint8_t *end = data + length;
+	
+	while (data < end)
+	{
+		switch (mState)
+		{
+			case kDone:
+				return true;
+			case kFailed:
+				return false;
+			case kStart:
+				if (*data != HEX_LINE_PREFIX)
+					return fail("Invalid firmware data.");
+				
+				mState = kSeparator;
+				break;
+			case kSeparator:
+				// Skip over any trailing newlines / whitespace
+				if (*data == HEX_LINE_PREFIX)
+				{
+					mState = kRecord;
+					mCarryLength = 0;
+					mRecordChars = 0;
+				}
+				else if (validHexChar(*data))
+				{
+					return fail("Invalid firmware.");
+				}
+				
+				data++;
+				break;
+			case kRecord:
+			{
+				uint8_t count;
+				
+				// Byte count first, it determines how many hex pairs make up the record
+				if (mCarryLength == 0 && end - data >= 2)
+				{
+					if (!hexDecode(data, 1, &count, NULL))
+						return fail("Invalid firmware, malformed record.");
+					
+					uint32_t recordSize = HEX_HEADER_SIZE + count + 1;
+					
+					// The whole record is in this chunk, decode it where it is
+					if ((size_t)(end - data) >= recordSize * 2)
+					{
+						if (!parseRecord(data, recordSize))
+							return false;
+						
+						data += recordSize * 2;
+						break;
+					}
+					
+					mRecordChars = recordSize * 2;
+				}
+				
+				// Carry the characters of a record the chunk ends in
+				uint32_t needed = (mRecordChars ? mRecordChars : 2) - mCarryLength;
+				uint32_t take = (size_t)(end - data) < needed ? (uint32_t)(end - data) : needed;
+				
+				memcpy(mCarry + mCarryLength, data, take);
+				mCarryLength += take;
+				data += take;
+				
+				if (mRecordChars == 0 && mCarryLength == 2)
+				{
+					if (!hexDecode(mCarry, 1, &count, NULL))
+						return fail("Invalid firmware, malformed record.");
+					
+					mRecordChars = (HEX_HEADER_SIZE + count + 1) * 2;
+				}
+				else if (mRecordChars != 0 && mCarryLength == mRecordChars)
+				{
+					if (!parseRecord(mCarry, mRecordChars / 2))
+						return false;
+				}
+				break;
+			}
+		}
+	}
+	
+	return mState != kFailed;
+}
+
+bool HexParser::finish()
+{
+	switch (mState)
+	{
+		case kDone:
+			return true;
+		case kFailed:
+			return false;
+		case kStart:
+			return fail("Invalid firmware data.");
+		case kRecord:
+			return fail("Invalid firmware, truncated record.");
+		default:
+			return fail("Invalid firmware.");
+	}
+}
+
+// Decode, check and apply one record, hex starts at its byte count. Leaves kRecord.
+bool HexParser::parseRecord(const uint8_t *hex, uint32_t recordSize)
+{
+	uint8_t binary[HEX_MAX_RECORD_SIZE];
+	uint32_t sum = 0;
+	
+	// Validate, decode and sum the whole record in one pass
+	if (!hexDecode(hex, recordSize, binary, &sum))
+		return fail("Invalid firmware, bad hex character.");
+	
+	mState = kSeparator;
+	
+	// Parse line data
+	uint8_t length = binary[0];
+	uint16_t addr = binary[1] << 8 | binary[2];
+	uint8_t record_type = binary[3];
+	
+#ifdef DEBUG
+	uint8_t checksum = binary[HEX_HEADER_SIZE + length];
+	
+	for (int i = HEX_HEADER_SIZE; i < HEX_HEADER_SIZE + length - 1; i++)
+	{
+		if (*((uint16_t *)&binary[i]) == swapNibbles(mVendorId))
+			printf("[%04x:%04x]: Found vendorId @ %04x type %02x checksum %02x\n", mVendorId, mProductId, addr, record_type, checksum);
+		if (*((uint16_t *)&binary[i]) == swapNibbles(mProductId))
+			printf("[%04x:%04x]: Found productId @ %04x type %02x checksum %02x\n", mVendorId, mProductId, addr, record_type, checksum);
+	}
+#endif
+	
+	// Two's complement checksum, all bytes including the checksum add up to zero
+	if (sum & 0xFF)
+		return fail("Invalid firmware, checksum mismatch.");
+	
+	// ParseFirmware class only supports I32HEX format
+	switch (record_type)
+	{
+			// Data
+		case REC_TYPE_DATA:
+		{
+			mAddress = (mAddress & 0xFFFF0000) | addr;
+			
+			const uint8_t *payload = &binary[HEX_HEADER_SIZE];
+			uint32_t dataAddress = mAddress;
+			bool merged = false;
+			
+			// Continue the previous command when this record starts where it ended,
+			// comparing full 32-bit addresses so ELA/ESA jumps always break the chain.
+			// Whatever does not fit starts new commands below, split like any other record.
+			if ((mFlags & kParseCoalesce) && mChainOpen && mChainAddress == dataAddress && mChainLength < LAUNCH_RAM_MAX_DATA)
+			{
+				uint8_t take = LAUNCH_RAM_MAX_DATA - mChainLength;
+				
+				if (take > length)
+					take = length;
+				
+				memcpy(mImage.extendLastCommand(take), payload, take);
+				mChainLength += take;
+				payload += take;
+				length -= take;
+				dataAddress += take;
+				merged = (length == 0);
+			}
+			
+			// Instruction parameters: 4 byte little endian address followed by the data,
+			// split over several commands when the record holds more than one can take
+			while (!merged)
+			{
+				uint8_t take = length < LAUNCH_RAM_MAX_DATA ? length : LAUNCH_RAM_MAX_DATA;
+				uint8_t *params = mImage.appendCommand(HCI_OPCODE_LAUNCH_RAM, LAUNCH_RAM_ADDRESS_SIZE + take);
+				
+				hciPut32(params, dataAddress);
+				memcpy(params + LAUNCH_RAM_ADDRESS_SIZE, payload, take);
+				mChainLength = take;
+				payload += take;
+				length -= take;
+				dataAddress += take;
+				merged = (length == 0);
+			}
+			
+			mChainOpen = true;
+			mChainAddress = dataAddress;
+			break;
+		}
+			// End of File
+		case REC_TYPE_EOF:
+			mState = kDone;
+			break;
+			// Extended Segment Address
+		case REC_TYPE_ESA:
+			if (length != 2)
+				return fail("Invalid firmware, extended segment address record is not 2 bytes.");
+			
+			// Segment address multiplied by 16
+			mAddress = binary[4] << 8 | binary[5];
+			mAddress <<= 4;
+			break;
+			// Start Segment Address
+		case REC_TYPE_SSA:
+			// Set CS:IP register for 80x86
+			return fail("Invalid firmware, unsupported start segment address instruction.");
+			// Extended Linear Address
+		case REC_TYPE_ELA:
+			if (length != 2)
+				return fail("Invalid firmware, extended linear address record is not 2 bytes.");
+			
+			// Set new higher 16 bits of the current address
+			mAddress = binary[4] << 24 | binary[5] << 16;
+			break;
+			// Start Linear Address
+		case REC_TYPE_SLA:
+			// Set EIP of 80386 and higher
+			return fail("Invalid firmware, unsupported start linear address instruction.");
+		default:
+			fprintf(stderr, "[%04x:%04x]: parseFirmware: Invalid firmware, unknown record type encountered: 0x%02x.\n", mVendorId, mProductId, record_type);
+			mState = kFailed;
+			return false;
+	}
+	
+	return true;
+}
+
+bool parseFirmware(const uint8_t* data, uint32_t len, uint16_t vendorId, uint16_t productId, FirmwareImage &image, uint32_t flags)
+{
+	HexParser parser(image, vendorId, productId, flags);
+	
+	parser.expect(len);
+	
+	return parser.push(data, len) && parser.finish();
+}
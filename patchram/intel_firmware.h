@@ -20,8 +20,9 @@
 #ifndef intel_firmware_h
 #define intel_firmware_h
 
-#include <IOKit/IOKitLib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include "firmware_image.h"
 
 // IntelHex firmware parsing
 #define HEX_LINE_PREFIX ':'
@@ -34,10 +35,80 @@
 #define REC_TYPE_ELA 4  // Extended Linear Address
 #define REC_TYPE_SLA 5  // Start Linear Address
 
-#define BUFFER_SIZE		1024 * 100
+// LAUNCH_RAM parameters: 4 byte address followed by up to 251 bytes of data
+#define LAUNCH_RAM_ADDRESS_SIZE 4
+#define LAUNCH_RAM_MAX_DATA (0xFF - LAUNCH_RAM_ADDRESS_SIZE)
 
-bool decompressFirmware(void *inBuffer, void *outBuffer, uint32_t inBufferSize, uint32_t *outBufferSize);
-CFMutableArrayRef parseFirmware(const UInt8* data, UInt32 len, UInt16 vendorId, UInt16 productId);
+// parseFirmware flags
+enum
+{
+	kParseDefault = 0,
+	kParseCoalesce = 1 << 0, // Merge address contiguous data records into maximal LAUNCH_RAM commands
+};
+
+// Longest record: header, 255 data bytes and the checksum
+#define HEX_MAX_RECORD_SIZE (HEX_HEADER_SIZE + 0xFF + 1)
+
+/*
+ *  Incremental Intel HEX parser
+ *
+ *  Input is pushed in chunks that may end anywhere, even inside a record.
+ *  Records that lie within a chunk are decoded in place and only one split
+ *  by the end of a chunk is carried over, so the parser never holds more
+ *  than one record of input whatever the size of the firmware. Each record
+ *  is appended to the image as soon as it is complete.
+ */
+class HexParser
+{
+public:
+	// Clears the image
+	HexParser(FirmwareImage &image, uint16_t vendorId, uint16_t productId, uint32_t flags = kParseDefault);
+
+	// Reserve the image for length more characters of input, if known
+	void expect(size_t length);
+
+	// Parse the next chunk, returns false once the firmware turned out to be invalid
+	bool push(const uint8_t *data, size_t length);
+
+	// End of input, returns true if the firmware ended with its End of File record
+	bool finish();
+
+	// The End of File record was parsed, any further input is ignored
+	bool done() const { return mState == kDone; }
+
+private:
+	enum State
+	{
+		kStart,			// Nothing seen yet, the first character has to start a record
+		kSeparator,		// Between records
+		kRecord,		// Inside a record
+		kDone,
+		kFailed,
+	};
+
+	bool parseRecord(const uint8_t *hex, uint32_t recordSize);
+	bool fail(const char *message);
+
+	FirmwareImage &mImage;
+	uint16_t mVendorId;
+	uint16_t mProductId;
+	uint32_t mFlags;
+	State mState;
+	uint32_t mAddress;
+
+	// Coalescing state: address following the last command and its data length
+	bool mChainOpen;
+	uint32_t mChainAddress;
+	uint8_t mChainLength;
+
+	// Characters of a record split by the end of a chunk, and how many it has (0 until the byte count is in)
+	uint8_t mCarry[2 * HEX_MAX_RECORD_SIZE];
+	uint32_t mCarryLength;
+	uint32_t mRecordChars;
+};
+
+// Parse a whole Intel HEX file in memory
+bool parseFirmware(const uint8_t* data, uint32_t len, uint16_t vendorId, uint16_t productId, FirmwareImage &image, uint32_t flags = kParseDefault);
 
 #endif
 
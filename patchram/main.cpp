@@ -17,169 +17,555 @@
  *
  */
 
-#include <IOKit/usb/IOUSBLib.h>
+#include <ctype.h>
 #include <iostream>
 #include <fstream>
+#include <getopt.h>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
 
-extern "C"
+#include "hci.h"
+#include "firmware_binary.h"
+#include "daemon.h"
+#include "firmware_bundle.h"
+#include "firmware_catalog.h"
+#include "firmware_feed.h"
+#include "firmware_loader.h"
+#include "firmware_benchmark.h"
+#include "firmware_recompress.h"
+#include "fleet.h"
+#include "intel_firmware.h"
+#include "transport_sim.h"
+#include "upgrade_engine.h"
+
+/*
+ *  Report how loading the firmware overlapped with the upgrade
+ *
+ *  The upgrade started right after loading did, or before it for firmware
+ *  selected from a catalog, and has just ended. Without the overlap it would
+ *  have started once the firmware was loaded and run for as long as it did
+ *  less the time it spent waiting for commands.
+ */
+static void printFeedTiming(FirmwareFeed &feed, const UpgradeStats &stats)
 {
-	extern void NSLog(CFStringRef format, ...);
+	// Never started, the upgrade ended before a firmware was selected
+	if (feed.started() == FirmwareFeed::Clock::time_point())
+		return;
+	
+	double total = std::chrono::duration<double, std::milli>(FirmwareFeed::Clock::now() - feed.started()).count();
+	bool loaded = feed.finish();
+	const FeedStats &load = feed.stats();
 	
-	#include "hci.h"
-	#include "usb_device.h"
-	#include "intel_firmware.h"
+	// Mapped firmware is not decoded
+	if (load.fileBytes > 0)
+		printf("  firmware: %s %llu -> %llu bytes  read %.1f ms  parse %.1f ms  first command at %.1f ms  %s at %.1f ms\n", compressionName(load.format), (unsigned long long)load.fileBytes, (unsigned long long)load.hexBytes, load.readTime, load.parseTime, load.firstCommand, loaded ? "loaded" : "failed", load.loaded);
+	
+	if (stats.instructions > 0)
+		printf("  overlap: first launch ram at %.1f ms  waited %.1f ms for firmware  total %.1f ms (%.1f ms loading first)\n", total - stats.elapsed + stats.firstInstruction, stats.firmwareWait, total, load.loaded + stats.elapsed - stats.firmwareWait);
 }
 
-bool uploadFirmware(unsigned short vendorId, unsigned short productId, CFMutableArrayRef instructions, int initialDelay, int preResetDelay, int postResetDelay, bool supportsHandshake)
+bool uploadFirmware(unsigned short vendorId, unsigned short productId, const FirmwareImage &image, const UpgradeOptions &options, bool eventLoop, FirmwareFeed *feed)
 {
-	IOUSBDeviceInterface300** device = getDevice(vendorId, productId);
+	std::unique_ptr<HciTransport> transport(openUsbTransport(vendorId, productId));
 	
-	if (device == NULL)
-	{
-		fprintf(stderr, "[%04x:%04x]: Failed to retrieve USB device\n", vendorId, productId);
+	if (!transport)
 		return false;
-	}
-	
-#ifdef DEBUG
-	printDeviceInfo(device);
-#endif
-	
-	IOReturn kr = kIOReturnSuccess;
 	
-	kr = (*device)->USBDeviceOpen(device);
+	UpgradeStats stats;
+	bool result;
 	
-	if (kr != kIOReturnSuccess)
+	if (eventLoop)
 	{
-		fprintf(stderr, "USBDeviceOpen failed (0x%08x)\n", kr);
+		UpgradeEngine engine;
+		engine.add(*transport, image, options, feed);
 		
-		return false;
+		result = engine.run() == 1;
+		stats = engine.stats(0);
+	}
+	else
+	{
+		UpgradeSession session(*transport, image, options, feed);
+		
+		result = session.run();
+		stats = session.stats();
 	}
 	
-	setConfiguration(device);
-	
-	//findInterfaces(device);
+	if (feed)
+		printFeedTiming(*feed, stats);
 	
-	IOUSBInterfaceInterface300** interface = findFirstInterface(device);
+	return result;
+}
+
+/*
+ *  Run a complete upgrade against the simulated controller and report timing
+ *
+ *  returns true when the upgrade completed and the controller RAM holds every LAUNCH_RAM command,
+ *          or the controller was current and nothing was written
+ */
+static bool simulateUpgrade(const SimulatorConfig &config, const FirmwareImage &image, const UpgradeOptions &options, bool eventLoop, FirmwareFeed *feed)
+{
+	std::unique_ptr<SimulatorScheduler> scheduler(eventLoop ? new SimulatorScheduler() : NULL);
+	SimulatedTransport transport(config, scheduler.get());
+	UpgradeStats upgradeStats;
+	DeviceState state;
+	bool result;
 	
-	if (interface != NULL)
+	if (eventLoop)
 	{
-		kr = (*interface)->USBInterfaceOpen(interface);
-		
-		if (kr != kIOReturnSuccess)
-		{
-			fprintf(stderr, "USBInterfaceOpen failed (0x%08x)\n", kr);
-			
-			return false;
-		}
+		UpgradeEngine engine;
+		engine.add(transport, image, options, feed);
 		
-		UInt8 intfIndex, intfClass, intfSubClass, intfProtocol;
-		
-		if ((*interface)->GetInterfaceNumber(interface, &intfIndex) != kIOReturnSuccess)
-			return false;
-		
-		if ((*interface)->GetInterfaceClass(interface, &intfClass) != kIOReturnSuccess)
-			return false;
-		
-		if ((*interface)->GetInterfaceSubClass(interface, &intfSubClass) != kIOReturnSuccess)
-			return false;
-		
-		if ((*interface)->GetInterfaceProtocol(interface, &intfProtocol) != kIOReturnSuccess)
-			return false;
-		
-#ifdef DEBUG
-		printf("[%04x:%04x]: Interface %d (class %02x, subclass %02x, protocol %02x) located\n", vendorId, productId, intfIndex, intfClass, intfSubClass, intfProtocol);
-#endif
+		result = engine.run() == 1;
+		upgradeStats = engine.stats(0);
+		state = engine.state(0);
+	}
+	else
+	{
+		UpgradeSession session(transport, image, options, feed);
 		
-		performUpgrade(interface, instructions, initialDelay, preResetDelay, postResetDelay, supportsHandshake);
+		result = session.run();
+		upgradeStats = session.stats();
+		state = session.state();
+	}
+	
+	// An upgrade that ended early leaves the firmware loading, the image is only complete after this
+	if (feed)
+		feed->finish();
+	
+	SimulatorStats stats = transport.stats();
+	
+	printf("[%04x:%04x]: Simulated upgrade %s in %.1f ms\n", config.vendorId, config.productId, !result ? "failed" : state == kUpdateNotNeeded ? "not needed" : "completed", upgradeStats.elapsed);
+	printf("  commands: %u  launch ram: %u/%zu (%llu bytes)  max outstanding: %u  credit overruns: %u  faults: %u  dropped: %u\n", stats.commands, stats.launchRam, image.count(), (unsigned long long)stats.launchRamBytes, stats.maxOutstanding, stats.creditOverruns, stats.faults, stats.dropped);
+	printf("  launch ram hash: %016llx  state transitions: %u (%016llx)  resumes: %u\n", (unsigned long long)stats.launchRamHash, upgradeStats.transitions, (unsigned long long)upgradeStats.transitionHash, upgradeStats.resumes);
+	printf("  round trip: command %.3f ms  launch ram %.3f ms (timeout %u ms)  timeouts: %u\n", upgradeStats.commandRtt, upgradeStats.launchRamRtt, upgradeStats.launchRamTimeout, upgradeStats.timeouts);
+	
+	if (upgradeStats.verifyReads > 0)
+		printf("  verify: %u reads  %llu bytes in %.1f ms\n", upgradeStats.verifyReads, (unsigned long long)upgradeStats.verifyBytes, upgradeStats.verifyElapsed);
+	
+	if (feed)
+		printFeedTiming(*feed, upgradeStats);
+	
+	// A controller that is already current gets no LAUNCH_RAM at all
+	if (state == kUpdateNotNeeded)
+		return result && stats.launchRam == 0;
+	
+	// Resumed writes send some commands twice, what counts is the RAM they leave behind
+	bool ramMatches = stats.ramHash == hashLaunchRam(image);
+	
+	if (!ramMatches)
+		printf("  controller RAM does not match the firmware\n");
+	
+	return result && ramMatches && stats.creditOverruns == 0;
+}
 
-		(*interface)->USBInterfaceClose(interface);
-		(*interface)->Release(interface);
+/*
+ *  Pick the firmware for a controller from a catalog and start loading it
+ *
+ *  Called once READ_LOCAL_VERSION and READ_VERBOSE_CONFIG have been answered,
+ *  see UpgradeOptions::selectFirmware.
+ *
+ *  returns false if the catalog has no firmware for the controller
+ */
+static bool selectFirmware(const FirmwareCatalog &catalog, FirmwareFeed &feed, const FirmwareVersion &device, uint16_t vendorId, uint16_t productId, uint32_t parseFlags)
+{
+	const FirmwareCatalogEntry *entry = catalog.find(device.lmpSubversion, vendorId, productId);
+	const char *chip = chipName(device.lmpSubversion);
+	
+	if (entry == NULL)
+	{
+		fprintf(stderr, "[%04x:%04x]: No firmware for %s (subversion 0x%04x) in the catalog, aborting.\n", vendorId, productId, chip ? chip : "BCM", device.lmpSubversion);
+		return false;
 	}
-	else
+	
+	const char *path = catalog.path(*entry);
+	
+	if (!catalog.current(*entry))
 	{
-		fprintf(stderr, "[%04x:%04x]:  Failed to locate interface\n", vendorId, productId);
+		fprintf(stderr, "[%04x:%04x]: Firmware '%s' changed since it was cataloged, aborting.\n", vendorId, productId, path);
+		return false;
 	}
 	
-	(*device)->USBDeviceClose(device);
-	(*device)->Release(device);
+	printf("Firmware: %s (build %u)\n", path, entry->build);
+	
+	return feed.start(path, vendorId, productId, parseFlags);
+}
+
+/*
+ *  Load the firmware for a controller from a bundle
+ *
+ *  Called once READ_LOCAL_VERSION and READ_VERBOSE_CONFIG have been answered,
+ *  see UpgradeOptions::selectFirmware.
+ *
+ *  returns false if the bundle has no firmware for the controller
+ */
+static bool selectFirmware(const FirmwareBundle &bundle, FirmwareImage &image, const FirmwareVersion &device, uint16_t vendorId, uint16_t productId)
+{
+	const FirmwareBundleEntry *entry = bundle.select(device, vendorId, productId, image);
+	
+	if (entry == NULL)
+		return false;
+	
+	printf("Firmware: %s (build %u, %s)\n", bundle.name(*entry), entry->build, entry->compression == kCompressionNone ? "stored" : compressionName((CompressionFormat)entry->compression));
 	
 	return true;
 }
 
+static void printUsage()
+{
+	printf("Usage: patchram [options] <vendorId hex> <productId hex> <firmware.dfu|catalog%s|bundle%s>\n", FIRMWARE_CATALOG_EXTENSION, FIRMWARE_BUNDLE_EXTENSION);
+	printf("       patchram compile [options] <vendorId hex> <productId hex> <firmware.dfu> <output%s>\n", FIRMWARE_BINARY_EXTENSION);
+	printf("       patchram fleet [options] <manifest>\n");
+	printf("       patchram daemon [options] <manifest>\n");
+	printf("       patchram catalog [options] <firmware directory> [<output%s>]\n", FIRMWARE_CATALOG_EXTENSION);
+	printf("       patchram pack [options] <firmware directory> <output%s>\n", FIRMWARE_BUNDLE_EXTENSION);
+	printf("       patchram list <bundle%s>\n", FIRMWARE_BUNDLE_EXTENSION);
+	printf("       patchram extract <bundle%s> <directory>\n", FIRMWARE_BUNDLE_EXTENSION);
+	printf("       patchram recompress [options] <firmware.zhx> <output>\n");
+	printf("       patchram benchmark <firmware.zhx>\n\n");
+	printf("Options:\n");
+	printf("  -f, --fixed-delays     Sleep for the fixed delays instead of probing the controller for readiness\n");
+	printf("  -c, --coalesce         Merge contiguous HEX data records into maximal LAUNCH_RAM commands\n");
+	printf("  -e, --event-loop       Run upgrades as coroutines on one event loop thread instead of a thread each\n");
+	printf("                         (USB devices still get a reader thread each, writes block the loop)\n");
+	printf("  -k, --skip-current     Leave controllers alone that already run the firmware's build (from the file name)\n");
+	printf("  -n, --no-reset         Read the controller version without resetting it first, reset only to download\n");
+	printf("  -j, --jobs=<n>         Fleet and daemon mode: number of devices flashed at the same time (default %d)\n", FLEET_DEFAULT_WORKERS);
+	printf("                         Catalog and pack mode: number of firmware files parsed at the same time\n");
+	printf("  -r, --retries=<n>      Resume the firmware write after up to n transient transfer errors (default 3)\n");
+	printf("  -t, --timeout=<floor>[:<ceiling>]\n");
+	printf("                         Bounds of the timeouts derived from measured round trips (ms, default %u:%u)\n", HCI_TIMEOUT_FLOOR, HCI_TIMEOUT);
+	printf("  -v, --verify           Read the controller RAM back and check it against the firmware before END_OF_RECORD\n");
+	printf("  -p, --pipeline[=depth] Keep up to depth LAUNCH_RAM commands in flight (bounded by controller credits)\n");
+	printf("  -z, --compress[=fmt]   Pack mode: compress the firmware that shrinks by at least an eighth instead of storing it\n");
+	printf("                         Recompress mode: format to write\n");
+	printf("                         fmt: zlib%s%s (default %s)\n", compressionAvailable(kCompressionZstd) ? ", zstd" : "", compressionAvailable(kCompressionLz4) ? ", lz4" : "", compressionName(preferredCompression()));
+	printf("  -s, --simulate[=opts]  Upgrade an in-process simulated controller instead of a USB device\n");
+	printf("                         opts: latency,jitter,reset,boot (us),credits,seed,devices,build,patched,subver,handshake,\n");
+	printf("                               fault=<opcode hex>:<n>:<status|drop|stall|disconnect>\n");
+}
+
 int main(int argc, const char * argv[])
 {
-	printf("patchram, Broadcom PatchRAM DFU (Device Firmware Upgrade) utility for macOS.\n");
+	printf("patchram, Broadcom PatchRAM DFU (Device Firmware Upgrade) utility for macOS and Linux.\n");
 	printf("Based on original dfu-tool & dfu-programmer for Linux and BrcmPatchRAM for macOS.\n\n");
 	
-	if (argc != 4)
+	static const struct option longOptions[] =
 	{
-		printf("Usage: patchram <vendorId hex> <productId hex> <firmware.dfu>\n");
-		return -1;
+		{ "coalesce",     no_argument,       NULL, 'c' },
+		{ "compress",     optional_argument, NULL, 'z' },
+		{ "event-loop",   no_argument,       NULL, 'e' },
+		{ "fixed-delays", no_argument,       NULL, 'f' },
+		{ "jobs",         required_argument, NULL, 'j' },
+		{ "no-reset",     no_argument,       NULL, 'n' },
+		{ "pipeline",     optional_argument, NULL, 'p' },
+		{ "retries",      required_argument, NULL, 'r' },
+		{ "simulate",     optional_argument, NULL, 's' },
+		{ "skip-current", no_argument,       NULL, 'k' },
+		{ "timeout",      required_argument, NULL, 't' },
+		{ "verify",       no_argument,       NULL, 'v' },
+		{ NULL,           0,                 NULL, 0   }
+	};
+	
+	bool compile = false;
+	bool fleet = false;
+	bool daemon = false;
+	bool catalog = false;
+	const char *bundle = NULL;
+	bool recompress = false;
+	bool benchmark = false;
+	CompressionFormat compression = kCompressionNone;
+	int workers = FLEET_DEFAULT_WORKERS;
+	uint32_t parseFlags = kParseDefault;
+	UpgradeOptions upgradeOptions;
+	bool eventLoop = false;
+	bool simulate = false;
+	const char *simulateOptions = "";
+	int option;
+	char *end;
+	
+	// Subcommand: compile firmware into the precompiled binary format
+	if (argc > 1 && strcmp(argv[1], "compile") == 0)
+	{
+		compile = true;
+		argc--;
+		argv++;
+	}
+	// Subcommand: flash every device listed in a manifest
+	else if (argc > 1 && strcmp(argv[1], "fleet") == 0)
+	{
+		fleet = true;
+		argc--;
+		argv++;
+	}
+	// Subcommand: keep firmware loaded and flash devices as they are plugged in
+	else if (argc > 1 && strcmp(argv[1], "daemon") == 0)
+	{
+		daemon = true;
+		argc--;
+		argv++;
+	}
+	// Subcommand: index a firmware directory for selection by chip
+	else if (argc > 1 && strcmp(argv[1], "catalog") == 0)
+	{
+		catalog = true;
+		argc--;
+		argv++;
+	}
+	// Subcommands: pack a firmware directory into a bundle, show or unpack one
+	else if (argc > 1 && (strcmp(argv[1], "pack") == 0 || strcmp(argv[1], "list") == 0 || strcmp(argv[1], "extract") == 0))
+	{
+		bundle = argv[1];
+		argc--;
+		argv++;
+	}
+	// Subcommand: convert compressed firmware to another format
+	else if (argc > 1 && strcmp(argv[1], "recompress") == 0)
+	{
+		recompress = true;
+		compression = preferredCompression();
+		argc--;
+		argv++;
+	}
+	// Subcommand: compare the compression formats on a firmware
+	else if (argc > 1 && strcmp(argv[1], "benchmark") == 0)
+	{
+		benchmark = true;
+		argc--;
+		argv++;
 	}
 	
-	// Parse device vendor & product
-	UInt16 vendorId = strtoul(argv[1], NULL, 16);
-	UInt16 productId = strtoul(argv[2], NULL, 16);
-	UInt32 initialDelay = 100, preResetDelay = 250, postResetDelay = 100;
-	bool useHandshake = supportsHandshake(vendorId, productId);
+	while ((option = getopt_long(argc, (char * const *)argv, "cefj:knp::r:s::t:vz::", longOptions, NULL)) != -1)
+	{
+		switch (option)
+		{
+			case 'c':
+				parseFlags |= kParseCoalesce;
+				break;
+			case 'e':
+				eventLoop = true;
+				break;
+			case 'f':
+				upgradeOptions.fixedDelays = true;
+				break;
+			case 'j':
+				workers = atoi(optarg);
+				
+				if (workers < 1)
+				{
+					fprintf(stderr, "Invalid number of jobs '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'k':
+				upgradeOptions.skipCurrent = true;
+				break;
+			case 'n':
+				upgradeOptions.initialReset = false;
+				break;
+			case 'p':
+				upgradeOptions.pipelineDepth = optarg ? atoi(optarg) : 0xFF;
+				
+				if (upgradeOptions.pipelineDepth < 1)
+				{
+					fprintf(stderr, "Invalid pipeline depth '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'r':
+				upgradeOptions.retries = (uint32_t)strtoul(optarg, &end, 10);
+				
+				if (*optarg == '\0' || *end != '\0')
+				{
+					fprintf(stderr, "Invalid number of retries '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 's':
+				simulate = true;
+				
+				if (optarg)
+					simulateOptions = optarg;
+				break;
+			case 't':
+				upgradeOptions.timeoutFloor = (uint32_t)strtoul(optarg, &end, 10);
+				
+				if (*end == ':')
+					upgradeOptions.timeout = (uint32_t)strtoul(end + 1, &end, 10);
+				
+				if (!isdigit(*optarg) || *end != '\0' || upgradeOptions.timeout == 0 || upgradeOptions.timeoutFloor > upgradeOptions.timeout)
+				{
+					fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'v':
+				upgradeOptions.verify = true;
+				break;
+			case 'z':
+				compression = preferredCompression();
+				
+				if (optarg && (!parseCompression(optarg, compression) || !compressionAvailable(compression) || compression == kCompressionGzip || compression == kCompressionDeflate))
+				{
+					fprintf(stderr, "Invalid or unsupported compression '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			default:
+				printUsage();
+				return -1;
+		}
+	}
 	
-#ifdef DEBUG
-	printf("[%04x:%04x]: initialDelay: %d preResetDelay: %d postResetDelay: %d useHandshake: %d\n", vendorId, productId, initialDelay, preResetDelay, postResetDelay, useHandshake);
-#endif
+	int arguments = argc - optind;
+	
+	if (catalog ? arguments < 1 || arguments > 2 : arguments != (compile ? 4 : bundle ? (strcmp(bundle, "list") == 0 ? 1 : 2) : recompress ? 2 : fleet || daemon || benchmark ? 1 : 3))
+	{
+		printUsage();
+		return -1;
+	}
 	
-	std::ifstream inFile(argv[3], std::ios_base::in | std::ios_base::binary);
+	argv += optind;
 	
-	if (!inFile)
+	if (bundle)
 	{
-		fprintf(stderr, "Error reading file '%s'\n", argv[3]);
-		return 1;
+		if (strcmp(bundle, "pack") == 0)
+			return packFirmwareBundle(argv[0], argv[1], (uint32_t)workers, parseFlags, compression) ? 0 : 1;
+		
+		if (strcmp(bundle, "list") == 0)
+			return listFirmwareBundle(argv[0]) ? 0 : 1;
+		
+		return extractFirmwareBundle(argv[0], argv[1]) ? 0 : 1;
 	}
 	
-	std::filebuf *pbuf = inFile.rdbuf();
-	std::size_t inBufferSize = pbuf->pubseekoff (0, std::ios_base::end);
-	pbuf->pubseekpos(0);
-	char *inBuffer = new char[inBufferSize];
-	pbuf->sgetn(inBuffer, inBufferSize);
-	inFile.close();
+	if (recompress)
+		return recompressFirmware(argv[0], argv[1], compression) ? 0 : 1;
 	
-	char *ext = strrchr((char *)argv[3], '.');
+	if (benchmark)
+		return benchmarkFirmware(argv[0]) ? 0 : 1;
 	
-	if (strcmp(ext, ".hex") == 0 || strcmp(ext, ".dfu") == 0)
+	if (catalog)
 	{
-		CFMutableArrayRef instructions = parseFirmware((const UInt8*)inBuffer, (UInt32)inBufferSize, vendorId, productId);
+		std::string indexPath = arguments == 2 ? argv[1] : std::string(argv[0]) + "/" + FIRMWARE_CATALOG_NAME;
 		
-		//NSLog(CFSTR("%@"), instructions);
+		return buildFirmwareCatalog(argv[0], indexPath.c_str(), (uint32_t)workers) ? 0 : 1;
+	}
+	
+	if (fleet || daemon)
+	{
+		std::vector<FleetJob> jobs;
+		SimulatorConfig config;
+		FleetOptions fleetOptions;
 		
-#ifdef DEBUG
-		printf("[%04x:%04x]: Initiating DFU for USB device\n", vendorId, productId);
-#endif
+		if (!readManifest(argv[0], jobs))
+			return 1;
+		
+		if (simulate && !parseSimulatorConfig(simulateOptions, config))
+			return -1;
+		
+		fleetOptions.parseFlags = parseFlags;
+		fleetOptions.upgrade = upgradeOptions;
+		fleetOptions.workers = (uint32_t)workers;
+		fleetOptions.eventLoop = eventLoop;
+		fleetOptions.simulator = simulate ? &config : NULL;
 		
-		uploadFirmware(vendorId, productId, instructions, initialDelay, preResetDelay, postResetDelay, useHandshake);
+		if (daemon)
+			return runDaemon(jobs, fleetOptions) ? 0 : 1;
 		
-		CFRelease(instructions);
+		return runFleet(jobs, fleetOptions) ? 0 : 1;
 	}
-	else
+	
+	// Parse device vendor & product
+	uint16_t vendorId = strtoul(argv[0], NULL, 16);
+	uint16_t productId = strtoul(argv[1], NULL, 16);
+	upgradeOptions.useHandshake = supportsHandshake(vendorId, productId);
+	upgradeOptions.fixedDelays = upgradeOptions.fixedDelays || needsFixedDelays(vendorId, productId);
+	const char *fileName = argv[2];
+	FirmwareImage image;
+	uint64_t sourceHash = 0;
+	std::unique_ptr<FirmwareFeed> feed;
+	FirmwareCatalog firmwareCatalog;
+	FirmwareBundle firmwareBundle;
+	
+	// The firmware is looked up once the controller has reported its chip
+	if (isFirmwareCatalog(fileName))
+	{
+		if (compile)
+		{
+			fprintf(stderr, "A catalog cannot be compiled, pass the firmware file\n");
+			return -1;
+		}
+		
+		if (!firmwareCatalog.open(fileName))
+			return 1;
+		
+		FirmwareFeed *selected = new FirmwareFeed(image);
+		feed.reset(selected);
+		
+		upgradeOptions.selectFirmware = [&firmwareCatalog, selected, vendorId, productId, parseFlags](const FirmwareVersion &device)
+		{
+			return selectFirmware(firmwareCatalog, *selected, device, vendorId, productId, parseFlags);
+		};
+	}
+	// The bundled firmware for the chip is loaded from the mapping once the controller has reported it
+	else if (isFirmwareBundle(fileName))
 	{
-		char *outBuffer[BUFFER_SIZE];
-		uint32_t outBufferSize;
+		if (compile)
+		{
+			fprintf(stderr, "A bundle cannot be compiled, pass the firmware file\n");
+			return -1;
+		}
+		
+		if (!firmwareBundle.open(fileName))
+			return 1;
 		
-		if (decompressFirmware(inBuffer, (void *)outBuffer, (uint32_t)inBufferSize, &outBufferSize))
+		upgradeOptions.selectFirmware = [&firmwareBundle, &image, vendorId, productId](const FirmwareVersion &device)
 		{
-			CFMutableArrayRef instructions = parseFirmware((const UInt8*)outBuffer, outBufferSize, vendorId, productId);
-			
-			//NSLog(CFSTR("%@"), instructions);
-			
+			return selectFirmware(firmwareBundle, image, device, vendorId, productId);
+		};
+	}
+	// Intel HEX is read, inflated and parsed while the upgrade is already running
+	else if (!compile && isHexFirmware(fileName))
+	{
+		feed.reset(new FirmwareFeed(image));
+		
+		if (!feed->start(fileName, vendorId, productId, parseFlags))
+			return 1;
+	}
+	else if (!loadFirmware(fileName, vendorId, productId, parseFlags, image, &sourceHash))
+	{
+		return 1;
+	}
+	
+	if (compile)
+	{
+		if (!writeFirmwareBinary(argv[3], image, sourceHash, vendorId, productId, parseFlags))
+			return 1;
+		
+		printf("[%04x:%04x]: Compiled %zu commands (%zu bytes) to '%s'\n", vendorId, productId, image.count(), image.size(), argv[3]);
+		return 0;
+	}
+	
 #ifdef DEBUG
-			printf("[%04x:%04x]: Initiating DFU for USB device\n", vendorId, productId);
+	printf("[%04x:%04x]: initialDelay: %d preResetDelay: %d postResetDelay: %d useHandshake: %d fixedDelays: %d pipelineDepth: %d\n", vendorId, productId, upgradeOptions.initialDelay, upgradeOptions.preResetDelay, upgradeOptions.postResetDelay, upgradeOptions.useHandshake, upgradeOptions.fixedDelays, upgradeOptions.pipelineDepth);
+	printf("[%04x:%04x]: Initiating DFU for USB device\n", vendorId, productId);
 #endif
-			
-			uploadFirmware(vendorId, productId, instructions, initialDelay, preResetDelay, postResetDelay, useHandshake);
-			
-			CFRelease(instructions);
-		}
+	
+	if (simulate)
+	{
+		SimulatorConfig config;
+		config.vendorId = vendorId;
+		config.productId = productId;
+		config.handshake = upgradeOptions.useHandshake;
+		
+		if (!parseSimulatorConfig(simulateOptions, config))
+			return -1;
+		
+		return simulateUpgrade(config, image, upgradeOptions, eventLoop, feed.get()) ? 0 : 1;
 	}
 	
-	delete[] inBuffer;
+	if (!uploadFirmware(vendorId, productId, image, upgradeOptions, eventLoop, feed.get()))
+		return 1;
 	
 	return 0;
 }
@@ -0,0 +1,81 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() : mData(NULL), mSize(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char *path)
+{
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error opening file '%s' (%s)\n", path, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		fprintf(stderr, "Error reading file '%s'\n", path);
+		::close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Error mapping file '%s' (%s)\n", path, strerror(errno));
+		return false;
+	}
+
+	mData = (const uint8_t *)data;
+	mSize = (size_t)st.st_size;
+
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (mData != NULL)
+		munmap((void *)mData, mSize);
+
+	mData = NULL;
+	mSize = 0;
+}
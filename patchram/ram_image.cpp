@@ -0,0 +1,203 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "ram_image.h"
+
+#include <string.h>
+#include <iterator>
+#include "intel_firmware.h"
+
+void RamImage::write(uint32_t address, const uint8_t *data, uint32_t length)
+{
+	uint64_t end = (uint64_t)address + length;
+	std::map<uint32_t, std::vector<uint8_t>>::iterator block = mBlocks.upper_bound(address);
+
+	// Extend the block the write starts in or follows on from, otherwise start one
+	if (block != mBlocks.begin() && std::prev(block)->first + std::prev(block)->second.size() >= address)
+		--block;
+	else
+		block = mBlocks.emplace_hint(block, address, std::vector<uint8_t>());
+
+	std::vector<uint8_t> &bytes = block->second;
+	uint32_t start = block->first;
+
+	if (bytes.size() < end - start)
+		bytes.resize(end - start);
+
+	// Merge the blocks the write overlaps or touches, keeping their bytes past its end
+	std::map<uint32_t, std::vector<uint8_t>>::iterator next = std::next(block);
+
+	while (next != mBlocks.end() && next->first <= end)
+	{
+		uint64_t nextEnd = next->first + next->second.size();
+
+		if (nextEnd > end)
+		{
+			bytes.resize(nextEnd - start);
+			memcpy(&bytes[end - start], &next->second[end - next->first], nextEnd - end);
+		}
+
+		next = mBlocks.erase(next);
+	}
+
+	memcpy(&bytes[address - start], data, length);
+}
+
+void RamImage::read(uint32_t address, uint8_t *data, uint32_t length) const
+{
+	uint64_t end = (uint64_t)address + length;
+	std::map<uint32_t, std::vector<uint8_t>>::const_iterator block = mBlocks.upper_bound(address);
+
+	memset(data, 0, length);
+
+	if (block != mBlocks.begin())
+		--block;
+
+	for (; block != mBlocks.end() && block->first < end; ++block)
+	{
+		uint64_t first = block->first > address ? block->first : address;
+		uint64_t last = block->first + block->second.size();
+
+		if (last > end)
+			last = end;
+
+		if (first < last)
+			memcpy(data + (first - address), &block->second[first - block->first], last - first);
+	}
+}
+
+void RamImage::load(const FirmwareImage &image)
+{
+	for (size_t i = 0; i < image.count(); i++)
+	{
+		FirmwareSpan span = image.command(i);
+		uint16_t opcode = hciGet16(span.data);
+		uint8_t paramLength = span.data[2];
+		const uint8_t *params = span.data + HCI_COMMAND_HEADER_SIZE;
+
+		if (opcode != HCI_OPCODE_LAUNCH_RAM || paramLength < LAUNCH_RAM_ADDRESS_SIZE)
+			continue;
+
+		write(hciGet32(params), params + LAUNCH_RAM_ADDRESS_SIZE, paramLength - LAUNCH_RAM_ADDRESS_SIZE);
+	}
+}
+
+std::vector<RamRegion> RamImage::regions() const
+{
+	std::vector<RamRegion> regions;
+
+	regions.reserve(mBlocks.size());
+
+	for (std::map<uint32_t, std::vector<uint8_t>>::const_iterator block = mBlocks.begin(); block != mBlocks.end(); ++block)
+	{
+		// Empty LAUNCH_RAM commands leave empty blocks behind
+		if (block->second.empty())
+			continue;
+
+		RamRegion region = { block->first, (uint32_t)block->second.size(), hashBytes(block->second.data(), block->second.size()) };
+		regions.push_back(region);
+	}
+
+	return regions;
+}
+
+uint64_t RamImage::hash() const
+{
+	std::vector<RamRegion> all = regions();
+
+	if (all.empty())
+		return 0;
+
+	return hashBytes(all.data(), all.size() * sizeof(RamRegion));
+}
+
+RamVerifier::RamVerifier() :
+	mReadRegion(0), mReadOffset(0), mCheckRegion(0), mCheckOffset(0), mCheckHash(FNV1A64_OFFSET), mBytes(0), mReads(0)
+{
+}
+
+void RamVerifier::start(const FirmwareImage &image)
+{
+	RamImage ram;
+
+	ram.load(image);
+	mRegions = ram.regions();
+
+	mReadRegion = 0;
+	mReadOffset = 0;
+	mCheckRegion = 0;
+	mCheckOffset = 0;
+	mCheckHash = FNV1A64_OFFSET;
+	mBytes = 0;
+	mReads = 0;
+}
+
+bool RamVerifier::nextRead(HciReadRamCommand &command)
+{
+	if (mReadRegion == mRegions.size())
+		return false;
+
+	const RamRegion &region = mRegions[mReadRegion];
+	uint32_t address = region.address + mReadOffset;
+	uint32_t length = region.length - mReadOffset;
+
+	if (length > READ_RAM_MAX_LENGTH)
+		length = READ_RAM_MAX_LENGTH;
+
+	command = hciReadRam(address, (uint8_t)length);
+
+	mReadOffset += length;
+	mReads++;
+
+	if (mReadOffset == region.length)
+	{
+		mReadRegion++;
+		mReadOffset = 0;
+	}
+
+	return true;
+}
+
+bool RamVerifier::check(const uint8_t *data, uint32_t length)
+{
+	const RamRegion &region = mRegions[mCheckRegion];
+	uint32_t expected = region.length - mCheckOffset;
+
+	if (expected > READ_RAM_MAX_LENGTH)
+		expected = READ_RAM_MAX_LENGTH;
+
+	if (length != expected)
+		return false;
+
+	mCheckHash = hashBytes(data, length, mCheckHash);
+	mCheckOffset += length;
+	mBytes += length;
+
+	if (mCheckOffset < region.length)
+		return true;
+
+	if (mCheckHash != region.hash)
+		return false;
+
+	mCheckRegion++;
+	mCheckOffset = 0;
+	mCheckHash = FNV1A64_OFFSET;
+
+	return true;
+}
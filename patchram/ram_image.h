@@ -0,0 +1,117 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef ram_image_h
+#define ram_image_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "firmware_image.h"
+#include "hci_codec.h"
+
+// Command Complete parameters are at most 255 bytes: numCommands, opcode, status and the data
+#define READ_RAM_MAX_LENGTH 251
+
+// Contiguous range of controller RAM and hashBytes() of its contents
+struct RamRegion
+{
+	uint32_t address;
+	uint32_t length;
+	uint64_t hash;
+};
+
+/*
+ *  Sparse copy of controller RAM
+ *
+ *  Holds what a sequence of writes leaves behind as disjoint blocks of
+ *  contiguous bytes, later writes replacing earlier ones. Writes that follow
+ *  on from the previous one, as LAUNCH_RAM commands do, extend its block in
+ *  place.
+ */
+class RamImage
+{
+public:
+	void write(uint32_t address, const uint8_t *data, uint32_t length);
+
+	// Bytes never written read as 0
+	void read(uint32_t address, uint8_t *data, uint32_t length) const;
+
+	// Apply the LAUNCH_RAM commands of a firmware image
+	void load(const FirmwareImage &image);
+
+	std::vector<RamRegion> regions() const;
+
+	// hashBytes() over the regions, 0 if nothing was written
+	uint64_t hash() const;
+
+	void clear() { mBlocks.clear(); }
+
+private:
+	std::map<uint32_t, std::vector<uint8_t>> mBlocks;
+};
+
+/*
+ *  Read-back check of the RAM a firmware image writes
+ *
+ *  Splits the regions of the image into HCI_VSC_READ_RAM commands of up to
+ *  READ_RAM_MAX_LENGTH bytes and hashes the data of their completions as
+ *  they arrive, which has to be in the order the reads were sent. A region
+ *  is compared as soon as its last byte is in, nothing is buffered.
+ */
+class RamVerifier
+{
+public:
+	RamVerifier();
+
+	void start(const FirmwareImage &image);
+
+	// Fill in the next read, false once every read was handed out
+	bool nextRead(HciReadRamCommand &command);
+
+	// Data of the next completion, false if it is short or ends a region that does not match
+	bool check(const uint8_t *data, uint32_t length);
+
+	bool done() const { return mCheckRegion == mRegions.size(); }
+
+	// The region being checked, the failed one after check() returned false
+	const RamRegion &region() const { return mRegions[mCheckRegion]; }
+
+	size_t regions() const { return mRegions.size(); }
+	uint64_t bytes() const { return mBytes; }
+	uint32_t reads() const { return mReads; }
+
+private:
+	std::vector<RamRegion> mRegions;
+
+	// Next read to send
+	size_t mReadRegion;
+	uint32_t mReadOffset;
+
+	// Next completion to check
+	size_t mCheckRegion;
+	uint32_t mCheckOffset;
+	uint64_t mCheckHash;
+
+	uint64_t mBytes;
+	uint32_t mReads;
+};
+
+#endif
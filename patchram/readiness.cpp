@@ -0,0 +1,100 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "readiness.h"
+
+#include <stdio.h>
+#include <chrono>
+#include "hci.h"
+
+bool isProbeEvent(const HciEvent *event)
+{
+	HciCommandCompleteView complete(event->data, event->length);
+
+	return event->status == kTransportSuccess && complete.valid() && complete.opcode() == HCI_OPCODE_READ_FEATURES;
+}
+
+ReadyResult waitForReady(HciTransport &transport, EventReader &reader, uint32_t limit, uint32_t interval)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds(limit);
+	uint32_t probes = 0;
+
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		TransportStatus status = transport.sendCommand(HCI_READ_FEATURES.data(), HCI_READ_FEATURES.size());
+
+		// A controller that is still booting may also refuse the control transfer
+		if (status == kTransportNoDevice || status == kTransportAborted)
+			return kReadyFailed;
+
+		probes++;
+
+		std::chrono::steady_clock::time_point wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval);
+
+		if (wake > deadline)
+			wake = deadline;
+
+		// Take events until the probe is answered or the interval runs out
+		while (true)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			if (now >= wake)
+				break;
+
+			uint32_t timeout = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+			const HciEvent *event = reader.next(timeout ? timeout : 1);
+
+			if (event == NULL)
+			{
+				if (!reader.running())
+					return kReadyFailed;
+
+				continue;
+			}
+
+			if (event->status != kTransportSuccess)
+			{
+				// Leave the failure for the state machine to report
+				return kReadyFailed;
+			}
+
+			bool probe = isProbeEvent(event);
+			reader.release();
+
+			if (probe)
+			{
+#ifdef DEBUG
+				printf("Controller ready after %lld us (%u probes).\n", (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(), probes);
+#endif
+				return kReady;
+			}
+		}
+
+		if (interval < READY_PROBE_INTERVAL_MAX)
+			interval *= 2;
+	}
+
+#ifdef DEBUG
+	printf("Controller did not answer %u probes within %u ms.\n", probes, limit);
+#endif
+
+	return kReadyTimeout;
+}
@@ -0,0 +1,58 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef readiness_h
+#define readiness_h
+
+#include <stdint.h>
+#include "event_reader.h"
+#include "hci_transport.h"
+
+// Probe backoff (ms), doubled after every unanswered probe
+#define READY_PROBE_INTERVAL_MIN 1
+#define READY_PROBE_INTERVAL_MAX 16
+
+enum ReadyResult
+{
+	kReady,				// Controller answered a probe
+	kReadyTimeout,		// No answer within the limit, carry on as after a fixed delay
+	kReadyFailed,		// Transport failure, the upgrade has to be aborted
+};
+
+/*
+ *  Wait for the controller to accept commands again
+ *
+ *  Sends HCI_READ_FEATURES probes under a bounded exponential backoff and
+ *  returns as soon as one is answered. Late answers to earlier probes are
+ *  left in the event stream and have to be skipped with isProbeEvent().
+ *
+ *  limit    - Longest time to wait (ms), normally the fixed delay it replaces
+ *  interval - Wait for an answer before the second probe (ms). Once the command
+ *             round trip is known it is passed here, so a slow answer is not
+ *             taken for a lost probe and answered by a second one the
+ *             controller has no credit for.
+ *
+ *  returns kReady, kReadyTimeout or kReadyFailed
+ */
+ReadyResult waitForReady(HciTransport &transport, EventReader &reader, uint32_t limit, uint32_t interval = READY_PROBE_INTERVAL_MIN);
+
+// True for the completion of a readiness probe
+bool isProbeEvent(const HciEvent *event);
+
+#endif
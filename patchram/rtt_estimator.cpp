@@ -0,0 +1,78 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "rtt_estimator.h"
+
+#include <math.h>
+#include "hci_transport.h"
+
+// Smallest variance term, the clock granularity of the deadlines (ms)
+static const double kGranularity = 1.0;
+
+RttEstimator::RttEstimator() :
+	mSrtt(0), mRttvar(0), mSamples(0), mBackoff(0), mFloor(0), mCeiling(HCI_TIMEOUT)
+{
+}
+
+void RttEstimator::setBounds(uint32_t floor, uint32_t ceiling)
+{
+	mFloor = floor < ceiling ? floor : ceiling;
+	mCeiling = ceiling;
+}
+
+void RttEstimator::sample(double rtt)
+{
+	if (mSamples == 0)
+	{
+		mSrtt = rtt;
+		mRttvar = rtt / 2;
+	}
+	else
+	{
+		mRttvar = 0.75 * mRttvar + 0.25 * fabs(mSrtt - rtt);
+		mSrtt = 0.875 * mSrtt + 0.125 * rtt;
+	}
+
+	mSamples++;
+	mBackoff = 0;
+}
+
+void RttEstimator::backoff()
+{
+	if (mBackoff < RTT_MAX_BACKOFF)
+		mBackoff++;
+}
+
+double RttEstimator::estimate() const
+{
+	if (mSamples == 0)
+		return 0;
+
+	return mSrtt + fmax(kGranularity, 4 * mRttvar);
+}
+
+uint32_t RttEstimator::timeout() const
+{
+	if (mSamples == 0)
+		return mCeiling;
+
+	double timeout = fmax(ceil(estimate()), mFloor) * (1 << mBackoff);
+
+	return timeout < mCeiling ? (uint32_t)timeout : mCeiling;
+}
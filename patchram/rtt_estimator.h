@@ -0,0 +1,71 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef rtt_estimator_h
+#define rtt_estimator_h
+
+#include <stdint.h>
+
+// Doublings of the timeout after expired deadlines, until the next sample
+#define RTT_MAX_BACKOFF 6
+
+/*
+ *  Timeout derived from measured round trips
+ *
+ *  Keeps the smoothed round trip time and its mean deviation the way TCP
+ *  does (RFC 6298: gains 1/8 and 1/4, timeout SRTT + 4 * RTTVAR) and bounds
+ *  the timeout by a floor and a ceiling. Until the first sample the timeout
+ *  is the ceiling. Every expired deadline doubles it until the next sample
+ *  arrives, so a slow controller is waited for longer rather than timed out
+ *  over and over.
+ */
+class RttEstimator
+{
+public:
+	RttEstimator();
+
+	// Bounds of timeout() (ms)
+	void setBounds(uint32_t floor, uint32_t ceiling);
+
+	// Round trip of a request that succeeded on its first attempt (ms)
+	void sample(double rtt);
+
+	// A deadline derived from timeout() expired
+	void backoff();
+
+	// Deadline for the next request (ms)
+	uint32_t timeout() const;
+
+	// SRTT + 4 * RTTVAR without bounds or backoff (ms), 0 before the first sample
+	double estimate() const;
+
+	double srtt() const { return mSrtt; }
+	double rttvar() const { return mRttvar; }
+	uint32_t samples() const { return mSamples; }
+
+private:
+	double mSrtt;
+	double mRttvar;
+	uint32_t mSamples;
+	uint32_t mBackoff;
+	uint32_t mFloor;
+	uint32_t mCeiling;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef spsc_ring_h
+#define spsc_ring_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ *  Heap allocation for types aligned to a cache line
+ *
+ *  The aligned operator new of C++17 is only available from macOS 10.13 on,
+ *  so these over-allocate with malloc and keep the block just in front of the
+ *  aligned object. Types that hold a ring derive from it.
+ */
+struct CacheLineAllocated
+{
+	static void *operator new(size_t size)
+	{
+		void *block = malloc(size + sizeof(void *) + CACHE_LINE_SIZE - 1);
+
+		if (block == NULL)
+			throw std::bad_alloc();
+
+		void **object = (void **)(((uintptr_t)block + sizeof(void *) + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+		object[-1] = block;
+
+		return object;
+	}
+
+	static void operator delete(void *object)
+	{
+		if (object != NULL)
+			free(((void **)object)[-1]);
+	}
+};
+
+/*
+ *  Single producer / single consumer lock-free ring
+ *
+ *  Slots are filled and consumed in place: the producer writes into the slot
+ *  returned by back() and publishes it with push(), the consumer reads front()
+ *  and hands the slot back with pop(). Each side keeps a cached copy of the
+ *  other side's index so the shared cache line is only touched when the ring
+ *  looks full or empty.
+ */
+template <typename T, size_t Capacity>
+class SpscRing : public CacheLineAllocated
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer: free slot to fill, or NULL when the ring is full
+	T *back()
+	{
+		size_t tail = mTail.load(std::memory_order_relaxed);
+
+		if (tail - mHeadCache == Capacity)
+		{
+			mHeadCache = mHead.load(std::memory_order_acquire);
+
+			if (tail - mHeadCache == Capacity)
+				return NULL;
+		}
+
+		return &mSlots[tail & (Capacity - 1)];
+	}
+
+	// Producer: publish the slot returned by back()
+	void push()
+	{
+		mTail.store(mTail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+	}
+
+	// Consumer: oldest published slot, or NULL when the ring is empty
+	T *front()
+	{
+		size_t head = mHead.load(std::memory_order_relaxed);
+
+		if (head == mTailCache)
+		{
+			mTailCache = mTail.load(std::memory_order_acquire);
+
+			if (head == mTailCache)
+				return NULL;
+		}
+
+		return &mSlots[head & (Capacity - 1)];
+	}
+
+	// Consumer: release the slot returned by front()
+	void pop()
+	{
+		mHead.store(mHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool empty() const
+	{
+		return mHead.load(std::memory_order_seq_cst) == mTail.load(std::memory_order_seq_cst);
+	}
+
+private:
+	T mSlots[Capacity];
+
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> mHead {0};
+	size_t mTailCache = 0;
+
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> mTail {0};
+	size_t mHeadCache = 0;
+};
+
+#endif
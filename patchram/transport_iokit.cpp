@@ -0,0 +1,575 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef __APPLE__
+
+#include <mach/mach.h>
+#include <IOKit/usb/IOUSBLib.h>
+#include <IOKit/IOCFPlugIn.h>
+#include <stdio.h>
+#include "transport_iokit.h"
+
+extern "C"
+{
+#include "usb_device.h"
+}
+
+
+const char *usb_dir[] =
+{
+	"out",
+	"in",
+	"none",
+	"any"
+};
+
+const char *usb_ctrl[] =
+{
+	"control",
+	"isoc",
+	"bulk",
+	"interrupt",
+	"any"
+};
+
+const char* stringFromReturn(IOReturn rtn)
+{
+	static const IONamedValue IOReturn_values[] = {
+		{ kIOReturnIsoTooOld,          "Isochronous I/O request for distant past"     },
+		{ kIOReturnIsoTooNew,          "Isochronous I/O request for distant future"   },
+		{ kIOReturnNotFound,           "Data was not found"                           },
+		// REVIEW: new error identifiers?
+#ifndef TARGET_ELCAPITAN
+		{ kIOUSBUnknownPipeErr,        "Pipe ref not recognized"                      },
+		{ kIOUSBTooManyPipesErr,       "Too many pipes"                               },
+		{ kIOUSBNoAsyncPortErr,        "No async port"                                },
+		{ kIOUSBNotEnoughPowerErr,     "Not enough power for selected configuration"  },
+		{ kIOUSBEndpointNotFound,      "Endpoint not found"                           },
+		{ kIOUSBConfigNotFound,        "Configuration not found"                      },
+		{ kIOUSBTransactionTimeout,    "Transaction timed out"                        },
+		{ kIOUSBTransactionReturned,   "Transaction has been returned to the caller"  },
+		{ kIOUSBPipeStalled,           "Pipe has stalled, error needs to be cleared"  },
+		{ kIOUSBInterfaceNotFound,     "Interface reference not recognized"           },
+		{ kIOUSBLowLatencyBufferNotPreviouslyAllocated,
+			"Attempted to user land low latency isoc calls w/out calling PrepareBuffer" },
+		{ kIOUSBLowLatencyFrameListNotPreviouslyAllocated,
+			"Attempted to user land low latency isoc calls w/out calling PrepareBuffer" },
+		{ kIOUSBHighSpeedSplitError,   "Error on hi-speed bus doing split transaction"},
+		{ kIOUSBSyncRequestOnWLThread, "Synchronous USB request on workloop thread."  },
+		{ kIOUSBDeviceNotHighSpeed,    "The device is not a high speed device."       },
+		{ kIOUSBClearPipeStallNotRecursive,
+			"IOUSBPipe::ClearPipeStall should not be called rescursively"               },
+		{ kIOUSBLinkErr,               "USB link error"                               },
+		{ kIOUSBNotSent2Err,           "Transaction not sent"                         },
+		{ kIOUSBNotSent1Err,           "Transaction not sent"                         },
+		{ kIOUSBNotEnoughPipesErr,     "Not enough pipes in interface"                },
+		{ kIOUSBBufferUnderrunErr,     "Buffer Underrun (Host hardware failure)"      },
+		{ kIOUSBBufferOverrunErr,      "Buffer Overrun (Host hardware failure"        },
+		{ kIOUSBReserved2Err,          "Reserved"                                     },
+		{ kIOUSBReserved1Err,          "Reserved"                                     },
+		{ kIOUSBWrongPIDErr,           "Pipe stall, Bad or wrong PID"                 },
+		{ kIOUSBPIDCheckErr,           "Pipe stall, PID CRC error"                    },
+		{ kIOUSBDataToggleErr,         "Pipe stall, Bad data toggle"                  },
+		{ kIOUSBBitstufErr,            "Pipe stall, bitstuffing"                      },
+		{ kIOUSBCRCErr,                "Pipe stall, bad CRC"                          },
+#endif
+		{ 0,                           NULL                                           }
+	};
+	
+	for(int i = 0; IOReturn_values[i].name; i++)
+	{
+		if (IOReturn_values[i].value == rtn)
+			return IOReturn_values[i].name;
+	}
+	
+	return NULL;
+}
+
+IOReturn findInterfaces(IOUSBDeviceInterface300 **device)
+{
+	IOReturn                    kr;
+	IOUSBFindInterfaceRequest   request;
+	io_iterator_t               iterator;
+	io_service_t                usbInterface;
+	IOCFPlugInInterface         **plugInInterface = NULL;
+	IOUSBInterfaceInterface     **interface = NULL;
+	HRESULT                     result;
+	SInt32                      score;
+	UInt8                       interfaceClass;
+	UInt8                       interfaceSubClass;
+	UInt8                       interfaceNumEndpoints;
+	int                         pipeRef;
+	// Placing the constant kIOUSBFindInterfaceDontCare into the following
+	// fields of the IOUSBFindInterfaceRequest structure will allow you
+	// to find all the interfaces
+	request.bInterfaceClass = kIOUSBFindInterfaceDontCare;
+	request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+	request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+	request.bAlternateSetting = kIOUSBFindInterfaceDontCare;
+	// Get an iterator for the interfaces on the device
+	kr = (*device)->CreateInterfaceIterator(device,
+										&request, &iterator);
+	while ((usbInterface = IOIteratorNext(iterator)))
+	{
+		// Create an intermediate plug-in
+		kr = IOCreatePlugInInterfaceForService(usbInterface,
+							kIOUSBInterfaceUserClientTypeID,
+							kIOCFPlugInInterfaceID,
+							&plugInInterface, &score);
+		// Release the usbInterface object after getting the plug-in
+		kr = IOObjectRelease(usbInterface);
+		if ((kr != kIOReturnSuccess) || !plugInInterface)
+		{
+			fprintf(stderr, "Unable to create a plug-in (%08x)\n", kr);
+			break;
+		}
+		// Now create the device interface for the interface
+		result = (*plugInInterface)->QueryInterface(plugInInterface,
+					CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID),
+					(LPVOID *) &interface);
+		// No longer need the intermediate plug-in
+		(*plugInInterface)->Release(plugInInterface);
+		if (result || !interface)
+		{
+			fprintf(stderr, "Couldn’t create a device interface for the interface (%08x)\n", (int) result);
+			break;
+		}
+		// Get interface class and subclass
+		kr = (*interface)->GetInterfaceClass(interface,
+													&interfaceClass);
+		kr = (*interface)->GetInterfaceSubClass(interface,
+												&interfaceSubClass);
+		printf("Interface class %d, subclass %d\n", interfaceClass,
+													interfaceSubClass);
+		// Now open the interface. This will cause the pipes associated with
+		// the endpoints in the interface descriptor to be instantiated
+		kr = (*interface)->USBInterfaceOpen(interface);
+		if (kr != kIOReturnSuccess)
+		{
+			fprintf(stderr, "Unable to open interface (%08x)\n", kr);
+			(void) (*interface)->Release(interface);
+			break;
+		}
+		// Get the number of endpoints associated with this interface
+		kr = (*interface)->GetNumEndpoints(interface,
+										&interfaceNumEndpoints);
+		if (kr != kIOReturnSuccess)
+		{
+			fprintf(stderr, "Unable to get number of endpoints (%08x)\n", kr);
+			(void) (*interface)->USBInterfaceClose(interface);
+			(void) (*interface)->Release(interface);
+			break;
+		}
+		printf("Interface has %d endpoints\n", interfaceNumEndpoints);
+		// Access each pipe in turn, starting with the pipe at index 1
+		// The pipe at index 0 is the default control pipe and should be
+		// accessed using (*usbDevice)->DeviceRequest() instead
+		for (pipeRef = 1; pipeRef <= interfaceNumEndpoints; pipeRef++)
+		{
+			IOReturn        kr2;
+			UInt8           direction;
+			UInt8           number;
+			UInt8           transferType;
+			UInt16          maxPacketSize;
+			UInt8           interval;
+			kr2 = (*interface)->GetPipeProperties(interface,
+										pipeRef, &direction,
+										&number, &transferType,
+										&maxPacketSize, &interval);
+			if (kr2 != kIOReturnSuccess && kr2 != kIOReturnNotOpen)
+				fprintf(stderr, "Unable to get properties of pipe %d (%08x)\n", pipeRef, kr2);
+			else
+			{
+				printf("PipeRef %d: ", pipeRef);
+				printf("direction %s, ", usb_dir[direction]);
+				printf("transfer type %s, maxPacketSize %d\n", usb_ctrl[direction], maxPacketSize);
+			}
+		}
+		
+		(void) (*interface)->USBInterfaceClose(interface);
+		(void) (*interface)->Release(interface);
+	}
+	
+	return kr;
+}
+
+int findPipe(IOUSBInterfaceInterface300** interface, UInt8 type, UInt8 direction)
+{
+	IOReturn kr;
+	UInt8 interfaceNumEndpoints, findDirection, number, transferType, interval;
+	UInt16 maxPacketSize;
+	
+	if ((*interface)->GetNumEndpoints(interface, &interfaceNumEndpoints) != KERN_SUCCESS)
+		return 0;
+	
+	for (UInt8 pipeRef = 1; pipeRef <= interfaceNumEndpoints; pipeRef++)
+	{
+		kr = (*interface)->GetPipeProperties(interface, pipeRef, &findDirection, &number, &transferType, &maxPacketSize, &interval);
+		
+		if (kr != kIOReturnSuccess)
+		{
+			fprintf(stderr, "GetPipeProperties Failure (0x%08x)\n", kr);
+			
+			return 0;
+		}
+		
+#ifdef DEBUG
+		printf("pipeRef: %d direction: %d number: %d transferType: %d maxPacketSize: %d interval: %d\n", pipeRef, findDirection, number, transferType, maxPacketSize, interval);
+#endif
+		
+		if (type == transferType && direction == findDirection)
+		{
+#ifdef DEBUG
+			printf("Found matching endpoint\n");
+#endif
+			
+			return pipeRef;
+		}
+	}
+	
+	return 0;
+}
+
+IOReturn hciCommand(IOUSBInterfaceInterface300** interface, const void* command, UInt16 length, UInt32 timeout)
+{
+	IOUSBDevRequestTO request;
+	request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBDevice);
+	request.bRequest = 0;
+	request.wValue = 0;
+	request.wIndex = 0;
+	request.wLength = length;
+	request.pData = (void*)command;
+	request.completionTimeout = timeout;
+	request.noDataTimeout = timeout;
+	IOReturn result = (*interface)->ControlRequestTO(interface, 0, &request);
+	
+	if (result != kIOReturnSuccess)
+	{
+		fprintf(stderr, "hciCommand failed ('%s' 0x%08x).\n", stringFromReturn(result), result);
+	}
+#ifdef DEBUG
+	else
+	{
+		printf("hciCommand success (%d bytes sent).\n", request.wLenDone);
+	}
+#endif
+	
+	return result;
+}
+
+IOReturn getDeviceStatus(IOUSBInterfaceInterface300** interface, USBStatus *status, UInt32 timeout)
+{
+	uint16_t stat = 0;
+	IOUSBDevRequestTO request;
+	request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
+	request.bRequest = kUSBRqGetStatus;
+	request.wValue = 0;
+	request.wIndex = 0;
+	request.wLength = sizeof(stat);
+	request.pData = &stat;
+	request.completionTimeout = timeout;
+	request.noDataTimeout = timeout;
+	IOReturn result = (*interface)->ControlRequestTO(interface, 0, &request);
+	*status = stat;
+	return result;
+}
+
+IOReturn bulkWrite(IOUSBInterfaceInterface300** interface, UInt8 pipeRef, const void* data, UInt32 length, UInt32 timeout)
+{
+	IOReturn kr;
+	kr = (*interface)->WritePipeTO(interface, pipeRef, (void*)data, length, timeout, timeout);
+	
+	if (kr != kIOReturnSuccess)
+		fprintf(stderr, "WritePipeTO failed ('%s' 0x%08x).\n", stringFromReturn(kr), kr);
+	
+	return kr;
+}
+
+static TransportStatus transportStatus(IOReturn kr)
+{
+	switch (kr)
+	{
+		case kIOReturnSuccess:
+			return kTransportSuccess;
+		case kIOReturnTimeout:
+		case kIOUSBTransactionTimeout:
+			return kTransportTimeout;
+		case kIOUSBPipeStalled:
+			return kTransportStalled;
+		case kIOReturnNotResponding:
+			return kTransportNotResponding;
+		case kIOReturnNoDevice:
+			return kTransportNoDevice;
+		case kIOReturnAborted:
+			return kTransportAborted;
+		default:
+			return kTransportError;
+	}
+}
+
+IOKitTransport::IOKitTransport(IOUSBDeviceInterface300** device, IOUSBInterfaceInterface300** interface, UInt8 pipeIn, UInt8 pipeOut) :
+	mDevice(device), mInterface(interface), mPipeIn(pipeIn), mPipeOut(pipeOut), mLocation(0), mTimeout(HCI_TIMEOUT)
+{
+	(*mDevice)->GetLocationID(mDevice, &mLocation);
+}
+
+IOKitTransport::~IOKitTransport()
+{
+	abort();
+	
+	(*mInterface)->USBInterfaceClose(mInterface);
+	(*mInterface)->Release(mInterface);
+	
+	(*mDevice)->USBDeviceClose(mDevice);
+	(*mDevice)->Release(mDevice);
+}
+
+IOKitTransport *IOKitTransport::open(UInt16 vendorId, UInt16 productId)
+{
+	IOUSBDeviceInterface300** device = getDevice(vendorId, productId);
+	
+	if (device == NULL)
+	{
+		fprintf(stderr, "[%04x:%04x]: Failed to retrieve USB device\n", vendorId, productId);
+		return NULL;
+	}
+	
+	return open(device, vendorId, productId);
+}
+
+size_t IOKitTransport::openAll(UInt16 vendorId, UInt16 productId, std::vector<std::unique_ptr<HciTransport>> &transports)
+{
+	IOUSBDeviceInterface300** devices[USB_MAX_DEVICES];
+	int count = getDevices(vendorId, productId, devices, USB_MAX_DEVICES);
+	size_t opened = 0;
+	
+	for (int i = 0; i < count; i++)
+	{
+		IOKitTransport *transport = open(devices[i], vendorId, productId);
+		
+		if (transport == NULL)
+			continue;
+		
+		transports.push_back(std::unique_ptr<HciTransport>(transport));
+		opened++;
+	}
+	
+	return opened;
+}
+
+// One first-match notification per watched vendor/product
+struct HotplugWatch
+{
+	HotplugMatch match;
+	const HotplugHandler *handler;
+	io_iterator_t iterator;
+};
+
+static void devicesArrived(void *refCon, io_iterator_t iterator)
+{
+	HotplugWatch *watch = (HotplugWatch *)refCon;
+	io_service_t service;
+	
+	// Draining the iterator also re-arms the notification
+	while ((service = IOIteratorNext(iterator)) != 0)
+	{
+		IOUSBDeviceInterface300** device = getServiceDevice(service);
+		IOObjectRelease(service);
+		
+		if (device == NULL)
+			continue;
+		
+		IOKitTransport *transport = IOKitTransport::open(device, watch->match.vendorId, watch->match.productId);
+		
+		if (transport != NULL)
+			(*watch->handler)(std::unique_ptr<HciTransport>(transport), watch->match.vendorId, watch->match.productId);
+	}
+}
+
+bool IOKitTransport::watch(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler)
+{
+	IONotificationPortRef port = IONotificationPortCreate(kIOMasterPortDefault);
+	
+	if (port == NULL)
+	{
+		fprintf(stderr, "IONotificationPortCreate failed\n");
+		return false;
+	}
+	
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(port), kCFRunLoopDefaultMode);
+	
+	std::vector<HotplugWatch> watches(matches.size());
+	bool result = true;
+	
+	for (size_t i = 0; i < matches.size(); i++)
+	{
+		HotplugWatch &watch = watches[i];
+		watch.match = matches[i];
+		watch.handler = &handler;
+		watch.iterator = 0;
+		
+		CFDictionaryRef matchingDictionary = getMatchingDictionary(watch.match.vendorId, watch.match.productId);
+		
+		if (matchingDictionary == NULL)
+		{
+			fprintf(stderr, "Failed to initialize device matching dictionary.\n");
+			result = false;
+			break;
+		}
+		
+		// Consumes the matching dictionary
+		IOReturn kr = IOServiceAddMatchingNotification(port, kIOFirstMatchNotification, matchingDictionary, devicesArrived, &watch, &watch.iterator);
+		
+		if (kr != kIOReturnSuccess)
+		{
+			fprintf(stderr, "[%04x:%04x]: IOServiceAddMatchingNotification failed (0x%08x)\n", watch.match.vendorId, watch.match.productId, kr);
+			result = false;
+			break;
+		}
+		
+		// Devices that are already attached
+		devicesArrived(&watch, watch.iterator);
+	}
+	
+	while (result && !stop)
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, HOTPLUG_POLL_INTERVAL / 1000.0, false);
+	
+	for (size_t i = 0; i < watches.size(); i++)
+	{
+		if (watches[i].iterator != 0)
+			IOObjectRelease(watches[i].iterator);
+	}
+	
+	IONotificationPortDestroy(port);
+	
+	return result;
+}
+
+IOKitTransport *IOKitTransport::open(IOUSBDeviceInterface300** device, UInt16 vendorId, UInt16 productId)
+{
+#ifdef DEBUG
+	printDeviceInfo(device);
+#endif
+	
+	IOReturn kr = (*device)->USBDeviceOpen(device);
+	
+	if (kr != kIOReturnSuccess)
+	{
+		fprintf(stderr, "USBDeviceOpen failed (0x%08x)\n", kr);
+		(*device)->Release(device);
+		return NULL;
+	}
+	
+	setConfiguration(device);
+	
+	//findInterfaces(device);
+	
+	IOUSBInterfaceInterface300** interface = findFirstInterface(device);
+	
+	if (interface == NULL)
+	{
+		fprintf(stderr, "[%04x:%04x]:  Failed to locate interface\n", vendorId, productId);
+		(*device)->USBDeviceClose(device);
+		(*device)->Release(device);
+		return NULL;
+	}
+	
+	kr = (*interface)->USBInterfaceOpen(interface);
+	
+	if (kr != kIOReturnSuccess)
+	{
+		fprintf(stderr, "USBInterfaceOpen failed (0x%08x)\n", kr);
+		(*interface)->Release(interface);
+		(*device)->USBDeviceClose(device);
+		(*device)->Release(device);
+		return NULL;
+	}
+	
+#ifdef DEBUG
+	UInt8 intfIndex = 0, intfClass = 0, intfSubClass = 0, intfProtocol = 0;
+	
+	(*interface)->GetInterfaceNumber(interface, &intfIndex);
+	(*interface)->GetInterfaceClass(interface, &intfClass);
+	(*interface)->GetInterfaceSubClass(interface, &intfSubClass);
+	(*interface)->GetInterfaceProtocol(interface, &intfProtocol);
+	
+	printf("[%04x:%04x]: Interface %d (class %02x, subclass %02x, protocol %02x) located\n", vendorId, productId, intfIndex, intfClass, intfSubClass, intfProtocol);
+#endif
+	
+	UInt8 pipeIn = findPipe(interface, kUSBInterrupt, kUSBIn);
+	UInt8 pipeOut = findPipe(interface, kUSBBulk, kUSBOut);
+	
+	if (pipeIn == 0 || pipeOut == 0)
+	{
+		fprintf(stderr, "Couldn't find pipes.\n");
+		(*interface)->USBInterfaceClose(interface);
+		(*interface)->Release(interface);
+		(*device)->USBDeviceClose(device);
+		(*device)->Release(device);
+		return NULL;
+	}
+	
+	return new IOKitTransport(device, interface, pipeIn, pipeOut);
+}
+
+TransportStatus IOKitTransport::sendCommand(const void *command, uint16_t length)
+{
+	return transportStatus(hciCommand(mInterface, command, length, mTimeout));
+}
+
+TransportStatus IOKitTransport::bulkWrite(const void *data, uint32_t length)
+{
+	return transportStatus(::bulkWrite(mInterface, mPipeOut, data, length, mTimeout));
+}
+
+TransportStatus IOKitTransport::readEvent(void *buffer, uint32_t *length, uint32_t timeout)
+{
+	IOReturn kr;
+	UInt32 size = *length;
+	
+	if (timeout == 0)
+		kr = (*mInterface)->ReadPipe(mInterface, mPipeIn, buffer, &size);
+	else
+		kr = (*mInterface)->ReadPipeTO(mInterface, mPipeIn, buffer, &size, timeout, timeout);
+	
+	*length = size;
+	
+	return transportStatus(kr);
+}
+
+TransportStatus IOKitTransport::getDeviceStatus(uint16_t *status)
+{
+	USBStatus stat = 0;
+	IOReturn kr = ::getDeviceStatus(mInterface, &stat, mTimeout);
+	*status = stat;
+	return transportStatus(kr);
+}
+
+void IOKitTransport::clearStall()
+{
+	(*mInterface)->ClearPipeStall(mInterface, mPipeIn);
+}
+
+void IOKitTransport::abort()
+{
+	(*mInterface)->AbortPipe(mInterface, mPipeIn);
+	(*mInterface)->AbortPipe(mInterface, mPipeOut);
+}
+
+#endif // __APPLE__
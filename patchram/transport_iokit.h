@@ -0,0 +1,63 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef transport_iokit_h
+#define transport_iokit_h
+
+#include <IOKit/usb/IOUSBLib.h>
+#include "hci_transport.h"
+
+IOReturn findInterfaces(IOUSBDeviceInterface300 **device);
+int findPipe(IOUSBInterfaceInterface300** interface, UInt8 type, UInt8 direction);
+IOReturn hciCommand(IOUSBInterfaceInterface300** interface, const void* command, UInt16 length, UInt32 timeout);
+IOReturn getDeviceStatus(IOUSBInterfaceInterface300** interface, USBStatus *status, UInt32 timeout);
+IOReturn bulkWrite(IOUSBInterfaceInterface300** interface, UInt8 pipeRef, const void* data, UInt32 length, UInt32 timeout);
+
+// HCI transport over the IOKit USB user client
+class IOKitTransport : public HciTransport
+{
+public:
+	~IOKitTransport();
+
+	static IOKitTransport *open(UInt16 vendorId, UInt16 productId);
+	static IOKitTransport *open(IOUSBDeviceInterface300** device, UInt16 vendorId, UInt16 productId);
+	static size_t openAll(UInt16 vendorId, UInt16 productId, std::vector<std::unique_ptr<HciTransport>> &transports);
+	static bool watch(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler);
+
+	TransportStatus sendCommand(const void *command, uint16_t length);
+	TransportStatus bulkWrite(const void *data, uint32_t length);
+	TransportStatus readEvent(void *buffer, uint32_t *length, uint32_t timeout);
+	TransportStatus getDeviceStatus(uint16_t *status);
+	void clearStall();
+	void abort();
+	uint32_t location() const { return mLocation; }
+	void setTimeout(uint32_t timeout) { mTimeout = timeout; }
+
+private:
+	IOKitTransport(IOUSBDeviceInterface300** device, IOUSBInterfaceInterface300** interface, UInt8 pipeIn, UInt8 pipeOut);
+
+	IOUSBDeviceInterface300** mDevice;
+	IOUSBInterfaceInterface300** mInterface;
+	UInt8 mPipeIn;
+	UInt8 mPipeOut;
+	UInt32 mLocation;
+	UInt32 mTimeout;
+};
+
+#endif
@@ -0,0 +1,425 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "transport_libusb.h"
+
+#ifdef PATCHRAM_USE_LIBUSB
+
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+
+static TransportStatus transportStatus(int error)
+{
+	switch (error)
+	{
+		case LIBUSB_SUCCESS:
+			return kTransportSuccess;
+		case LIBUSB_ERROR_TIMEOUT:
+			return kTransportTimeout;
+		case LIBUSB_ERROR_PIPE:
+			return kTransportStalled;
+		case LIBUSB_ERROR_NO_DEVICE:
+			return kTransportNoDevice;
+		case LIBUSB_ERROR_INTERRUPTED:
+			return kTransportAborted;
+		default:
+			return kTransportError;
+	}
+}
+
+static TransportStatus transferStatus(libusb_transfer_status status)
+{
+	switch (status)
+	{
+		case LIBUSB_TRANSFER_COMPLETED:
+			return kTransportSuccess;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return kTransportTimeout;
+		case LIBUSB_TRANSFER_STALL:
+			return kTransportStalled;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return kTransportNoDevice;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return kTransportAborted;
+		default:
+			return kTransportError;
+	}
+}
+
+static void LIBUSB_CALL transferComplete(libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+// Same layout as the IOKit locationID: bus in the top byte, then one nibble per port
+static uint32_t deviceLocation(libusb_device *device)
+{
+	uint8_t ports[7];
+	int count = libusb_get_port_numbers(device, ports, sizeof(ports));
+	uint32_t location = (uint32_t)libusb_get_bus_number(device) << 24;
+
+	for (int i = 0; i < count && i < 6; i++)
+		location |= (uint32_t)(ports[i] & 0x0F) << (20 - i * 4);
+
+	return location;
+}
+
+LibusbTransport::LibusbTransport(const Context &context, libusb_device_handle *handle, int interface, uint8_t endpointIn, uint8_t endpointOut) :
+	mContext(context), mHandle(handle), mInterface(interface), mEndpointIn(endpointIn), mEndpointOut(endpointOut), mTimeout(HCI_TIMEOUT)
+{
+	mLocation = deviceLocation(libusb_get_device(handle));
+	mControl = libusb_alloc_transfer(0);
+	mBulk = libusb_alloc_transfer(0);
+	mInterrupt = libusb_alloc_transfer(0);
+}
+
+LibusbTransport::~LibusbTransport()
+{
+	abort();
+
+	libusb_free_transfer(mControl);
+	libusb_free_transfer(mBulk);
+	libusb_free_transfer(mInterrupt);
+
+	// Releasing the interface re-attaches the kernel driver
+	libusb_release_interface(mHandle, mInterface);
+	libusb_close(mHandle);
+}
+
+LibusbTransport::Context LibusbTransport::createContext()
+{
+	libusb_context *context = NULL;
+	int rc = libusb_init(&context);
+
+	if (rc != LIBUSB_SUCCESS)
+	{
+		fprintf(stderr, "libusb_init failed (%s)\n", libusb_error_name(rc));
+		return Context();
+	}
+
+	return Context(context, libusb_exit);
+}
+
+LibusbTransport *LibusbTransport::open(uint16_t vendorId, uint16_t productId)
+{
+	Context context = createContext();
+
+	if (!context)
+		return NULL;
+
+	libusb_device_handle *handle = libusb_open_device_with_vid_pid(context.get(), vendorId, productId);
+
+	if (handle == NULL)
+	{
+		fprintf(stderr, "[%04x:%04x]: Failed to retrieve USB device\n", vendorId, productId);
+		return NULL;
+	}
+
+	return open(context, handle, vendorId, productId);
+}
+
+size_t LibusbTransport::openAll(uint16_t vendorId, uint16_t productId, std::vector<std::unique_ptr<HciTransport>> &transports)
+{
+	Context context = createContext();
+	libusb_device **devices = NULL;
+	size_t opened = 0;
+
+	if (!context)
+		return 0;
+
+	ssize_t count = libusb_get_device_list(context.get(), &devices);
+
+	for (ssize_t i = 0; i < count; i++)
+	{
+		libusb_device_descriptor descriptor;
+		libusb_device_handle *handle = NULL;
+
+		if (libusb_get_device_descriptor(devices[i], &descriptor) != LIBUSB_SUCCESS || descriptor.idVendor != vendorId || descriptor.idProduct != productId)
+			continue;
+
+		int rc = libusb_open(devices[i], &handle);
+
+		if (rc != LIBUSB_SUCCESS)
+		{
+			fprintf(stderr, "[%04x:%04x]: Failed to open USB device 0x%08x (%s)\n", vendorId, productId, deviceLocation(devices[i]), libusb_error_name(rc));
+			continue;
+		}
+
+		LibusbTransport *transport = open(context, handle, vendorId, productId);
+
+		if (transport == NULL)
+			continue;
+
+		transports.push_back(std::unique_ptr<HciTransport>(transport));
+		opened++;
+	}
+
+	if (devices != NULL)
+		libusb_free_device_list(devices, 1);
+
+	return opened;
+}
+
+// Devices reported by the hotplug callback, opened once the event loop returns
+struct HotplugQueue
+{
+	std::mutex lock;
+	std::vector<libusb_device *> devices;
+};
+
+static int LIBUSB_CALL deviceArrived(libusb_context *, libusb_device *device, libusb_hotplug_event, void *userData)
+{
+	HotplugQueue *queue = (HotplugQueue *)userData;
+
+	// No synchronous I/O is allowed from here, keep a reference for later
+	std::lock_guard<std::mutex> lock(queue->lock);
+	queue->devices.push_back(libusb_ref_device(device));
+
+	return 0;
+}
+
+bool LibusbTransport::watch(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler)
+{
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		fprintf(stderr, "libusb hotplug is not supported on this platform\n");
+		return false;
+	}
+
+	Context context = createContext();
+
+	if (!context)
+		return false;
+
+	HotplugQueue queue;
+	std::vector<libusb_hotplug_callback_handle> callbacks;
+	bool result = true;
+
+	for (size_t i = 0; i < matches.size(); i++)
+	{
+		libusb_hotplug_callback_handle callback;
+		int rc = libusb_hotplug_register_callback(context.get(), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE, matches[i].vendorId, matches[i].productId, LIBUSB_HOTPLUG_MATCH_ANY, deviceArrived, &queue, &callback);
+
+		if (rc != LIBUSB_SUCCESS)
+		{
+			fprintf(stderr, "[%04x:%04x]: libusb_hotplug_register_callback failed (%s)\n", matches[i].vendorId, matches[i].productId, libusb_error_name(rc));
+			result = false;
+			break;
+		}
+
+		callbacks.push_back(callback);
+	}
+
+	while (result && !stop)
+	{
+		std::vector<libusb_device *> devices;
+
+		{
+			std::lock_guard<std::mutex> lock(queue.lock);
+			devices.swap(queue.devices);
+		}
+
+		for (size_t i = 0; i < devices.size(); i++)
+		{
+			libusb_device_descriptor descriptor;
+			libusb_device_handle *handle = NULL;
+
+			if (libusb_get_device_descriptor(devices[i], &descriptor) == LIBUSB_SUCCESS)
+			{
+				int rc = libusb_open(devices[i], &handle);
+
+				if (rc != LIBUSB_SUCCESS)
+				{
+					fprintf(stderr, "[%04x:%04x]: Failed to open USB device 0x%08x (%s)\n", descriptor.idVendor, descriptor.idProduct, deviceLocation(devices[i]), libusb_error_name(rc));
+				}
+				else
+				{
+					LibusbTransport *transport = open(context, handle, descriptor.idVendor, descriptor.idProduct);
+
+					if (transport != NULL)
+						handler(std::unique_ptr<HciTransport>(transport), descriptor.idVendor, descriptor.idProduct);
+				}
+			}
+
+			libusb_unref_device(devices[i]);
+		}
+
+		// Transports opened from this context run the event loop too, and may be the ones to call deviceArrived
+		timeval interval = { 0, HOTPLUG_POLL_INTERVAL * 1000 };
+		libusb_handle_events_timeout_completed(context.get(), &interval, NULL);
+	}
+
+	for (size_t i = 0; i < callbacks.size(); i++)
+		libusb_hotplug_deregister_callback(context.get(), callbacks[i]);
+
+	for (size_t i = 0; i < queue.devices.size(); i++)
+		libusb_unref_device(queue.devices[i]);
+
+	return result;
+}
+
+LibusbTransport *LibusbTransport::open(const Context &context, libusb_device_handle *handle, uint16_t vendorId, uint16_t productId)
+{
+	int rc;
+
+	// btusb normally owns the interface, detach it while we hold the device
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+
+	libusb_config_descriptor *config = NULL;
+	int interface = 0;
+	uint8_t endpointIn = 0, endpointOut = 0;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(handle), &config) == LIBUSB_SUCCESS)
+	{
+		// Same as IOKit findFirstInterface/findPipe: first interface, interrupt in and bulk out
+		const libusb_interface_descriptor *descriptor = &config->interface[0].altsetting[0];
+		interface = descriptor->bInterfaceNumber;
+
+		for (int i = 0; i < descriptor->bNumEndpoints; i++)
+		{
+			const libusb_endpoint_descriptor *endpoint = &descriptor->endpoint[i];
+			uint8_t type = endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+			bool in = (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+
+			if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT && in && endpointIn == 0)
+				endpointIn = endpoint->bEndpointAddress;
+			else if (type == LIBUSB_TRANSFER_TYPE_BULK && !in && endpointOut == 0)
+				endpointOut = endpoint->bEndpointAddress;
+		}
+
+		libusb_free_config_descriptor(config);
+	}
+
+	if (endpointIn == 0 || endpointOut == 0)
+	{
+		fprintf(stderr, "Couldn't find pipes.\n");
+		libusb_close(handle);
+		return NULL;
+	}
+
+	rc = libusb_claim_interface(handle, interface);
+
+	if (rc != LIBUSB_SUCCESS)
+	{
+		fprintf(stderr, "libusb_claim_interface failed (%s)\n", libusb_error_name(rc));
+		libusb_close(handle);
+		return NULL;
+	}
+
+#ifdef DEBUG
+	printf("[%04x:%04x]: Interface %d located (in 0x%02x, out 0x%02x)\n", vendorId, productId, interface, endpointIn, endpointOut);
+#else
+	(void)vendorId;
+	(void)productId;
+#endif
+
+	return new LibusbTransport(context, handle, interface, endpointIn, endpointOut);
+}
+
+TransportStatus LibusbTransport::submit(libusb_transfer *transfer)
+{
+	int completed = 0;
+
+	transfer->user_data = &completed;
+	transfer->callback = transferComplete;
+
+	int rc = libusb_submit_transfer(transfer);
+
+	if (rc != LIBUSB_SUCCESS)
+		return transportStatus(rc);
+
+	while (!completed)
+	{
+		rc = libusb_handle_events_completed(mContext.get(), &completed);
+
+		if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_INTERRUPTED)
+		{
+			// Cancel and keep handling events until the callback has run
+			libusb_cancel_transfer(transfer);
+		}
+	}
+
+	return transferStatus(transfer->status);
+}
+
+TransportStatus LibusbTransport::sendCommand(const void *command, uint16_t length)
+{
+	if (length > sizeof(mControlBuffer) - LIBUSB_CONTROL_SETUP_SIZE)
+		return kTransportError;
+
+	libusb_fill_control_setup(mControlBuffer, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_DEVICE, 0, 0, 0, length);
+	memcpy(mControlBuffer + LIBUSB_CONTROL_SETUP_SIZE, command, length);
+	libusb_fill_control_transfer(mControl, mHandle, mControlBuffer, transferComplete, NULL, mTimeout);
+
+	TransportStatus status = submit(mControl);
+
+	if (status != kTransportSuccess)
+		fprintf(stderr, "hciCommand failed ('%s').\n", transportStatusString(status));
+
+	return status;
+}
+
+TransportStatus LibusbTransport::bulkWrite(const void *data, uint32_t length)
+{
+	libusb_fill_bulk_transfer(mBulk, mHandle, mEndpointOut, (unsigned char *)data, (int)length, transferComplete, NULL, mTimeout);
+
+	TransportStatus status = submit(mBulk);
+
+	if (status != kTransportSuccess)
+		fprintf(stderr, "Bulk write failed ('%s').\n", transportStatusString(status));
+
+	return status;
+}
+
+TransportStatus LibusbTransport::readEvent(void *buffer, uint32_t *length, uint32_t timeout)
+{
+	libusb_fill_interrupt_transfer(mInterrupt, mHandle, mEndpointIn, (unsigned char *)buffer, (int)*length, transferComplete, NULL, timeout);
+
+	TransportStatus status = submit(mInterrupt);
+	*length = status == kTransportSuccess ? (uint32_t)mInterrupt->actual_length : 0;
+
+	return status;
+}
+
+TransportStatus LibusbTransport::getDeviceStatus(uint16_t *status)
+{
+	libusb_fill_control_setup(mControlBuffer, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE, LIBUSB_REQUEST_GET_STATUS, 0, 0, sizeof(*status));
+	libusb_fill_control_transfer(mControl, mHandle, mControlBuffer, transferComplete, NULL, mTimeout);
+
+	TransportStatus result = submit(mControl);
+	*status = mControlBuffer[LIBUSB_CONTROL_SETUP_SIZE] | mControlBuffer[LIBUSB_CONTROL_SETUP_SIZE + 1] << 8;
+
+	return result;
+}
+
+void LibusbTransport::clearStall()
+{
+	libusb_clear_halt(mHandle, mEndpointIn);
+}
+
+void LibusbTransport::abort()
+{
+	// Cancelling a transfer that is not in flight is harmless (LIBUSB_ERROR_NOT_FOUND)
+	libusb_cancel_transfer(mControl);
+	libusb_cancel_transfer(mBulk);
+	libusb_cancel_transfer(mInterrupt);
+}
+
+#endif // PATCHRAM_USE_LIBUSB
@@ -0,0 +1,81 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef transport_libusb_h
+#define transport_libusb_h
+
+#include "hci_transport.h"
+
+#ifdef PATCHRAM_USE_LIBUSB
+
+#include <libusb-1.0/libusb.h>
+#include <memory>
+#include <vector>
+
+/*
+ *  HCI transport over libusb-1.0
+ *
+ *  Every transfer is submitted asynchronously and completed by running the
+ *  libusb event loop, which is what timeouts and cancellation rely on.
+ */
+class LibusbTransport : public HciTransport
+{
+public:
+	~LibusbTransport();
+
+	static LibusbTransport *open(uint16_t vendorId, uint16_t productId);
+	static size_t openAll(uint16_t vendorId, uint16_t productId, std::vector<std::unique_ptr<HciTransport>> &transports);
+	static bool watch(const std::vector<HotplugMatch> &matches, const std::atomic<bool> &stop, const HotplugHandler &handler);
+
+	TransportStatus sendCommand(const void *command, uint16_t length);
+	TransportStatus bulkWrite(const void *data, uint32_t length);
+	TransportStatus readEvent(void *buffer, uint32_t *length, uint32_t timeout);
+	TransportStatus getDeviceStatus(uint16_t *status);
+	void clearStall();
+	void abort();
+	uint32_t location() const { return mLocation; }
+	void setTimeout(uint32_t timeout) { mTimeout = timeout; }
+
+private:
+	typedef std::shared_ptr<libusb_context> Context;
+
+	LibusbTransport(const Context &context, libusb_device_handle *handle, int interface, uint8_t endpointIn, uint8_t endpointOut);
+
+	static Context createContext();
+	static LibusbTransport *open(const Context &context, libusb_device_handle *handle, uint16_t vendorId, uint16_t productId);
+
+	TransportStatus submit(libusb_transfer *transfer);
+
+	// Shared by every device opened together, released with the last one
+	Context mContext;
+	libusb_device_handle *mHandle;
+	int mInterface;
+	uint8_t mEndpointIn;
+	uint8_t mEndpointOut;
+	uint32_t mLocation;
+	uint32_t mTimeout;
+	libusb_transfer *mControl;
+	libusb_transfer *mBulk;
+	libusb_transfer *mInterrupt;
+	uint8_t mControlBuffer[LIBUSB_CONTROL_SETUP_SIZE + 0x104];
+};
+
+#endif // PATCHRAM_USE_LIBUSB
+
+#endif
@@ -0,0 +1,641 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "transport_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include "firmware_image.h"
+#include "hci.h"
+#include "intel_firmware.h"
+
+// HCI error codes
+#define HCI_STATUS_UNKNOWN_COMMAND 0x01
+#define HCI_STATUS_COMMAND_DISALLOWED 0x0c
+#define HCI_STATUS_INVALID_PARAMETERS 0x12
+
+uint64_t hashLaunchRam(const FirmwareImage &image)
+{
+	RamImage ram;
+
+	ram.load(image);
+
+	return ram.hash();
+}
+
+static bool parseFault(const char *value, SimulatorConfig &config)
+{
+	char *end;
+
+	config.faultOpcode = (uint16_t)strtoul(value, &end, 16);
+
+	if (*end != ':')
+		return false;
+
+	config.faultIndex = (uint32_t)strtoul(end + 1, &end, 0);
+
+	if (*end != ':' || config.faultIndex == 0)
+		return false;
+
+	const char *type = end + 1;
+
+	if (strcmp(type, "status") == 0)
+		config.fault = kFaultStatus;
+	else if (strcmp(type, "drop") == 0)
+		config.fault = kFaultDrop;
+	else if (strcmp(type, "stall") == 0)
+		config.fault = kFaultStall;
+	else if (strcmp(type, "disconnect") == 0)
+		config.fault = kFaultDisconnect;
+	else
+		return false;
+
+	return true;
+}
+
+bool parseSimulatorConfig(const char *spec, SimulatorConfig &config)
+{
+	std::string options(spec);
+	size_t start = 0;
+
+	while (start < options.size())
+	{
+		size_t comma = options.find(',', start);
+
+		if (comma == std::string::npos)
+			comma = options.size();
+
+		std::string option = options.substr(start, comma - start);
+		size_t equals = option.find('=');
+		start = comma + 1;
+
+		if (equals == std::string::npos)
+		{
+			fprintf(stderr, "Simulator option '%s' has no value\n", option.c_str());
+			return false;
+		}
+
+		std::string key = option.substr(0, equals);
+		const char *value = option.c_str() + equals + 1;
+		char *end = NULL;
+		// The LMP subversion is given in hex like the chip table and the fault opcodes
+		unsigned long number = strtoul(value, &end, key == "subver" ? 16 : 0);
+
+		if (key == "fault")
+		{
+			if (!parseFault(value, config))
+			{
+				fprintf(stderr, "Invalid simulator fault '%s' (expected <opcode hex>:<n>:<status|drop|stall|disconnect>)\n", value);
+				return false;
+			}
+			continue;
+		}
+
+		if (end == value || *end != '\0')
+		{
+			fprintf(stderr, "Invalid value for simulator option '%s'\n", key.c_str());
+			return false;
+		}
+
+		if (key == "latency")
+			config.latency = (uint32_t)number;
+		else if (key == "jitter")
+			config.jitter = (uint32_t)number;
+		else if (key == "reset")
+			config.resetTime = (uint32_t)number;
+		else if (key == "boot")
+			config.bootTime = (uint32_t)number;
+		else if (key == "credits" && number > 0 && number <= 0xFF)
+			config.credits = (uint8_t)number;
+		else if (key == "seed")
+			config.seed = (uint32_t)number;
+		else if (key == "devices" && number > 0)
+			config.devices = (uint32_t)number;
+		else if (key == "build")
+			config.build = (uint16_t)number;
+		else if (key == "patched")
+			config.patchedBuild = (uint16_t)number;
+		else if (key == "subver")
+			config.lmpSubversion = (uint16_t)number;
+		else if (key == "handshake")
+			config.handshake = number != 0;
+		else
+		{
+			fprintf(stderr, "Unknown simulator option '%s'\n", option.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Heap order for SimulatorScheduler, earliest task on top
+static bool laterTask(const SimulatorScheduler::Clock::time_point &a, const SimulatorScheduler::Clock::time_point &b)
+{
+	return a > b;
+}
+
+SimulatorScheduler::SimulatorScheduler() :
+	mThread(&SimulatorScheduler::run, this)
+{
+}
+
+SimulatorScheduler::~SimulatorScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mStop = true;
+		mSignal.notify_all();
+	}
+
+	mThread.join();
+}
+
+void SimulatorScheduler::schedule(const void *owner, Clock::time_point when, const std::function<void()> &task)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	Task entry = { when, owner, task };
+
+	mTasks.push_back(entry);
+	std::push_heap(mTasks.begin(), mTasks.end(), [](const Task &a, const Task &b) { return laterTask(a.when, b.when); });
+	mSignal.notify_all();
+}
+
+void SimulatorScheduler::cancel(const void *owner)
+{
+	std::unique_lock<std::mutex> lock(mLock);
+
+	mTasks.erase(std::remove_if(mTasks.begin(), mTasks.end(), [owner](const Task &task) { return task.owner == owner; }), mTasks.end());
+	std::make_heap(mTasks.begin(), mTasks.end(), [](const Task &a, const Task &b) { return laterTask(a.when, b.when); });
+	mSignal.wait(lock, [this, owner] { return mRunning != owner; });
+}
+
+void SimulatorScheduler::run()
+{
+	std::unique_lock<std::mutex> lock(mLock);
+
+	while (!mStop)
+	{
+		if (mTasks.empty())
+		{
+			mSignal.wait(lock);
+			continue;
+		}
+
+		if (mTasks.front().when > Clock::now())
+		{
+			mSignal.wait_until(lock, mTasks.front().when);
+			continue;
+		}
+
+		std::pop_heap(mTasks.begin(), mTasks.end(), [](const Task &a, const Task &b) { return laterTask(a.when, b.when); });
+		Task task = mTasks.back();
+		mTasks.pop_back();
+
+		mRunning = task.owner;
+		lock.unlock();
+		task.task();
+		lock.lock();
+		mRunning = NULL;
+		mSignal.notify_all();
+	}
+}
+
+SimulatedTransport::SimulatedTransport(const SimulatorConfig &config, SimulatorScheduler *scheduler) :
+	mConfig(config), mRandom(config.seed), mBusyUntil(Clock::now()), mBootUntil(mBusyUntil), mBuild(config.build), mScheduler(scheduler)
+{
+}
+
+SimulatedTransport::~SimulatedTransport()
+{
+	if (mScheduler)
+		mScheduler->cancel(this);
+}
+
+// Completions still being processed at time, ignoring the first skip queued events
+uint32_t SimulatedTransport::outstanding(Clock::time_point time, size_t skip) const
+{
+	uint32_t count = 0;
+
+	for (size_t i = skip; i < mEvents.size(); i++)
+	{
+		if (mEvents[i].commandComplete && mEvents[i].ready > time)
+			count++;
+	}
+
+	return count;
+}
+
+SimulatedTransport::Event &SimulatedTransport::queueEvent(Clock::time_point ready, uint8_t eventCode, uint8_t length)
+{
+	Event event = Event();
+	event.ready = ready;
+	event.length = 2 + length;
+	event.data[0] = eventCode;
+	event.data[1] = length;
+
+	mEvents.push_back(event);
+
+	return mEvents.back();
+}
+
+TransportStatus SimulatedTransport::process(const uint8_t *command, uint32_t length)
+{
+	if (length < HCI_COMMAND_HEADER_SIZE || length != HCI_COMMAND_HEADER_SIZE + (uint32_t)command[2])
+	{
+		fprintf(stderr, "Simulator: malformed command (%u bytes)\n", length);
+		return kTransportError;
+	}
+
+	std::lock_guard<std::mutex> lock(mLock);
+
+	if (mDisconnected)
+		return kTransportNoDevice;
+
+	uint16_t opcode = hciGet16(command);
+	uint8_t paramLength = command[2];
+	Clock::time_point now = Clock::now();
+	SimulatorFault fault = kFaultNone;
+	uint8_t status = 0;
+
+	mStats.commands++;
+
+	// Still booting, the command is lost
+	if (now < mBootUntil)
+	{
+		mStats.dropped++;
+		return kTransportSuccess;
+	}
+
+	uint32_t pending = outstanding(now, 0);
+
+	if (pending + 1 > mStats.maxOutstanding)
+		mStats.maxOutstanding = pending + 1;
+
+	if (pending >= mConfig.credits)
+	{
+		mStats.creditOverruns++;
+		status = HCI_STATUS_COMMAND_DISALLOWED;
+	}
+
+	if (mConfig.fault != kFaultNone && opcode == mConfig.faultOpcode && ++mFaultCount == mConfig.faultIndex)
+	{
+		fault = mConfig.fault;
+		mStats.faults++;
+	}
+
+	if (fault == kFaultDisconnect)
+	{
+		mDisconnected = true;
+		mEvents.clear();
+		mSignal.notify_all();
+		scheduleRead();
+		return kTransportNoDevice;
+	}
+
+	// Commands are processed one after the other
+	uint32_t processing = mConfig.latency;
+
+	if (mConfig.jitter > 0)
+		processing += std::uniform_int_distribution<uint32_t>(0, mConfig.jitter)(mRandom);
+
+	if (opcode == HCI_OPCODE_RESET)
+		processing += mConfig.resetTime;
+
+	Clock::time_point ready = (mBusyUntil > now ? mBusyUntil : now) + std::chrono::microseconds(processing);
+	mBusyUntil = ready;
+
+	if (fault == kFaultDrop)
+		return kTransportSuccess;
+
+	uint8_t returnLength = 0;
+	bool vendorEvent = false;
+
+	switch (opcode)
+	{
+		case HCI_OPCODE_RESET:
+		case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
+			break;
+		case HCI_OPCODE_READ_LOCAL_VERSION:
+		case HCI_OPCODE_READ_FEATURES:
+			returnLength = 8;
+			break;
+		case HCI_OPCODE_READ_USB_PRODUCT:
+			returnLength = 4;
+			break;
+		case HCI_OPCODE_READ_VERBOSE_CONFIG:
+			returnLength = 6;
+			break;
+		case HCI_OPCODE_LAUNCH_RAM:
+		case HCI_OPCODE_END_OF_RECORD:
+			if (!mMiniDriver && status == 0)
+				status = HCI_STATUS_COMMAND_DISALLOWED;
+			break;
+		case HCI_OPCODE_READ_RAM:
+			if (paramLength == HciReadRamCommand::kParamSize && command[7] <= READ_RAM_MAX_LENGTH)
+				returnLength = command[7];
+			else if (status == 0)
+				status = HCI_STATUS_INVALID_PARAMETERS;
+			break;
+		default:
+			if (status == 0)
+				status = HCI_STATUS_UNKNOWN_COMMAND;
+			break;
+	}
+
+	if (fault == kFaultStatus)
+		status = mConfig.faultStatus;
+
+	// Opcode (2) + status (1) + numCommands (1) + return parameters
+	Event &event = queueEvent(ready, HCI_EVENT_COMMAND_COMPLETE, 4 + returnLength);
+	uint8_t *data = event.data;
+	event.commandComplete = true;
+	event.stall = fault == kFaultStall;
+	hciPut16(data + 3, opcode);
+	data[5] = status;
+
+	if (status == 0)
+	{
+		switch (opcode)
+		{
+			case HCI_OPCODE_RESET:
+				// Patched firmware becomes active on reset
+				if (mStats.patched)
+					mBuild = mConfig.patchedBuild;
+
+				mMiniDriver = false;
+				mBootUntil = ready + std::chrono::microseconds(mConfig.bootTime);
+				break;
+			case HCI_OPCODE_READ_FEATURES:
+				// LMP features of a BR/EDR + LE controller
+				data[6] = 0xbf;
+				data[7] = 0xfe;
+				data[8] = 0xcf;
+				data[9] = 0xfe;
+				data[10] = 0xdb;
+				data[11] = 0xff;
+				data[12] = 0x7b;
+				data[13] = 0x87;
+				break;
+			case HCI_OPCODE_READ_LOCAL_VERSION:
+				data[6] = 0x06;
+				hciPut16(data + 7, mBuild & 0x0fff);
+				data[9] = 0x06;
+				hciPut16(data + 10, 0x000f);
+				hciPut16(data + 12, mConfig.lmpSubversion);
+				break;
+			case HCI_OPCODE_READ_USB_PRODUCT:
+				hciPut16(data + 6, mConfig.vendorId);
+				hciPut16(data + 8, mConfig.productId);
+				break;
+			case HCI_OPCODE_READ_VERBOSE_CONFIG:
+				data[6] = mConfig.chipsetId;
+				hciPut16(data + 10, mBuild);
+				break;
+			case HCI_OPCODE_DOWNLOAD_MINIDRIVER:
+				mMiniDriver = true;
+				mBootUntil = ready + std::chrono::microseconds(mConfig.bootTime);
+				break;
+			case HCI_OPCODE_LAUNCH_RAM:
+				mStats.launchRam++;
+				mStats.launchRamBytes += paramLength;
+				mStats.launchRamHash = hashBytes(command, length, mStats.launchRam == 1 ? FNV1A64_OFFSET : mStats.launchRamHash);
+
+				if (paramLength >= LAUNCH_RAM_ADDRESS_SIZE)
+					mRam.write(hciGet32(command + HCI_COMMAND_HEADER_SIZE), command + HCI_COMMAND_HEADER_SIZE + LAUNCH_RAM_ADDRESS_SIZE, paramLength - LAUNCH_RAM_ADDRESS_SIZE);
+				break;
+			case HCI_OPCODE_READ_RAM:
+				mRam.read(hciGet32(command + HCI_COMMAND_HEADER_SIZE), data + 6, returnLength);
+				break;
+			case HCI_OPCODE_END_OF_RECORD:
+				mMiniDriver = false;
+				mStats.patched = true;
+				mBootUntil = ready + std::chrono::microseconds(mConfig.bootTime);
+				vendorEvent = mConfig.handshake;
+				break;
+		}
+	}
+
+	// Handshake devices announce they are ready to be reset once booted
+	if (vendorEvent)
+	{
+		Event &ready = queueEvent(mBootUntil + std::chrono::microseconds(mConfig.latency), HCI_EVENT_VENDOR, 1);
+		ready.data[2] = 0x00;
+	}
+
+	mSignal.notify_all();
+	scheduleRead();
+
+	return kTransportSuccess;
+}
+
+TransportStatus SimulatedTransport::sendCommand(const void *command, uint16_t length)
+{
+	return process((const uint8_t *)command, length);
+}
+
+TransportStatus SimulatedTransport::bulkWrite(const void *data, uint32_t length)
+{
+	return process((const uint8_t *)data, length);
+}
+
+TransportStatus SimulatedTransport::readEvent(void *buffer, uint32_t *length, uint32_t timeout)
+{
+	std::unique_lock<std::mutex> lock(mLock);
+	uint32_t aborts = mAborts;
+	// Like the USB backends no timeout waits until an event arrives or the read is aborted
+	Clock::time_point deadline = timeout ? Clock::now() + std::chrono::milliseconds(timeout) : Clock::time_point::max();
+
+	while (true)
+	{
+		if (mDisconnected)
+			return kTransportNoDevice;
+
+		if (mStalled)
+			return kTransportStalled;
+
+		if (mAborts != aborts)
+			return kTransportAborted;
+
+		Clock::time_point now = Clock::now();
+
+		if (!mEvents.empty() && mEvents.front().ready <= now)
+			break;
+
+		if (now >= deadline)
+			return kTransportTimeout;
+
+		Clock::time_point wake = deadline;
+
+		if (!mEvents.empty() && mEvents.front().ready < wake)
+			wake = mEvents.front().ready;
+
+		if (wake == Clock::time_point::max())
+			mSignal.wait(lock);
+		else
+			mSignal.wait_until(lock, wake);
+	}
+
+	return takeEvent(buffer, length);
+}
+
+// Hand out the first queued event, it has to be ready. Called with mLock held.
+TransportStatus SimulatedTransport::takeEvent(void *buffer, uint32_t *length)
+{
+	Event event = mEvents.front();
+	mEvents.pop_front();
+
+	if (event.stall)
+	{
+		mStalled = true;
+		return kTransportStalled;
+	}
+
+	// Credits left once this command has completed
+	if (event.commandComplete)
+	{
+		uint32_t busy = outstanding(event.ready, 0);
+		event.data[2] = busy < mConfig.credits ? mConfig.credits - busy : 0;
+	}
+
+	if (*length < event.length)
+		return kTransportError;
+
+	memcpy(buffer, event.data, event.length);
+	*length = event.length;
+
+	return kTransportSuccess;
+}
+
+// Arrange for the outstanding async read to be looked at once the first event is ready. Called with mLock held.
+void SimulatedTransport::scheduleRead()
+{
+	if (!mReadCallback || mReadScheduled)
+		return;
+
+	mReadScheduled = true;
+
+	if (mDisconnected || mStalled)
+		mScheduler->schedule(this, Clock::now(), [this] { completeRead(); });
+	else if (!mEvents.empty())
+		mScheduler->schedule(this, mEvents.front().ready, [this] { completeRead(); });
+	else
+		mReadScheduled = false;
+}
+
+void SimulatedTransport::completeRead()
+{
+	EventCallback callback;
+	TransportStatus status;
+	uint32_t length = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mReadScheduled = false;
+
+		if (!mReadCallback)
+			return;
+
+		if (mDisconnected)
+		{
+			status = kTransportNoDevice;
+		}
+		else if (mStalled)
+		{
+			status = kTransportStalled;
+		}
+		else
+		{
+			// An earlier, since aborted, event may have been the one this was scheduled for
+			if (mEvents.empty() || mEvents.front().ready > Clock::now())
+			{
+				scheduleRead();
+				return;
+			}
+
+			length = mReadLength;
+			status = takeEvent(mReadBuffer, &length);
+		}
+
+		callback.swap(mReadCallback);
+	}
+
+	callback(status, length);
+}
+
+bool SimulatedTransport::readEventAsync(void *buffer, uint32_t length, const EventCallback &callback)
+{
+	if (mScheduler == NULL)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mLock);
+
+	mReadBuffer = buffer;
+	mReadLength = length;
+	mReadCallback = callback;
+	scheduleRead();
+
+	return true;
+}
+
+TransportStatus SimulatedTransport::getDeviceStatus(uint16_t *status)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+
+	if (mDisconnected)
+		return kTransportNoDevice;
+
+	*status = 0;
+
+	return kTransportSuccess;
+}
+
+void SimulatedTransport::clearStall()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+	mStalled = false;
+}
+
+void SimulatedTransport::abort()
+{
+	EventCallback callback;
+
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mEvents.clear();
+		mAborts++;
+		mSignal.notify_all();
+		callback.swap(mReadCallback);
+	}
+
+	if (callback)
+		callback(kTransportAborted, 0);
+}
+
+SimulatorStats SimulatedTransport::stats()
+{
+	std::lock_guard<std::mutex> lock(mLock);
+
+	mStats.ramHash = mRam.hash();
+
+	return mStats;
+}
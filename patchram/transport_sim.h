@@ -0,0 +1,211 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef transport_sim_h
+#define transport_sim_h
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "hci_transport.h"
+#include "ram_image.h"
+
+class FirmwareImage;
+
+enum SimulatorFault
+{
+	kFaultNone,
+	kFaultStatus,		// Complete the command with an error status
+	kFaultDrop,			// Never complete the command
+	kFaultStall,		// Stall the event pipe instead of delivering the completion
+	kFaultDisconnect,	// Device disappears when the command arrives
+};
+
+struct SimulatorConfig
+{
+	uint16_t vendorId = 0x0a5c;
+	uint16_t productId = 0x216f;
+	uint16_t lmpSubversion = 0x220e;	// BCM20702A1
+	uint8_t chipsetId = 0x3f;
+	uint16_t build = 0;					// Build reported before patching (0 = ROM)
+	uint16_t patchedBuild = 1572;		// Build reported after patching and reset
+	bool handshake = false;				// Send the vendor event after END_OF_RECORD
+
+	uint32_t latency = 250;				// Per-command processing time (us)
+	uint32_t jitter = 0;				// Additional uniformly distributed time (us)
+	uint32_t resetTime = 0;				// Additional time for HCI_RESET (us)
+	uint32_t bootTime = 0;				// Commands are dropped for this long after RESET,
+										// DOWNLOAD_MINIDRIVER and END_OF_RECORD complete (us)
+	uint8_t credits = 1;				// Commands the controller accepts at once
+	uint32_t seed = 1;
+	uint32_t devices = 1;				// Controllers per job in fleet mode
+
+	SimulatorFault fault = kFaultNone;
+	uint16_t faultOpcode = 0;
+	uint32_t faultIndex = 1;			// Inject on the nth command with faultOpcode
+	uint8_t faultStatus = 0x1f;			// Unspecified error
+};
+
+struct SimulatorStats
+{
+	uint32_t commands = 0;
+	uint32_t launchRam = 0;
+	uint64_t launchRamBytes = 0;
+	uint64_t launchRamHash = 0;			// hashBytes() over every LAUNCH_RAM command in order
+	uint64_t ramHash = 0;				// hashLaunchRam() of the RAM the controller ended up with
+	uint32_t maxOutstanding = 0;
+	uint32_t creditOverruns = 0;
+	uint32_t faults = 0;
+	uint32_t dropped = 0;				// Commands sent while the controller was booting
+	bool patched = false;
+};
+
+/*
+ *  Parse simulator options
+ *
+ *  spec - Comma separated key=value list: latency, jitter, reset, boot (us),
+ *         credits, seed, devices, build, patched, subver, handshake and
+ *         fault=<opcode hex>:<n>:<status|drop|stall|disconnect>
+ *
+ *  returns false on an unknown key or malformed value
+ */
+bool parseSimulatorConfig(const char *spec, SimulatorConfig &config);
+
+/*
+ *  Hash of the RAM contents the LAUNCH_RAM commands of an image leave behind
+ *
+ *  A later write to an address replaces the earlier one, so a firmware write
+ *  that was resumed and sent some commands twice hashes the same as a clean
+ *  one. Returns 0 for an image without LAUNCH_RAM commands, see RamImage.
+ */
+uint64_t hashLaunchRam(const FirmwareImage &image);
+
+/*
+ *  Timer thread shared by simulated controllers
+ *
+ *  Completes readEventAsync calls at the time the simulated controller
+ *  would deliver the event, so any number of controllers can be driven
+ *  without a thread each. Tasks belong to an owner and are cancelled with it.
+ */
+class SimulatorScheduler
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	SimulatorScheduler();
+	~SimulatorScheduler();
+
+	void schedule(const void *owner, Clock::time_point when, const std::function<void()> &task);
+
+	// Drop the owner's pending tasks and wait for one that is running to return
+	void cancel(const void *owner);
+
+private:
+	struct Task
+	{
+		Clock::time_point when;
+		const void *owner;
+		std::function<void()> task;
+	};
+
+	void run();
+
+	std::mutex mLock;
+	std::condition_variable mSignal;
+	std::vector<Task> mTasks;			// Heap, earliest first
+	const void *mRunning = NULL;
+	bool mStop = false;
+	std::thread mThread;
+};
+
+/*
+ *  In-process Broadcom controller
+ *
+ *  Answers the HCI commands used by UpgradeSession with the event layout of a
+ *  real BCM20702 part. Commands are processed one at a time, each taking
+ *  latency + jitter, and completions only become readable once that time has
+ *  passed. Submitting more commands than the controller has credits for is
+ *  counted and completed with Command Disallowed. readEventAsync is only
+ *  supported when a scheduler is given.
+ */
+class SimulatedTransport : public HciTransport
+{
+public:
+	explicit SimulatedTransport(const SimulatorConfig &config, SimulatorScheduler *scheduler = NULL);
+	~SimulatedTransport();
+
+	TransportStatus sendCommand(const void *command, uint16_t length);
+	TransportStatus bulkWrite(const void *data, uint32_t length);
+	TransportStatus readEvent(void *buffer, uint32_t *length, uint32_t timeout);
+	TransportStatus getDeviceStatus(uint16_t *status);
+	void clearStall();
+	void abort();
+	bool readEventAsync(void *buffer, uint32_t length, const EventCallback &callback);
+
+	SimulatorStats stats();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Event
+	{
+		Clock::time_point ready;
+		bool commandComplete;
+		bool stall;
+		uint16_t length;
+		uint8_t data[2 + 255];			// Event code, parameter length, parameters
+	};
+
+	TransportStatus process(const uint8_t *command, uint32_t length);
+	TransportStatus takeEvent(void *buffer, uint32_t *length);
+	void scheduleRead();
+	void completeRead();
+	uint32_t outstanding(Clock::time_point time, size_t skip) const;
+	Event &queueEvent(Clock::time_point ready, uint8_t eventCode, uint8_t length);
+
+	SimulatorConfig mConfig;
+	SimulatorStats mStats;
+	std::mutex mLock;
+	std::condition_variable mSignal;
+	std::deque<Event> mEvents;
+	std::mt19937 mRandom;
+	Clock::time_point mBusyUntil;
+	Clock::time_point mBootUntil;
+	uint32_t mFaultCount = 0;
+	uint32_t mAborts = 0;				// Wakes a blocked readEvent
+	uint16_t mBuild;
+	bool mMiniDriver = false;
+	bool mStalled = false;
+	bool mDisconnected = false;
+	RamImage mRam;						// Written by LAUNCH_RAM, read by READ_RAM
+
+	// Outstanding readEventAsync
+	SimulatorScheduler *mScheduler;
+	void *mReadBuffer = NULL;
+	uint32_t mReadLength = 0;
+	EventCallback mReadCallback;
+	bool mReadScheduled = false;
+};
+
+#endif
@@ -0,0 +1,767 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "upgrade_engine.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <exception>
+#include "readiness.h"
+
+typedef UpgradeEngine::Clock Clock;
+
+/*
+ *  Coroutine returning bool
+ *
+ *  Starts suspended and runs when awaited, resuming the awaiting coroutine
+ *  when it returns. The top level task of a session is started by the engine.
+ */
+class UpgradeTask
+{
+public:
+	struct promise_type
+	{
+		bool result = false;
+		std::coroutine_handle<> continuation;
+
+		UpgradeTask get_return_object() { return UpgradeTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			void await_resume() noexcept {}
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				std::coroutine_handle<> continuation = handle.promise().continuation;
+				return continuation ? continuation : std::noop_coroutine();
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+		void return_value(bool value) { result = value; }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	UpgradeTask() {}
+	UpgradeTask(UpgradeTask &&other) : mHandle(other.mHandle) { other.mHandle = nullptr; }
+	~UpgradeTask() { if (mHandle) mHandle.destroy(); }
+
+	UpgradeTask &operator=(UpgradeTask &&other)
+	{
+		std::swap(mHandle, other.mHandle);
+		return *this;
+	}
+
+	bool await_ready() const { return false; }
+	bool await_resume() const { return mHandle.promise().result; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation)
+	{
+		mHandle.promise().continuation = continuation;
+		return mHandle;
+	}
+
+	std::coroutine_handle<promise_type> handle() const { return mHandle; }
+
+private:
+	explicit UpgradeTask(std::coroutine_handle<promise_type> handle) : mHandle(handle) {}
+
+	std::coroutine_handle<promise_type> mHandle;
+};
+
+/*
+ *  One upgrade driven by UpgradeEngine
+ *
+ *  The upgrade reads top to bottom in upgrade(), every point where
+ *  UpgradeSession would block is a co_await on the engine instead.
+ */
+class EngineSession : public UpgradeContext
+{
+public:
+	EngineSession(UpgradeEngine &engine, HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed);
+	~EngineSession();
+
+	void start();
+	bool finished() const { return mFinished; }
+	bool result() const { return mResult; }
+
+	// Loop thread: take completed reads, waking the coroutine if it waits for an event
+	void collect();
+
+	// Loop thread: a timer set for this session fired
+	void expire(uint32_t generation);
+
+private:
+	// Oldest event, or NULL after timeout ms (0 waits indefinitely). Hand it back with releaseEvent().
+	struct EventAwaiter
+	{
+		EngineSession &session;
+		uint32_t timeout;
+
+		bool await_ready() const { return !session.mEvents.empty(); }
+		void await_suspend(std::coroutine_handle<> handle) { session.suspend(handle, true, timeout); }
+		const HciEvent *await_resume() const { return session.mEvents.empty() ? NULL : &session.mEvents.front(); }
+	};
+
+	struct SleepAwaiter
+	{
+		EngineSession &session;
+		uint32_t delay;
+
+		bool await_ready() const { return delay == 0; }
+		void await_suspend(std::coroutine_handle<> handle) { session.suspend(handle, false, delay); }
+		void await_resume() const {}
+	};
+
+	EventAwaiter nextEvent(uint32_t timeout) { return EventAwaiter{ *this, timeout }; }
+	void releaseEvent() { mEvents.pop_front(); }
+	SleepAwaiter sleep(uint32_t delay) { return SleepAwaiter{ *this, delay }; }
+
+	void suspend(std::coroutine_handle<> handle, bool forEvent, uint32_t timeout);
+	void wake();
+
+	UpgradeTask main();
+	UpgradeTask upgrade();
+	UpgradeTask writeFirmware();
+	UpgradeTask resume();
+	UpgradeTask verifyRam();
+	UpgradeTask command(const uint8_t *command, uint16_t length, const char *name);
+	UpgradeTask completion();
+	UpgradeTask receive();
+	UpgradeTask waitForController(int delay);
+	bool fail(const char *message);
+
+	void postRead();
+	void readComplete(TransportStatus status, uint32_t length);
+
+	UpgradeEngine &mEngine;
+	UpgradeTask mTask;
+	Clock::time_point mStart;
+	bool mFinished;
+	bool mResult;
+
+	// The suspended coroutine and what it waits for
+	std::coroutine_handle<> mWaiter;
+	bool mWaitingForEvent;
+	uint32_t mGeneration;
+
+	std::deque<HciEvent> mEvents;
+
+	// Asynchronous read, written by the backend and handed over by UpgradeEngine::post()
+	HciEvent mRead;
+	bool mReadPosted;
+
+	// Only for transports without readEventAsync
+	std::unique_ptr<EventReader> mReader;
+};
+
+EngineSession::EngineSession(UpgradeEngine &engine, HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed) :
+	UpgradeContext(transport, image, options, feed), mEngine(engine), mFinished(false), mResult(false),
+	mWaitingForEvent(false), mGeneration(0), mReadPosted(false)
+{
+}
+
+EngineSession::~EngineSession()
+{
+	if (mReader)
+		mReader->stop();
+}
+
+void EngineSession::start()
+{
+	mStart = Clock::now();
+	mTransport.setTimeout(mOptions.timeout);
+
+	// Post the first event read before anything is sent
+	mReadPosted = mTransport.readEventAsync(mRead.data, HCI_MAX_EVENT_SIZE, [this](TransportStatus status, uint32_t length) { readComplete(status, length); });
+
+	if (!mReadPosted)
+	{
+		mReader.reset(new EventReader(mTransport, &mCommandsSent));
+		mReader->start([this] { mEngine.post(this); });
+	}
+
+	mTask = main();
+	mEngine.schedule(mTask.handle());
+}
+
+void EngineSession::postRead()
+{
+	mRead.sent = mCommandsSent;
+	mReadPosted = mTransport.readEventAsync(mRead.data, HCI_MAX_EVENT_SIZE, [this](TransportStatus status, uint32_t length) { readComplete(status, length); });
+}
+
+void EngineSession::readComplete(TransportStatus status, uint32_t length)
+{
+	mRead.status = status;
+	mRead.length = length;
+	mEngine.post(this);
+}
+
+void EngineSession::collect()
+{
+	if (mFinished)
+		return;
+
+	if (mReader)
+	{
+		const HciEvent *event;
+
+		while ((event = mReader->poll()) != NULL)
+		{
+			mEvents.push_back(*event);
+			mReader->release();
+		}
+	}
+	else
+	{
+		mEvents.push_back(mRead);
+
+		// Keep a read posted, a failed one ends the event stream
+		if (mRead.status == kTransportSuccess)
+			postRead();
+		else
+			mReadPosted = false;
+	}
+
+	if (mWaiter && mWaitingForEvent && !mEvents.empty())
+		wake();
+}
+
+void EngineSession::expire(uint32_t generation)
+{
+	if (mWaiter && generation == mGeneration)
+		wake();
+}
+
+void EngineSession::suspend(std::coroutine_handle<> handle, bool forEvent, uint32_t timeout)
+{
+	mWaiter = handle;
+	mWaitingForEvent = forEvent;
+
+	if (timeout > 0)
+		mEngine.addTimer(Clock::now() + std::chrono::milliseconds(timeout), this, mGeneration);
+}
+
+void EngineSession::wake()
+{
+	std::coroutine_handle<> waiter = mWaiter;
+
+	// Outstanding timers for this wait no longer apply
+	mWaiter = nullptr;
+	mGeneration++;
+	mEngine.schedule(waiter);
+}
+
+bool EngineSession::fail(const char *message)
+{
+	fprintf(stderr, "%s", message);
+	mState = kUpdateAborted;
+	noteState();
+
+	return false;
+}
+
+UpgradeTask EngineSession::main()
+{
+	mResult = co_await upgrade();
+
+	if (mReader)
+		mReader->stop();
+
+	mTransport.abort();
+
+	mStats.elapsed = std::chrono::duration<double, std::milli>(Clock::now() - mStart).count();
+	mFinished = true;
+	mEngine.mActive--;
+
+	co_return mResult;
+}
+
+UpgradeTask EngineSession::upgrade()
+{
+	noteState();
+
+	// Probing without the initial reset comes back here if a download is needed
+	while (mState != kDownloadMiniDriver)
+	{
+		if (mState == kPreInitialize)
+		{
+			// Reset the device to put it in a defined state.
+			mResetSent = true;
+
+			if (!co_await command(HCI_RESET.data(), HCI_RESET.size(), "HCI_RESET"))
+				co_return false;
+
+			// Wait for device to become ready after reset.
+			if (!co_await waitForController(mOptions.postResetDelay))
+				co_return fail("Device lost after reset, aborting.\n");
+		}
+
+		if (!co_await command(HCI_READ_LOCAL_VERSION.data(), HCI_READ_LOCAL_VERSION.size(), "HCI_READ_LOCAL_VERSION"))
+			co_return false;
+
+		if (!co_await command(HCI_VSC_READ_USB_PRODUCT.data(), HCI_VSC_READ_USB_PRODUCT.size(), "HCI_VSC_READ_USB_PRODUCT"))
+			co_return false;
+
+		if (!co_await command(HCI_VSC_READ_VERBOSE_CONFIG.data(), HCI_VSC_READ_VERBOSE_CONFIG.size(), "HCI_VSC_READ_VERBOSE_CONFIG"))
+			co_return false;
+
+		if (mState == kUpdateNotNeeded)
+			co_return true;
+	}
+
+	// Initiate firmware upgrade
+	if (!co_await command(HCI_VSC_DOWNLOAD_MINIDRIVER.data(), HCI_VSC_DOWNLOAD_MINIDRIVER.size(), "HCI_VSC_DOWNLOAD_MINIDRIVER"))
+		co_return false;
+
+	// If the device is not ready to receive the firmware instructions
+	// we will deadlock due to lack of responses.
+	if (!co_await waitForController(mOptions.initialDelay))
+		co_return fail("Device lost after mini-driver download, aborting.\n");
+
+	// Late probe answers may still hold controller credits, the first completion reports the real number
+	mCredits = 1;
+	mCreditsSent = mCommandsSent;
+
+	// Write first instruction(s) to trigger response
+	mState = kInstructionWrite;
+	noteState();
+
+	// A transient error while verifying resumes the write, one while END_OF_RECORD is outstanding is final
+	do
+	{
+		if (!co_await writeFirmware())
+			co_return false;
+
+		// Read the firmware back while the mini-driver still owns the RAM, END_OF_RECORD launches it
+		if (mOptions.verify && !mVerified)
+		{
+			if (!co_await verifyRam())
+				co_return false;
+
+			if (mState == kResume)
+				continue;
+		}
+
+		// Firmware data fully written
+		if (!co_await command(HCI_VSC_END_OF_RECORD.data(), HCI_VSC_END_OF_RECORD.size(), "HCI_VSC_END_OF_RECORD"))
+			co_return false;
+	}
+	while (mState == kResume);
+
+	if (mOptions.useHandshake)
+	{
+		// The controller announces it is ready to be reset with a vendor event
+		if (mState != kResetWrite && !co_await completion())
+			co_return false;
+
+		if (mState != kResetWrite)
+			co_return fail("Unexpected event while waiting for the vendor event, aborting.\n");
+	}
+	else if (!co_await waitForController(mOptions.preResetDelay))
+	{
+		co_return fail("Device lost after firmware write, aborting.\n");
+	}
+
+	if (!co_await command(HCI_RESET.data(), HCI_RESET.size(), "HCI_RESET"))
+		co_return false;
+
+	if (!co_await waitForController(mOptions.postResetDelay))
+		co_return fail("Device lost after reset, aborting.\n");
+
+	uint16_t status;
+	mTransport.getDeviceStatus(&status);
+#ifdef DEBUG
+	printf("Reset Complete (0x%08x)\n", status);
+#endif
+	printf("Done.\n");
+	mState = kUpdateComplete;
+	noteState();
+
+	co_return true;
+}
+
+UpgradeTask EngineSession::writeFirmware()
+{
+	// Only blocks the loop while nothing is in flight and the firmware is still being loaded
+	while (mDataIndex < instructionCount(mInFlight == 0) || mInFlight > 0 || mState == kResume)
+	{
+		if (mState == kResume)
+		{
+			if (!co_await resume())
+				co_return false;
+
+			continue;
+		}
+
+		if (mOptions.pipelineDepth > 0)
+		{
+			TransportStatus status = kTransportSuccess;
+
+			// Keep as many instructions in flight as the controller has credits for
+			while (mDataIndex < instructionCount(mInFlight == 0) && mInFlight < window())
+			{
+				if ((status = writeInstruction(mDataIndex)) != kTransportSuccess)
+					break;
+
+				mDataIndex++;
+				mInFlight++;
+			}
+
+			// The firmware being loaded turned out to be invalid
+			if (mState == kUpdateAborted)
+				break;
+
+			if (status != kTransportSuccess)
+			{
+				if (!recover(status))
+					co_return fail("LAUNCH_RAM write failed, aborting.\n");
+
+				continue;
+			}
+
+			// Wait for completions, or for the controller to return credits
+			if (!co_await receive())
+				co_return false;
+		}
+		else
+		{
+			TransportStatus status = writeInstruction(mDataIndex);
+
+			if (status != kTransportSuccess)
+			{
+				if (!recover(status))
+					co_return fail("LAUNCH_RAM write failed, aborting.\n");
+
+				continue;
+			}
+
+			mDataIndex++;
+
+			if (!co_await completion())
+				co_return false;
+		}
+
+		if (mState == kInstructionWritten)
+			mState = kInstructionWrite;
+		else if (mState != kInstructionWrite && mState != kResume)
+			co_return fail("Unexpected event during firmware write, aborting.\n");
+	}
+
+	if (mState == kUpdateAborted)
+	{
+		noteState();
+		co_return false;
+	}
+
+	co_return true;
+}
+
+// Read back and check the RAM, leaves kVerifyRam once every region matched or for kResume
+UpgradeTask EngineSession::verifyRam()
+{
+	startVerify();
+	noteState();
+
+	bool reading = sendReads();
+
+	while (reading)
+	{
+		if (!co_await receive())
+			co_return false;
+
+		reading = mState == kVerifyRam && sendReads();
+	}
+
+	noteState();
+
+	co_return mState != kUpdateAborted;
+}
+
+// Restart the event stream and resynchronize, leaves kResume once the write can go on
+UpgradeTask EngineSession::resume()
+{
+	// A failed read ends the event stream, start it again
+	if (mReader)
+	{
+		mReader->stop();
+		mReader->start([this] { mEngine.post(this); });
+	}
+	else if (!mReadPosted)
+	{
+		postRead();
+	}
+
+	TransportStatus status = sendResync();
+
+	if (status != kTransportSuccess)
+	{
+		if (!recover(status))
+			co_return fail("Resync failed, aborting.\n");
+
+		co_return true;
+	}
+
+	// Stale completions are dropped until the resync is answered, or another error starts over
+	while (mState == kResume && mResyncSent)
+	{
+		if (!co_await receive())
+			co_return false;
+	}
+
+	co_return true;
+}
+
+// Send a command and wait for the event that moves the state machine on
+UpgradeTask EngineSession::command(const uint8_t *command, uint16_t length, const char *name)
+{
+	if (send(command, length) != kTransportSuccess)
+	{
+		fprintf(stderr, "%s failed, aborting.\n", name);
+		mState = kUpdateAborted;
+		noteState();
+		co_return false;
+	}
+
+	co_return co_await completion();
+}
+
+// Take events until the state changes, returns false if the upgrade was aborted
+UpgradeTask EngineSession::completion()
+{
+	DeviceState state = mState;
+
+	while (mState == state)
+	{
+		if (!co_await receive())
+			co_return false;
+	}
+
+	co_return true;
+}
+
+// Apply the next event to the state machine, returns false if the upgrade was aborted
+UpgradeTask EngineSession::receive()
+{
+	const HciEvent *event = co_await nextEvent(eventTimeout());
+
+	// Skip late answers to readiness probes
+	while (event && isProbeEvent(event))
+	{
+		releaseEvent();
+		event = co_await nextEvent(eventTimeout());
+	}
+
+	// Waiting longer leaves the state as it is, the caller takes the next event
+	if (event == NULL)
+	{
+		handleTimeout();
+	}
+	else
+	{
+		handleEvent(event);
+		releaseEvent();
+
+		// Apply completions that queued up meanwhile before sending more
+		while (drainsEvents() && !mEvents.empty())
+		{
+			if (!isProbeEvent(&mEvents.front()))
+				handleEvent(&mEvents.front());
+			releaseEvent();
+		}
+	}
+
+	noteState();
+
+	co_return mState != kUpdateAborted;
+}
+
+/*
+ *  Wait until the controller is ready for the next command
+ *
+ *  Same probing as waitForReady(), with the waits handed to the engine.
+ *
+ *  delay - Fixed delay (ms), also the upper bound when probing
+ *
+ *  returns false if the transport failed while waiting
+ */
+UpgradeTask EngineSession::waitForController(int delay)
+{
+	if (mOptions.fixedDelays)
+	{
+		co_await sleep(delay);
+		co_return true;
+	}
+
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(delay);
+	uint32_t interval = probeInterval();
+
+	while (Clock::now() < deadline)
+	{
+		TransportStatus status = mTransport.sendCommand(HCI_READ_FEATURES.data(), HCI_READ_FEATURES.size());
+
+		// A controller that is still booting may also refuse the control transfer
+		if (status == kTransportNoDevice || status == kTransportAborted)
+			co_return false;
+
+		Clock::time_point wake = std::min(Clock::now() + std::chrono::milliseconds(interval), deadline);
+
+		// Take events until the probe is answered or the interval runs out
+		while (Clock::now() < wake)
+		{
+			uint32_t timeout = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(wake - Clock::now()).count();
+			const HciEvent *event = co_await nextEvent(timeout ? timeout : 1);
+
+			if (event == NULL)
+				continue;
+
+			// Leave the failure for the state machine to report
+			if (event->status != kTransportSuccess)
+				co_return false;
+
+			bool probe = isProbeEvent(event);
+			releaseEvent();
+
+			if (probe)
+				co_return true;
+		}
+
+		if (interval < READY_PROBE_INTERVAL_MAX)
+			interval *= 2;
+	}
+
+	co_return true;
+}
+
+// Heap order for the timers, earliest on top
+static bool laterTimer(const UpgradeEngine::Clock::time_point &a, const UpgradeEngine::Clock::time_point &b)
+{
+	return a > b;
+}
+
+UpgradeEngine::UpgradeEngine() :
+	mActive(0)
+{
+}
+
+UpgradeEngine::~UpgradeEngine()
+{
+}
+
+size_t UpgradeEngine::add(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed)
+{
+	mSessions.push_back(std::unique_ptr<EngineSession>(new EngineSession(*this, transport, image, options, feed)));
+
+	return mSessions.size() - 1;
+}
+
+void UpgradeEngine::addTimer(Clock::time_point when, EngineSession *session, uint32_t generation)
+{
+	Timer timer = { when, session, generation };
+
+	mTimers.push_back(timer);
+	std::push_heap(mTimers.begin(), mTimers.end(), [](const Timer &a, const Timer &b) { return laterTimer(a.when, b.when); });
+}
+
+void UpgradeEngine::post(EngineSession *session)
+{
+	std::lock_guard<std::mutex> lock(mLock);
+
+	mPosted.push_back(session);
+	mSignal.notify_one();
+}
+
+size_t UpgradeEngine::run()
+{
+	mActive = mSessions.size();
+
+	for (size_t i = 0; i < mSessions.size(); i++)
+		mSessions[i]->start();
+
+	while (true)
+	{
+		while (!mReady.empty())
+		{
+			std::coroutine_handle<> handle = mReady.front();
+			mReady.pop_front();
+			handle.resume();
+		}
+
+		if (mActive == 0)
+			break;
+
+		std::vector<EngineSession *> posted;
+
+		{
+			std::unique_lock<std::mutex> lock(mLock);
+
+			if (mTimers.empty())
+				mSignal.wait(lock, [this] { return !mPosted.empty(); });
+			else
+				mSignal.wait_until(lock, mTimers.front().when, [this] { return !mPosted.empty(); });
+
+			posted.swap(mPosted);
+		}
+
+		for (size_t i = 0; i < posted.size(); i++)
+			posted[i]->collect();
+
+		Clock::time_point now = Clock::now();
+
+		while (!mTimers.empty() && mTimers.front().when <= now)
+		{
+			std::pop_heap(mTimers.begin(), mTimers.end(), [](const Timer &a, const Timer &b) { return laterTimer(a.when, b.when); });
+			Timer timer = mTimers.back();
+			mTimers.pop_back();
+
+			timer.session->expire(timer.generation);
+		}
+	}
+
+	mTimers.clear();
+
+	size_t succeeded = 0;
+
+	for (size_t i = 0; i < mSessions.size(); i++)
+	{
+		if (mSessions[i]->result())
+			succeeded++;
+	}
+
+	return succeeded;
+}
+
+bool UpgradeEngine::result(size_t index) const
+{
+	return mSessions[index]->result();
+}
+
+DeviceState UpgradeEngine::state(size_t index) const
+{
+	return mSessions[index]->state();
+}
+
+const UpgradeStats &UpgradeEngine::stats(size_t index) const
+{
+	return mSessions[index]->stats();
+}
@@ -0,0 +1,98 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef upgrade_engine_h
+#define upgrade_engine_h
+
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "hci.h"
+
+class EngineSession;
+
+/*
+ *  Runs any number of upgrades on one thread
+ *
+ *  Every upgrade is a coroutine that awaits command completions, vendor
+ *  events and timeouts from a single event loop instead of blocking a thread
+ *  of its own. It goes through the same UpgradeContext state transitions as
+ *  UpgradeSession. Only the simulator implements readEventAsync, the libusb
+ *  and IOKit transports get an EventReader thread each. Commands and bulk
+ *  writes are synchronous on every transport, so the loop is blocked while
+ *  one of them is transferred and a slow device holds up the others.
+ */
+class UpgradeEngine
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	UpgradeEngine();
+	~UpgradeEngine();
+
+	// Queue an upgrade, transport, image and feed (if the image is still being loaded) have to
+	// outlive run(). Returns its index.
+	size_t add(HciTransport &transport, const FirmwareImage &image, const UpgradeOptions &options, FirmwareFeed *feed = NULL);
+
+	// Run every queued upgrade to completion, returns the number that succeeded
+	size_t run();
+
+	size_t count() const { return mSessions.size(); }
+	bool result(size_t index) const;
+	DeviceState state(size_t index) const;
+	const UpgradeStats &stats(size_t index) const;
+
+private:
+	friend class EngineSession;
+
+	struct Timer
+	{
+		Clock::time_point when;
+		EngineSession *session;
+		uint32_t generation;
+	};
+
+	UpgradeEngine(const UpgradeEngine &);
+	UpgradeEngine &operator=(const UpgradeEngine &);
+
+	// Loop thread: resume handle on the next pass
+	void schedule(std::coroutine_handle<> handle) { mReady.push_back(handle); }
+	void addTimer(Clock::time_point when, EngineSession *session, uint32_t generation);
+
+	// Any thread: the session has completed reads to collect
+	void post(EngineSession *session);
+
+	std::vector<std::unique_ptr<EngineSession>> mSessions;
+	size_t mActive;
+
+	// Only touched by the loop thread
+	std::deque<std::coroutine_handle<>> mReady;
+	std::vector<Timer> mTimers;			// Heap, earliest first
+
+	std::mutex mLock;
+	std::condition_variable mSignal;
+	std::vector<EngineSession *> mPosted;
+};
+
+#endif
@@ -127,6 +127,25 @@ io_service_t findMatchingService(const unsigned short vendorId, const unsigned s
 	return IOServiceGetMatchingService(kIOMasterPortDefault, matchingDictionary);
 }
 
+/*
+ *  Obtain an USB device pointer for an IOService
+ *
+ *  service     - USB device service
+ *
+ *  returns IOUSBDeviceInterface300** or NULL on error
+ */
+IOUSBDeviceInterface300** getServiceDevice(io_service_t service)
+{
+	SInt32 score;
+	IOCFPlugInInterface** plugin;
+	IOUSBDeviceInterface300** device = NULL;
+	
+	if (IOCreatePlugInInterfaceForService(service, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score) == kIOReturnSuccess)
+		(*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID300), (LPVOID)&device);
+	
+	return device;
+}
+
 /*
  *  Obtain an USB device pointer for a USB device
  *
@@ -137,10 +156,7 @@ io_service_t findMatchingService(const unsigned short vendorId, const unsigned s
  */
 IOUSBDeviceInterface300** getDevice(const unsigned short vendorId, const unsigned short productId)
 {
-	SInt32 score;
 	io_service_t service = findMatchingService(vendorId, productId);
-	IOCFPlugInInterface** plugin;
-	IOUSBDeviceInterface300** device = NULL;
 	
 	if (service == 0)
 	{
@@ -148,10 +164,55 @@ IOUSBDeviceInterface300** getDevice(const unsigned short vendorId, const unsigne
 		return NULL;
 	}
 	
-	if (IOCreatePlugInInterfaceForService(service, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score) == kIOReturnSuccess)
-		(*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID300), (LPVOID)&device);
+	return getServiceDevice(service);
+}
+
+/*
+ *  Obtain USB device pointers for every matching USB device
+ *
+ *  vendorId    - USB device vendor
+ *  productId   - USB device product
+ *  devices     - Output array of device pointers
+ *  maxDevices  - Number of entries in devices
+ *
+ *  returns the number of devices stored in devices
+ */
+int getDevices(const unsigned short vendorId, const unsigned short productId, IOUSBDeviceInterface300*** devices, const int maxDevices)
+{
+	CFDictionaryRef matchingDictionary = getMatchingDictionary(vendorId, productId);
+	io_iterator_t iterator = 0;
+	io_service_t service;
+	int count = 0;
 	
-	return device;
+	if (matchingDictionary == NULL)
+	{
+		fprintf(stderr, "Failed to initialize device matching dictionary.\n");
+		return 0;
+	}
+	
+	// Consumes the matching dictionary
+	if (IOServiceGetMatchingServices(kIOMasterPortDefault, matchingDictionary, &iterator) != kIOReturnSuccess)
+	{
+		fprintf(stderr, "[%04x:%04x]: Failed to find matching services.\n", vendorId, productId);
+		return 0;
+	}
+	
+	while ((service = IOIteratorNext(iterator)) != 0)
+	{
+		IOUSBDeviceInterface300** device = NULL;
+		
+		if (count < maxDevices)
+			device = getServiceDevice(service);
+		
+		IOObjectRelease(service);
+		
+		if (device != NULL)
+			devices[count++] = device;
+	}
+	
+	IOObjectRelease(iterator);
+	
+	return count;
 }
 
 /*
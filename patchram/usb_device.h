@@ -26,7 +26,12 @@
 #include <stdio.h>
 
 
+#define USB_MAX_DEVICES 128
+
+CFDictionaryRef getMatchingDictionary(unsigned short vendorId, unsigned short productId);
+IOUSBDeviceInterface300** getServiceDevice(io_service_t service);
 IOUSBDeviceInterface300** getDevice(unsigned short vendorId, unsigned short productId);
+int getDevices(unsigned short vendorId, unsigned short productId, IOUSBDeviceInterface300*** devices, int maxDevices);
 bool setConfiguration(IOUSBDeviceInterface300** device);
 IOUSBInterfaceInterface300** findFirstInterface(IOUSBDeviceInterface300** device);
 void printDeviceInfo(IOUSBDeviceInterface300** device);
@@ -0,0 +1,87 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include "hex_decode.h"
+
+// Random inputs every hex decoder is checked against the scalar one with
+#define HEX_DECODE_CHECKS 100000
+
+static const char *const hexDecoders[] = { "avx2", "sse2" };
+
+/*
+ *  Compare every hex decoder this CPU has with the scalar one
+ *
+ *  Inputs cover lengths up to several AVX2 blocks at any alignment, in both
+ *  cases, and a quarter of them have one byte that is not a hex digit
+ *  anywhere. Validity, output and sum all have to match.
+ */
+int main()
+{
+	std::mt19937 random(1);
+	uint8_t hex[2 * 80 + 32];
+	uint8_t expected[80];
+	uint8_t output[80];
+
+	for (int i = 0; i < HEX_DECODE_CHECKS; i++)
+	{
+		size_t count = random() % 80;
+		uint8_t *input = hex + random() % 32;
+
+		for (size_t j = 0; j < count * 2; j++)
+			input[j] = "0123456789abcdefABCDEF"[random() % 22];
+
+		if (count > 0 && random() % 4 == 0)
+		{
+			uint8_t invalid;
+
+			do
+				invalid = (uint8_t)random();
+			while (isxdigit(invalid));
+
+			input[random() % (count * 2)] = invalid;
+		}
+
+		uint32_t expectedSum = 0;
+		bool valid = hexDecodeScalar(input, count, expected, &expectedSum);
+
+		for (const char *name : hexDecoders)
+		{
+			HexDecodeFunc decode = hexDecodeFunction(name);
+			uint32_t sum = 0;
+
+			if (decode == NULL)
+				continue;
+
+			if (decode(input, count, output, &sum) != valid || (valid && (sum != expectedSum || memcmp(output, expected, count) != 0)))
+			{
+				fprintf(stderr, "%s hex decode of %zu bytes differs from the scalar one\n", name, count);
+				return 1;
+			}
+		}
+	}
+
+	for (const char *name : hexDecoders)
+		printf("%-6s %s\n", name, hexDecodeFunction(name) ? "matches the scalar decoder" : "not supported, skipped");
+
+	return 0;
+}
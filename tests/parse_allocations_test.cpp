@@ -0,0 +1,198 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include "firmware_image.h"
+#include "intel_firmware.h"
+
+// Size of the synthetic firmware, about what Broadcom ships
+#define FIRMWARE_BYTES (400 * 1024)
+
+// Parsing into a FirmwareImage reserves its buffer and index once, and nothing per record
+#define PARSE_MAX_ALLOCATIONS 2
+
+// Heap allocations made through operator new, only counted in this test program
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	void *memory = malloc(size ? size : 1);
+
+	if (memory == NULL)
+		throw std::bad_alloc();
+
+	return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+	free(memory);
+}
+
+// Contents of the synthetic firmware at address
+static uint8_t firmwareByte(uint32_t address)
+{
+	return (uint8_t)(address * 7 + (address >> 8));
+}
+
+static void appendRecord(std::string &hex, uint16_t address, uint8_t type, const uint8_t *data, uint8_t length)
+{
+	uint8_t sum = length + (address >> 8) + (address & 0xFF) + type;
+	char text[16];
+
+	snprintf(text, sizeof(text), ":%02X%04X%02X", length, address, type);
+	hex += text;
+
+	for (uint8_t i = 0; i < length; i++)
+	{
+		snprintf(text, sizeof(text), "%02X", data[i]);
+		hex += text;
+		sum += data[i];
+	}
+
+	snprintf(text, sizeof(text), "%02X\r\n", (uint8_t)-sum);
+	hex += text;
+}
+
+// Intel HEX with data records of recordLength bytes from address 0, in 64 KiB segments
+static std::string synthesizeFirmware(uint32_t bytes, uint8_t recordLength)
+{
+	std::string hex;
+	uint8_t data[0xFF];
+
+	for (uint32_t address = 0; address < bytes; address += recordLength)
+	{
+		uint8_t length = bytes - address < recordLength ? (uint8_t)(bytes - address) : recordLength;
+
+		// Records do not cross a segment in this firmware, so this only starts one
+		if ((address & 0xFFFF) == 0)
+		{
+			uint8_t segment[2] = { (uint8_t)(address >> 24), (uint8_t)(address >> 16) };
+			appendRecord(hex, 0, REC_TYPE_ELA, segment, sizeof(segment));
+		}
+
+		for (uint8_t i = 0; i < length; i++)
+			data[i] = firmwareByte(address + i);
+
+		appendRecord(hex, (uint16_t)address, REC_TYPE_DATA, data, length);
+	}
+
+	appendRecord(hex, 0, REC_TYPE_EOF, NULL, 0);
+
+	return hex;
+}
+
+static bool checkAllocations(const char *method, const std::string &hex, uint32_t flags)
+{
+	FirmwareImage image;
+	uint64_t count = allocations.load(std::memory_order_relaxed);
+	bool parsed = parseFirmware((const uint8_t *)hex.data(), (uint32_t)hex.size(), 0, 0, image, flags);
+
+	count = allocations.load(std::memory_order_relaxed) - count;
+
+	printf("%-10s %6zu commands  %llu allocations\n", method, image.count(), (unsigned long long)count);
+
+	if (!parsed || count > PARSE_MAX_ALLOCATIONS)
+	{
+		fprintf(stderr, "%s parse: %s, %llu allocations (at most %d expected)\n", method, parsed ? "parsed" : "failed", (unsigned long long)count, PARSE_MAX_ALLOCATIONS);
+		return false;
+	}
+
+	return true;
+}
+
+// Records longer than a LAUNCH_RAM command takes are split, and every byte reaches the image
+static bool checkLongRecords(const char *method, uint32_t flags)
+{
+	const uint32_t bytes = 4 * 0xFF;
+	std::string hex = synthesizeFirmware(bytes, 0xFF);
+	FirmwareImage image;
+	uint32_t address = 0;
+
+	if (!parseFirmware((const uint8_t *)hex.data(), (uint32_t)hex.size(), 0, 0, image, flags))
+	{
+		fprintf(stderr, "%s parse of 255 byte records failed\n", method);
+		return false;
+	}
+
+	for (size_t i = 0; i < image.count(); i++)
+	{
+		FirmwareSpan span = image.command(i);
+		uint32_t paramLength = span.data[2];
+
+		if (span.length != HCI_COMMAND_HEADER_SIZE + paramLength || paramLength < LAUNCH_RAM_ADDRESS_SIZE || paramLength > LAUNCH_RAM_ADDRESS_SIZE + LAUNCH_RAM_MAX_DATA)
+		{
+			fprintf(stderr, "%s parse of 255 byte records: command %zu is %u bytes with %u parameter bytes\n", method, i, span.length, paramLength);
+			return false;
+		}
+
+		const uint8_t *params = span.data + HCI_COMMAND_HEADER_SIZE;
+		uint32_t commandAddress = params[0] | params[1] << 8 | params[2] << 16 | (uint32_t)params[3] << 24;
+
+		if (commandAddress != address)
+		{
+			fprintf(stderr, "%s parse of 255 byte records: command %zu writes 0x%08x instead of 0x%08x\n", method, i, commandAddress, address);
+			return false;
+		}
+
+		for (uint32_t j = LAUNCH_RAM_ADDRESS_SIZE; j < paramLength; j++, address++)
+		{
+			if (params[j] != firmwareByte(address))
+			{
+				fprintf(stderr, "%s parse of 255 byte records: wrong data at 0x%08x\n", method, address);
+				return false;
+			}
+		}
+	}
+
+	if (address != bytes)
+	{
+		fprintf(stderr, "%s parse of 255 byte records: %u of %u bytes written\n", method, address, bytes);
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	std::string hex = synthesizeFirmware(FIRMWARE_BYTES, 16);
+	bool result = true;
+
+	printf("%zu bytes of HEX\n", hex.size());
+
+	result = checkAllocations("image", hex, kParseDefault) && result;
+	result = checkAllocations("coalesced", hex, kParseCoalesce) && result;
+	result = checkLongRecords("image", kParseDefault) && result;
+	result = checkLongRecords("coalesced", kParseCoalesce) && result;
+
+	return result ? 0 : 1;
+}